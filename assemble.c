@@ -16,6 +16,9 @@ struct Assembler {
 	Label* current_global; /* for accessing nested locals */
 	FILE* handle; /* output handle */
 	const char* inname;
+	int64_t* imports; /* addresses of the c-function names cfcall uses */
+	int64_t nimports;
+	int64_t cimports;
 };
 
 struct Label {
@@ -120,46 +123,175 @@ get_label(Assembler* A, const char* name) {
 	return NULL;
 }
 
-void generate_bytecode(const char* infile, const char* outfile) {
+/* SUPERINSTRUCTIONS
+ *
+ * before anything is assembled, sequences of instructions that the
+ * compiler generates all the time are rewritten into one fused
+ * instruction (see spy_instructions in vm.c).  the operands of the fused
+ * instruction are the operands of the sequence, in order.  a sequence is
+ * never fused across a label definition, so nothing can jump into the
+ * middle of a fused instruction.  longer sequences must come first */
 
-	/* useful token pointers */
-	AsmTokenList* head = NULL;
-	AsmTokenList* code_start = NULL;
+typedef struct Fusion Fusion;
 
-	Assembler A;
-	A.inname = infile;
-	A.tokens = generate_tokens(infile);
-	A.labels = malloc(sizeof(LabelList));
-	A.labels->label = NULL;
-	A.labels->next = NULL;
-	A.current_global = NULL;
-	A.handle = fopen(outfile, "wb");
-	if (!A.handle) {
-		asm_die(&A, "couldn't open '%s' for writing", outfile);
-	} 
-	/* empty input file? quit */
-	if (!A.tokens->token) {
-		fclose(A.handle);
-		return;
+struct Fusion {
+	const char* sequence[5]; /* NULL terminated */
+	const char* fused;
+};
+
+static const Fusion fusions[] = {
+	{{"ilocall", "ilocall", "iadd", NULL}, "iaddll"},
+	{{"iconst", "imul", "iadd", NULL}, "iidx"},
+	{{"lea", "dup", NULL}, "leadup"},
+	{{"isave", "ider", "pop", NULL}, "isavep"},
+	{{"fsave", "fder", "pop", NULL}, "fsavep"},
+	{{"bsave", "bder", "pop", NULL}, "bsavep"},
+	{{"isave", "ider", NULL}, "isaved"},
+	{{"fsave", "fder", NULL}, "fsaved"},
+	{{"bsave", "bder", NULL}, "bsaved"},
+	{{"icmp", "je", NULL}, "icje"},
+	{{"icmp", "jne", NULL}, "icjne"},
+	{{"icmp", "jgt", NULL}, "icjgt"},
+	{{"icmp", "jge", NULL}, "icjge"},
+	{{"icmp", "jlt", NULL}, "icjlt"},
+	{{"icmp", "jle", NULL}, "icjle"},
+	{{"fcmp", "je", NULL}, "fcje"},
+	{{"fcmp", "jne", NULL}, "fcjne"},
+	{{"fcmp", "jgt", NULL}, "fcjgt"},
+	{{"fcmp", "jge", NULL}, "fcjge"},
+	{{"fcmp", "jlt", NULL}, "fcjlt"},
+	{{"fcmp", "jle", NULL}, "fcjle"},
+	{{NULL}, NULL}
+};
+
+/* if tokens points at an instruction, returns the instruction and sets
+ * last to its last token (the last operand, or the mnemonic itself) */
+static const SpyInstruction*
+read_instruction(AsmTokenList* tokens, AsmTokenList** last) {
+	if (!tokens || !tok_istype(tokens->token, ASMTOK_IDENTIFIER)) {
+		return NULL;
+	}
+	/* label definition? */
+	if (tokens->next && tok_istype(tokens->next->token, ASMTOK_OPERATOR) && tokens->next->token->oval == ':') {
+		return NULL;
+	}
+	const SpyInstruction* ins = spy_get_instruction(tokens->token->sval);
+	if (!ins) {
+		return NULL;
 	}
+	*last = tokens;
+	for (int i = 0; i < 4 && ins->operands[i] != OP_NONE; i++) {
+		/* comma, then operand (no comma before the first one) */
+		for (int j = (i > 0 ? 2 : 1); j > 0; j--) {
+			if (!(*last)->next) {
+				return NULL;
+			}
+			*last = (*last)->next;
+		}
+	}
+	return ins;
+}
 
+static AsmTokenList*
+new_comma(unsigned int line) {
+	AsmTokenList* comma = malloc(sizeof(AsmTokenList));
+	comma->token = malloc(sizeof(AsmToken));
+	comma->token->type = ASMTOK_OPERATOR;
+	comma->token->oval = ',';
+	comma->token->line = line;
+	comma->next = NULL;
+	comma->head = NULL;
+	return comma;
+}
+
+/* tries to fuse the sequence starting at tokens, returns 1 if it did */
+static int
+fuse_sequence(AsmTokenList* tokens, const Fusion* fusion) {
+	AsmTokenList* operands[8];
+	int noperands = 0;
+	AsmTokenList* scan = tokens;
+	AsmTokenList* last = NULL;
+	for (const char* const* name = fusion->sequence; *name; name++) {
+		const SpyInstruction* ins = read_instruction(scan, &last);
+		if (!ins || strcmp(ins->name, *name)) {
+			return 0;
+		}
+		/* collect the operand tokens (skip mnemonic and commas) */
+		AsmTokenList* op = scan->next;
+		for (int i = 0; i < 4 && ins->operands[i] != OP_NONE; i++) {
+			operands[noperands++] = op;
+			if (op != last) {
+				op = op->next->next;
+			}
+		}
+		scan = last->next;
+	}
+	/* rewrite: fused mnemonic, operand, comma, operand... rest */
+	AsmTokenList* tail = tokens;
+	tokens->token->sval = (char *)fusion->fused;
+	for (int i = 0; i < noperands; i++) {
+		if (i > 0) {
+			tail->next = new_comma(tokens->token->line);
+			tail = tail->next;
+		}
+		tail->next = operands[i];
+		tail = tail->next;
+	}
+	tail->next = scan;
+	return 1;
+}
+
+static void
+fuse_instructions(AsmTokenList* tokens) {
+	for (AsmTokenList* i = tokens; i; i = i->next) {
+		if (!tok_istype(i->token, ASMTOK_IDENTIFIER)) {
+			continue;
+		}
+		for (const Fusion* f = fusions; f->fused; f++) {
+			if (fuse_sequence(i, f)) {
+				break;
+			}
+		}
+	}
+}
+
+/* index of the c-function name at addr in the import table, it's added
+ * if it isn't there yet */
+static int64_t
+add_import(Assembler* A, int64_t addr) {
+	for (int64_t i = 0; i < A->nimports; i++) {
+		if (A->imports[i] == addr) {
+			return i;
+		}
+	}
+	if (A->nimports == A->cimports) {
+		A->cimports = A->cimports ? A->cimports * 2 : 16;
+		A->imports = realloc(A->imports, A->cimports * sizeof(int64_t));
+	}
+	A->imports[A->nimports] = addr;
+	return A->nimports++;
+}
+
+/* first pass, defines every label */
+static void
+find_labels(Assembler* A) {
+
+	AsmTokenList* head = A->tokens;
 	const SpyInstruction* ins;
 	int64_t cindex = 0; /* code index... how many bytes would be written so far */
 
-	head = A.tokens;
-
-	while (A.tokens) {
-		if (A.tokens->token->type == ASMTOK_IDENTIFIER) {
-			const char* on_word = A.tokens->token->sval;
+	while (A->tokens) {
+		if (A->tokens->token->type == ASMTOK_IDENTIFIER) {
+			const char* on_word = A->tokens->token->sval;
 			/* if on an instruction, increment index by 1 + operand_size */
 			if ((ins = spy_get_instruction(on_word))) {
 				cindex++; /* one byte for instruction */
 				if (ins->operands[0] == OP_NONE) {
-					A.tokens = A.tokens->next;
+					A->tokens = A->tokens->next;
 					continue;
 				}
-				if (A.tokens->next) {
-					A.tokens = A.tokens->next; /* move to first operand */
+				if (A->tokens->next) {
+					A->tokens = A->tokens->next; /* move to first operand */
 				}
 				for (const enum InstructionOperand* i = ins->operands; *i != OP_NONE; i++) {
 					switch (*i) {
@@ -176,19 +308,19 @@ void generate_bytecode(const char* infile, const char* outfile) {
 					}
 					/* don't increment over the last one */
 					if (*(i + 1) != OP_NONE) {
-						A.tokens = A.tokens->next;
+						A->tokens = A->tokens->next;
 					}
 				}
 			} else if (!strcmp(on_word, "di") || !strcmp(on_word, "df")) {
 				cindex += 8;
 				/* skip the operand, not important yet */
-				A.tokens = A.tokens->next;
+				A->tokens = A->tokens->next;
 			} else if (!strcmp(on_word, "db")) {
 				/* could be a string or single byte.. */
-				if (A.tokens->next->token->type == ASMTOK_INTEGER) {
+				if (A->tokens->next->token->type == ASMTOK_INTEGER) {
 					cindex++;
-				} else if (A.tokens->next->token->type == ASMTOK_STRING) {
-					const char* str = A.tokens->next->token->sval;
+				} else if (A->tokens->next->token->type == ASMTOK_STRING) {
+					const char* str = A->tokens->next->token->sval;
 					size_t len = strlen(str);
 					int start = cindex;
 					for (size_t i = 0; i < len; i++) {
@@ -200,24 +332,67 @@ void generate_bytecode(const char* infile, const char* outfile) {
 						}
 					}
 				} else {
-					asm_die(&A, "'db' can only have an integer or string as an operand");
+					asm_die(A, "'db' can only have an integer or string as an operand");
 				}
 				/* operand not important yet */
-				A.tokens = A.tokens->next;
-			} else if (peektype(&A) == ASMTOK_OPERATOR && A.tokens->next->token->oval == ':') {
-				register_label(&A, on_word, cindex);
-				A.tokens = A.tokens->next; /* skip colon */	
+				A->tokens = A->tokens->next;
+			} else if (peektype(A) == ASMTOK_OPERATOR && A->tokens->next->token->oval == ':') {
+				register_label(A, on_word, cindex);
+				A->tokens = A->tokens->next; /* skip colon */	
 			}
-		} else if (A.tokens->token->type == ASMTOK_STRING) {
-			asm_die(&A, "unexpected string");
+		} else if (A->tokens->token->type == ASMTOK_STRING) {
+			asm_die(A, "unexpected string");
 		}
-		if (!A.tokens) {
+		if (!A->tokens) {
 			break;
 		}
-		A.tokens = A.tokens->next;
+		A->tokens = A->tokens->next;
 	}
 
-	A.tokens = head; /* time for pass 2 */
+	A->tokens = head;
+
+}
+
+void generate_bytecode(const char* infile, const char* outfile) {
+
+	/* useful token pointers */
+	AsmTokenList* code_start = NULL;
+
+	Assembler A;
+	A.inname = infile;
+	A.tokens = generate_tokens(infile);
+	A.labels = malloc(sizeof(LabelList));
+	A.labels->label = NULL;
+	A.labels->next = NULL;
+	A.current_global = NULL;
+	A.imports = NULL;
+	A.nimports = 0;
+	A.cimports = 0;
+
+	/* the bytecode is written next to outfile and then renamed, a running
+	 * program can have the old file mapped (see spy_load_file) */
+	char* partial = malloc(strlen(outfile) + 5);
+	sprintf(partial, "%s.tmp", outfile);
+	A.handle = fopen(partial, "wb");
+	if (!A.handle) {
+		asm_die(&A, "couldn't open '%s' for writing", partial);
+	} 
+	/* empty input file? quit */
+	if (!A.tokens->token) {
+		fclose(A.handle);
+		rename(partial, outfile);
+		free(partial);
+		return;
+	}
+
+	if (DO_OPTIMIZE) {
+		fuse_instructions(A.tokens);
+	}
+
+	find_labels(&A);
+
+	/* time for pass 2 */
+	const SpyInstruction* ins;
 
 	while (A.tokens) {
 		if (A.tokens->token->type == ASMTOK_IDENTIFIER) {
@@ -229,7 +404,25 @@ void generate_bytecode(const char* infile, const char* outfile) {
 				A.tokens = A.tokens->next;
 				continue;
 			}
-			if ((ins = spy_get_instruction(A.tokens->token->sval))) {
+			ins = spy_get_instruction(A.tokens->token->sval);
+			if (ins && ins->opcode == 0x25 && A.tokens->next && tok_istype(A.tokens->next->token, ASMTOK_IDENTIFIER)) {
+				/* cfcall name, nargs goes through the import table as
+				 * cfcall_idx index, nargs, so the name is only looked up
+				 * once when the program is loaded */
+				A.tokens = A.tokens->next;
+				int64_t index = add_import(&A, get_label(&A, A.tokens->token->sval)->addr);
+				fputc(0x95, A.handle);
+				fwrite(&index, 1, sizeof(int64_t), A.handle);
+				A.tokens = A.tokens->next;
+				if (!tok_istype(A.tokens->token, ASMTOK_OPERATOR) || A.tokens->token->oval != ',') {
+					asm_die(&A, "expected comma");
+				}
+				A.tokens = A.tokens->next;
+				if (A.tokens->token->type != ASMTOK_INTEGER) {
+					asm_die(&A, "operand 2 should be an integer");
+				}
+				fwrite(&A.tokens->token->ival, 1, sizeof(int64_t), A.handle);
+			} else if (ins) {
 				fputc(ins->opcode, A.handle);
 				for (int i = 0; i < 4; i++) {
 					enum InstructionOperand op = ins->operands[i];
@@ -339,6 +532,50 @@ void generate_bytecode(const char* infile, const char* outfile) {
 	/* write NOP */
 	fputc(0x00, A.handle);
 
+	/* import table, see spy_imports */
+	if (A.nimports > 0) {
+		fwrite(A.imports, sizeof(int64_t), A.nimports, A.handle);
+		fwrite(&A.nimports, 1, sizeof(int64_t), A.handle);
+		fwrite(IMPORT_MAGIC, 1, 8, A.handle);
+	}
+	free(A.imports);
+
 	fclose(A.handle);
+	if (rename(partial, outfile) != 0) {
+		asm_die(&A, "couldn't write '%s'", outfile);
+	}
+	free(partial);
+
+}
+
+/* address of the global label name in infile (assembly), -1 if there is
+ * no such label */
+int64_t
+label_address(const char* infile, const char* name) {
+
+	Assembler A;
+	A.inname = infile;
+	A.tokens = generate_tokens(infile);
+	A.labels = malloc(sizeof(LabelList));
+	A.labels->label = NULL;
+	A.labels->next = NULL;
+	A.current_global = NULL;
+	A.handle = NULL;
+	if (!A.tokens->token) {
+		return -1;
+	}
+
+	/* same as generate_bytecode, fusing changes the addresses */
+	if (DO_OPTIMIZE) {
+		fuse_instructions(A.tokens);
+	}
+	find_labels(&A);
+
+	for (LabelList* i = A.labels; i && i->label; i = i->next) {
+		if (!strcmp(i->label->name, name)) {
+			return i->label->addr;
+		}
+	}
+	return -1;
 
 }
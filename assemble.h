@@ -1,6 +1,9 @@
 #ifndef ASSEMBLE_H
 #define ASSEMBLE_H
 
+#include <stdint.h>
+
 void generate_bytecode(const char*, const char*);
+int64_t label_address(const char*, const char*);
 
 #endif
@@ -0,0 +1,321 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include "vm.h"
+#include "generate.h"
+#include "batch.h"
+
+/*
+ * BATCH MODE
+ *
+ * spy --jobs N list runs every job in the file list on N threads.  a job
+ * is one line:
+ *   program [--stack-vm] [--jit] [--trace] [--heap bytes] [--workers n]
+ *           [--input file]
+ * the options are the same as for a single run, --input is read as the
+ * program's stdin (stdin is shared by every job without it).  jobs
+ * already run in parallel, so spawn runs its tasks on one thread unless
+ * the job asks for --workers.  blank lines
+ * and lines that start with # are skipped.
+ *
+ * every program is compiled once and loaded once for each set of options,
+ * before any job starts (the compiler isn't reentrant, and exits on
+ * errors).  then each thread takes the next job that hasn't been started
+ * and runs it in a SpyState of its own that shares the loaded program,
+ * with its output going to a buffer.  once every job is done, their
+ * output is printed in the order of the list, followed by a summary.
+ */
+
+typedef struct Program Program;
+typedef struct Job Job;
+typedef struct Batch Batch;
+
+struct Program {
+	char* name;
+	SpyConfig config; /* only the tiers */
+	SpyProgram* program;
+};
+
+struct Job {
+	char* line; /* as it was written in the list */
+	int program; /* index into Batch.programs */
+	SpyConfig config;
+	char* input; /* NULL for stdin */
+	int status; /* what spy_load/spy_run returned */
+	double ms;
+	spy_int instructions;
+	char* output;
+	size_t output_size;
+};
+
+struct Batch {
+	Program* programs;
+	int nprograms;
+	Job* jobs;
+	int njobs;
+	atomic_int next; /* next job that a thread takes */
+};
+
+static double
+batch_now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000.0 + t.tv_nsec / 1000000.0;
+}
+
+static int
+batch_program(Batch* B, const char* name, const SpyConfig* config) {
+	for (int i = 0; i < B->nprograms; i++) {
+		Program* program = &B->programs[i];
+		if (!strcmp(program->name, name)
+			&& program->config.register_tier == config->register_tier
+			&& program->config.jit == config->jit
+			&& program->config.trace == config->trace) {
+			return i;
+		}
+	}
+	Program* program = &B->programs[B->nprograms];
+	program->name = strdup(name);
+	program->config = *config;
+	program->program = NULL;
+	return B->nprograms++;
+}
+
+/* fills in job from its line, returns 0 if the line is malformed */
+static int
+batch_parse(Batch* B, Job* job, char* line) {
+	job->line = strdup(line);
+	job->program = -1;
+	job->config.register_tier = 1;
+	job->config.jit = 0;
+	job->config.trace = 0;
+	job->config.heap_size = 0;
+	job->config.workers = 1;
+	job->config.out = NULL;
+	job->config.in = NULL;
+	job->input = NULL;
+	job->status = 1;
+	job->ms = 0;
+	job->instructions = 0;
+	job->output = NULL;
+	job->output_size = 0;
+	char* name = NULL;
+	for (char* word = strtok(line, " \t"); word; word = strtok(NULL, " \t")) {
+		if (!name) {
+			name = word;
+		} else if (!strcmp(word, "--stack-vm")) {
+			job->config.register_tier = 0;
+		} else if (!strcmp(word, "--jit")) {
+			job->config.jit = 1;
+		} else if (!strcmp(word, "--trace")) {
+			job->config.trace = 1;
+		} else if (!strcmp(word, "--heap")) {
+			char* heap = strtok(NULL, " \t");
+			job->config.heap_size = heap ? strtoll(heap, NULL, 0) : 0;
+			if (job->config.heap_size <= 0 || job->config.heap_size > MAX_HEAP) {
+				printf("invalid heap size after '--heap'\n");
+				return 0;
+			}
+		} else if (!strcmp(word, "--workers")) {
+			char* workers = strtok(NULL, " \t");
+			job->config.workers = workers ? atoi(workers) : 0;
+			if (job->config.workers <= 0) {
+				printf("invalid number of workers after '--workers'\n");
+				return 0;
+			}
+		} else if (!strcmp(word, "--input")) {
+			char* input = strtok(NULL, " \t");
+			if (!input) {
+				printf("expected a file after '--input'\n");
+				return 0;
+			}
+			job->input = strdup(input);
+		} else {
+			printf("unknown option '%s'\n", word);
+			return 0;
+		}
+	}
+	job->program = batch_program(B, name, &job->config);
+	return 1;
+}
+
+/* reads the list, returns 0 if it couldn't */
+static int
+batch_read(Batch* B, const char* filename) {
+	FILE* handle = fopen(filename, "r");
+	if (!handle) {
+		printf("couldn't read job list '%s'\n", filename);
+		return 0;
+	}
+	int cap = 16;
+	char line[1024];
+	B->jobs = malloc(cap * sizeof(Job));
+	B->programs = malloc(cap * sizeof(Program));
+	while (fgets(line, sizeof(line), handle)) {
+		line[strcspn(line, "\r\n")] = 0;
+		char* start = line + strspn(line, " \t");
+		if (!*start || *start == '#') {
+			continue;
+		}
+		if (B->njobs == cap) {
+			cap *= 2;
+			B->jobs = realloc(B->jobs, cap * sizeof(Job));
+			B->programs = realloc(B->programs, cap * sizeof(Program));
+		}
+		if (!batch_parse(B, &B->jobs[B->njobs++], start)) {
+			fclose(handle);
+			return 0;
+		}
+	}
+	fclose(handle);
+	return 1;
+}
+
+/* compiles and loads every program, returns 0 if one couldn't be loaded.
+ * the same program with other options is only compiled once (compiling
+ * it again would write to a .spyb that's mapped by a loaded program) */
+static int
+batch_compile(Batch* B) {
+	for (int i = 0; i < B->nprograms; i++) {
+		Program* program = &B->programs[i];
+		int compiled = 0;
+		for (int j = 0; j < i; j++) {
+			compiled |= !strcmp(B->programs[j].name, program->name);
+		}
+		char* fbin;
+		if (compiled) {
+			fbin = malloc(strlen(program->name) + 6);
+			sprintf(fbin, "%s.spyb", program->name);
+		} else {
+			fbin = generate_program(program->name);
+		}
+		program->program = spy_program_new_file(&program->config, fbin);
+		free(fbin);
+		if (!program->program) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void
+batch_run(Batch* B, Job* job) {
+	Program* program = &B->programs[job->program];
+	double start = batch_now();
+	FILE* out = open_memstream(&job->output, &job->output_size);
+	FILE* in = NULL;
+	if (job->input && !(in = fopen(job->input, "r"))) {
+		fprintf(out, "couldn't read input from '%s'\n", job->input);
+	} else {
+		job->config.out = out;
+		job->config.in = in;
+		SpyState* spy = spy_new(&job->config);
+		job->status = spy_load_program(spy, program->program);
+		if (!job->status) {
+			job->status = spy_run(spy);
+		}
+		job->instructions = spy->instructions;
+		spy_free(spy);
+	}
+	if (in) {
+		fclose(in);
+	}
+	fclose(out);
+	job->ms = batch_now() - start;
+}
+
+static void*
+batch_worker(void* arg) {
+	Batch* B = arg;
+	for (;;) {
+		int i = atomic_fetch_add(&B->next, 1);
+		if (i >= B->njobs) {
+			return NULL;
+		}
+		batch_run(B, &B->jobs[i]);
+	}
+}
+
+static void
+batch_report(Batch* B, int threads, double ms) {
+	int failed = 0;
+	for (int i = 0; i < B->njobs; i++) {
+		Job* job = &B->jobs[i];
+		printf("=== job %d: %s ===\n", i + 1, job->line);
+		fwrite(job->output, 1, job->output_size, stdout);
+		if (job->output_size > 0 && job->output[job->output_size - 1] != '\n') {
+			printf("\n");
+		}
+		failed += job->status != 0;
+	}
+	printf("\n%-6s%-8s%12s%16s  %s\n", "job", "status", "ms", "instructions", "command");
+	for (int i = 0; i < B->njobs; i++) {
+		Job* job = &B->jobs[i];
+		printf("%-6d%-8s%12.2f%16lld  %s\n", i + 1, job->status ? "error" : "ok", job->ms, job->instructions, job->line);
+	}
+	printf("\n%d jobs on %d threads, %d failed, %.2f ms\n", B->njobs, threads, failed, ms);
+}
+
+/* returns 1 if any job failed */
+int
+spy_batch(const char* filename, int threads) {
+
+	Batch B;
+	B.programs = NULL;
+	B.nprograms = 0;
+	B.jobs = NULL;
+	B.njobs = 0;
+	atomic_init(&B.next, 0);
+
+	int ok = batch_read(&B, filename) && batch_compile(&B);
+	int failed = !ok;
+
+	if (ok) {
+		if (threads > B.njobs) {
+			threads = B.njobs > 0 ? B.njobs : 1;
+		}
+		if (threads > BATCH_MAX_THREADS) {
+			threads = BATCH_MAX_THREADS;
+		}
+		pthread_t workers[BATCH_MAX_THREADS];
+		double start = batch_now();
+		int started = 0;
+		for (; started < threads; started++) {
+			if (pthread_create(&workers[started], NULL, batch_worker, &B) != 0) {
+				break;
+			}
+		}
+		if (started == 0) {
+			/* no threads, run everything here */
+			batch_worker(&B);
+		}
+		for (int i = 0; i < started; i++) {
+			pthread_join(workers[i], NULL);
+		}
+		batch_report(&B, started > 0 ? started : 1, batch_now() - start);
+		for (int i = 0; i < B.njobs; i++) {
+			failed |= B.jobs[i].status != 0;
+		}
+	}
+
+	for (int i = 0; i < B.njobs; i++) {
+		free(B.jobs[i].line);
+		free(B.jobs[i].input);
+		free(B.jobs[i].output);
+	}
+	for (int i = 0; i < B.nprograms; i++) {
+		free(B.programs[i].name);
+		if (B.programs[i].program) {
+			spy_program_free(B.programs[i].program);
+		}
+	}
+	free(B.jobs);
+	free(B.programs);
+
+	return failed;
+
+}
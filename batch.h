@@ -0,0 +1,9 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+/* most threads that --jobs starts */
+#define BATCH_MAX_THREADS 256
+
+int spy_batch(const char*, int);
+
+#endif
@@ -9,34 +9,32 @@ static spy_int
 io_print(SpyState* spy) {
 	spy_int format_addr = spy_pop_int(spy);
 	spy_string format = spy_gets(spy, format_addr);
-	spy_int length = 0; /* total characters printed */
 	while (*format) {
 		switch (*format) {
 			/* NOTE: escape sequences not handeled here, the assembler already dealt with them */
 			case '%':
 				switch (*(++format)) {
 					case 'd':
-						length += printf("%lld", spy_pop_int(spy));
+						fprintf(spy->out, "%lld", spy_pop_int(spy));
 						break;
 					case 'x': 
 						switch (*(++format)) {
 							case 'i':
-								length += printf("%llx", spy_pop_int(spy));
+								fprintf(spy->out, "%llx", spy_pop_int(spy));
 								break;
 							case 'b':
-								length += printf("%x", spy_pop_byte(spy));
+								fprintf(spy->out, "%x", spy_pop_byte(spy));
 								break;			
 						}
 						break;
 					case 'f':
-						length += printf("%f", spy_pop_float(spy));
+						fprintf(spy->out, "%f", spy_pop_float(spy));
 						break;
 					case 'c':
-						fputc(spy_pop_byte(spy), stdout);
-						length++;
+						fputc(spy_pop_byte(spy), spy->out);
 						break;
 					case 's':
-						length += printf("%s", spy_gets(spy, spy_pop_int(spy)));
+						fprintf(spy->out, "%s", spy_gets(spy, spy_pop_int(spy)));
 						break;
 					case 'b': {
 						uint64_t bin;
@@ -65,22 +63,19 @@ io_print(SpyState* spy) {
 								break;
 						}
 						for (int i = 0; i < bits; i++) {
-							fputc('0' + ((bin >> (bits - i - 1)) & 0x1), stdout);
+							fputc('0' + ((bin >> (bits - i - 1)) & 0x1), spy->out);
 						}
-						length += 64;
 						break;
 					}
 				}
 				break;
 			default:
-				length++;
-				fputc(*format, stdout);
+				fputc(*format, spy->out);
 				break;
 		}
 		format++;
 	}
-	spy_push_int(spy, length);
-	return 1;
+	return 0;
 }
 
 static spy_int
@@ -102,7 +97,7 @@ io_fputs(SpyState* spy) {
 static spy_int
 io_outc(SpyState* spy) {
 	spy_byte c = spy_pop_byte(spy);
-	fputc(c, stdout);
+	fputc(c, spy->out);
 	return 0;
 }
 
@@ -166,7 +161,7 @@ io_fread(SpyState* spy) {
 static spy_int
 io_flush(SpyState* spy) {
 	char c;
-	while ((c = getchar()) != '\n' && c != EOF);
+	while ((c = fgetc(spy->in)) != '\n' && c != EOF);
 	return 0;
 }
 
@@ -175,7 +170,7 @@ io_read_int(SpyState* spy) {
 	/* TODO make work properly */
 	//spy_string format = spy_gets(spy, spy_pop_int(spy));
 	spy_int ptr = spy_pop_int(spy);
-	int check = scanf("%lld", (spy_int *)&spy->memory[ptr]);
+	int check = fscanf(spy->in, "%lld", (spy_int *)&spy->memory[ptr]);
 	if (check != 1) {
 		*(spy_int *)&spy->memory[ptr] = 0;
 		spy_push_int(spy, 0);
@@ -189,7 +184,7 @@ io_read_int(SpyState* spy) {
 static spy_int
 io_read_float(SpyState* spy) {
 	spy_int ptr = spy_pop_int(spy);
-	int check = scanf("%lf", (spy_float *)&spy->memory[ptr]);
+	int check = fscanf(spy->in, "%lf", (spy_float *)&spy->memory[ptr]);
 	if (check != 1) {
 		*(spy_float *)&spy->memory[ptr] = 0.0;
 		spy_push_int(spy, 0);
@@ -205,7 +200,7 @@ io_read_string(SpyState* spy) {
 	spy_int ptr = spy_pop_int(spy);
 	spy_int size = spy_pop_int(spy);
 	char* str = (char *)&spy->memory[ptr];
-	if (fgets(str, size, stdin)) {
+	if (fgets(str, size, spy->in)) {
 		/* strip newline at end if needed */
 		size_t slen = strlen(str) - 1;
 		if (*str && str[slen] == '\n') {
@@ -219,20 +214,20 @@ io_read_string(SpyState* spy) {
 }
 
 SpyCFunc capi_io[] = {
-	{"print", io_print},
-	{"outc", io_outc},
-	{"fopen", io_fopen},
-	{"fclose", io_fclose},
-	{"fseek", io_fseek},
-	{"ftell", io_ftell},
-	{"fgetc", io_fgetc},
-	{"fputc", io_fputc},
-	{"fputs", io_fputs},
-	{"fread", io_fread},
-	{"read_int", io_read_int},
-	{"read_float", io_read_float},
-	{"read_string", io_read_string},
-	{"flush", io_flush},
-	{NULL, NULL}
+	{"print", io_print, 0},
+	{"outc", io_outc, 0},
+	{"fopen", io_fopen, 1},
+	{"fclose", io_fclose, 0},
+	{"fseek", io_fseek, 1},
+	{"ftell", io_ftell, 1},
+	{"fgetc", io_fgetc, 1},
+	{"fputc", io_fputc, 0},
+	{"fputs", io_fputs, 0},
+	{"fread", io_fread, 1},
+	{"read_int", io_read_int, 1},
+	{"read_float", io_read_float, 1},
+	{"read_string", io_read_string, 1},
+	{"flush", io_flush, 0},
+	{NULL, NULL, 0}
 };
 
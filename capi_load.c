@@ -1,34 +1,355 @@
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <dlfcn.h>
 #include "capi_io.h"
 #include "capi_load.h"
 #include "capi_std.h"
 #include "capi_math.h"
+#include "spylib.h"
+
+/* REGISTRY
+ *
+ * every c-function that a program can call, in one hash table (open
+ * addressing, linear probing) that every state shares.  it starts with
+ * capi_io, capi_std and capi_math, the first time a state is made, and
+ * grows with the extensions from SPY_EXT_PATH and spy_load_ext.  those
+ * have to be loaded before any program runs, after that the table is
+ * only read.
+ *
+ * an extension is a shared object that exports
+ *   SpyCFunc SPY_EXT_SYMBOL[] = {{"name", f, results}, ..., {NULL}};
+ * it's never unloaded */
+
+static SpyCFunc** registry = NULL;
+static uint64_t registry_cap = 0; /* power of 2 */
+static uint64_t registry_size = 0;
+static pthread_once_t registry_once = PTHREAD_ONCE_INIT;
+
+/* fnv-1a */
+static uint64_t
+hash_name(const char* name) {
+	uint64_t h = 14695981039346656037ULL;
+	for (const unsigned char* c = (const unsigned char *)name; *c; c++) {
+		h = (h ^ *c) * 1099511628211ULL;
+	}
+	return h;
+}
+
+/* slot of name, or the empty slot it would go in */
+static SpyCFunc**
+find_slot(SpyCFunc** table, uint64_t cap, const char* name) {
+	uint64_t i = hash_name(name) & (cap - 1);
+	while (table[i] && strcmp(table[i]->name, name)) {
+		i = (i + 1) & (cap - 1);
+	}
+	return &table[i];
+}
 
 static void
-append_cfunc(SpyState* spy, SpyCFunc* cfunc) {
-	if (!spy->cfuncs->cfunc) {
-		spy->cfuncs->cfunc = cfunc;
-	} else {
-		SpyCFuncList* new_list = malloc(sizeof(SpyCFuncList));
-		new_list->cfunc = cfunc;
-		new_list->next = NULL;
-		SpyCFuncList* scanner = spy->cfuncs;
-		while (scanner->next) {
-			scanner = scanner->next;
+grow_registry() {
+	uint64_t cap = registry_cap ? registry_cap * 2 : 64;
+	SpyCFunc** table = calloc(cap, sizeof(SpyCFunc *));
+	for (uint64_t i = 0; i < registry_cap; i++) {
+		if (registry[i]) {
+			*find_slot(table, cap, registry[i]->name) = registry[i];
 		}
-		scanner->next = new_list;
 	}
+	free(registry);
+	registry = table;
+	registry_cap = cap;
 }
 
-static void
-register_array(SpyState* spy, SpyCFunc cfuncs[]) {
+/* TYPED C-FUNCTIONS
+ *
+ * a c-function with a signature is an ordinary c function, the vm loads
+ * its arguments from the stack and pushes what it returns:
+ *   {"sqrt", NULL, 1, "(float) -> float", (void (*)(void))sqrt}
+ * an argument is int (spy_int), float (spy_float) or ptr (a pointer into
+ * the program's memory, it gets the real address), the result is int,
+ * float or void.  only the address of a ptr is checked, not how far the
+ * function reads or writes from it: it has to bound its own accesses,
+ * usually by a size that's passed next to the pointer.  an f can be given too, it's called instead when the
+ * signature can't be used (see register_array).
+ *
+ * the function is called through a pointer of its own type (spy_int,
+ * spy_float and void* for the arguments, see NATIVE_CASE), so every
+ * calling convention gets what it expects.  there's a case for every
+ * shape, that's why it takes at most NATIVE_MAX_ARGS arguments */
+
+/* the type at *at, which is moved past it (and any spaces) */
+static char
+signature_type(const char** at) {
+	static const struct {
+		const char* name;
+		char type;
+	} types[] = {{"int", 'i'}, {"float", 'f'}, {"ptr", 'p'}, {"void", 'v'}};
+	while (**at == ' ') {
+		(*at)++;
+	}
+	for (int i = 0; i < 4; i++) {
+		size_t len = strlen(types[i].name);
+		if (!strncmp(*at, types[i].name, len)) {
+			*at += len;
+			while (**at == ' ') {
+				(*at)++;
+			}
+			return types[i].type;
+		}
+	}
+	return 0;
+}
+
+/* fills in the rest of cfunc from its signature, returns 0 if it's
+ * invalid */
+static int
+parse_signature(SpyCFunc* cfunc) {
+	const char* at = cfunc->signature;
+	cfunc->nargs = 0;
+	if (!cfunc->native || *at++ != '(') {
+		return 0;
+	}
+	while (*at == ' ') {
+		at++;
+	}
+	if (*at != ')') {
+		for (;;) {
+			char type = signature_type(&at);
+			if ((type != 'i' && type != 'p' && type != 'f') || cfunc->nargs == NATIVE_MAX_ARGS) {
+				return 0;
+			}
+			cfunc->args[cfunc->nargs++] = type;
+			if (*at != ',') {
+				break;
+			}
+			at++;
+		}
+	}
+	if (*at++ != ')') {
+		return 0;
+	}
+	while (*at == ' ') {
+		at++;
+	}
+	if (strncmp(at, "->", 2)) {
+		return 0;
+	}
+	at += 2;
+	cfunc->ret = signature_type(&at);
+	if (!cfunc->ret || cfunc->ret == 'p' || *at) {
+		return 0;
+	}
+	cfunc->results = cfunc->ret != 'v';
+	return 1;
+}
+
+/* CFCALL and CCFCALL of a typed c-function, its nargs arguments are on
+ * the stack first to last (they aren't turned around like for f) */
+void
+spy_call_native(SpyState* spy, SpyCFunc* cfunc, spy_int nargs) {
+	if (nargs != cfunc->nargs) {
+		spy_die(spy, "c-function '%s' takes %d arguments, not %lld", cfunc->name, cfunc->nargs, nargs);
+	}
+	if (nargs > (spy->sp - (spy->stack_end - SIZE_STACK)) / 8) {
+		spy_die(spy, "invalid c-function call (%lld arguments)", nargs);
+	}
+	union {
+		spy_int i;
+		spy_float f;
+		void* p;
+	} args[NATIVE_MAX_ARGS];
+	/* 2 bits for every argument (0 int, 1 float, 2 ptr), then a 1 */
+	int shape = 1 << (2 * nargs);
+	spy_byte* base = spy->sp - nargs * 8;
+	for (int i = 0; i < nargs; i++) {
+		spy_int value;
+		memcpy(&value, base + 8 + i * 8, 8);
+		switch (cfunc->args[i]) {
+			case 'i':
+				args[i].i = value;
+				break;
+			case 'p':
+				if (value < 0 || value >= spy->memory_size) {
+					spy_die(spy, "invalid pointer passed to '%s' (addr=0x%llX)", cfunc->name, value);
+				}
+				args[i].p = value ? &spy->memory[value] : NULL;
+				shape |= 2 << (2 * i);
+				break;
+			case 'f':
+				memcpy(&args[i].f, &value, 8);
+				shape |= 1 << (2 * i);
+				break;
+		}
+	}
+	spy->sp = base;
+	spy_int ri = 0;
+	spy_float rf = 0;
+	#define I spy_int
+	#define F spy_float
+	#define P void*
+	#define NATIVE_CASE(shape, params, ...) \
+		case shape: \
+			if (cfunc->ret == 'i') { \
+				ri = ((spy_int (*)params)cfunc->native)(__VA_ARGS__); \
+			} else if (cfunc->ret == 'f') { \
+				rf = ((spy_float (*)params)cfunc->native)(__VA_ARGS__); \
+			} else { \
+				((void (*)params)cfunc->native)(__VA_ARGS__); \
+			} \
+			break;
+	switch (shape) {
+		NATIVE_CASE(0x01, (void))
+		NATIVE_CASE(0x04, (I), args[0].i)
+		NATIVE_CASE(0x05, (F), args[0].f)
+		NATIVE_CASE(0x06, (P), args[0].p)
+		NATIVE_CASE(0x10, (I, I), args[0].i, args[1].i)
+		NATIVE_CASE(0x11, (F, I), args[0].f, args[1].i)
+		NATIVE_CASE(0x12, (P, I), args[0].p, args[1].i)
+		NATIVE_CASE(0x14, (I, F), args[0].i, args[1].f)
+		NATIVE_CASE(0x15, (F, F), args[0].f, args[1].f)
+		NATIVE_CASE(0x16, (P, F), args[0].p, args[1].f)
+		NATIVE_CASE(0x18, (I, P), args[0].i, args[1].p)
+		NATIVE_CASE(0x19, (F, P), args[0].f, args[1].p)
+		NATIVE_CASE(0x1A, (P, P), args[0].p, args[1].p)
+		NATIVE_CASE(0x40, (I, I, I), args[0].i, args[1].i, args[2].i)
+		NATIVE_CASE(0x41, (F, I, I), args[0].f, args[1].i, args[2].i)
+		NATIVE_CASE(0x42, (P, I, I), args[0].p, args[1].i, args[2].i)
+		NATIVE_CASE(0x44, (I, F, I), args[0].i, args[1].f, args[2].i)
+		NATIVE_CASE(0x45, (F, F, I), args[0].f, args[1].f, args[2].i)
+		NATIVE_CASE(0x46, (P, F, I), args[0].p, args[1].f, args[2].i)
+		NATIVE_CASE(0x48, (I, P, I), args[0].i, args[1].p, args[2].i)
+		NATIVE_CASE(0x49, (F, P, I), args[0].f, args[1].p, args[2].i)
+		NATIVE_CASE(0x4A, (P, P, I), args[0].p, args[1].p, args[2].i)
+		NATIVE_CASE(0x50, (I, I, F), args[0].i, args[1].i, args[2].f)
+		NATIVE_CASE(0x51, (F, I, F), args[0].f, args[1].i, args[2].f)
+		NATIVE_CASE(0x52, (P, I, F), args[0].p, args[1].i, args[2].f)
+		NATIVE_CASE(0x54, (I, F, F), args[0].i, args[1].f, args[2].f)
+		NATIVE_CASE(0x55, (F, F, F), args[0].f, args[1].f, args[2].f)
+		NATIVE_CASE(0x56, (P, F, F), args[0].p, args[1].f, args[2].f)
+		NATIVE_CASE(0x58, (I, P, F), args[0].i, args[1].p, args[2].f)
+		NATIVE_CASE(0x59, (F, P, F), args[0].f, args[1].p, args[2].f)
+		NATIVE_CASE(0x5A, (P, P, F), args[0].p, args[1].p, args[2].f)
+		NATIVE_CASE(0x60, (I, I, P), args[0].i, args[1].i, args[2].p)
+		NATIVE_CASE(0x61, (F, I, P), args[0].f, args[1].i, args[2].p)
+		NATIVE_CASE(0x62, (P, I, P), args[0].p, args[1].i, args[2].p)
+		NATIVE_CASE(0x64, (I, F, P), args[0].i, args[1].f, args[2].p)
+		NATIVE_CASE(0x65, (F, F, P), args[0].f, args[1].f, args[2].p)
+		NATIVE_CASE(0x66, (P, F, P), args[0].p, args[1].f, args[2].p)
+		NATIVE_CASE(0x68, (I, P, P), args[0].i, args[1].p, args[2].p)
+		NATIVE_CASE(0x69, (F, P, P), args[0].f, args[1].p, args[2].p)
+		NATIVE_CASE(0x6A, (P, P, P), args[0].p, args[1].p, args[2].p)
+	}
+	if (cfunc->ret == 'i') {
+		spy_push_int(spy, ri);
+	} else if (cfunc->ret == 'f') {
+		spy_push_float(spy, rf);
+	}
+	#undef I
+	#undef F
+	#undef P
+	#undef NATIVE_CASE
+}
+
+/* returns the name that's already registered, or whose signature is
+ * invalid (without an f to call instead), if there is one.  NULL when
+ * every function was added */
+static const char*
+register_array(SpyCFunc cfuncs[]) {
 	for (SpyCFunc* i = cfuncs; i->name != NULL; i++) {
-		append_cfunc(spy, i);
+		if (i->signature && !parse_signature(i)) {
+			if (!i->f) {
+				return i->name;
+			}
+			i->native = NULL;
+		}
+		if ((registry_size + 1) * 2 > registry_cap) {
+			grow_registry();
+		}
+		SpyCFunc** slot = find_slot(registry, registry_cap, i->name);
+		if (*slot) {
+			return i->name;
+		}
+		*slot = i;
+		registry_size++;
+	}
+	return NULL;
+}
+
+static int
+load_ext(const char* path) {
+	void* handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (!handle) {
+		printf("couldn't load extension '%s': %s\n", path, dlerror());
+		return 1;
+	}
+	SpyCFunc* cfuncs = dlsym(handle, SPY_EXT_SYMBOL);
+	if (!cfuncs) {
+		printf("extension '%s' doesn't export '%s'\n", path, SPY_EXT_SYMBOL);
+		dlclose(handle);
+		return 1;
+	}
+	const char* taken = register_array(cfuncs);
+	if (taken) {
+		/* the functions before it stay, the handle can't be closed */
+		printf("extension '%s' defines c-function '%s' again, or with an invalid signature\n", path, taken);
+		return 1;
+	}
+	return 0;
+}
+
+/* loads every extension in SPY_EXT_PATH (separated by ':'), exits if
+ * one can't be loaded since no state can report it yet */
+static void
+load_ext_path() {
+	const char* path = getenv("SPY_EXT_PATH");
+	if (!path || !*path) {
+		return;
+	}
+	char* paths = malloc(strlen(path) + 1);
+	strcpy(paths, path);
+	for (char* ext = strtok(paths, ":"); ext; ext = strtok(NULL, ":")) {
+		if (load_ext(ext)) {
+			exit(1);
+		}
+	}
+	free(paths);
+}
+
+/* exits if a built-in c-function can't be registered, like
+ * load_ext_path */
+static void
+init_capi() {
+	SpyCFunc* arrays[] = {capi_io, capi_std, capi_math};
+	for (int i = 0; i < 3; i++) {
+		const char* taken = register_array(arrays[i]);
+		if (taken) {
+			printf("couldn't register c-function '%s'\n", taken);
+			exit(1);
+		}
+	}
+	load_ext_path();
+}
+
+void
+spy_init_capi(SpyState* spy) {
+	pthread_once(&registry_once, init_capi);
+}
+
+/* NULL if there's no c-function called name */
+SpyCFunc*
+spy_capi_find(const char* name) {
+	if (!registry) {
+		return NULL;
 	}
+	return *find_slot(registry, registry_cap, name);
 }
 
-void spy_init_capi(SpyState* spy) {
-	register_array(spy, capi_io); 
-	register_array(spy, capi_std);
-	register_array(spy, capi_math);
+/* adds the c-functions of the shared object at path, returns 0 like
+ * spy_load (after printing why it couldn't) */
+int
+spy_load_ext(const char* path) {
+	pthread_once(&registry_once, init_capi);
+	return load_ext(path);
 }
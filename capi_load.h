@@ -3,6 +3,12 @@
 
 #include "vm.h"
 
+/* what an extension calls its SpyCFunc array, see capi_load.c */
+#define SPY_EXT_SYMBOL "spy_ext_cfuncs"
+
 void spy_init_capi(SpyState*); 
+SpyCFunc* spy_capi_find(const char*);
+int spy_load_ext(const char*);
+void spy_call_native(SpyState*, SpyCFunc*, spy_int);
 
 #endif
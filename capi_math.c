@@ -4,6 +4,8 @@
 #include "capi_math.h"
 #include "spylib.h"
 
+/* for when the signatures can't be used, see capi_load.c */
+
 static spy_int
 math_cos(SpyState* spy) {
 	spy_push_float(spy, cos(spy_pop_float(spy)));
@@ -28,12 +30,13 @@ math_sqrt(SpyState* spy) {
 	return 1;
 }
 
+/* typed, see capi_load.c */
 SpyCFunc capi_math[] = {
 	
-	{"cos", math_cos},
-	{"sin", math_sin},
-	{"tan", math_tan},
-	{"sqrt", math_sqrt},
-	{NULL, NULL}
+	{"cos", math_cos, 1, "(float) -> float", (void (*)(void))cos},
+	{"sin", math_sin, 1, "(float) -> float", (void (*)(void))sin},
+	{"tan", math_tan, 1, "(float) -> float", (void (*)(void))tan},
+	{"sqrt", math_sqrt, 1, "(float) -> float", (void (*)(void))sqrt},
+	{NULL, NULL, 0}
 	
 };
@@ -3,7 +3,10 @@
 #include <string.h>
 #include <stdarg.h>
 #include "generate.h"
+#include "lex.h"
+#include "assemble.h"
 #include "vm.h"
+#include "task.h"
 
 #define FORMAT_LABEL ".L%d"
 #define FORMAT_STATIC ".S%d"
@@ -52,15 +55,19 @@ struct InstructionStack {
 
 /* generate functions */
 static void generate_expression(CompileState*, ExpNode*);
+static void generate_vector_op(CompileState*, ExpNode*, void (*)(CompileState*, const char*, ...));
 static void generate_if(CompileState*);
 static void generate_functtion(CompileState*);
 static void generate_while(CompileState*);
 static void generate_for(CompileState*);
+static void generate_parallel_for(CompileState*);
 static void generate_condition(CompileState*, ExpNode*);
+static int count_values(const ExpNode*);
 static void generate_continue(CompileState*);
 static void generate_break(CompileState*);
 static void generate_return(CompileState*);
 static void generate_do(CompileState*);
+static void generate_spawn(CompileState*);
 static void initialize_local(CompileState*, VarDeclaration*);
 
 /* misc function */
@@ -176,6 +183,43 @@ get_prefix_b(const Datatype* data) {
 	       (data->type == DATA_BYTE && data->ptr_dim == 0) ? 'b' : 'i';
 }
 
+/* 'i' or 'f', the prefix of the instructions on the lanes of a vector */
+static char
+get_lane_prefix(const Datatype* data) {
+	return VECTOR_FLOAT(data) ? 'f' : 'i';
+}
+
+/* the value of exp is in memory (a variable, $p, p[i] or a field), so
+ * its address can be used instead */
+static int
+has_address(const ExpNode* exp) {
+	switch (exp->type) {
+		case EXP_IDENTIFIER:
+			return 1;
+		case EXP_UNARY:
+			return exp->uval->optype == '$';
+		case EXP_INDEX:
+			return !IS_VECTOR(exp->aval->array->eval);
+		case EXP_BINARY:
+			return exp->bval->optype == '.';
+	}
+	return 0;
+}
+
+/* f is alloc or delete of capi_std, which are instructions (malloc and
+ * free) instead of c-functions */
+static int
+is_heap_call(const VarDeclaration* f, const char* name) {
+	const FunctionDescriptor* desc = f->datatype->fdesc;
+	return (
+		(f->datatype->mods & MOD_FOREIGN)
+		&& !strcmp(f->name, name)
+		&& desc->nargs == 1
+		&& !desc->vararg
+		&& IS_VOID(desc->return_type) == !strcmp(name, "delete")
+	);
+}
+
 static TreeStruct*
 get_struct(CompileState* C, const char* identifier) {
 	for (TreeStructList* i = C->defined_structs; i; i = i->next) {
@@ -299,7 +343,7 @@ generate_expression(CompileState* C, ExpNode* exp) {
 	} else {
 		writer = writeb;
 	}
-	if (parent) {
+	if (parent && parent->type == EXP_BINARY) {
 		is_assign = IS_ASSIGN(parent->bval);
 	} else {
 		is_assign = 0;
@@ -322,6 +366,11 @@ generate_expression(CompileState* C, ExpNode* exp) {
 		exp->side == LEAF_LEFT && exp->type == EXP_UNARY && exp->uval->optype == '$'){
 		dont_der = 1;
 	}
+	/* a lane is read from (or saved to) where the vector is */
+	if (parent && parent->type == EXP_INDEX && parent->aval->array == exp
+		&& exp->eval && IS_VECTOR(exp->eval) && has_address(exp)) {
+		dont_der = 1;
+	}
 	switch (exp->type) {
 		case EXP_INTEGER:
 			writer(C, "iconst %lld\n", exp->ival);
@@ -358,6 +407,9 @@ generate_expression(CompileState* C, ExpNode* exp) {
 			} else if ((dont_der && !IS_STRUCT(d)) || d->array_dim > 0) {
 				/* structs are pointers, use locall */
 				writer(C, "lea %d\n", var->offset);
+			} else if (IS_VECTOR(d)) {
+				writer(C, "lea %d\n", var->offset);
+				writer(C, "vload %d\n", VECTOR_LANES(d));
 			} else {
 				char prefix = get_prefix(d);
 				writer(C, "%clocall %d\n", prefix, var->offset);
@@ -367,6 +419,19 @@ generate_expression(CompileState* C, ExpNode* exp) {
 		case EXP_CAST: {
 			const Datatype* to = exp->cxval->d;	
 			const Datatype* from = exp->cxval->operand->eval;
+			if (IS_VECTOR(to)) {
+				/* broadcast, unless it already is that vector */
+				generate_expression(C, exp->cxval->operand);
+				if (!IS_VECTOR(from)) {
+					if (VECTOR_FLOAT(to) && !IS_FLOAT(from)) {
+						writer(C, "itof\n");
+					} else if (!VECTOR_FLOAT(to) && IS_FLOAT(from)) {
+						writer(C, "ftoi\n");
+					}
+					writer(C, "vsplat %d\n", VECTOR_LANES(to));
+				}
+				break;
+			}
 			int from_f = from->type == DATA_FLOAT && from->ptr_dim == 0;
 			int from_i = from->type != DATA_FLOAT;
 			int to_f = to->type == DATA_FLOAT && to->ptr_dim == 0;
@@ -382,6 +447,16 @@ generate_expression(CompileState* C, ExpNode* exp) {
 		case EXP_CALL: {
 			FuncCall* call = exp->cval;
 			generate_expression(C, call->arguments);
+			if (call->reduce) {
+				const Datatype* v = call->arguments->eval;
+				const char* ins = call->reduce == '+' ? "sum" : call->reduce == '<' ? "min" : "max";
+				writer(C, "v%c%s %d\n", get_lane_prefix(v), ins, VECTOR_LANES(v));
+				break;
+			}
+			if (call->block) {
+				writer(C, "%s\n", call->block);
+				break;
+			}
 			/* !!!IMPORTANT!!! CCALL ADDRESS COMES __AFTER__ ARGUMENTS! */
 			if (call->computed) {
 				generate_expression(C, call->fptr);
@@ -394,7 +469,11 @@ generate_expression(CompileState* C, ExpNode* exp) {
 				}
 			} else {
 				VarDeclaration* f = get_local(C, call->fptr->sval);
-				if (f->datatype->mods & MOD_FOREIGN) {
+				if (is_heap_call(f, "alloc")) {
+					writer(C, "malloc\n");
+				} else if (is_heap_call(f, "delete")) {
+					writer(C, "free\n");
+				} else if (f->datatype->mods & MOD_FOREIGN) {
 					writer(C, "cfcall " FORMAT_FUNC ", %d\n", call->fptr->sval, call->nargs);
 				} else {
 					writer(C, "call " FORMAT_FUNC ", %d\n", call->fptr->sval, call->nargs);
@@ -404,6 +483,13 @@ generate_expression(CompileState* C, ExpNode* exp) {
 		}
 		case EXP_INDEX: {
 			ArrayIndex* index = exp->aval;
+			if (IS_VECTOR(index->array->eval) && !has_address(index->array)) {
+				/* a lane of a vector that's only on the stack */
+				generate_expression(C, index->array);
+				generate_expression(C, index->index);
+				writer(C, "vlane %d\n", VECTOR_LANES(index->array->eval));
+				break;
+			}
 			generate_expression(C, index->array);
 			generate_expression(C, index->index);
 			/* ... pointer arithmetic ... */
@@ -411,7 +497,9 @@ generate_expression(CompileState* C, ExpNode* exp) {
 			writer(C, "imul\n");
 			writer(C, "iadd\n");
 			/* struct just exists on the stack, don't dereference */
-			if (!dont_der && !IS_STRUCT(exp->eval)) {
+			if (!dont_der && IS_VECTOR(exp->eval)) {
+				writer(C, "vload %d\n", VECTOR_LANES(exp->eval));
+			} else if (!dont_der && !IS_STRUCT(exp->eval)) {
 				writer(C, "ider\n");
 			}
 			break;
@@ -423,7 +511,9 @@ generate_expression(CompileState* C, ExpNode* exp) {
 				case '$': {
 					/* don't dereference if the parent is an assignment */
 					/* @TODO problem? */
-					if (!dont_der) {
+					if (!dont_der && IS_VECTOR(exp->eval)) {
+						writer(C, "vload %d\n", VECTOR_LANES(exp->eval));
+					} else if (!dont_der) {
 						int prefix = get_prefix_b(exp->eval);
 						writer(C, "%cder\n", prefix);
 					}
@@ -453,7 +543,9 @@ generate_expression(CompileState* C, ExpNode* exp) {
 				if (DO_OPTIMIZE && field->offset > 0) {
 					writer(C, "iinc %d\n", field->offset);	
 				}
-				if (!dont_der) {
+				if (!dont_der && IS_VECTOR(exp->eval)) {
+					writer(C, "vload %d\n", VECTOR_LANES(exp->eval));
+				} else if (!dont_der) {
 					writer(C, "%cder\n", get_prefix_b(exp->eval));	
 				}
 			} else if (exp->bval->optype == SPEC_LOG_AND) {
@@ -465,8 +557,7 @@ generate_expression(CompileState* C, ExpNode* exp) {
 					writer(C, "iconst 0\n");
 				}
 				writer(C, "dup\n");
-				writer(C, "itest\n");
-				writer(C, "jz " FORMAT_LABEL "\n", ss0);
+				writer(C, "ijz " FORMAT_LABEL "\n", ss0);
 				generate_expression(C, rhs);
 				if (IS_VOID(rhs->eval)) {
 					writer(C, "iconst 0\n");
@@ -486,14 +577,12 @@ generate_expression(CompileState* C, ExpNode* exp) {
 				if (IS_VOID(lhs->eval)) {
 					writer(C, "iconst 0\n");
 				}
-				writer(C, "itest\n");
-				writer(C, "jnz " FORMAT_LABEL "\n", ss0);
+				writer(C, "ijnz " FORMAT_LABEL "\n", ss0);
 				generate_expression(C, rhs);
 				if (IS_VOID(rhs->eval)) {
 					writer(C, "iconst 0\n");
 				}
-				writer(C, "itest\n");
-				writer(C, "jnz " FORMAT_LABEL "\n", ss0);
+				writer(C, "ijnz " FORMAT_LABEL "\n", ss0);
 				writer(C, "jmp " FORMAT_LABEL "\n", ss1);
 				writer(C, FORMAT_DEF_LABEL, ss0);
 				writer(C, "iconst 1\n");
@@ -502,6 +591,15 @@ generate_expression(CompileState* C, ExpNode* exp) {
 				writer(C, "iconst 0\n");
 				writer(C, FORMAT_LABEL ":", ss2);
 				writer(C, " ; bot log or\n");
+			} else if (exp->eval && IS_VECTOR(exp->eval)) {
+				generate_vector_op(C, exp, writer);
+			} else if (exp->bval->optype == '=' && lhs->eval->type == DATA_STRUCT && IS_STRUCT(lhs->eval)) {
+				/* copy every field, the value is the struct that was assigned to */
+				generate_expression(C, lhs);
+				writer(C, "dup\n");
+				generate_expression(C, rhs);
+				writer(C, "iconst %d\n", lhs->eval->size);
+				writer(C, "memcpy\n");
 			} else if (exp->bval->optype == '=') {
 				char p = get_prefix_b(lhs->eval);
 				generate_expression(C, lhs);
@@ -607,13 +705,12 @@ generate_expression(CompileState* C, ExpNode* exp) {
 							op == SPEC_LE ? "gt" :
 							op == SPEC_EQ ? "ne" : "e"	
 						);	
-						writer(C, "%ccmp\n", prefix);
 						if (C->cond_jmp && is_top) {
 							/* if it's a conditional expression and the cond operator is at
 							 * the top of the tree, a simple conditional jump can be generated */
-							writer(C, "j%s " FORMAT_LABEL, C->gen_do ? ins : inverted, C->bottom_label);
+							writer(C, "%cj%s " FORMAT_LABEL, prefix, C->gen_do ? ins : inverted, C->bottom_label);
 						} else {
-							writer(C, "p%s", ins);
+							writer(C, "%cp%s", prefix, ins);
 						}
 						break;
 					}
@@ -627,6 +724,41 @@ generate_expression(CompileState* C, ExpNode* exp) {
 	}
 }
 
+/* arithmetic and assignments of vectors, both sides are the same type.
+ * an assignment saves every lane and loads them back as its value */
+static void
+generate_vector_op(CompileState* C, ExpNode* exp, void (*writer)(CompileState*, const char*, ...)) {
+	ExpNode* lhs = exp->bval->left;
+	ExpNode* rhs = exp->bval->right;
+	int lanes = VECTOR_LANES(exp->eval);
+	char prefix = get_lane_prefix(exp->eval);
+	char op = exp->bval->optype;
+	const char* ins = (
+		op == '+' || op == SPEC_INC_BY ? "add" :
+		op == '-' || op == SPEC_DEC_BY ? "sub" :
+		op == '*' || op == SPEC_MUL_BY ? "mul" : "div"
+	);
+	if (op == '=') {
+		generate_expression(C, lhs);
+		writer(C, "dup\n");
+		generate_expression(C, rhs);
+	} else if (IS_ASSIGN(exp->bval)) {
+		generate_expression(C, lhs);
+		writer(C, "dup\n");
+		writer(C, "dup\n");
+		writer(C, "vload %d\n", lanes);
+		generate_expression(C, rhs);
+		writer(C, "v%c%s %d\n", prefix, ins, lanes);
+	} else {
+		generate_expression(C, lhs);
+		generate_expression(C, rhs);
+		writer(C, "v%c%s %d\n", prefix, ins, lanes);
+		return;
+	}
+	writer(C, "vsave %d\n", lanes);
+	writer(C, "vload %d\n", lanes);
+}
+
 static void
 generate_break(CompileState* C) {
 	writeb(C, "jmp " FORMAT_LABEL "\n", C->break_label);
@@ -643,6 +775,40 @@ generate_return(CompileState* C) {
 	writeb(C, "jmp " FORMAT_LABEL "\n", C->return_label);
 }
 
+/* the arguments, where the result goes and the function are pushed, the
+ * vm runs the call as a task (see task.c) */
+static void
+generate_spawn(CompileState* C) {
+	TreeSpawn* spawn = C->focus->spawnval;
+	FuncCall* call = spawn->call->cval;
+	FunctionDescriptor* desc = C->current_function->funcval->desc->fdesc;
+	generate_expression(C, call->arguments);
+	if (spawn->dest) {
+		writeb(C, "lea %d\n", spawn->dest->offset);
+	} else {
+		writeb(C, "iconst 0\n");
+	}
+	writeb(C, "iconst " FORMAT_FUNC "\n", call->fptr->sval);
+	writeb(C, "spawn %d, %d\n", call->nargs, desc->sync_offset);
+}
+
+/* number of values an expression leaves on the stack (a comma
+ * expression leaves the value of every operand, a vector one for every
+ * lane) */
+static int
+count_values(const ExpNode* exp) {
+	if (!exp) {
+		return 0;
+	}
+	if (exp->type == EXP_BINARY && exp->bval->optype == ',') {
+		return count_values(exp->bval->left) + count_values(exp->bval->right);
+	}
+	if (exp->eval && IS_VECTOR(exp->eval)) {
+		return VECTOR_LANES(exp->eval);
+	}
+	return exp->eval && !IS_VOID(exp->eval);
+}
+
 /* helper function for while, if, for */
 static void
 generate_condition(CompileState* C, ExpNode* condition) {
@@ -650,8 +816,10 @@ generate_condition(CompileState* C, ExpNode* condition) {
 		C->cond_jmp = 1;
 		generate_expression(C, condition);
 		C->cond_jmp = 0;
-		if (!IS_COMPARE(condition)) {
-			writeb(C, "%ctest\n", get_prefix(condition->eval));
+		if (!IS_COMPARE(condition) && get_prefix(condition->eval) == 'i') {
+			writeb(C, "ij%s " FORMAT_LABEL "\n", C->gen_do ? "nz" : "z", C->bottom_label);
+		} else if (!IS_COMPARE(condition)) {
+			writeb(C, "ftest\n");
 			if (C->gen_do) {
 				writeb(C, "jnz " FORMAT_LABEL "\n", C->bottom_label);
 			} else {
@@ -709,6 +877,10 @@ generate_do(CompileState* C) {
 
 static void
 generate_for(CompileState* C) {
+	if (C->focus->forval->parallel) {
+		generate_parallel_for(C);
+		return;
+	}
 	C->cont_label = C->label_count++;
 	C->bottom_label = C->break_label = C->label_count++;
 	writeb(C, 
@@ -716,16 +888,122 @@ generate_for(CompileState* C) {
 		C->cont_label,
 		C->bottom_label
 	);
-	generate_expression(C, C->focus->forval->init);
+	ExpNode* init = C->focus->forval->init;
+	ExpNode* statement = C->focus->forval->statement;
+	generate_expression(C, init);
+	/* init and statement are evaluated for their side effects only, don't
+	 * leave their values on the stack (it would grow every iteration) */
+	for (int i = count_values(init); i > 0; i--) {
+		writeb(C, "pop\n");
+	}
 	writeb(C, FORMAT_DEF_LABEL, C->cont_label);
 	generate_condition(C, C->focus->forval->condition);
 	C->exp_push = 1;
-	generate_expression(C, C->focus->forval->statement);	
+	generate_expression(C, statement);	
+	for (int i = count_values(statement); i > 0; i--) {
+		pushb(C, "pop\n");
+	}
 	C->exp_push = 0;	
 	pushb(C, "jmp " FORMAT_LABEL "\n", C->cont_label);
 	pushb(C, FORMAT_DEF_LABEL, C->break_label);
 }
 
+/* the range is evaluated once, then pfor runs the chunk code below it
+ * for parts of the range, each in its own copy of the frame (see task.c).
+ * a chunk finds its part and the loop's frame in the vm's locals:
+ *   [offset]       counter of unfinished chunks (only in the loop's frame)
+ *   [offset + 8]   start of the chunk
+ *   [offset + 16]  end of the chunk
+ *   [offset + 24]  address of the loop's bp, for the reductions */
+static void
+generate_parallel_for(CompileState* C) {
+	TreeParallel* par = C->focus->forval->parallel;
+	VarDeclaration* var = par->var;
+	unsigned int chunk_label = C->label_count++;
+	unsigned int top_label = C->label_count++;
+	unsigned int end_label = C->label_count++;
+	unsigned int done_label = C->label_count++;
+	C->cont_label = C->label_count++;
+	C->bottom_label = C->break_label = C->label_count++;
+	writeb(C,
+		"; parallel for\n;\tchunk: " FORMAT_LABEL "\n;\tbot: " FORMAT_LABEL "\n",
+		chunk_label,
+		C->bottom_label
+	);
+	/* the loop's frame keeps start in var and end at [offset + 16] for
+	 * the final value of var */
+	generate_expression(C, par->start);
+	writeb(C, "ilocals %d\n", var->offset);
+	writeb(C, "ilocall %d\n", var->offset);
+	generate_expression(C, par->end);
+	if (par->inclusive) {
+		writeb(C, "iconst 1\n");
+		writeb(C, "iadd\n");
+	}
+	writeb(C, "ilocals %d\n", par->offset + 16);
+	writeb(C, "ilocall %d\n", par->offset + 16);
+	writeb(C, "iconst %lld\n", par->step);
+	writeb(C, "iconst " FORMAT_LABEL "\n", chunk_label);
+	/* the frame is copied from the function's first argument */
+	writeb(C, "pfor %d, %d\n", par->offset, C->current_function->funcval->desc->fdesc->nargs);
+	writeb(C, "jmp " FORMAT_LABEL "\n", end_label);
+
+	/* a chunk sums into zero, min and max can start from the value that
+	 * the variable had before the loop */
+	writeb(C, FORMAT_DEF_LABEL, chunk_label);
+	for (TreeReduction* i = par->reductions; i; i = i->next) {
+		if (i->optype == '+') {
+			writeb(C, "iconst 0\n");
+			writeb(C, "ilocals %d\n", i->var->offset);
+		}
+	}
+	writeb(C, "ilocall %d\n", par->offset + 8);
+	writeb(C, "ilocals %d\n", var->offset);
+	writeb(C, FORMAT_DEF_LABEL, top_label);
+	writeb(C, "ilocall %d\n", var->offset);
+	writeb(C, "ilocall %d\n", par->offset + 16);
+	writeb(C, "ijge " FORMAT_LABEL "\n", C->bottom_label);
+
+	pushb(C, FORMAT_DEF_LABEL, C->cont_label);
+	pushb(C, "ilocall %d\n", var->offset);
+	pushb(C, "iconst %lld\n", par->step);
+	pushb(C, "iadd\n");
+	pushb(C, "ilocals %d\n", var->offset);
+	pushb(C, "jmp " FORMAT_LABEL "\n", top_label);
+	pushb(C, FORMAT_DEF_LABEL, C->bottom_label);
+	for (TreeReduction* i = par->reductions; i; i = i->next) {
+		int how = i->optype == '+' ? TASK_REDUCE_ADD : i->optype == '<' ? TASK_REDUCE_MIN : TASK_REDUCE_MAX;
+		char prefix = get_prefix(i->var->datatype);
+		pushb(C, "ilocall %d\n", par->offset + 24);
+		pushb(C, "iconst %d\n", 8 + i->var->offset);
+		pushb(C, "iadd\n");
+		pushb(C, "%clocall %d\n", prefix, i->var->offset);
+		pushb(C, "%creduce %d\n", prefix, how);
+	}
+	pushb(C, "pend\n");
+
+	/* var = start + iterations * step, unless the range is empty */
+	pushb(C, FORMAT_DEF_LABEL, end_label);
+	pushb(C, "ilocall %d\n", var->offset);
+	pushb(C, "ilocall %d\n", par->offset + 16);
+	pushb(C, "ijge " FORMAT_LABEL "\n", done_label);
+	pushb(C, "ilocall %d\n", par->offset + 16);
+	pushb(C, "ilocall %d\n", var->offset);
+	pushb(C, "isub\n");
+	pushb(C, "iconst 1\n");
+	pushb(C, "isub\n");
+	pushb(C, "iconst %lld\n", par->step);
+	pushb(C, "idiv\n");
+	pushb(C, "iconst 1\n");
+	pushb(C, "iadd\n");
+	pushb(C, "iconst %lld\n", par->step);
+	pushb(C, "imul\n");
+	pushb(C, "ilocall %d\n", var->offset);
+	pushb(C, "iadd\n");
+	pushb(C, "ilocals %d\n", var->offset);
+	pushb(C, FORMAT_DEF_LABEL, done_label);
+}
+
 /* generate_function helper function */
 static void 
 print_stack_map(CompileState* C, TreeNode* node) {
@@ -773,19 +1051,20 @@ generate_function(CompileState* C) {
 	TreeFunction* func = C->focus->funcval;
 	FunctionDescriptor* desc = func->desc->fdesc;
 	writeb(C, FORMAT_DEF_FUNC, func->name);	
-	int index = 0;
-	for (VarDeclarationList* i = desc->arguments; i; i = i->next) {
-		writeb(C, "%carg %d\n", get_prefix(i->decl->datatype), index++);
-	}
+	/* the arguments aren't copied, they're locals below bp */
 	if (DO_OPTIMIZE && desc->stack_space > 0) {
 		writeb(C, "res %d\n", desc->stack_space);
 	}
 	pushb(C, FORMAT_DEF_LABEL, C->return_label);
+	if (desc->sync_offset >= 0) {
+		/* a function doesn't return before its spawns are done */
+		pushb(C, "sync %d\n", desc->sync_offset);
+	}
 	const Datatype* ret = desc->return_type;
 	if (ret->type == DATA_VOID) {
-		pushb(C, "vret\n");	
+		pushb(C, "vret %d\n", desc->nargs);	
 	} else {
-		pushb(C, "%cret\n", get_prefix(ret));
+		pushb(C, "%cret %d\n", get_prefix(ret), desc->nargs);
 	}
 
 }
@@ -800,11 +1079,29 @@ initialize_local(CompileState* C, VarDeclaration* var) {
 	int is_ptr = var->datatype->ptr_dim > 0;
 	writeb(C, "; initialize '%s'\n", var->name);
 	if (d->array_dim > 0) {
+		/* every element is 0 */
+		int size = d->size + (d->type == DATA_STRUCT && !is_ptr ? 8 : 0);
+		for (int i = 0; i < d->array_dim; i++) {
+			size *= d->array_size[i];
+		}
 		writeb(C, "lea %d\n", var->offset);
+		writeb(C, "iconst 0\n");
+		writeb(C, "iconst %d\n", size);
+		writeb(C, "memset\n");
+		writeb(C, "; -----------\n");
+		return;
 	} else if (d->type == DATA_STRUCT && !is_ptr) {
 		/* if it's a struct, initialize it as a pointer to stack space */
 		/* note a struct's stack space exists 8 bytes after its pointer */
 		writeb(C, "lea %d\n", var->offset + 8);
+	} else if (IS_VECTOR(d)) {
+		/* every lane is 0 */
+		writeb(C, "lea %d\n", var->offset);
+		writeb(C, "iconst 0\n");
+		writeb(C, "vsplat %d\n", VECTOR_LANES(d));
+		writeb(C, "vsave %d\n", VECTOR_LANES(d));
+		writeb(C, "; -----------\n");
+		return;
 	} else {
 		/* otherwise just initialize it as 0... no need to initialize a float
 		 * differently because a 0 int is a 0 float */
@@ -879,7 +1176,7 @@ generate_instructions(ParseState* P, const char* outfile_name) {
 			case NODE_STATEMENT: {
 				ExpNode* exp = C.focus->stateval->exp;
 				generate_expression(&C, exp);
-				if (!IS_VOID(exp->eval)) {
+				for (int i = count_values(exp); i > 0; i--) {
 					writeb(&C, "pop\n");
 				}
 				break;
@@ -893,6 +1190,12 @@ generate_instructions(ParseState* P, const char* outfile_name) {
 			case NODE_RETURN:
 				generate_return(&C);
 				break;
+			case NODE_SPAWN:
+				generate_spawn(&C);
+				break;
+			case NODE_SYNC:
+				writeb(&C, "sync %d\n", C.current_function->funcval->desc->fdesc->sync_offset);
+				break;
 			case NODE_BLOCK:
 				for (VarDeclarationList* i = C.focus->blockval->locals; i; i = i->next) {
 					initialize_local(&C, i->decl);
@@ -912,3 +1215,27 @@ generate_instructions(ParseState* P, const char* outfile_name) {
 	fclose(C.handle);
 
 }
+
+/* compiles name.spy (and writes name.spys), returns the path of the
+ * bytecode, name.spyb.  the caller frees it */
+char*
+generate_program(const char* name) {
+
+	size_t slen = strlen(name);
+	char* fspy = malloc(slen + 5);
+	char* fasm = malloc(slen + 6);
+	char* fbin = malloc(slen + 6);
+	sprintf(fspy, "%s.spy", name);
+	sprintf(fasm, "%s.spys", name);
+	sprintf(fbin, "%s.spyb", name);
+
+	TokenList* tokens = generate_tokens_from_source(fspy);
+	ParseState* state = generate_syntax_tree(tokens);
+	generate_instructions(state, fasm);
+	generate_bytecode(fasm, fbin);
+
+	free(fspy);
+	free(fasm);
+	return fbin;
+
+}
@@ -4,5 +4,6 @@
 #include "parse.h"
 
 void generate_instructions(ParseState*, const char*);
+char* generate_program(const char*);
 
 #endif
@@ -0,0 +1,1748 @@
+/*
+ * INTERPRETER
+ *
+ * this is included twice by vm.c, there is no include guard.  SPY_INTERPRET
+ * is the name of the function, and SPY_VERIFIED is 1 in the copy that only
+ * runs code that has passed spy_verify (see verify.c).  the macros expand
+ * to the same text both times, the checks that the verifier has already
+ * done at load time test SPY_VERIFIED and are compiled out of that copy
+ */
+
+static void
+SPY_INTERPRET(SpyState* spy, SpyOp* entry) {
+
+	SpyOp* op;
+
+	/* NOTES
+	 *
+	 * 1. for now, jump instructions are relative to the
+	 * start of the code section (INCLUDING the data section)
+	 * e.g. ip becomes the decoded instruction at code[addr];
+	 * 
+	 *
+	 */
+
+	/* some useful macros for instructions */
+
+	/* stack overflow and quit() are only checked for at safepoints, see
+	 * spy_stack_bounds.  bytes is how much the code after the safepoint
+	 * can push.  note: 16 is the maximum stack space that an instruction
+	 * requires, register instructions can write up to REG_MAX_TEMPS slots
+	 * above sp.  the stack is followed by a guard (see MEMORY in vm.c), so
+	 * if that can't be jumped over, the mmu does the check */
+	#define STACK_CHECK(bytes) \
+		{ \
+			if ((bytes) > SIZE_GUARD - REG_STACK_RESERVE \
+				&& spy->stack_end - spy->sp <= REG_STACK_RESERVE + (bytes)) { \
+				spy_die(spy, "stack overflow"); \
+			} \
+		}
+
+	/* in verified code, only calls check for stack, they check for the
+	 * largest frame that any function can have (see verify.c) */
+	#define SAFEPOINT() \
+		{ \
+			if (spy->bail) { \
+				return; \
+			} \
+			if (!SPY_VERIFIED) { \
+				STACK_CHECK(spy->stack_slack); \
+			} \
+		}
+
+	/* typed c-functions take their arguments as they are on the stack,
+	 * the others pop them first to last (see capi_load.c) */
+	#define CALL_CFUNC(cfunc, nargs) \
+		{ \
+			if ((cfunc)->native) { \
+				spy_call_native(spy, (cfunc), (nargs)); \
+			} else { \
+				if ((nargs) > 1) { \
+					spy_cfunc_args(spy, (nargs)); \
+				} \
+				(cfunc)->f(spy); \
+			} \
+		}
+
+	#define CALL_SAFEPOINT() \
+		{ \
+			if (spy->bail) { \
+				return; \
+			} \
+			STACK_CHECK(SPY_VERIFIED ? spy->frame_height : spy->stack_slack); \
+		}
+
+	/* backward jumps are safepoints, and are counted for the loop traces */
+	#define JMPCOND(cond) \
+		{ \
+			if ((cond)) { \
+				spy->ip = op->a.op; \
+				if (spy->ip <= op) { \
+					SAFEPOINT(); \
+					if (spy->trace) { \
+						spy_trace_loop(spy); \
+					} \
+				} \
+			} \
+		}
+
+	#define CJMPCOND(cond) \
+		{ \
+			spy_int addr = spy_pop_int(spy); \
+			if ((cond)) { \
+				spy->ip = spy_op_at(spy, addr); \
+				SAFEPOINT(); \
+			} \
+		}
+
+	#define INTARITH(op) \
+		{ \
+			spy_int b = spy_pop_int(spy); \
+			spy_int a = spy_pop_int(spy); \
+			spy_push_int(spy, a op b); \
+		}
+	
+	#define FLOATARITH(op) \
+		{ \
+			spy_float b = spy_pop_float(spy); \
+			spy_float a = spy_pop_float(spy); \
+			spy_push_float(spy, a op b); \
+		}
+
+	#define CMPTYPE(type) \
+		{ \
+			spy_ ## type b = spy_pop_ ## type(spy); \
+			spy_ ## type a = spy_pop_ ## type(spy); \
+			if (a == b) { \
+				spy->flags |= FLAG_EQ; \
+				spy->flags &= ~(FLAG_LT | FLAG_GT); \
+			} else if (a > b) { \
+				spy->flags |= FLAG_GT; \
+				spy->flags &= ~(FLAG_LT | FLAG_EQ); \
+			} else { \
+				spy->flags |= FLAG_LT; \
+				spy->flags &= ~(FLAG_GT | FLAG_EQ); \
+			} \
+			if (a - b > 0) { \
+				spy->flags &= ~FLAG_S; \
+			} else { \
+				spy->flags |= FLAG_S; \
+			} \
+		} 
+
+	#define TESTTYPE(type) \
+		{ \
+			spy_ ## type a = spy_pop_ ## type(spy); \
+			if (a == 0) { \
+				spy->flags |= FLAG_Z; \
+			} else { \
+				spy->flags &= ~FLAG_Z; \
+			} \
+			if (a < 0) { \
+				spy->flags |= FLAG_S; \
+			} else { \
+				spy->flags &= ~FLAG_S; \
+			} \
+		}
+
+	/* compares without flags, cond is an expression of a and b */
+	#define CMPJMP(type, cond) \
+		{ \
+			spy_ ## type b = spy_pop_ ## type(spy); \
+			spy_ ## type a = spy_pop_ ## type(spy); \
+			JMPCOND(cond); \
+		}
+
+	#define CMPPUSH(type, cond) \
+		{ \
+			spy_ ## type b = spy_pop_ ## type(spy); \
+			spy_ ## type a = spy_pop_ ## type(spy); \
+			spy_push_int(spy, (cond) != 0); \
+		}
+
+	#define PUSHFLAG(flag) spy_push_int(spy, (spy->flags & (flag)) != 0)
+	
+	#define PUSHNOTFLAG(flag) spy_push_int(spy, !(spy->flags & (flag)))
+
+	/* only checks that addr is mapped, the guards fault by themselves */
+	#define BOUNDS_CHECK(addr) if (addr <= 0 || addr > spy->memory_size - 8) spy_die(spy, "segmentation fault (addr=0x%llX)", addr)
+
+	/* verified code doesn't check the addresses that the verifier has
+	 * found to be in the frame (bit is VERIFY_ADDR or VERIFY_ADDR2), or
+	 * the constant addresses of AIDER, AISAVE, ... */
+	#define FRAME_BOUNDS_CHECK(addr, bit) if (!SPY_VERIFIED || !(op->b.i & (bit))) BOUNDS_CHECK(addr)
+
+	#define CONST_BOUNDS_CHECK(addr) if (!SPY_VERIFIED) BOUNDS_CHECK(addr)
+
+	/* vectors (see VECTORS in vm.c), op->a.i is the number of lanes.  the
+	 * verifier has checked it in verified code, native code only calls
+	 * spy_exec_vector with a valid one */
+	#define VECTOR_CHECK() \
+		if (!SPY_VERIFIED && (op->a.i < 1 || op->a.i > VECTOR_MAX_LANES)) { \
+			spy_die(spy, "invalid vector of %lld lanes", op->a.i); \
+		}
+
+	#define VECTOR_BOUNDS_CHECK(addr, n) \
+		if (addr <= 0 || addr > spy->memory_size - 8 * (n)) spy_die(spy, "segmentation fault (addr=0x%llX)", addr)
+
+	#define VLOAD() \
+		{ \
+			spy_int n = op->a.i; \
+			spy_int addr = spy_pop_int(spy); \
+			VECTOR_BOUNDS_CHECK(addr, n); \
+			memcpy(spy->sp + 8, &spy->memory[addr], 8 * n); \
+			spy->sp += 8 * n; \
+		}
+
+	#define VSAVE() \
+		{ \
+			spy_int n = op->a.i; \
+			spy_byte* lanes = spy->sp - 8 * n + 8; \
+			spy_int addr; \
+			memcpy(&addr, lanes - 8, 8); \
+			VECTOR_BOUNDS_CHECK(addr, n); \
+			memcpy(&spy->memory[addr], lanes, 8 * n); \
+			spy->sp = lanes - 16; \
+		}
+
+	#define VSPLAT() \
+		{ \
+			spy_int n = op->a.i; \
+			for (spy_int l = 1; l < n; l++) { \
+				memcpy(spy->sp + 8 * l, spy->sp, 8); \
+			} \
+			spy->sp += 8 * (n - 1); \
+		}
+
+	#define VLANE() \
+		{ \
+			spy_int n = op->a.i; \
+			spy_int lane = spy_pop_int(spy); \
+			if (lane < 0 || lane >= n) { \
+				spy_die(spy, "lane %lld of a vector of %lld lanes", lane, n); \
+			} \
+			spy->sp -= 8 * n; \
+			memmove(spy->sp + 8, spy->sp + 8 + 8 * lane, 8); \
+			spy->sp += 8; \
+		}
+
+	/* the vector on top of the stack is b, the one below it a */
+	#define VARITH(type, o) \
+		{ \
+			spy_int n = op->a.i; \
+			spy_ ## type a[VECTOR_MAX_LANES]; \
+			spy_ ## type b[VECTOR_MAX_LANES]; \
+			spy_byte* at = spy->sp - 16 * n + 8; \
+			memcpy(a, at, 8 * n); \
+			memcpy(b, at + 8 * n, 8 * n); \
+			for (spy_int l = 0; l < n; l++) { \
+				a[l] = a[l] o b[l]; \
+			} \
+			memcpy(at, a, 8 * n); \
+			spy->sp -= 8 * n; \
+		}
+
+	/* folds lanes 1 ... n-1 into r, which starts as lane 0 */
+	#define VREDUCE(type, fold) \
+		{ \
+			spy_int n = op->a.i; \
+			spy_ ## type v[VECTOR_MAX_LANES]; \
+			spy->sp -= 8 * n; \
+			memcpy(v, spy->sp + 8, 8 * n); \
+			spy_ ## type r = v[0]; \
+			for (spy_int l = 1; l < n; l++) { \
+				fold; \
+			} \
+			spy_push_ ## type(spy, r); \
+		}
+
+	/* blocks of n bytes (see BLOCKS in vm.c), n is on top of the stack */
+	#define BLOCK_BOUNDS_CHECK(addr, n) \
+		if (addr <= 0 || addr > spy->memory_size - (n)) spy_die(spy, "segmentation fault (addr=0x%llX)", addr)
+
+	#define BLOCK_POP_SIZE() \
+		spy_int n = spy_pop_int(spy); \
+		if (n < 0 || n > spy->memory_size) { \
+			spy_die(spy, "invalid block of %lld bytes", n); \
+		}
+
+	#define MEMCOPY(f) \
+		{ \
+			BLOCK_POP_SIZE(); \
+			spy_int src = spy_pop_int(spy); \
+			spy_int dest = spy_pop_int(spy); \
+			if (n > 0) { \
+				BLOCK_BOUNDS_CHECK(src, n); \
+				BLOCK_BOUNDS_CHECK(dest, n); \
+				f(&spy->memory[dest], &spy->memory[src], n); \
+			} \
+		}
+
+	#define MEMSET() \
+		{ \
+			BLOCK_POP_SIZE(); \
+			spy_int value = spy_pop_int(spy); \
+			spy_int dest = spy_pop_int(spy); \
+			if (n > 0) { \
+				BLOCK_BOUNDS_CHECK(dest, n); \
+				memset(&spy->memory[dest], (uint8_t)value, n); \
+			} \
+		}
+
+	#define MEMCMP() \
+		{ \
+			BLOCK_POP_SIZE(); \
+			spy_int b = spy_pop_int(spy); \
+			spy_int a = spy_pop_int(spy); \
+			int r = 0; \
+			if (n > 0) { \
+				BLOCK_BOUNDS_CHECK(a, n); \
+				BLOCK_BOUNDS_CHECK(b, n); \
+				r = memcmp(&spy->memory[a], &spy->memory[b], n); \
+			} \
+			spy_push_int(spy, (r > 0) - (r < 0)); \
+		}
+
+	/* register instruction operands (see regvm.h).  every register
+	 * instruction adjusts sp after it is done with its operands */
+	#define RBASE(n) (op->base[n] == RB_BP ? spy->bp : op->base[n] == RB_SP ? spy->sp : (spy_byte *)spy->rconst)
+	#define RINT(n) (*(spy_int *)(RBASE(n) + op->reg[n]))
+	#define RFLOAT(n) (*(spy_float *)(RBASE(n) + op->reg[n]))
+	#define RBYTE(n) (*(spy_byte *)(RBASE(n) + op->reg[n]))
+
+	#define RINTARITH(o) \
+		{ \
+			RINT(0) = RINT(1) o RINT(2); \
+			spy->sp += op->sp_delta; \
+		}
+
+	#define RFLOATARITH(o) \
+		{ \
+			RFLOAT(0) = RFLOAT(1) o RFLOAT(2); \
+			spy->sp += op->sp_delta; \
+		}
+
+	#define RJMPCOND(cond) \
+		{ \
+			int taken = (cond); \
+			spy->sp += op->sp_delta; \
+			if (taken) { \
+				spy->ip = op->b.op; \
+				if (spy->ip <= op) { \
+					SAFEPOINT(); \
+					if (spy->trace) { \
+						spy_trace_loop(spy); \
+					} \
+				} \
+			} \
+		}
+	
+	/* instruction fetch, shared by both dispatch modes.  there are no
+	 * checks here, see SAFEPOINT */
+	#define VM_FETCH() \
+		{ \
+			op = spy->ip++; \
+			spy->instructions++; \
+			if (spy->recording) { \
+				spy_trace_record(spy, op); \
+			} \
+		}
+
+	/* with computed goto, every handler fetches the next opcode and jumps
+	 * straight to its handler through the dispatch table (the switch is
+	 * only used to enter the first instruction).  otherwise, handlers
+	 * break out of the switch and the loop fetches the next opcode */
+#if SPY_COMPUTED_GOTO
+	#define VM_CASE(op) op_ ## op: case op
+	#define VM_NEXT() \
+		{ \
+			VM_FETCH(); \
+			goto *op->handler; \
+		}
+	static const void* const dispatch[256] = {
+		[0x00 ... 0xFF] = &&op_unknown,
+		[0x00] = &&op_0x00, [0x01] = &&op_0x01, [0x02] = &&op_0x02, [0x03] = &&op_0x03,
+		[0x04] = &&op_0x04, [0x05] = &&op_0x05, [0x06] = &&op_0x06, [0x07] = &&op_0x07,
+		[0x08] = &&op_0x08, [0x09] = &&op_0x09, [0x0A] = &&op_0x0A, [0x0B] = &&op_0x0B,
+		[0x0C] = &&op_0x0C, [0x0D] = &&op_0x0D, [0x0E] = &&op_0x0E, [0x0F] = &&op_0x0F,
+		[0x10] = &&op_0x10, [0x11] = &&op_0x11, [0x12] = &&op_0x12, [0x13] = &&op_0x13,
+		[0x14] = &&op_0x14, [0x15] = &&op_0x15, [0x16] = &&op_0x16, [0x17] = &&op_0x17,
+		[0x18] = &&op_0x18, [0x19] = &&op_0x19, [0x1A] = &&op_0x1A, [0x1B] = &&op_0x1B,
+		[0x1C] = &&op_0x1C, [0x1D] = &&op_0x1D, [0x1E] = &&op_0x1E, [0x1F] = &&op_0x1F,
+		[0x20] = &&op_0x20, [0x21] = &&op_0x21, [0x22] = &&op_0x22, [0x23] = &&op_0x23,
+		[0x24] = &&op_0x24, [0x25] = &&op_0x25, [0x26] = &&op_0x26, [0x27] = &&op_0x27,
+		[0x28] = &&op_0x28, [0x29] = &&op_0x29, [0x2A] = &&op_0x2A, [0x2B] = &&op_0x2B,
+		[0x2C] = &&op_0x2C, [0x2D] = &&op_0x2D, [0x2E] = &&op_0x2E, [0x2F] = &&op_0x2F,
+		[0x30] = &&op_0x30, [0x31] = &&op_0x31, [0x32] = &&op_0x32, [0x33] = &&op_0x33,
+		[0x34] = &&op_0x34, [0x35] = &&op_0x35, [0x36] = &&op_0x36, [0x37] = &&op_0x37,
+		[0x38] = &&op_0x38, [0x39] = &&op_0x39, [0x3A] = &&op_0x3A, [0x3B] = &&op_0x3B,
+		[0x3C] = &&op_0x3C, [0x3D] = &&op_0x3D, [0x3E] = &&op_0x3E, [0x3F] = &&op_0x3F,
+		[0x40] = &&op_0x40, [0x41] = &&op_0x41, [0x42] = &&op_0x42, [0x43] = &&op_0x43,
+		[0x44] = &&op_0x44, [0x45] = &&op_0x45, [0x46] = &&op_0x46, [0x47] = &&op_0x47,
+		[0x48] = &&op_0x48, [0x49] = &&op_0x49, [0x4A] = &&op_0x4A, [0x4B] = &&op_0x4B,
+		[0x4C] = &&op_0x4C, [0x4D] = &&op_0x4D, [0x4E] = &&op_0x4E, [0x4F] = &&op_0x4F,
+		[0x50] = &&op_0x50, [0x51] = &&op_0x51, [0x52] = &&op_0x52, [0x53] = &&op_0x53,
+		[0x54] = &&op_0x54, [0x55] = &&op_0x55, [0x56] = &&op_0x56, [0x57] = &&op_0x57,
+		[0x58] = &&op_0x58, [0x59] = &&op_0x59, [0x5A] = &&op_0x5A, [0x5B] = &&op_0x5B,
+		[0x5C] = &&op_0x5C, [0x5D] = &&op_0x5D, [0x5E] = &&op_0x5E, [0x5F] = &&op_0x5F,
+		[0x60] = &&op_0x60, [0x61] = &&op_0x61, [0x62] = &&op_0x62, [0x63] = &&op_0x63,
+		[0x64] = &&op_0x64, [0x65] = &&op_0x65, [0x66] = &&op_0x66, [0x67] = &&op_0x67,
+		[0x68] = &&op_0x68, [0x69] = &&op_0x69, [0x6A] = &&op_0x6A, [0x6B] = &&op_0x6B,
+		[0x6C] = &&op_0x6C, [0x6D] = &&op_0x6D, [0x6E] = &&op_0x6E, [0x6F] = &&op_0x6F,
+		[0x70] = &&op_0x70, [0x71] = &&op_0x71, [0x72] = &&op_0x72, [0x73] = &&op_0x73,
+		[0x74] = &&op_0x74, [0x75] = &&op_0x75, [0x76] = &&op_0x76, [0x77] = &&op_0x77,
+		[0x78] = &&op_0x78, [0x79] = &&op_0x79, [0x7A] = &&op_0x7A, [0x7B] = &&op_0x7B,
+		[0x7C] = &&op_0x7C, [0x7D] = &&op_0x7D, [0x7E] = &&op_0x7E, [0x7F] = &&op_0x7F,
+		[0x80] = &&op_0x80, [0x81] = &&op_0x81, [0x82] = &&op_0x82, [0x83] = &&op_0x83,
+		[0x84] = &&op_0x84, [0x85] = &&op_0x85, [0x86] = &&op_0x86, [0x87] = &&op_0x87,
+		[0x88] = &&op_0x88, [0x89] = &&op_0x89, [0x8A] = &&op_0x8A, [0x8B] = &&op_0x8B,
+		[0x8C] = &&op_0x8C, [0x8D] = &&op_0x8D, [0x8E] = &&op_0x8E, [0x8F] = &&op_0x8F,
+		[0x90] = &&op_0x90, [0x91] = &&op_0x91, [0x92] = &&op_0x92, [0x93] = &&op_0x93,
+		[0x94] = &&op_0x94, [0x95] = &&op_0x95, [0x96] = &&op_0x96, [0x97] = &&op_0x97,
+		[0x98] = &&op_0x98, [0x99] = &&op_0x99,
+		[0xD4] = &&op_0xD4, [0xD5] = &&op_0xD5, [0xD6] = &&op_0xD6, [0xD7] = &&op_0xD7,
+		[0xD8] = &&op_0xD8, [0xD9] = &&op_0xD9, [0xDA] = &&op_0xDA, [0xDB] = &&op_0xDB,
+		[0xDC] = &&op_0xDC, [0xDD] = &&op_0xDD, [0xDE] = &&op_0xDE, [0xDF] = &&op_0xDF,
+		[0xE0] = &&op_0xE0, [0xE1] = &&op_0xE1, [0xE2] = &&op_0xE2, [0xE3] = &&op_0xE3,
+		[0xE4] = &&op_0xE4, [0xE5] = &&op_0xE5,
+		[R_MOV] = &&op_R_MOV, [R_LEA] = &&op_R_LEA, [R_IADD] = &&op_R_IADD, [R_ISUB] = &&op_R_ISUB,
+		[R_IMUL] = &&op_R_IMUL, [R_IDIV] = &&op_R_IDIV, [R_MOD] = &&op_R_MOD, [R_SHL] = &&op_R_SHL,
+		[R_SHR] = &&op_R_SHR, [R_AND] = &&op_R_AND, [R_OR] = &&op_R_OR, [R_XOR] = &&op_R_XOR,
+		[R_FADD] = &&op_R_FADD, [R_FSUB] = &&op_R_FSUB, [R_FMUL] = &&op_R_FMUL, [R_FDIV] = &&op_R_FDIV,
+		[R_ITOF] = &&op_R_ITOF, [R_FTOI] = &&op_R_FTOI, [R_IDER] = &&op_R_IDER, [R_FDER] = &&op_R_FDER,
+		[R_BDER] = &&op_R_BDER, [R_BLOAD] = &&op_R_BLOAD, [R_ISAVE] = &&op_R_ISAVE, [R_FSAVE] = &&op_R_FSAVE,
+		[R_BSAVE] = &&op_R_BSAVE, [R_BSTORE] = &&op_R_BSTORE, [R_SP] = &&op_R_SP,
+		[R_IJE] = &&op_R_IJE, [R_IJNE] = &&op_R_IJNE, [R_IJGT] = &&op_R_IJGT, [R_IJGE] = &&op_R_IJGE,
+		[R_IJLT] = &&op_R_IJLT, [R_IJLE] = &&op_R_IJLE, [R_FJE] = &&op_R_FJE, [R_FJNE] = &&op_R_FJNE,
+		[R_FJGT] = &&op_R_FJGT, [R_FJGE] = &&op_R_FJGE, [R_FJLT] = &&op_R_FJLT, [R_FJLE] = &&op_R_FJLE,
+		[R_IJZ] = &&op_R_IJZ, [R_IJNZ] = &&op_R_IJNZ,
+		[J_RETURN] = &&op_J_RETURN, [S_SNAPSHOT] = &&op_S_SNAPSHOT,
+		[0xFD] = &&op_0xFD, [0xFE] = &&op_0xFE, [0xFF] = &&op_0xFF,
+	};
+
+	/* point every decoded instruction at its handler, once when the
+	 * program is made (states share the ops after that) */
+	if (!entry) {
+		for (SpyOp* i = spy->ops; i < spy->ops + spy->nops; i++) {
+			i->handler = dispatch[i->opcode];
+		}
+		return;
+	}
+	if (spy->jit && !spy_jit_sentinel(spy->jit)->handler) {
+		spy_jit_sentinel(spy->jit)->handler = dispatch[J_RETURN];
+	}
+#else
+	#define VM_CASE(op) case op
+	#define VM_NEXT() break
+
+	if (!entry) {
+		return;
+	}
+#endif
+
+	spy->ip = entry;
+
+	/* go */
+	for (;;) {
+
+		VM_FETCH();
+
+		switch (op->opcode) {
+			/* NOP */
+			VM_CASE(0x00): 
+				spy->bail = 1;
+				return;
+
+			/* ICONST */
+			VM_CASE(0x01): 
+				spy_push_int(spy, op->a.i);
+				VM_NEXT();
+
+			/* ICMP */
+			VM_CASE(0x02): 
+				CMPTYPE(int);
+				VM_NEXT();
+			
+
+			/* ITEST */
+			VM_CASE(0x03): 
+				TESTTYPE(int);
+				VM_NEXT();
+			
+			/* JE */	
+			VM_CASE(0x04): 
+				JMPCOND(spy->flags & FLAG_EQ);
+				VM_NEXT();
+			
+			/* JNE */
+			VM_CASE(0x05):
+				JMPCOND(!(spy->flags & FLAG_EQ));
+				VM_NEXT();
+
+			/* JGT */
+			VM_CASE(0x06):
+				JMPCOND(spy->flags & FLAG_GT);
+				VM_NEXT();
+	
+			/* JGE */
+			VM_CASE(0x07):
+				JMPCOND(!(spy->flags & FLAG_LT));
+				VM_NEXT();
+
+			/* JLT */
+			VM_CASE(0x08):
+				JMPCOND(spy->flags & FLAG_LT);
+				VM_NEXT();
+			
+			/* JLE */
+			VM_CASE(0x09):
+				JMPCOND(!(spy->flags & FLAG_GT));
+				VM_NEXT();
+
+			/* JZ */
+			VM_CASE(0x0A):
+				JMPCOND(spy->flags & FLAG_Z);
+				VM_NEXT();
+			
+			/* JNZ */
+			VM_CASE(0x0B):
+				JMPCOND(!(spy->flags & FLAG_Z));
+				VM_NEXT();
+
+			/* JS */
+			VM_CASE(0x0C):
+				JMPCOND(spy->flags & FLAG_S);
+				VM_NEXT();
+
+			/* JNS */
+			VM_CASE(0x0D):
+				JMPCOND(!(spy->flags & FLAG_S));
+				VM_NEXT();
+	
+			/* JMP */
+			VM_CASE(0x0E):
+				JMPCOND(1); /* will be optimized */
+				VM_NEXT();
+
+			/* CJEQ */	
+			VM_CASE(0x0F): 
+				CJMPCOND(spy->flags & FLAG_EQ);
+				VM_NEXT();
+			
+			/* CJNEQ */
+			VM_CASE(0x10):
+				CJMPCOND(!(spy->flags & FLAG_EQ));
+				VM_NEXT();
+
+			/* CJGT */
+			VM_CASE(0x11):
+				CJMPCOND(spy->flags & FLAG_GT);
+				VM_NEXT();
+	
+			/* CJGE */
+			VM_CASE(0x12):
+				CJMPCOND(!(spy->flags & FLAG_GT));
+				VM_NEXT();
+
+			/* CJLT */
+			VM_CASE(0x13):
+				CJMPCOND(spy->flags & FLAG_LT);
+				VM_NEXT();
+			
+			/* CJLE */
+			VM_CASE(0x14):
+				CJMPCOND(!(spy->flags & FLAG_GT));
+				VM_NEXT();
+
+			/* CJZ */
+			VM_CASE(0x15):
+				CJMPCOND(spy->flags & FLAG_Z);
+				VM_NEXT();
+			
+			/* CJNZ */
+			VM_CASE(0x16):
+				CJMPCOND(!(spy->flags & FLAG_Z));
+				VM_NEXT();
+
+			/* CJS */
+			VM_CASE(0x17):
+				CJMPCOND(spy->flags & FLAG_S);
+				VM_NEXT();
+
+			/* CJNS */
+			VM_CASE(0x18):
+				CJMPCOND(!(spy->flags & FLAG_S));
+				VM_NEXT();
+
+			/* CJMP */
+			VM_CASE(0x19):
+				CJMPCOND(1); /* will be optimized */
+				VM_NEXT();
+
+			/* IADD */
+			VM_CASE(0x1A):
+				INTARITH(+);
+				VM_NEXT();
+
+			/* ISUB */
+			VM_CASE(0x1B):
+				INTARITH(-);
+				VM_NEXT();
+
+			/* IMUL */
+			VM_CASE(0x1C):
+				INTARITH(*);
+				VM_NEXT();
+
+			/* IDIV */
+			VM_CASE(0x1D):
+				INTARITH(/);
+				VM_NEXT();
+
+			/* SHL */
+			VM_CASE(0x1E):
+				INTARITH(<<);
+				VM_NEXT();
+
+			/* SHR */
+			VM_CASE(0x1F):
+				INTARITH(>>);
+				VM_NEXT();
+
+			/* AND */
+			VM_CASE(0x20):
+				INTARITH(&);
+				VM_NEXT();
+
+			/* OR */
+			VM_CASE(0x21):
+				INTARITH(|);
+				VM_NEXT();
+
+			/* XOR */
+			VM_CASE(0x22):
+				INTARITH(^);
+				VM_NEXT();
+
+			/* CALL */
+			VM_CASE(0x23): {
+				SpyOp* target = op->a.op;
+				/* the arguments stay where they were pushed, the callee
+				 * finds them below bp (see IRET) */
+				spy_push_int(spy, (intptr_t)spy->ip);	/* save ip */
+				spy_push_int(spy, (intptr_t)spy->bp);	/* save bp */
+				spy->bp = spy->sp;
+				spy->ip = target;
+				if (spy->jit) {
+					spy_jit_enter(spy, target);
+				}
+				CALL_SAFEPOINT();
+				VM_NEXT();
+			}
+			
+			/* CCALL (computed call, NOT C-func call) */
+			VM_CASE(0x24): {
+				SpyOp* target = spy_quick_op(spy, op, spy_pop_int(spy));
+				spy_push_int(spy, (intptr_t)spy->ip);	/* save ip */
+				spy_push_int(spy, (intptr_t)spy->bp);	/* save bp */
+				spy->bp = spy->sp;
+				spy->ip = target;
+				if (spy->jit) {
+					spy_jit_enter(spy, spy->ip);
+				}
+				CALL_SAFEPOINT();
+				VM_NEXT();
+			}
+
+			/* CFCALL (c-func call), CFCALL_IDX (c-func call through the
+			 * import table), both resolved when the code was loaded */
+			VM_CASE(0x25): VM_CASE(0x95): {
+				SpyCFunc* cfunc = op->a.cfunc;
+				spy_int nargs = op->b.i;
+				if (!cfunc) {
+					if (op->opcode == 0x95) {
+						spy_die(spy, "invalid c-function import %lld", spy_read_int64(&spy->code[op->addr + 1]));
+					}
+					spy_die(spy, "unknown c-function '%s'", &spy->code[spy_read_int64(&spy->code[op->addr + 1])]);
+				}
+				spy_byte* base = spy->sp - nargs * 8;
+				CALL_CFUNC(cfunc, nargs);
+				if (spy->bail) {
+					return;
+				}
+				if (SPY_VERIFIED) {
+					/* the verifier counted on the arguments being replaced
+					 * by cfunc->results values */
+					spy->sp = base + cfunc->results * 8;
+				}
+				VM_NEXT();
+			}
+
+			/* IRET, the operand is the number of arguments that the
+			 * function takes, they're popped with the frame */
+			VM_CASE(0x26): {
+				spy_int retval;
+				retval = spy_pop_int(spy);
+				spy->sp = spy->bp;
+				spy->bp = (uint8_t *)spy_pop_int(spy);
+				spy->ip = (SpyOp *)spy_pop_int(spy);
+				spy->sp -= op->a.i * 8;
+				spy_push_int(spy, retval);
+				VM_NEXT();
+			}
+
+			/* EXIT */
+			VM_CASE(0x27):
+				spy->bail = 1;
+				return;
+
+			/* IDER */
+			VM_CASE(0x28): {
+				spy_int addr = spy_pop_int(spy);
+				FRAME_BOUNDS_CHECK(addr, VERIFY_ADDR);
+				spy_push_int(spy, *(spy_int *)&spy->memory[addr]);
+				VM_NEXT();
+			}
+
+			/* BDER */
+			VM_CASE(0x29): {
+				spy_int addr = spy_pop_int(spy);
+				FRAME_BOUNDS_CHECK(addr, VERIFY_ADDR);
+				spy_push_byte(spy, spy->memory[addr]);
+				VM_NEXT();
+			}
+
+			/* ISAVE */
+			VM_CASE(0x2A): {
+				spy_int value = spy_pop_int(spy);
+				spy_int addr = spy_pop_int(spy);
+				FRAME_BOUNDS_CHECK(addr, VERIFY_ADDR);
+				spy_save_int(spy, addr, value);	
+				VM_NEXT();
+			}
+				
+			/* BSAVE */
+			VM_CASE(0x2B): {
+				spy_byte value = spy_pop_byte(spy);
+				spy_int addr = spy_pop_int(spy);
+				FRAME_BOUNDS_CHECK(addr, VERIFY_ADDR);
+				spy_save_byte(spy, addr, value);
+				VM_NEXT();
+			}
+
+			/* RES */
+			VM_CASE(0x2C): {
+				spy_int inc = op->a.i;
+				if (!SPY_VERIFIED) {
+					STACK_CHECK(op->b.i); /* locals and operands of this frame */
+				}
+				memset(spy->sp + 8, 0, inc);
+				spy->sp += inc;
+				VM_NEXT();
+			}
+
+			/* IINC */
+			VM_CASE(0x2D):
+				spy_push_int(spy, spy_pop_int(spy) + op->a.i);
+				VM_NEXT();
+
+			/* POP */
+			VM_CASE(0x2E):
+				spy_pop_int(spy); /* type of pop is irrelevant */
+				VM_NEXT();
+
+			/* IARG, counts from the last argument (the compiler reads
+			 * arguments as locals at negative offsets instead) */
+			VM_CASE(0x2F): 
+				spy_push_int(spy, *(spy_int *)&spy->bp[-2*8 - op->a.i*8]);
+				VM_NEXT();
+			
+			/* BARG */
+			VM_CASE(0x30):
+				spy_push_byte(spy, spy->bp[-2*8 - op->a.i*8]);
+				VM_NEXT();
+
+			/* LEA */
+			VM_CASE(0x31):
+				spy_push_int(spy, (spy_int)(&spy->bp[8 + op->a.i] - spy->memory));
+				VM_NEXT();
+
+			/* AISAVE (absolute integer save) */
+			VM_CASE(0x32): {
+				spy_int value = spy_pop_int(spy);
+				spy_int addr = op->a.i;
+				CONST_BOUNDS_CHECK(addr);
+				spy_save_int(spy, addr, value);	
+				VM_NEXT();
+			}
+				
+			/* ABSAVE */
+			VM_CASE(0x33): {	
+				spy_byte value = spy_pop_byte(spy);
+				spy_int addr = op->a.i;
+				CONST_BOUNDS_CHECK(addr);
+				spy_save_byte(spy, addr, value);
+				VM_NEXT();
+			}
+
+			/* AIDER */
+			VM_CASE(0x34):  {
+				spy_int addr = op->a.i;
+				CONST_BOUNDS_CHECK(addr);
+				spy_push_int(spy, spy_mem_int(spy, addr));
+				VM_NEXT();
+			}
+
+			/* ABDER */
+			VM_CASE(0x35): {
+				spy_int addr = op->a.i;
+				CONST_BOUNDS_CHECK(addr);
+				spy_push_byte(spy, spy_mem_int(spy, addr));
+				VM_NEXT();
+			}
+			
+			/* MALLOC */
+			VM_CASE(0x36):
+				spy_push_int(spy, spy_heap_alloc(spy, spy_pop_int(spy)));
+				VM_NEXT();
+
+			/* FREE */
+			VM_CASE(0x37):
+				spy_heap_free(spy, spy_pop_int(spy));
+				VM_NEXT();
+
+			/* VRET */
+			VM_CASE(0x38): {
+				spy->sp = spy->bp;
+				spy->bp = (uint8_t *)spy_pop_int(spy);
+				spy->ip = (SpyOp *)spy_pop_int(spy);
+				spy->sp -= op->a.i * 8;
+				VM_NEXT();
+			}
+
+			/* ILOCALL */
+			VM_CASE(0x39):
+				spy_push_int(spy, *(spy_int *)&spy->bp[8 + op->a.i]);
+				VM_NEXT();
+			
+			/* BLOCALL */
+			VM_CASE(0x3A): 
+				spy_push_byte(spy, spy->bp[8 + op->a.i]);
+				VM_NEXT();
+			
+			/* ILOCALS */
+			VM_CASE(0x3B):
+				*(spy_int *)&spy->bp[8 + op->a.i] = spy_pop_int(spy);
+				VM_NEXT();
+
+			/* BLOCALS */
+			VM_CASE(0x3C):
+				spy->bp[8 + op->a.i] = spy_pop_byte(spy);
+				VM_NEXT();
+
+			/* PE */
+			VM_CASE(0x3D):
+				PUSHFLAG(FLAG_EQ);
+				VM_NEXT();
+				
+			/* PNE */
+			VM_CASE(0x3E):	
+				PUSHNOTFLAG(FLAG_EQ);
+				VM_NEXT();
+
+			/* PGT */
+			VM_CASE(0x3F):
+				PUSHFLAG(FLAG_GT);
+				VM_NEXT();
+				
+			/* PGE */
+			VM_CASE(0x40):	
+				PUSHNOTFLAG(FLAG_LT);
+				VM_NEXT();
+
+			/* PLT */
+			VM_CASE(0x41):
+				PUSHFLAG(FLAG_LT);
+				VM_NEXT();
+				
+			/* PLE */
+			VM_CASE(0x42):	
+				PUSHNOTFLAG(FLAG_GT);
+				VM_NEXT();
+
+			/* PZ */
+			VM_CASE(0x43):
+				PUSHFLAG(FLAG_Z);
+				VM_NEXT();
+				
+			/* PNZ */
+			VM_CASE(0x44):	
+				PUSHNOTFLAG(FLAG_Z);
+				VM_NEXT();
+
+			/* PS */
+			VM_CASE(0x45):
+				PUSHFLAG(FLAG_S);
+				VM_NEXT();
+
+			/* PNS */
+			VM_CASE(0x46):
+				PUSHNOTFLAG(FLAG_S);
+				VM_NEXT();
+
+			/* FCONST */
+			VM_CASE(0x47):
+				spy_push_float(spy, op->a.f);
+				VM_NEXT();
+			
+			/* FCMP */
+			VM_CASE(0x48):
+				CMPTYPE(float);
+				VM_NEXT();
+
+			/* FTEST */
+			VM_CASE(0x49):
+				TESTTYPE(float);
+				VM_NEXT();
+
+			/* FADD */
+			VM_CASE(0x4A):
+				FLOATARITH(+);
+				VM_NEXT();
+
+			/* FSUB */
+			VM_CASE(0x4B):
+				FLOATARITH(-);
+				VM_NEXT();
+			
+			/* FMUL */
+			VM_CASE(0x4C):
+				FLOATARITH(*);
+				VM_NEXT();
+
+			/* FDIV */
+			VM_CASE(0x4D):
+				FLOATARITH(/);
+				VM_NEXT();
+
+			/* FINC */
+			VM_CASE(0x4E):
+				spy_push_float(spy, spy_pop_float(spy) + op->a.f);
+				VM_NEXT();
+
+			/* FRET */
+			VM_CASE(0x4F): {
+				spy_float retval;
+				retval = spy_pop_float(spy);
+				spy->sp = spy->bp;
+				spy->bp = (uint8_t *)spy_pop_int(spy);
+				spy->ip = (SpyOp *)spy_pop_int(spy);
+				spy->sp -= op->a.i * 8;
+				spy_push_float(spy, retval);
+				VM_NEXT();
+			}
+
+			/* FLOCALL */
+			VM_CASE(0x50):
+				spy_push_float(spy, *(spy_float *)&spy->bp[8 + op->a.i]);
+				VM_NEXT();
+
+			/* FLOCALS */
+			VM_CASE(0x51):
+				*(spy_float *)&spy->bp[8 + op->a.i] = spy_pop_float(spy);
+				VM_NEXT();
+
+			/* AFSAVE */
+			VM_CASE(0x52): {
+				spy_float value = spy_pop_int(spy);
+				spy_int addr = op->a.i;
+				spy_save_float(spy, addr, value);	
+				VM_NEXT();
+			}
+
+			/* AFDER */
+			VM_CASE(0x53): 
+				spy_push_float(spy, spy_mem_float(spy, op->a.i));
+				VM_NEXT();
+
+			/* FDER */
+			VM_CASE(0x54):
+				spy_push_float(spy, *(spy_float *)&spy->memory[spy_pop_int(spy)]);
+				VM_NEXT();
+
+			/* FARG */
+			VM_CASE(0x55):
+				spy_push_float(spy, *(spy_float *)&spy->bp[-2*8 - op->a.i*8]);
+				VM_NEXT();
+
+			/* ITOF */
+			VM_CASE(0x56):
+				spy_push_float(spy, (spy_float)spy_pop_int(spy));
+				VM_NEXT();
+
+			/* FTOI */
+			VM_CASE(0x57):
+				spy_push_int(spy, (spy_int)spy_pop_float(spy));
+				VM_NEXT();
+			
+			/* DUP */
+			VM_CASE(0x58):
+				spy_push_int(spy, spy_top_int(spy));
+				VM_NEXT();
+
+			/* FSAVE */
+			VM_CASE(0x59): {
+				spy_float value = spy_pop_float(spy);
+				spy_int addr = spy_pop_int(spy);
+				spy_save_float(spy, addr, value);	
+				VM_NEXT();
+			}
+
+			/* MOD */
+			VM_CASE(0x5A):
+				INTARITH(%);
+				VM_NEXT();
+			
+			/* CCFCALL */
+			VM_CASE(0x5B): {
+				spy_int nargs = op->a.i;
+				SpyCFunc* cfunc = spy_quick_cfunc(spy, op, spy_pop_int(spy));
+				CALL_CFUNC(cfunc, nargs);
+				if (spy->bail) {
+					return;
+				}
+				VM_NEXT();
+			}
+
+			/* NOT */
+			VM_CASE(0x5C):
+				spy_push_int(spy, !spy_pop_int(spy));
+				VM_NEXT();
+			
+			/* LAND */
+			VM_CASE(0x5D):
+				INTARITH(&&);
+				VM_NEXT();
+
+			/* LOR */
+			VM_CASE(0x5E):
+				INTARITH(||);
+				VM_NEXT();
+
+			/* DUP2*/
+			VM_CASE(0x5F):
+				spy_push_int(spy, *(spy_int *)&spy->sp[-8]);
+				VM_NEXT();
+
+			/* IADDLL */
+			VM_CASE(0x60):
+				spy_push_int(spy, *(spy_int *)&spy->bp[8 + op->a.i] + *(spy_int *)&spy->bp[8 + op->b.i]);
+				VM_NEXT();
+
+			/* IIDX */
+			VM_CASE(0x61): {
+				spy_int index = spy_pop_int(spy);
+				spy_int base = spy_pop_int(spy);
+				spy_push_int(spy, base + index*op->a.i);
+				VM_NEXT();
+			}
+
+			/* LEADUP */
+			VM_CASE(0x62): {
+				spy_int addr = (spy_int)(&spy->bp[8 + op->a.i] - spy->memory);
+				spy_push_int(spy, addr);
+				spy_push_int(spy, addr);
+				VM_NEXT();
+			}
+
+			/* ISAVEP */
+			VM_CASE(0x63): {
+				spy_int value = spy_pop_int(spy);
+				spy_int addr = spy_pop_int(spy);
+				FRAME_BOUNDS_CHECK(addr, VERIFY_ADDR);
+				spy_save_int(spy, addr, value);
+				addr = spy_pop_int(spy);
+				FRAME_BOUNDS_CHECK(addr, VERIFY_ADDR2);
+				VM_NEXT();
+			}
+
+			/* FSAVEP */
+			VM_CASE(0x64): {
+				spy_float value = spy_pop_float(spy);
+				spy_int addr = spy_pop_int(spy);
+				spy_save_float(spy, addr, value);
+				spy_pop_int(spy);
+				VM_NEXT();
+			}
+
+			/* BSAVEP */
+			VM_CASE(0x65): {
+				spy_byte value = spy_pop_byte(spy);
+				spy_int addr = spy_pop_int(spy);
+				FRAME_BOUNDS_CHECK(addr, VERIFY_ADDR);
+				spy_save_byte(spy, addr, value);
+				addr = spy_pop_int(spy);
+				FRAME_BOUNDS_CHECK(addr, VERIFY_ADDR2);
+				VM_NEXT();
+			}
+
+			/* ISAVED */
+			VM_CASE(0x66): {
+				spy_int value = spy_pop_int(spy);
+				spy_int addr = spy_pop_int(spy);
+				FRAME_BOUNDS_CHECK(addr, VERIFY_ADDR);
+				spy_save_int(spy, addr, value);
+				addr = spy_pop_int(spy);
+				FRAME_BOUNDS_CHECK(addr, VERIFY_ADDR2);
+				spy_push_int(spy, spy_mem_int(spy, addr));
+				VM_NEXT();
+			}
+
+			/* FSAVED */
+			VM_CASE(0x67): {
+				spy_float value = spy_pop_float(spy);
+				spy_int addr = spy_pop_int(spy);
+				spy_save_float(spy, addr, value);
+				addr = spy_pop_int(spy);
+				spy_push_float(spy, spy_mem_float(spy, addr));
+				VM_NEXT();
+			}
+
+			/* BSAVED */
+			VM_CASE(0x68): {
+				spy_byte value = spy_pop_byte(spy);
+				spy_int addr = spy_pop_int(spy);
+				FRAME_BOUNDS_CHECK(addr, VERIFY_ADDR);
+				spy_save_byte(spy, addr, value);
+				addr = spy_pop_int(spy);
+				FRAME_BOUNDS_CHECK(addr, VERIFY_ADDR2);
+				spy_push_byte(spy, spy_mem_byte(spy, addr));
+				VM_NEXT();
+			}
+
+			/* ICJE */
+			VM_CASE(0x69):
+				CMPTYPE(int);
+				JMPCOND(spy->flags & FLAG_EQ);
+				VM_NEXT();
+
+			/* ICJNE */
+			VM_CASE(0x6A):
+				CMPTYPE(int);
+				JMPCOND(!(spy->flags & FLAG_EQ));
+				VM_NEXT();
+
+			/* ICJGT */
+			VM_CASE(0x6B):
+				CMPTYPE(int);
+				JMPCOND(spy->flags & FLAG_GT);
+				VM_NEXT();
+
+			/* ICJGE */
+			VM_CASE(0x6C):
+				CMPTYPE(int);
+				JMPCOND(!(spy->flags & FLAG_LT));
+				VM_NEXT();
+
+			/* ICJLT */
+			VM_CASE(0x6D):
+				CMPTYPE(int);
+				JMPCOND(spy->flags & FLAG_LT);
+				VM_NEXT();
+
+			/* ICJLE */
+			VM_CASE(0x6E):
+				CMPTYPE(int);
+				JMPCOND(!(spy->flags & FLAG_GT));
+				VM_NEXT();
+
+			/* FCJE */
+			VM_CASE(0x6F):
+				CMPTYPE(float);
+				JMPCOND(spy->flags & FLAG_EQ);
+				VM_NEXT();
+
+			/* FCJNE */
+			VM_CASE(0x70):
+				CMPTYPE(float);
+				JMPCOND(!(spy->flags & FLAG_EQ));
+				VM_NEXT();
+
+			/* FCJGT */
+			VM_CASE(0x71):
+				CMPTYPE(float);
+				JMPCOND(spy->flags & FLAG_GT);
+				VM_NEXT();
+
+			/* FCJGE */
+			VM_CASE(0x72):
+				CMPTYPE(float);
+				JMPCOND(!(spy->flags & FLAG_LT));
+				VM_NEXT();
+
+			/* FCJLT */
+			VM_CASE(0x73):
+				CMPTYPE(float);
+				JMPCOND(spy->flags & FLAG_LT);
+				VM_NEXT();
+
+			/* FCJLE */
+			VM_CASE(0x74):
+				CMPTYPE(float);
+				JMPCOND(!(spy->flags & FLAG_GT));
+				VM_NEXT();
+
+			/* IJE */
+			VM_CASE(0x75):
+				CMPJMP(int, a == b);
+				VM_NEXT();
+
+			/* IJNE */
+			VM_CASE(0x76):
+				CMPJMP(int, a != b);
+				VM_NEXT();
+
+			/* IJGT */
+			VM_CASE(0x77):
+				CMPJMP(int, a > b);
+				VM_NEXT();
+
+			/* IJGE */
+			VM_CASE(0x78):
+				CMPJMP(int, a >= b);
+				VM_NEXT();
+
+			/* IJLT */
+			VM_CASE(0x79):
+				CMPJMP(int, a < b);
+				VM_NEXT();
+
+			/* IJLE */
+			VM_CASE(0x7A):
+				CMPJMP(int, a <= b);
+				VM_NEXT();
+
+			/* FJE */
+			VM_CASE(0x7B):
+				CMPJMP(float, a == b);
+				VM_NEXT();
+
+			/* FJNE */
+			VM_CASE(0x7C):
+				CMPJMP(float, !(a == b));
+				VM_NEXT();
+
+			/* FJGT */
+			VM_CASE(0x7D):
+				CMPJMP(float, a > b);
+				VM_NEXT();
+
+			/* FJGE */
+			VM_CASE(0x7E):
+				CMPJMP(float, a >= b);
+				VM_NEXT();
+
+			/* FJLT */
+			VM_CASE(0x7F):
+				CMPJMP(float, !(a >= b));
+				VM_NEXT();
+
+			/* FJLE */
+			VM_CASE(0x80):
+				CMPJMP(float, !(a > b));
+				VM_NEXT();
+
+			/* IPE */
+			VM_CASE(0x81):
+				CMPPUSH(int, a == b);
+				VM_NEXT();
+
+			/* IPNE */
+			VM_CASE(0x82):
+				CMPPUSH(int, a != b);
+				VM_NEXT();
+
+			/* IPGT */
+			VM_CASE(0x83):
+				CMPPUSH(int, a > b);
+				VM_NEXT();
+
+			/* IPGE */
+			VM_CASE(0x84):
+				CMPPUSH(int, a >= b);
+				VM_NEXT();
+
+			/* IPLT */
+			VM_CASE(0x85):
+				CMPPUSH(int, a < b);
+				VM_NEXT();
+
+			/* IPLE */
+			VM_CASE(0x86):
+				CMPPUSH(int, a <= b);
+				VM_NEXT();
+
+			/* FPE */
+			VM_CASE(0x87):
+				CMPPUSH(float, a == b);
+				VM_NEXT();
+
+			/* FPNE */
+			VM_CASE(0x88):
+				CMPPUSH(float, !(a == b));
+				VM_NEXT();
+
+			/* FPGT */
+			VM_CASE(0x89):
+				CMPPUSH(float, a > b);
+				VM_NEXT();
+
+			/* FPGE */
+			VM_CASE(0x8A):
+				CMPPUSH(float, a >= b);
+				VM_NEXT();
+
+			/* FPLT */
+			VM_CASE(0x8B):
+				CMPPUSH(float, !(a >= b));
+				VM_NEXT();
+
+			/* FPLE */
+			VM_CASE(0x8C):
+				CMPPUSH(float, !(a > b));
+				VM_NEXT();
+
+			/* IJZ */
+			VM_CASE(0x8D):
+				JMPCOND(spy_pop_int(spy) == 0);
+				VM_NEXT();
+
+			/* IJNZ */
+			VM_CASE(0x8E):
+				JMPCOND(spy_pop_int(spy) != 0);
+				VM_NEXT();
+
+			/* SPAWN (see task.c), the counter is a local of this frame */
+			VM_CASE(0x8F): {
+				SpyOp* target = spy_op_at(spy, spy_pop_int(spy));
+				spy_int dest = spy_pop_int(spy);
+				if (dest) {
+					BOUNDS_CHECK(dest);
+				}
+				spy_int counter = &spy->bp[8 + op->b.i] - spy->memory;
+#if SPY_COMPUTED_GOTO
+				const void* handler = dispatch[J_RETURN];
+#else
+				const void* handler = NULL;
+#endif
+				if (!spy_task_spawn(spy, target, dest, counter, op->a.i, handler)) {
+					return;
+				}
+				VM_NEXT();
+			}
+
+			/* SYNC */
+			VM_CASE(0x90):
+				if (!spy_task_sync(spy, &spy->bp[8 + op->a.i] - spy->memory)) {
+					return;
+				}
+				VM_NEXT();
+
+			/* PFOR, runs the chunks and waits for them */
+			VM_CASE(0x91): {
+				SpyOp* entry = spy_op_at(spy, spy_pop_int(spy));
+				spy_int step = spy_pop_int(spy);
+				spy_int end = spy_pop_int(spy);
+				spy_int start = spy_pop_int(spy);
+#if SPY_COMPUTED_GOTO
+				const void* handler = dispatch[J_RETURN];
+#else
+				const void* handler = NULL;
+#endif
+				if (!spy_task_for(spy, entry, start, end, step, op->a.i, op->b.i, handler)) {
+					return;
+				}
+				VM_NEXT();
+			}
+
+			/* PEND, the end of a chunk (see task_run) */
+			VM_CASE(0x92):
+				return;
+
+			/* IREDUCE */
+			VM_CASE(0x93): {
+				spy_int value = spy_pop_int(spy);
+				spy_int addr = spy_pop_int(spy);
+				BOUNDS_CHECK(addr);
+				spy_task_reduce(spy, addr, value, (int)op->a.i, 0);
+				VM_NEXT();
+			}
+
+			/* FREDUCE */
+			VM_CASE(0x94): {
+				spy_int value = spy_pop_int(spy);
+				spy_int addr = spy_pop_int(spy);
+				BOUNDS_CHECK(addr);
+				spy_task_reduce(spy, addr, value, (int)op->a.i, 1);
+				VM_NEXT();
+			}
+
+			/* VLOAD */
+			VM_CASE(0xD4):
+				VECTOR_CHECK();
+				VLOAD();
+				VM_NEXT();
+
+			/* VSAVE */
+			VM_CASE(0xD5):
+				VECTOR_CHECK();
+				VSAVE();
+				VM_NEXT();
+
+			/* VSPLAT */
+			VM_CASE(0xD6):
+				VECTOR_CHECK();
+				VSPLAT();
+				VM_NEXT();
+
+			/* VLANE */
+			VM_CASE(0xD7):
+				VECTOR_CHECK();
+				VLANE();
+				VM_NEXT();
+
+			/* VIADD */
+			VM_CASE(0xD8):
+				VECTOR_CHECK();
+				VARITH(int, +);
+				VM_NEXT();
+
+			/* VISUB */
+			VM_CASE(0xD9):
+				VECTOR_CHECK();
+				VARITH(int, -);
+				VM_NEXT();
+
+			/* VIMUL */
+			VM_CASE(0xDA):
+				VECTOR_CHECK();
+				VARITH(int, *);
+				VM_NEXT();
+
+			/* VIDIV */
+			VM_CASE(0xDB):
+				VECTOR_CHECK();
+				VARITH(int, /);
+				VM_NEXT();
+
+			/* VFADD */
+			VM_CASE(0xDC):
+				VECTOR_CHECK();
+				VARITH(float, +);
+				VM_NEXT();
+
+			/* VFSUB */
+			VM_CASE(0xDD):
+				VECTOR_CHECK();
+				VARITH(float, -);
+				VM_NEXT();
+
+			/* VFMUL */
+			VM_CASE(0xDE):
+				VECTOR_CHECK();
+				VARITH(float, *);
+				VM_NEXT();
+
+			/* VFDIV */
+			VM_CASE(0xDF):
+				VECTOR_CHECK();
+				VARITH(float, /);
+				VM_NEXT();
+
+			/* VISUM */
+			VM_CASE(0xE0):
+				VECTOR_CHECK();
+				VREDUCE(int, r += v[l]);
+				VM_NEXT();
+
+			/* VIMIN */
+			VM_CASE(0xE1):
+				VECTOR_CHECK();
+				VREDUCE(int, r = v[l] < r ? v[l] : r);
+				VM_NEXT();
+
+			/* VIMAX */
+			VM_CASE(0xE2):
+				VECTOR_CHECK();
+				VREDUCE(int, r = v[l] > r ? v[l] : r);
+				VM_NEXT();
+
+			/* VFSUM */
+			VM_CASE(0xE3):
+				VECTOR_CHECK();
+				VREDUCE(float, r += v[l]);
+				VM_NEXT();
+
+			/* VFMIN */
+			VM_CASE(0xE4):
+				VECTOR_CHECK();
+				VREDUCE(float, r = v[l] < r ? v[l] : r);
+				VM_NEXT();
+
+			/* VFMAX */
+			VM_CASE(0xE5):
+				VECTOR_CHECK();
+				VREDUCE(float, r = v[l] > r ? v[l] : r);
+				VM_NEXT();
+
+			/* MEMCPY */
+			VM_CASE(0x96):
+				MEMCOPY(memcpy);
+				VM_NEXT();
+
+			/* MEMMOVE */
+			VM_CASE(0x97):
+				MEMCOPY(memmove);
+				VM_NEXT();
+
+			/* MEMSET */
+			VM_CASE(0x98):
+				MEMSET();
+				VM_NEXT();
+
+			/* MEMCMP */
+			VM_CASE(0x99):
+				MEMCMP();
+				VM_NEXT();
+
+			/* REGISTER TIER */
+			VM_CASE(R_MOV):
+				RINT(0) = RINT(1);
+				spy->sp += op->sp_delta;
+				VM_NEXT();
+
+			VM_CASE(R_LEA):
+				RINT(0) = (spy_int)(&spy->bp[op->a.i] - spy->memory);
+				spy->sp += op->sp_delta;
+				VM_NEXT();
+
+			VM_CASE(R_IADD):
+				RINTARITH(+);
+				VM_NEXT();
+
+			VM_CASE(R_ISUB):
+				RINTARITH(-);
+				VM_NEXT();
+
+			VM_CASE(R_IMUL):
+				RINTARITH(*);
+				VM_NEXT();
+
+			VM_CASE(R_IDIV):
+				RINTARITH(/);
+				VM_NEXT();
+
+			VM_CASE(R_MOD):
+				RINTARITH(%);
+				VM_NEXT();
+
+			VM_CASE(R_SHL):
+				RINTARITH(<<);
+				VM_NEXT();
+
+			VM_CASE(R_SHR):
+				RINTARITH(>>);
+				VM_NEXT();
+
+			VM_CASE(R_AND):
+				RINTARITH(&);
+				VM_NEXT();
+
+			VM_CASE(R_OR):
+				RINTARITH(|);
+				VM_NEXT();
+
+			VM_CASE(R_XOR):
+				RINTARITH(^);
+				VM_NEXT();
+
+			VM_CASE(R_FADD):
+				RFLOATARITH(+);
+				VM_NEXT();
+
+			VM_CASE(R_FSUB):
+				RFLOATARITH(-);
+				VM_NEXT();
+
+			VM_CASE(R_FMUL):
+				RFLOATARITH(*);
+				VM_NEXT();
+
+			VM_CASE(R_FDIV):
+				RFLOATARITH(/);
+				VM_NEXT();
+
+			VM_CASE(R_ITOF):
+				RFLOAT(0) = (spy_float)RINT(1);
+				spy->sp += op->sp_delta;
+				VM_NEXT();
+
+			VM_CASE(R_FTOI):
+				RINT(0) = (spy_int)RFLOAT(1);
+				spy->sp += op->sp_delta;
+				VM_NEXT();
+
+			VM_CASE(R_IDER): {
+				spy_int addr = RINT(1);
+				BOUNDS_CHECK(addr);
+				RINT(0) = spy_mem_int(spy, addr);
+				spy->sp += op->sp_delta;
+				VM_NEXT();
+			}
+
+			VM_CASE(R_FDER):
+				RFLOAT(0) = spy_mem_float(spy, RINT(1));
+				spy->sp += op->sp_delta;
+				VM_NEXT();
+
+			VM_CASE(R_BDER): {
+				spy_int addr = RINT(1);
+				BOUNDS_CHECK(addr);
+				RINT(0) = (spy_int)spy_mem_byte(spy, addr);
+				spy->sp += op->sp_delta;
+				VM_NEXT();
+			}
+
+			VM_CASE(R_BLOAD):
+				RINT(0) = (spy_int)RBYTE(1);
+				spy->sp += op->sp_delta;
+				VM_NEXT();
+
+			VM_CASE(R_ISAVE): {
+				spy_int addr = RINT(0);
+				BOUNDS_CHECK(addr);
+				spy_save_int(spy, addr, RINT(1));
+				spy->sp += op->sp_delta;
+				VM_NEXT();
+			}
+
+			VM_CASE(R_FSAVE):
+				spy_save_float(spy, RINT(0), RFLOAT(1));
+				spy->sp += op->sp_delta;
+				VM_NEXT();
+
+			VM_CASE(R_BSAVE): {
+				spy_int addr = RINT(0);
+				BOUNDS_CHECK(addr);
+				spy_save_byte(spy, addr, RBYTE(1));
+				spy->sp += op->sp_delta;
+				VM_NEXT();
+			}
+
+			VM_CASE(R_BSTORE):
+				RBYTE(0) = RBYTE(1);
+				spy->sp += op->sp_delta;
+				VM_NEXT();
+
+			VM_CASE(R_SP):
+				spy->sp += op->sp_delta;
+				VM_NEXT();
+
+			/* these match the flag tests of the stack branches, e.g. JLE is
+			 * !GT, so NaN compares the same way in both tiers */
+			VM_CASE(R_IJE):
+				RJMPCOND(RINT(0) == RINT(1));
+				VM_NEXT();
+
+			VM_CASE(R_IJNE):
+				RJMPCOND(RINT(0) != RINT(1));
+				VM_NEXT();
+
+			VM_CASE(R_IJGT):
+				RJMPCOND(RINT(0) > RINT(1));
+				VM_NEXT();
+
+			VM_CASE(R_IJGE):
+				RJMPCOND(RINT(0) >= RINT(1));
+				VM_NEXT();
+
+			VM_CASE(R_IJLT):
+				RJMPCOND(RINT(0) < RINT(1));
+				VM_NEXT();
+
+			VM_CASE(R_IJLE):
+				RJMPCOND(RINT(0) <= RINT(1));
+				VM_NEXT();
+
+			VM_CASE(R_FJE):
+				RJMPCOND(RFLOAT(0) == RFLOAT(1));
+				VM_NEXT();
+
+			VM_CASE(R_FJNE):
+				RJMPCOND(!(RFLOAT(0) == RFLOAT(1)));
+				VM_NEXT();
+
+			VM_CASE(R_FJGT):
+				RJMPCOND(RFLOAT(0) > RFLOAT(1));
+				VM_NEXT();
+
+			VM_CASE(R_FJGE):
+				RJMPCOND(RFLOAT(0) >= RFLOAT(1));
+				VM_NEXT();
+
+			VM_CASE(R_FJLT):
+				RJMPCOND(!(RFLOAT(0) >= RFLOAT(1)));
+				VM_NEXT();
+
+			VM_CASE(R_FJLE):
+				RJMPCOND(!(RFLOAT(0) > RFLOAT(1)));
+				VM_NEXT();
+
+			VM_CASE(R_IJZ):
+				RJMPCOND(RINT(0) == 0);
+				VM_NEXT();
+
+			VM_CASE(R_IJNZ):
+				RJMPCOND(RINT(0) != 0);
+				VM_NEXT();
+
+			/* return to the native code that started this interpreter */
+			VM_CASE(J_RETURN):
+				return;
+
+			/* armed by --snapshot-at, changes back into the real instruction
+			 * once the image is written (see snapshot.c) */
+			VM_CASE(S_SNAPSHOT):
+				spy->ip = op;
+				spy_snapshot_take(spy);
+#if SPY_COMPUTED_GOTO
+				op->handler = dispatch[op->opcode];
+#endif
+				VM_NEXT();
+
+			/* ILOG */
+			VM_CASE(0xFD):
+				fprintf(spy->out, "%lld\n", spy_pop_int(spy));
+				VM_NEXT();
+
+			/* BLOG */
+			VM_CASE(0xFE):
+				fprintf(spy->out, "%d\n", spy_pop_byte(spy));
+				VM_NEXT();
+
+			/* FLOG */
+			VM_CASE(0xFF):
+				fprintf(spy->out, "%f\n", spy_pop_float(spy));
+				VM_NEXT();
+
+			/* unknown opcodes are skipped */
+#if SPY_COMPUTED_GOTO
+			op_unknown:
+#endif
+			default:
+				VM_NEXT();
+		}
+
+	}
+
+}
@@ -0,0 +1,2721 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "vm.h"
+#include "spylib.h"
+#include "capi_load.h"
+#include "regvm.h"
+#include "jit.h"
+
+#if SPY_JIT
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ * BASELINE JIT
+ *
+ * compiles a function to x86-64 when it is called for the JIT_THRESHOLD'th
+ * time.  a function is everything that is reachable from a call target
+ * without following calls.  every decoded instruction (stack or register
+ * instruction) is compiled by its own template, there's no optimization
+ * across instructions... all it does is take away the dispatch.
+ *
+ * native code keeps the vm state in callee saved registers:
+ *   rbx = sp, r12 = bp, r13 = memory, r14 = spy
+ *   rbp = highest sp that isn't a stack overflow
+ * and uses the same stack and frames as the interpreter, so both can call
+ * each other freely.  calls, c-functions and compares are done by calling
+ * back into C.  if the callee isn't compiled, a nested interpreter runs it
+ * until its return pops the J_RETURN sentinel pushed by the call.
+ *
+ * a function that uses an instruction without a template (computed jumps,
+ * absolute loads/stores, ...) is never compiled and stays interpreted.
+ */
+
+typedef void (*SpyNative)(SpyState*);
+typedef struct Compiler Compiler;
+typedef struct Patch Patch;
+
+struct SpyJit {
+	SpyOp sentinel;
+	SpyNative* native; /* decoded instruction -> compiled function */
+	uint32_t* hits;
+	uint8_t* failed;
+};
+
+/* x86-64 registers */
+enum {
+	RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+	R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+#define J_SP	RBX
+#define J_BP	R12
+#define J_MEM	R13
+#define J_SPY	R14
+#define J_LIMIT	RBP
+
+/* condition codes (second byte of a jcc rel32) */
+#define CC_B	0x82
+#define CC_AE	0x83
+#define CC_E	0x84
+#define CC_NE	0x85
+#define CC_BE	0x86
+#define CC_A	0x87
+#define CC_S	0x88
+#define CC_NS	0x89
+#define CC_P	0x8A
+#define CC_NP	0x8B
+#define CC_L	0x8C
+#define CC_GE	0x8D
+#define CC_LE	0x8E
+#define CC_G	0x8F
+#define CC_JMP	0x00
+
+struct Patch {
+	uint32_t at; /* offset of a rel32 */
+	uint32_t target; /* label */
+};
+
+struct Compiler {
+	SpyState* spy;
+	uint8_t* buf;
+	uint32_t len;
+	uint32_t cap;
+	uint32_t* label; /* decoded instruction -> offset in buf */
+	uint32_t overflow; /* label of the stack overflow stub */
+	uint32_t leave; /* label of the epilogue */
+	Patch* patches;
+	uint32_t npatches;
+	uint32_t patches_cap;
+};
+
+static const char* msg_overflow = "stack overflow";
+static const char* msg_segfault = "segmentation fault (addr=0x%llX)";
+
+/* bytes in front of installed code that hold the size of its mapping */
+#define JIT_HEADER 16
+
+/* EMITTER */
+
+static void
+c_byte(Compiler* C, uint8_t b) {
+	if (C->len == C->cap) {
+		C->cap *= 2;
+		C->buf = realloc(C->buf, C->cap);
+	}
+	C->buf[C->len++] = b;
+}
+
+static void
+c_int32(Compiler* C, int32_t v) {
+	for (int i = 0; i < 4; i++) {
+		c_byte(C, (uint8_t)(v >> (i * 8)));
+	}
+}
+
+static void
+c_int64(Compiler* C, int64_t v) {
+	for (int i = 0; i < 8; i++) {
+		c_byte(C, (uint8_t)(v >> (i * 8)));
+	}
+}
+
+static void
+c_rex(Compiler* C, int w, int reg, int rm) {
+	uint8_t rex = 0x40 | (w << 3) | ((reg & 8) >> 1) | ((rm & 8) >> 3);
+	if (rex != 0x40) {
+		c_byte(C, rex);
+	}
+}
+
+/* modrm for [base + disp32] */
+static void
+c_mem(Compiler* C, int reg, int base, int32_t disp) {
+	c_byte(C, 0x80 | ((reg & 7) << 3) | (base & 7));
+	if ((base & 7) == RSP) {
+		c_byte(C, 0x24);
+	}
+	c_int32(C, disp);
+}
+
+/* opcode reg, [base + disp] */
+static void
+c_op_mem(Compiler* C, int w, uint8_t opcode, int reg, int base, int32_t disp) {
+	c_rex(C, w, reg, base);
+	c_byte(C, opcode);
+	c_mem(C, reg, base, disp);
+}
+
+/* opcode reg, rm */
+static void
+c_op_reg(Compiler* C, int w, uint8_t opcode, int reg, int rm) {
+	c_rex(C, w, reg, rm);
+	c_byte(C, opcode);
+	c_byte(C, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* two byte opcode (0F xx) reg, rm */
+static void
+c_op2_reg(Compiler* C, int w, uint8_t opcode, int reg, int rm) {
+	c_rex(C, w, reg, rm);
+	c_byte(C, 0x0F);
+	c_byte(C, opcode);
+	c_byte(C, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* sse instruction with a register operand, e.g. addsd */
+static void
+c_sse_reg(Compiler* C, uint8_t prefix, int w, uint8_t opcode, int reg, int rm) {
+	c_byte(C, prefix);
+	c_op2_reg(C, w, opcode, reg, rm);
+}
+
+/* sse instruction with a memory operand, e.g. movsd */
+static void
+c_sse_mem(Compiler* C, uint8_t prefix, uint8_t opcode, int reg, int base, int32_t disp) {
+	c_byte(C, prefix);
+	c_rex(C, 0, reg, base);
+	c_byte(C, 0x0F);
+	c_byte(C, opcode);
+	c_mem(C, reg, base, disp);
+}
+
+static void
+c_load(Compiler* C, int reg, int base, int32_t disp) {
+	c_op_mem(C, 1, 0x8B, reg, base, disp);
+}
+
+static void
+c_store(Compiler* C, int base, int32_t disp, int reg) {
+	c_op_mem(C, 1, 0x89, reg, base, disp);
+}
+
+static void
+c_lea(Compiler* C, int reg, int base, int32_t disp) {
+	c_op_mem(C, 1, 0x8D, reg, base, disp);
+}
+
+static void
+c_mov(Compiler* C, int dst, int src) {
+	c_op_reg(C, 1, 0x89, src, dst);
+}
+
+static void
+c_movi(Compiler* C, int reg, int64_t v) {
+	c_rex(C, 1, 0, reg);
+	c_byte(C, 0xB8 + (reg & 7));
+	c_int64(C, v);
+}
+
+/* add/and/sub/cmp rm, imm32 (ext selects the operation) */
+static void
+c_alui(Compiler* C, int ext, int rm, int32_t v) {
+	c_rex(C, 1, 0, rm);
+	c_byte(C, 0x81);
+	c_byte(C, 0xC0 | (ext << 3) | (rm & 7));
+	c_int32(C, v);
+}
+
+#define ALU_ADD 0
+#define ALU_AND 4
+#define ALU_SUB 5
+#define ALU_CMP 7
+
+static void
+c_push_reg(Compiler* C, int reg) {
+	c_rex(C, 0, 0, reg);
+	c_byte(C, 0x50 + (reg & 7));
+}
+
+static void
+c_pop_reg(Compiler* C, int reg) {
+	c_rex(C, 0, 0, reg);
+	c_byte(C, 0x58 + (reg & 7));
+}
+
+static void
+c_call(Compiler* C, const void* f) {
+	c_movi(C, R11, (int64_t)(intptr_t)f);
+	c_op_reg(C, 0, 0xFF, 2, R11); /* call r11 */
+}
+
+/* jump to a label, patched once every label is known */
+static void
+c_jump(Compiler* C, uint8_t cc, uint32_t target) {
+	if (cc == CC_JMP) {
+		c_byte(C, 0xE9);
+	} else {
+		c_byte(C, 0x0F);
+		c_byte(C, cc);
+	}
+	if (C->npatches == C->patches_cap) {
+		C->patches_cap *= 2;
+		C->patches = realloc(C->patches, C->patches_cap * sizeof(Patch));
+	}
+	C->patches[C->npatches].at = C->len;
+	C->patches[C->npatches].target = target;
+	C->npatches++;
+	c_int32(C, 0);
+}
+
+/* forward jump inside of a template, see c_land */
+static uint32_t
+c_skip(Compiler* C, uint8_t cc) {
+	if (cc == CC_JMP) {
+		c_byte(C, 0xE9);
+	} else {
+		c_byte(C, 0x0F);
+		c_byte(C, cc);
+	}
+	c_int32(C, 0);
+	return C->len;
+}
+
+static void
+c_land(Compiler* C, uint32_t from) {
+	int32_t rel = (int32_t)(C->len - from);
+	memcpy(&C->buf[from - 4], &rel, 4);
+}
+
+/* VM STATE */
+
+static void
+c_vm_push(Compiler* C, int reg) {
+	c_lea(C, J_SP, J_SP, 8);
+	c_store(C, J_SP, 0, reg);
+}
+
+static void
+c_vm_pop(Compiler* C, int reg) {
+	c_load(C, reg, J_SP, 0);
+	c_lea(C, J_SP, J_SP, -8);
+}
+
+/* C code is about to look at (or change) sp and bp */
+static void
+c_sync(Compiler* C) {
+	c_store(C, J_SPY, offsetof(SpyState, sp), J_SP);
+	c_store(C, J_SPY, offsetof(SpyState, bp), J_BP);
+}
+
+static void
+c_reload(Compiler* C) {
+	c_load(C, J_SP, J_SPY, offsetof(SpyState, sp));
+	c_load(C, J_BP, J_SPY, offsetof(SpyState, bp));
+}
+
+/* calls f(spy, ...) with sp and bp in sync, leaves if it set spy->bail */
+static void
+c_call_vm(Compiler* C, const void* f) {
+	c_sync(C);
+	c_mov(C, RDI, J_SPY);
+	c_call(C, f);
+	c_reload(C);
+	c_rex(C, 0, 0, J_SPY);
+	c_byte(C, 0x83); /* cmp dword [spy + bail], 0 */
+	c_mem(C, 7, J_SPY, offsetof(SpyState, bail));
+	c_byte(C, 0);
+	c_jump(C, CC_NE, C->leave);
+}
+
+/* same check as BOUNDS_CHECK */
+static void
+c_bounds(Compiler* C, int reg) {
+	c_op_reg(C, 1, 0x85, reg, reg); /* test */
+	uint32_t bad = c_skip(C, CC_LE);
+	c_alui(C, ALU_CMP, reg, (int32_t)C->spy->memory_size - 7);
+	uint32_t ok = c_skip(C, CC_L);
+	c_land(C, bad);
+	c_mov(C, RDX, reg);
+	c_movi(C, RSI, (int64_t)(intptr_t)msg_segfault);
+	c_mov(C, RDI, J_SPY);
+	c_op_reg(C, 0, 0x31, RAX, RAX); /* xor eax, eax (no vector args) */
+	c_call(C, spy_die);
+	c_land(C, ok);
+}
+
+/* sets flags by running the instruction in C, see spy_exec_flags */
+static void
+c_flags(Compiler* C, uint8_t opcode) {
+	c_sync(C);
+	c_mov(C, RDI, J_SPY);
+	c_movi(C, RSI, opcode);
+	c_call(C, spy_exec_flags);
+	c_load(C, J_SP, J_SPY, offsetof(SpyState, sp));
+}
+
+/* branch on spy->flags like the stack jumps */
+static void
+c_flag_jump(Compiler* C, uint16_t mask, int set, uint32_t target) {
+	c_byte(C, 0x66); /* test word [spy + flags], mask */
+	c_rex(C, 0, 0, J_SPY);
+	c_byte(C, 0xF7);
+	c_mem(C, 0, J_SPY, offsetof(SpyState, flags));
+	c_byte(C, (uint8_t)mask);
+	c_byte(C, (uint8_t)(mask >> 8));
+	c_jump(C, set ? CC_NE : CC_E, target);
+}
+
+/* REGISTER OPERANDS */
+
+static int
+c_base(uint8_t base) {
+	return base == RB_BP ? J_BP : J_SP;
+}
+
+static void
+c_rload(Compiler* C, const SpyOp* op, int n, int reg) {
+	if (op->base[n] == RB_K) {
+		c_movi(C, reg, C->spy->rconst[op->reg[n] / 8]);
+	} else {
+		c_load(C, reg, c_base(op->base[n]), op->reg[n]);
+	}
+}
+
+static void
+c_rstore(Compiler* C, const SpyOp* op, int n, int reg) {
+	c_store(C, c_base(op->base[n]), op->reg[n], reg);
+}
+
+static void
+c_rfload(Compiler* C, const SpyOp* op, int n, int xmm) {
+	if (op->base[n] == RB_K) {
+		c_movi(C, R10, C->spy->rconst[op->reg[n] / 8]);
+		c_sse_reg(C, 0x66, 1, 0x6E, xmm, R10); /* movq xmm, r10 */
+	} else {
+		c_sse_mem(C, 0xF2, 0x10, xmm, c_base(op->base[n]), op->reg[n]);
+	}
+}
+
+static void
+c_rfstore(Compiler* C, const SpyOp* op, int n, int xmm) {
+	c_sse_mem(C, 0xF2, 0x11, xmm, c_base(op->base[n]), op->reg[n]);
+}
+
+/* sp_delta of a register instruction, doesn't touch the cpu flags */
+static void
+c_rsp(Compiler* C, const SpyOp* op) {
+	if (op->sp_delta) {
+		c_lea(C, J_SP, J_SP, op->sp_delta);
+	}
+}
+
+/* TEMPLATES */
+
+/* rax = a (below top), rcx = b (top) */
+static void
+c_pop2(Compiler* C) {
+	c_vm_pop(C, RCX);
+	c_load(C, RAX, J_SP, 0);
+}
+
+static void
+c_intarith(Compiler* C, uint8_t opcode) {
+	c_pop2(C);
+	c_op_reg(C, 1, opcode, RCX, RAX);
+	c_store(C, J_SP, 0, RAX);
+}
+
+static void
+c_floatarith(Compiler* C, uint8_t opcode) {
+	c_sse_mem(C, 0xF2, 0x10, 0, J_SP, -8);
+	c_sse_mem(C, 0xF2, opcode, 0, J_SP, 0);
+	c_lea(C, J_SP, J_SP, -8);
+	c_sse_mem(C, 0xF2, 0x11, 0, J_SP, 0);
+}
+
+/* rax = rax / rcx, rdx = rax % rcx */
+static void
+c_idiv(Compiler* C) {
+	c_byte(C, 0x48); /* cqo */
+	c_byte(C, 0x99);
+	c_op_reg(C, 1, 0xF7, 7, RCX);
+}
+
+/* shl (ext 4) or sar (ext 7) rax, cl */
+static void
+c_shift(Compiler* C, int ext) {
+	c_op_reg(C, 1, 0xD3, ext, RAX);
+}
+
+/* rax = rax != 0 (sete with ext E, setne with NE) */
+static void
+c_bool(Compiler* C, int reg, uint8_t cc) {
+	c_op_reg(C, 1, 0x85, reg, reg);
+	c_op2_reg(C, 0, cc + 0x10, 0, reg); /* setcc reg8 */
+	c_op2_reg(C, 0, 0xB6, reg, reg); /* movzx reg, reg8 */
+}
+
+/* [a, b] -> [], cmp rax, rcx or ucomisd xmm0, xmm1 */
+static void
+c_compare(Compiler* C, int is_float) {
+	if (is_float) {
+		c_sse_mem(C, 0xF2, 0x10, 0, J_SP, -8);
+		c_sse_mem(C, 0xF2, 0x10, 1, J_SP, 0);
+		c_lea(C, J_SP, J_SP, -16);
+		c_sse_reg(C, 0x66, 0, 0x2E, 0, 1); /* ucomisd xmm0, xmm1 */
+	} else {
+		c_pop2(C);
+		c_lea(C, J_SP, J_SP, -8);
+		c_op_reg(C, 1, 0x39, RCX, RAX); /* cmp rax, rcx */
+	}
+}
+
+/* branch after ucomisd, cond is e ... le like the fj instructions.
+ * unordered (NaN) sets ZF, PF and CF */
+static void
+c_float_jump(Compiler* C, int cond, uint32_t target) {
+	static const uint8_t cc[6] = {CC_E, CC_NE, CC_A, CC_AE, CC_B, CC_BE};
+	if (cond == 0) {
+		uint32_t skip = c_skip(C, CC_P);
+		c_jump(C, CC_E, target);
+		c_land(C, skip);
+	} else if (cond == 1) {
+		c_jump(C, CC_P, target);
+		c_jump(C, CC_NE, target);
+	} else {
+		c_jump(C, cc[cond], target);
+	}
+}
+
+/* eax = result of the compare, cond is e ... le */
+static void
+c_compare_bool(Compiler* C, int is_float, int cond) {
+	static const uint8_t icc[6] = {CC_E, CC_NE, CC_G, CC_GE, CC_L, CC_LE};
+	static const uint8_t fcc[6] = {CC_E, CC_NE, CC_A, CC_AE, CC_B, CC_BE};
+	c_op2_reg(C, 0, (is_float ? fcc : icc)[cond] + 0x10, 0, RAX); /* setcc al */
+	if (is_float && cond < 2) {
+		c_op2_reg(C, 0, (cond == 0 ? CC_NP : CC_P) + 0x10, 0, RDX); /* setnp/setp dl */
+		c_op_reg(C, 0, cond == 0 ? 0x20 : 0x08, RDX, RAX); /* and/or al, dl */
+	}
+	c_op2_reg(C, 0, 0xB6, RAX, RAX); /* movzx eax, al */
+}
+
+static void
+c_ret(Compiler* C, int has_value, spy_int nargs) {
+	if (has_value) {
+		c_load(C, RAX, J_SP, 0);
+	}
+	c_mov(C, J_SP, J_BP);
+	c_load(C, J_BP, J_SP, 0);
+	c_load(C, RDX, J_SP, -8);
+	c_store(C, J_SPY, offsetof(SpyState, ip), RDX);
+	c_lea(C, J_SP, J_SP, (int32_t)(-16 - 8 * nargs));
+	if (has_value) {
+		c_vm_push(C, RAX);
+	}
+	c_jump(C, CC_JMP, C->leave);
+}
+
+/* [addr] -> [value] */
+static void
+c_der(Compiler* C, int check, int byte) {
+	c_load(C, RAX, J_SP, 0);
+	if (check) {
+		c_bounds(C, RAX);
+	}
+	c_op_reg(C, 1, 0x01, J_MEM, RAX); /* add rax, r13 */
+	if (byte) {
+		c_rex(C, 0, RAX, RAX);
+		c_byte(C, 0x0F);
+		c_byte(C, 0xB6);
+		c_mem(C, RAX, RAX, 0);
+	} else {
+		c_load(C, RAX, RAX, 0);
+	}
+	c_store(C, J_SP, 0, RAX);
+}
+
+/* [addr, value] -> [] */
+static void
+c_save(Compiler* C, int check, int byte) {
+	c_pop2(C);
+	c_lea(C, J_SP, J_SP, -8);
+	if (check) {
+		c_bounds(C, RAX);
+	}
+	c_op_reg(C, 1, 0x01, J_MEM, RAX);
+	c_op_mem(C, !byte, byte ? 0x88 : 0x89, RCX, RAX, 0);
+}
+
+static void
+c_cmp_jump(Compiler* C, uint8_t cmp, uint16_t mask, int set, uint32_t target) {
+	c_flags(C, cmp);
+	c_flag_jump(C, mask, set, target);
+}
+
+/* templates for the branches, indexed by opcode - 0x04 */
+static const struct {
+	uint16_t mask;
+	int set;
+} flag_jumps[10] = {
+	{FLAG_EQ, 1}, {FLAG_EQ, 0}, {FLAG_GT, 1}, {FLAG_LT, 0}, {FLAG_LT, 1},
+	{FLAG_GT, 0}, {FLAG_Z, 1}, {FLAG_Z, 0}, {FLAG_S, 1}, {FLAG_S, 0}
+};
+
+/* pe ... pns, indexed by opcode - 0x3D */
+static const uint8_t flag_pushes[10] = {
+	FLAG_EQ, FLAG_EQ, FLAG_GT, FLAG_LT, FLAG_LT, FLAG_GT, FLAG_Z, FLAG_Z, FLAG_S, FLAG_S
+};
+
+static uint32_t
+c_target(Compiler* C, const SpyOp* target) {
+	return (uint32_t)(target - C->spy->ops);
+}
+
+/* call helpers, see the bottom of this file */
+static void jit_call(SpyState*, SpyOp*);
+static void jit_ccall(SpyState*);
+static void jit_cfcall(SpyState*, SpyOp*);
+static void jit_ccfcall(SpyState*, spy_int);
+
+/* instructions that never continue with the next one */
+static int
+c_ends_function(uint8_t opcode) {
+	switch (opcode) {
+		case 0x00: case 0x0E: case 0x19: case 0x26: case 0x27: case 0x38: case 0x4F: case 0x92:
+			return 1;
+	}
+	return 0;
+}
+
+/* jump target of an instruction that stays inside of the function */
+static const SpyOp*
+c_local_target(const SpyOp* op) {
+	if (op->opcode >= R_IJE && op->opcode <= R_IJNZ) {
+		return op->b.op;
+	}
+	if ((spy_is_branch(op->opcode) && op->opcode != 0x23) || op->opcode == 0x0E) {
+		return op->a.op;
+	}
+	return NULL;
+}
+
+/* compiles one instruction, returns 0 if there is no template for it */
+static int
+c_instruction(Compiler* C, const SpyOp* op) {
+
+	/* check for stack overflow at the same safepoints as the interpreter
+	 * (see spy_stack_bounds), J_LIMIT leaves room for spy->stack_slack */
+	const SpyOp* target = c_local_target(op);
+	if (op->opcode == 0x2C) {
+		c_lea(C, RAX, J_SP, (int32_t)(op->b.i - C->spy->stack_slack));
+		c_op_reg(C, 1, 0x39, J_LIMIT, RAX); /* cmp rax, rbp */
+		c_jump(C, CC_AE, C->overflow);
+	} else if ((target && target <= op) || op->opcode == 0x23 || op->opcode == 0x24 || op->opcode == 0x19) {
+		c_op_reg(C, 1, 0x39, J_LIMIT, J_SP); /* cmp rbx, rbp */
+		c_jump(C, CC_AE, C->overflow);
+	}
+
+	switch (op->opcode) {
+		/* NOP, EXIT */
+		case 0x00: case 0x27:
+			c_rex(C, 0, 0, J_SPY);
+			c_byte(C, 0xC7); /* mov dword [spy + bail], 1 */
+			c_mem(C, 0, J_SPY, offsetof(SpyState, bail));
+			c_int32(C, 1);
+			c_jump(C, CC_JMP, C->leave);
+			return 1;
+		/* ICONST, FCONST */
+		case 0x01: case 0x47:
+			c_movi(C, RAX, op->a.i);
+			c_vm_push(C, RAX);
+			return 1;
+		/* ICMP, ITEST, FCMP, FTEST */
+		case 0x02: case 0x03: case 0x48: case 0x49:
+			c_flags(C, op->opcode);
+			return 1;
+		/* JE ... JNS */
+		case 0x04: case 0x05: case 0x06: case 0x07: case 0x08:
+		case 0x09: case 0x0A: case 0x0B: case 0x0C: case 0x0D:
+			if (!op->a.op) {
+				return 0;
+			}
+			c_flag_jump(C, flag_jumps[op->opcode - 0x04].mask, flag_jumps[op->opcode - 0x04].set, c_target(C, op->a.op));
+			return 1;
+		/* JMP */
+		case 0x0E:
+			if (!op->a.op) {
+				return 0;
+			}
+			c_jump(C, CC_JMP, c_target(C, op->a.op));
+			return 1;
+		case 0x1A: c_intarith(C, 0x01); return 1; /* IADD */
+		case 0x1B: c_intarith(C, 0x29); return 1; /* ISUB */
+		case 0x20: c_intarith(C, 0x21); return 1; /* AND */
+		case 0x21: c_intarith(C, 0x09); return 1; /* OR */
+		case 0x22: c_intarith(C, 0x31); return 1; /* XOR */
+		/* IMUL */
+		case 0x1C:
+			c_pop2(C);
+			c_op2_reg(C, 1, 0xAF, RAX, RCX);
+			c_store(C, J_SP, 0, RAX);
+			return 1;
+		/* IDIV, MOD */
+		case 0x1D: case 0x5A:
+			c_pop2(C);
+			c_idiv(C);
+			c_store(C, J_SP, 0, op->opcode == 0x1D ? RAX : RDX);
+			return 1;
+		/* SHL, SHR */
+		case 0x1E: case 0x1F:
+			c_pop2(C);
+			c_shift(C, op->opcode == 0x1E ? 4 : 7);
+			c_store(C, J_SP, 0, RAX);
+			return 1;
+		/* CALL */
+		case 0x23:
+			if (!op->a.op) {
+				return 0;
+			}
+			c_movi(C, RSI, (int64_t)(intptr_t)op->a.op);
+			c_call_vm(C, jit_call);
+			return 1;
+		/* CCALL */
+		case 0x24:
+			c_call_vm(C, jit_ccall);
+			return 1;
+		/* CFCALL, CFCALL_IDX */
+		case 0x25: case 0x95:
+			c_movi(C, RSI, (int64_t)(intptr_t)op);
+			c_call_vm(C, jit_cfcall);
+			return 1;
+		/* CCFCALL */
+		case 0x5B:
+			c_movi(C, RSI, op->a.i);
+			c_call_vm(C, jit_ccfcall);
+			return 1;
+		/* VLOAD ... VFMAX, run in C (see spy_exec_vector) */
+		case 0xD4: case 0xD5: case 0xD6: case 0xD7: case 0xD8: case 0xD9:
+		case 0xDA: case 0xDB: case 0xDC: case 0xDD: case 0xDE: case 0xDF:
+		case 0xE0: case 0xE1: case 0xE2: case 0xE3: case 0xE4: case 0xE5:
+			if (op->a.i < 1 || op->a.i > VECTOR_MAX_LANES) {
+				return 0;
+			}
+			c_movi(C, RSI, (int64_t)(intptr_t)op);
+			c_call_vm(C, spy_exec_vector);
+			return 1;
+		/* MEMCPY, MEMMOVE, MEMSET, MEMCMP, run in C (see spy_exec_memory) */
+		case 0x96: case 0x97: case 0x98: case 0x99:
+			c_movi(C, RSI, op->opcode);
+			c_call_vm(C, spy_exec_memory);
+			return 1;
+		/* IRET, FRET */
+		case 0x26: case 0x4F:
+			if (op->a.i < 0 || op->a.i > SIZE_STACK / 8) {
+				return 0;
+			}
+			c_ret(C, 1, op->a.i);
+			return 1;
+		/* VRET */
+		case 0x38:
+			if (op->a.i < 0 || op->a.i > SIZE_STACK / 8) {
+				return 0;
+			}
+			c_ret(C, 0, op->a.i);
+			return 1;
+		case 0x28: c_der(C, 1, 0); return 1; /* IDER */
+		case 0x29: c_der(C, 1, 1); return 1; /* BDER */
+		case 0x54: c_der(C, 0, 0); return 1; /* FDER */
+		case 0x2A: c_save(C, 1, 0); return 1; /* ISAVE */
+		case 0x2B: c_save(C, 1, 1); return 1; /* BSAVE */
+		case 0x59: c_save(C, 0, 0); return 1; /* FSAVE */
+		/* RES */
+		case 0x2C:
+			c_lea(C, RDI, J_SP, 8);
+			c_op_reg(C, 0, 0x31, RSI, RSI);
+			c_movi(C, RDX, op->a.i);
+			c_call(C, memset);
+			c_movi(C, RAX, op->a.i);
+			c_op_reg(C, 1, 0x01, RAX, J_SP);
+			return 1;
+		/* IINC */
+		case 0x2D:
+			c_movi(C, RAX, op->a.i);
+			c_op_mem(C, 1, 0x01, RAX, J_SP, 0); /* add [rbx], rax */
+			return 1;
+		/* POP */
+		case 0x2E:
+			c_lea(C, J_SP, J_SP, -8);
+			return 1;
+		/* IARG, FARG, BARG */
+		case 0x2F: case 0x55: case 0x30:
+			if (op->a.i < 0 || op->a.i > SIZE_STACK) {
+				return 0;
+			}
+			if (op->opcode == 0x30) {
+				c_rex(C, 0, RAX, J_BP);
+				c_byte(C, 0x0F);
+				c_byte(C, 0xB6);
+				c_mem(C, RAX, J_BP, -2*8 - op->a.i*8);
+			} else {
+				c_load(C, RAX, J_BP, -2*8 - op->a.i*8);
+			}
+			c_vm_push(C, RAX);
+			return 1;
+		/* LEA */
+		case 0x31:
+			if (op->a.i < -SIZE_STACK || op->a.i > SIZE_STACK) {
+				return 0;
+			}
+			c_lea(C, RAX, J_BP, 8 + op->a.i);
+			c_op_reg(C, 1, 0x29, J_MEM, RAX); /* sub rax, r13 */
+			c_vm_push(C, RAX);
+			return 1;
+		/* MALLOC, FREE, run in C (see spy_exec_heap) */
+		case 0x36: case 0x37:
+			c_movi(C, RSI, op->opcode);
+			c_call_vm(C, spy_exec_heap);
+			return 1;
+		/* ILOCALL, FLOCALL, BLOCALL */
+		case 0x39: case 0x50: case 0x3A:
+			if (op->a.i < -SIZE_STACK || op->a.i > SIZE_STACK) {
+				return 0;
+			}
+			if (op->opcode == 0x3A) {
+				c_rex(C, 0, RAX, J_BP);
+				c_byte(C, 0x0F);
+				c_byte(C, 0xB6);
+				c_mem(C, RAX, J_BP, 8 + op->a.i);
+			} else {
+				c_load(C, RAX, J_BP, 8 + op->a.i);
+			}
+			c_vm_push(C, RAX);
+			return 1;
+		/* ILOCALS, FLOCALS, BLOCALS */
+		case 0x3B: case 0x51: case 0x3C:
+			if (op->a.i < -SIZE_STACK || op->a.i > SIZE_STACK) {
+				return 0;
+			}
+			c_vm_pop(C, RAX);
+			c_op_mem(C, op->opcode != 0x3C, op->opcode == 0x3C ? 0x88 : 0x89, RAX, J_BP, 8 + op->a.i);
+			return 1;
+		/* PE ... PNS */
+		case 0x3D: case 0x3E: case 0x3F: case 0x40: case 0x41:
+		case 0x42: case 0x43: case 0x44: case 0x45: case 0x46: {
+			c_rex(C, 0, RAX, J_SPY); /* movzx eax, word [spy + flags] */
+			c_byte(C, 0x0F);
+			c_byte(C, 0xB7);
+			c_mem(C, RAX, J_SPY, offsetof(SpyState, flags));
+			c_alui(C, ALU_AND, RAX, flag_pushes[op->opcode - 0x3D]);
+			/* even opcodes (pne, pge, ...) push the inverse */
+			c_bool(C, RAX, (op->opcode - 0x3D) % 2 ? CC_E : CC_NE);
+			c_vm_push(C, RAX);
+			return 1;
+		}
+		case 0x4A: c_floatarith(C, 0x58); return 1; /* FADD */
+		case 0x4B: c_floatarith(C, 0x5C); return 1; /* FSUB */
+		case 0x4C: c_floatarith(C, 0x59); return 1; /* FMUL */
+		case 0x4D: c_floatarith(C, 0x5E); return 1; /* FDIV */
+		/* FINC */
+		case 0x4E:
+			c_movi(C, RAX, op->a.i);
+			c_sse_reg(C, 0x66, 1, 0x6E, 1, RAX);
+			c_sse_mem(C, 0xF2, 0x10, 0, J_SP, 0);
+			c_sse_reg(C, 0xF2, 0, 0x58, 0, 1);
+			c_sse_mem(C, 0xF2, 0x11, 0, J_SP, 0);
+			return 1;
+		/* ITOF */
+		case 0x56:
+			c_load(C, RAX, J_SP, 0);
+			c_sse_reg(C, 0xF2, 1, 0x2A, 0, RAX); /* cvtsi2sd xmm0, rax */
+			c_sse_mem(C, 0xF2, 0x11, 0, J_SP, 0);
+			return 1;
+		/* FTOI */
+		case 0x57:
+			c_sse_mem(C, 0xF2, 0x10, 0, J_SP, 0);
+			c_sse_reg(C, 0xF2, 1, 0x2C, RAX, 0); /* cvttsd2si rax, xmm0 */
+			c_store(C, J_SP, 0, RAX);
+			return 1;
+		/* DUP, DUP2 */
+		case 0x58: case 0x5F:
+			c_load(C, RAX, J_SP, op->opcode == 0x58 ? 0 : -8);
+			c_vm_push(C, RAX);
+			return 1;
+		/* NOT */
+		case 0x5C:
+			c_load(C, RAX, J_SP, 0);
+			c_bool(C, RAX, CC_E);
+			c_store(C, J_SP, 0, RAX);
+			return 1;
+		/* LAND, LOR */
+		case 0x5D: case 0x5E:
+			c_pop2(C);
+			c_bool(C, RAX, CC_NE);
+			c_bool(C, RCX, CC_NE);
+			c_op_reg(C, 1, op->opcode == 0x5D ? 0x21 : 0x09, RCX, RAX);
+			c_store(C, J_SP, 0, RAX);
+			return 1;
+		/* IADDLL */
+		case 0x60:
+			if (op->a.i < -SIZE_STACK || op->a.i > SIZE_STACK || op->b.i < -SIZE_STACK || op->b.i > SIZE_STACK) {
+				return 0;
+			}
+			c_load(C, RAX, J_BP, 8 + op->a.i);
+			c_op_mem(C, 1, 0x03, RAX, J_BP, 8 + op->b.i);
+			c_vm_push(C, RAX);
+			return 1;
+		/* IIDX */
+		case 0x61:
+			c_vm_pop(C, RCX);
+			c_movi(C, RAX, op->a.i);
+			c_op2_reg(C, 1, 0xAF, RCX, RAX);
+			c_op_mem(C, 1, 0x01, RCX, J_SP, 0);
+			return 1;
+		/* LEADUP */
+		case 0x62:
+			if (op->a.i < -SIZE_STACK || op->a.i > SIZE_STACK) {
+				return 0;
+			}
+			c_lea(C, RAX, J_BP, 8 + op->a.i);
+			c_op_reg(C, 1, 0x29, J_MEM, RAX);
+			c_vm_push(C, RAX);
+			c_vm_push(C, RAX);
+			return 1;
+		/* ISAVEP, FSAVEP, BSAVEP, ISAVED, FSAVED, BSAVED */
+		case 0x63: case 0x64: case 0x65: case 0x66: case 0x67: case 0x68: {
+			int type = (op->opcode - 0x63) % 3;
+			c_save(C, type != 1, type == 2);
+			if (op->opcode >= 0x66) {
+				c_der(C, type != 1, type == 2);
+				return 1;
+			}
+			c_vm_pop(C, RAX);
+			if (type != 1) {
+				c_bounds(C, RAX);
+			}
+			return 1;
+		}
+		/* ICJE ... FCJLE */
+		case 0x69: case 0x6A: case 0x6B: case 0x6C: case 0x6D: case 0x6E:
+		case 0x6F: case 0x70: case 0x71: case 0x72: case 0x73: case 0x74: {
+			if (!op->a.op) {
+				return 0;
+			}
+			int cond = (op->opcode - 0x69) % 6;
+			c_cmp_jump(C, op->opcode <= 0x6E ? 0x02 : 0x48, flag_jumps[cond].mask, flag_jumps[cond].set, c_target(C, op->a.op));
+			return 1;
+		}
+		/* IJE ... FJLE */
+		case 0x75: case 0x76: case 0x77: case 0x78: case 0x79: case 0x7A:
+		case 0x7B: case 0x7C: case 0x7D: case 0x7E: case 0x7F: case 0x80: {
+			static const uint8_t cc[6] = {CC_E, CC_NE, CC_G, CC_GE, CC_L, CC_LE};
+			if (!op->a.op) {
+				return 0;
+			}
+			c_compare(C, op->opcode >= 0x7B);
+			if (op->opcode >= 0x7B) {
+				c_float_jump(C, op->opcode - 0x7B, c_target(C, op->a.op));
+			} else {
+				c_jump(C, cc[op->opcode - 0x75], c_target(C, op->a.op));
+			}
+			return 1;
+		}
+		/* IPE ... FPLE */
+		case 0x81: case 0x82: case 0x83: case 0x84: case 0x85: case 0x86:
+		case 0x87: case 0x88: case 0x89: case 0x8A: case 0x8B: case 0x8C:
+			c_compare(C, op->opcode >= 0x87);
+			c_compare_bool(C, op->opcode >= 0x87, (op->opcode - 0x81) % 6);
+			c_vm_push(C, RAX);
+			return 1;
+		/* IJZ, IJNZ */
+		case 0x8D: case 0x8E:
+			if (!op->a.op) {
+				return 0;
+			}
+			c_vm_pop(C, RAX);
+			c_op_reg(C, 1, 0x85, RAX, RAX);
+			c_jump(C, op->opcode == 0x8D ? CC_E : CC_NE, c_target(C, op->a.op));
+			return 1;
+	}
+
+	/* register tier, see regvm.h */
+	switch (op->opcode) {
+		case R_MOV:
+			c_rload(C, op, 1, RAX);
+			c_rstore(C, op, 0, RAX);
+			break;
+		case R_LEA:
+			c_lea(C, RAX, J_BP, (int32_t)op->a.i);
+			c_op_reg(C, 1, 0x29, J_MEM, RAX);
+			c_rstore(C, op, 0, RAX);
+			break;
+		case R_IADD: case R_ISUB: case R_AND: case R_OR: case R_XOR: {
+			static const uint8_t alu[5] = {0x01, 0x29, 0x21, 0x09, 0x31};
+			int which = op->opcode == R_IADD ? 0 : op->opcode == R_ISUB ? 1 : op->opcode - R_AND + 2;
+			c_rload(C, op, 1, RAX);
+			c_rload(C, op, 2, RCX);
+			c_op_reg(C, 1, alu[which], RCX, RAX);
+			c_rstore(C, op, 0, RAX);
+			break;
+		}
+		case R_IMUL:
+			c_rload(C, op, 1, RAX);
+			c_rload(C, op, 2, RCX);
+			c_op2_reg(C, 1, 0xAF, RAX, RCX);
+			c_rstore(C, op, 0, RAX);
+			break;
+		case R_IDIV: case R_MOD:
+			c_rload(C, op, 1, RAX);
+			c_rload(C, op, 2, RCX);
+			c_idiv(C);
+			c_rstore(C, op, 0, op->opcode == R_IDIV ? RAX : RDX);
+			break;
+		case R_SHL: case R_SHR:
+			c_rload(C, op, 1, RAX);
+			c_rload(C, op, 2, RCX);
+			c_shift(C, op->opcode == R_SHL ? 4 : 7);
+			c_rstore(C, op, 0, RAX);
+			break;
+		case R_FADD: case R_FSUB: case R_FMUL: case R_FDIV: {
+			static const uint8_t sse[4] = {0x58, 0x5C, 0x59, 0x5E};
+			c_rfload(C, op, 1, 0);
+			c_rfload(C, op, 2, 1);
+			c_sse_reg(C, 0xF2, 0, sse[op->opcode - R_FADD], 0, 1);
+			c_rfstore(C, op, 0, 0);
+			break;
+		}
+		case R_ITOF:
+			c_rload(C, op, 1, RAX);
+			c_sse_reg(C, 0xF2, 1, 0x2A, 0, RAX);
+			c_rfstore(C, op, 0, 0);
+			break;
+		case R_FTOI:
+			c_rfload(C, op, 1, 0);
+			c_sse_reg(C, 0xF2, 1, 0x2C, RAX, 0);
+			c_rstore(C, op, 0, RAX);
+			break;
+		case R_IDER: case R_FDER: case R_BDER:
+			c_rload(C, op, 1, RAX);
+			if (op->opcode != R_FDER) {
+				c_bounds(C, RAX);
+			}
+			c_op_reg(C, 1, 0x01, J_MEM, RAX);
+			if (op->opcode == R_BDER) {
+				c_rex(C, 0, RAX, RAX);
+				c_byte(C, 0x0F);
+				c_byte(C, 0xB6);
+				c_mem(C, RAX, RAX, 0);
+			} else {
+				c_load(C, RAX, RAX, 0);
+			}
+			c_rstore(C, op, 0, RAX);
+			break;
+		case R_BLOAD:
+			if (op->base[1] == RB_K) {
+				c_movi(C, RAX, (uint8_t)C->spy->rconst[op->reg[1] / 8]);
+			} else {
+				c_rex(C, 0, RAX, c_base(op->base[1]));
+				c_byte(C, 0x0F);
+				c_byte(C, 0xB6);
+				c_mem(C, RAX, c_base(op->base[1]), op->reg[1]);
+			}
+			c_rstore(C, op, 0, RAX);
+			break;
+		case R_ISAVE: case R_FSAVE: case R_BSAVE:
+			c_rload(C, op, 0, RAX);
+			if (op->opcode != R_FSAVE) {
+				c_bounds(C, RAX);
+			}
+			c_rload(C, op, 1, RCX);
+			c_op_reg(C, 1, 0x01, J_MEM, RAX);
+			c_op_mem(C, op->opcode != R_BSAVE, op->opcode == R_BSAVE ? 0x88 : 0x89, RCX, RAX, 0);
+			break;
+		case R_BSTORE:
+			c_rload(C, op, 1, RCX);
+			c_op_mem(C, 0, 0x88, RCX, c_base(op->base[0]), op->reg[0]);
+			break;
+		case R_SP:
+			break;
+		case R_IJE: case R_IJNE: case R_IJGT: case R_IJGE: case R_IJLT: case R_IJLE: {
+			static const uint8_t cc[6] = {CC_E, CC_NE, CC_G, CC_GE, CC_L, CC_LE};
+			c_rload(C, op, 0, RAX);
+			c_rload(C, op, 1, RCX);
+			c_op_reg(C, 1, 0x39, RCX, RAX); /* cmp rax, rcx */
+			c_rsp(C, op);
+			c_jump(C, cc[op->opcode - R_IJE], c_target(C, op->b.op));
+			return 1;
+		}
+		case R_FJE: case R_FJNE: case R_FJGT: case R_FJGE: case R_FJLT: case R_FJLE: {
+			c_rfload(C, op, 0, 0);
+			c_rfload(C, op, 1, 1);
+			c_sse_reg(C, 0x66, 0, 0x2E, 0, 1); /* ucomisd xmm0, xmm1 */
+			c_rsp(C, op);
+			c_float_jump(C, op->opcode - R_FJE, c_target(C, op->b.op));
+			return 1;
+		}
+		case R_IJZ: case R_IJNZ:
+			c_rload(C, op, 0, RAX);
+			c_op_reg(C, 1, 0x85, RAX, RAX);
+			c_rsp(C, op);
+			c_jump(C, op->opcode == R_IJZ ? CC_E : CC_NE, c_target(C, op->b.op));
+			return 1;
+		default:
+			return 0;
+	}
+	c_rsp(C, op);
+	return 1;
+
+}
+
+/* copies code into executable memory.  the size of the mapping is kept
+ * in front of the code, see spy_jit_release */
+static void*
+jit_install(const uint8_t* buf, uint32_t len) {
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t size = (len + JIT_HEADER + page - 1) / page * page;
+	uint8_t* code = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (code == MAP_FAILED) {
+		return NULL;
+	}
+	memcpy(code, &size, sizeof(size_t));
+	memcpy(code + JIT_HEADER, buf, len);
+	if (mprotect(code, size, PROT_READ | PROT_EXEC) != 0) {
+		munmap(code, size);
+		return NULL;
+	}
+	return code + JIT_HEADER;
+}
+
+/* unmaps code from jit_install (compiled functions and traces) */
+void
+spy_jit_release(void* native) {
+	if (native) {
+		uint8_t* code = (uint8_t *)native - JIT_HEADER;
+		size_t size;
+		memcpy(&size, code, sizeof(size_t));
+		munmap(code, size);
+	}
+}
+
+static SpyNative
+jit_compile(SpyState* spy, const SpyOp* entry) {
+
+	Compiler C;
+	uint32_t nops = (uint32_t)spy->nops;
+	uint8_t* reached = calloc(nops, sizeof(uint8_t));
+	uint32_t* pending = malloc(nops * sizeof(uint32_t));
+	uint32_t npending = 0;
+	SpyNative native = NULL;
+
+	C.spy = spy;
+	C.len = 0;
+	C.cap = 4096;
+	C.buf = malloc(C.cap);
+	C.label = malloc((nops + 2) * sizeof(uint32_t));
+	C.overflow = nops;
+	C.leave = nops + 1;
+	C.npatches = 0;
+	C.patches_cap = 64;
+	C.patches = malloc(C.patches_cap * sizeof(Patch));
+
+	/* find every instruction of the function */
+	pending[npending++] = c_target(&C, entry);
+	reached[c_target(&C, entry)] = 1;
+	while (npending > 0) {
+		uint32_t i = pending[--npending];
+		const SpyOp* op = &spy->ops[i];
+		const SpyOp* target = c_local_target(op);
+		if (target && !reached[c_target(&C, target)]) {
+			reached[c_target(&C, target)] = 1;
+			pending[npending++] = c_target(&C, target);
+		}
+		if (!c_ends_function(op->opcode) && i + 1 < nops && !reached[i + 1]) {
+			reached[i + 1] = 1;
+			pending[npending++] = i + 1;
+		}
+	}
+
+	/* prologue, the frame was already made by whoever called */
+	c_push_reg(&C, RBP);
+	c_push_reg(&C, RBX);
+	c_push_reg(&C, R12);
+	c_push_reg(&C, R13);
+	c_push_reg(&C, R14); /* rsp is 16 byte aligned again */
+	c_mov(&C, J_SPY, RDI);
+	c_reload(&C);
+	c_load(&C, J_MEM, J_SPY, offsetof(SpyState, memory));
+	c_lea(&C, J_LIMIT, J_MEM, SIZE_CODE + SIZE_STACK - REG_STACK_RESERVE - (int32_t)spy->stack_slack);
+	c_jump(&C, CC_JMP, c_target(&C, entry));
+
+	for (uint32_t i = 0; i < nops; i++) {
+		if (!reached[i]) {
+			continue;
+		}
+		C.label[i] = C.len;
+		if (!c_instruction(&C, &spy->ops[i])) {
+			goto done;
+		}
+	}
+
+	C.label[C.overflow] = C.len;
+	c_mov(&C, RDI, J_SPY);
+	c_movi(&C, RSI, (int64_t)(intptr_t)msg_overflow);
+	c_op_reg(&C, 0, 0x31, RAX, RAX);
+	c_call(&C, spy_die);
+
+	C.label[C.leave] = C.len;
+	c_sync(&C);
+	c_pop_reg(&C, R14);
+	c_pop_reg(&C, R13);
+	c_pop_reg(&C, R12);
+	c_pop_reg(&C, RBX);
+	c_pop_reg(&C, RBP);
+	c_byte(&C, 0xC3);
+
+	for (uint32_t i = 0; i < C.npatches; i++) {
+		int32_t rel = (int32_t)(C.label[C.patches[i].target] - (C.patches[i].at + 4));
+		memcpy(&C.buf[C.patches[i].at], &rel, 4);
+	}
+
+	native = (SpyNative)jit_install(C.buf, C.len);
+
+done:
+	free(reached);
+	free(pending);
+	free(C.buf);
+	free(C.label);
+	free(C.patches);
+	return native;
+
+}
+
+/* CALLS FROM NATIVE CODE */
+
+/* the same frame as the interpreter's CALL */
+static void
+jit_enter_frame(SpyState* spy, SpyOp* target) {
+	spy_push_int(spy, (intptr_t)&spy->jit->sentinel);
+	spy_push_int(spy, (intptr_t)spy->bp);
+	spy->bp = spy->sp;
+	if (!spy_jit_enter(spy, target)) {
+		spy_interpret(spy, target);
+	}
+}
+
+static void
+jit_call(SpyState* spy, SpyOp* target) {
+	jit_enter_frame(spy, target);
+}
+
+static void
+jit_ccall(SpyState* spy) {
+	spy_int addr = spy_pop_int(spy);
+	jit_enter_frame(spy, spy_op_at(spy, addr));
+}
+
+static void
+jit_call_cfunc(SpyState* spy, SpyCFunc* cfunc, spy_int nargs) {
+	if (cfunc->native) {
+		spy_call_native(spy, cfunc, nargs);
+		return;
+	}
+	if (nargs > 1) {
+		spy_cfunc_args(spy, nargs);
+	}
+	cfunc->f(spy);
+}
+
+static void
+jit_cfcall(SpyState* spy, SpyOp* op) {
+	if (!op->a.cfunc) {
+		if (op->opcode == 0x95) {
+			spy_die(spy, "invalid c-function import %lld", spy_mem_int(spy, op->addr + 1));
+		}
+		spy_die(spy, "unknown c-function '%s'", &spy->code[spy_mem_int(spy, op->addr + 1)]);
+	}
+	jit_call_cfunc(spy, op->a.cfunc, op->b.i);
+}
+
+static void
+jit_ccfcall(SpyState* spy, spy_int nargs) {
+	const char* name = (const char *)&spy->code[spy_pop_int(spy)];
+	SpyCFunc* cfunc = spy_find_cfunc(spy, name);
+	if (!cfunc) {
+		spy_die(spy, "unknown c-function '%s'", name);
+	}
+	jit_call_cfunc(spy, cfunc, nargs);
+}
+
+SpyJit*
+spy_jit_new(SpyState* spy) {
+	SpyJit* jit = malloc(sizeof(SpyJit));
+	memset(&jit->sentinel, 0, sizeof(SpyOp));
+	jit->sentinel.opcode = J_RETURN;
+	jit->native = calloc(spy->nops, sizeof(SpyNative));
+	jit->hits = calloc(spy->nops, sizeof(uint32_t));
+	jit->failed = calloc(spy->nops, sizeof(uint8_t));
+	return jit;
+}
+
+void
+spy_jit_free(SpyState* spy, SpyJit* jit) {
+	for (spy_int i = 0; i < spy->nops; i++) {
+		spy_jit_release(jit->native[i]);
+	}
+	free(jit->native);
+	free(jit->hits);
+	free(jit->failed);
+	free(jit);
+}
+
+SpyOp*
+spy_jit_sentinel(SpyJit* jit) {
+	return &jit->sentinel;
+}
+
+/* called when a frame for target was just made.  if target is (or can be)
+ * compiled, runs it and returns 1 with spy->ip set to the return address */
+int
+spy_jit_enter(SpyState* spy, SpyOp* target) {
+	SpyJit* jit = spy->jit;
+	size_t i = target - spy->ops;
+	if (!jit->native[i]) {
+		if (jit->failed[i] || ++jit->hits[i] < JIT_THRESHOLD) {
+			return 0;
+		}
+		jit->native[i] = jit_compile(spy, target);
+		if (!jit->native[i]) {
+			jit->failed[i] = 1;
+			return 0;
+		}
+	}
+	jit->native[i](spy);
+	return 1;
+}
+
+/* TRACES
+ *
+ * a trace is one path through a loop, recorded by trace.c.  it starts and
+ * ends at the loop header.  a trace is compiled as a whole:
+ *   - stack values are only tracked symbolically (like regvm.c) and are
+ *     written to the stack only when the trace is left
+ *   - compares are fused into the instruction that reads the flags
+ *   - the most used locals are kept in registers
+ * every branch becomes a guard that leaves the trace if it doesn't go the
+ * recorded way.  leaving the trace writes back the stack and the locals, so
+ * that the interpreter continues with the right ip, sp and bp.  failing
+ * bounds checks also just leave the trace, and the interpreter reports them.
+ *
+ * rbx is sp when the current pass through the loop started.  stack values
+ * are numbered by position, position p lives at rbx + 8p
+ */
+
+#define TRACE_MAX_DEPTH 48
+
+/* free registers, locals that are kept in registers take them from the
+ * front, the rest hold temporary values.  rax, rcx, rdx, r11, xmm0 and
+ * xmm1 are scratch registers of the templates */
+static const uint8_t trace_gprs[] = {RSI, RDI, R8, R9, R10, R15, RBP};
+#define TRACE_NGPRS 7
+#define TRACE_GPR_LOCALS 5
+#define TRACE_NXMMS 14 /* xmm2 ... xmm15 */
+#define TRACE_XMM_LOCALS 10
+
+typedef struct TraceValue TraceValue;
+typedef struct TraceLoc TraceLoc;
+typedef struct TraceSlot TraceSlot;
+typedef struct TraceExit TraceExit;
+typedef struct Tracer Tracer;
+
+struct TraceValue {
+	enum TraceValueKind {
+		TV_MEM, /* in its stack slot */
+		TV_CONST,
+		TV_GPR, /* in a temporary register */
+		TV_XMM,
+		TV_SLOT /* copy of the local at bp + off */
+	} kind;
+	uint8_t reg;
+	int32_t off;
+	spy_int k;
+};
+
+struct TraceLoc {
+	enum TraceLocKind {
+		TL_GPR,
+		TL_XMM,
+		TL_MEM, /* [reg + off] */
+		TL_CONST
+	} kind;
+	uint8_t reg;
+	int32_t off;
+	spy_int k;
+};
+
+/* a local (or argument) that the trace uses */
+struct TraceSlot {
+	int32_t off;
+	enum TraceSlotClass {
+		TS_ANY,
+		TS_INT,
+		TS_FLOAT,
+		TS_NONE /* can't be kept in a register */
+	} cls;
+	uint32_t uses;
+	int reg; /* -1 if it stays in memory */
+};
+
+struct TraceExit {
+	uint32_t label;
+	SpyOp* ip;
+	int depth;
+	uint8_t flags_op; /* compare that the interpreter needs the flags of */
+	TraceValue values[2 * TRACE_MAX_DEPTH + 1];
+};
+
+struct Tracer {
+	Compiler C;
+	SpyState* spy;
+	TraceValue values[2 * TRACE_MAX_DEPTH + 1];
+	int depth;
+	int maxpos;
+	uint8_t gpr_used[16];
+	uint8_t xmm_used[16];
+	TraceSlot* slots;
+	int nslots;
+	int ncached;
+	TraceExit** exits;
+	int nexits;
+	int exits_cap;
+	uint32_t labels_cap;
+	uint32_t nlabels;
+	uint32_t* checks; /* stack checks, patched with maxpos */
+	int nchecks;
+	uint8_t pending; /* compare that wasn't used yet, 0 if none */
+	int failed;
+};
+
+#define VALUE(T, p) (&(T)->values[(p) + TRACE_MAX_DEPTH])
+
+/* conditions of guards, the first six are signed integer compares */
+enum {
+	CND_E, CND_NE, CND_G, CND_GE, CND_L, CND_LE,
+	CND_FE, CND_FNE, CND_FA, CND_FAE, CND_FB, CND_FBE,
+	CND_S, CND_NS
+};
+
+static const uint8_t cnd_cc[] = {
+	CC_E, CC_NE, CC_G, CC_GE, CC_L, CC_LE,
+	CC_E, CC_NE, CC_A, CC_AE, CC_B, CC_BE,
+	CC_S, CC_NS
+};
+
+static const uint8_t cnd_invert[] = {
+	CND_NE, CND_E, CND_LE, CND_L, CND_GE, CND_G,
+	CND_FNE, CND_FE, CND_FBE, CND_FB, CND_FAE, CND_FA,
+	CND_NS, CND_S
+};
+
+static uint32_t
+t_label(Tracer* T) {
+	if (T->nlabels == T->labels_cap) {
+		T->labels_cap *= 2;
+		T->C.label = realloc(T->C.label, T->labels_cap * sizeof(uint32_t));
+	}
+	return T->nlabels++;
+}
+
+static void
+t_check(Tracer* T, int p) {
+	if (p <= -TRACE_MAX_DEPTH || p >= TRACE_MAX_DEPTH) {
+		T->failed = 1;
+	} else if (p > T->maxpos) {
+		T->maxpos = p;
+	}
+}
+
+/* the position of an operand of a register instruction */
+static int
+t_position(Tracer* T, int32_t off) {
+	if (off % 8) {
+		T->failed = 1;
+		return 0;
+	}
+	int p = T->depth + off / 8;
+	t_check(T, p);
+	return T->failed ? 0 : p;
+}
+
+static TraceSlot*
+t_find_slot(Tracer* T, int32_t off) {
+	for (int i = 0; i < T->nslots; i++) {
+		if (T->slots[i].off == off) {
+			return &T->slots[i];
+		}
+	}
+	return NULL;
+}
+
+static TraceLoc
+t_slot_loc(Tracer* T, int32_t off) {
+	TraceSlot* s = t_find_slot(T, off);
+	if (s && s->reg >= 0) {
+		return (TraceLoc){s->cls == TS_FLOAT ? TL_XMM : TL_GPR, s->reg, 0, 0};
+	}
+	return (TraceLoc){TL_MEM, J_BP, off, 0};
+}
+
+static TraceLoc
+t_loc(Tracer* T, int p) {
+	TraceValue* v = VALUE(T, p);
+	switch (v->kind) {
+		case TV_CONST:
+			return (TraceLoc){TL_CONST, 0, 0, v->k};
+		case TV_GPR:
+			return (TraceLoc){TL_GPR, v->reg, 0, 0};
+		case TV_XMM:
+			return (TraceLoc){TL_XMM, v->reg, 0, 0};
+		case TV_SLOT:
+			return t_slot_loc(T, v->off);
+		default:
+			return (TraceLoc){TL_MEM, J_SP, 8 * p, 0};
+	}
+}
+
+static TraceLoc
+t_gpr(uint8_t reg) {
+	return (TraceLoc){TL_GPR, reg, 0, 0};
+}
+
+static TraceLoc
+t_xmm(uint8_t reg) {
+	return (TraceLoc){TL_XMM, reg, 0, 0};
+}
+
+static int
+t_fits32(spy_int k) {
+	return k >= INT32_MIN && k <= INT32_MAX;
+}
+
+/* copies 8 bytes, uses r11 if both are in memory */
+static void
+t_move(Tracer* T, TraceLoc dst, TraceLoc src) {
+	Compiler* C = &T->C;
+	switch (dst.kind) {
+		case TL_GPR:
+			switch (src.kind) {
+				case TL_GPR:
+					if (src.reg != dst.reg) {
+						c_mov(C, dst.reg, src.reg);
+					}
+					break;
+				case TL_XMM:
+					c_sse_reg(C, 0x66, 1, 0x7E, src.reg, dst.reg); /* movq */
+					break;
+				case TL_MEM:
+					c_load(C, dst.reg, src.reg, src.off);
+					break;
+				case TL_CONST:
+					c_movi(C, dst.reg, src.k);
+					break;
+			}
+			break;
+		case TL_XMM:
+			switch (src.kind) {
+				case TL_GPR:
+					c_sse_reg(C, 0x66, 1, 0x6E, dst.reg, src.reg);
+					break;
+				case TL_XMM:
+					if (src.reg != dst.reg) {
+						c_op2_reg(C, 0, 0x28, dst.reg, src.reg); /* movaps */
+					}
+					break;
+				case TL_MEM:
+					c_sse_mem(C, 0xF2, 0x10, dst.reg, src.reg, src.off);
+					break;
+				case TL_CONST:
+					c_movi(C, R11, src.k);
+					c_sse_reg(C, 0x66, 1, 0x6E, dst.reg, R11);
+					break;
+			}
+			break;
+		case TL_MEM:
+			switch (src.kind) {
+				case TL_GPR:
+					c_store(C, dst.reg, dst.off, src.reg);
+					break;
+				case TL_XMM:
+					c_sse_mem(C, 0xF2, 0x11, src.reg, dst.reg, dst.off);
+					break;
+				case TL_MEM:
+					if (src.reg != dst.reg || src.off != dst.off) {
+						c_load(C, R11, src.reg, src.off);
+						c_store(C, dst.reg, dst.off, R11);
+					}
+					break;
+				case TL_CONST:
+					if (t_fits32(src.k)) {
+						c_op_mem(C, 1, 0xC7, 0, dst.reg, dst.off);
+						c_int32(C, (int32_t)src.k);
+					} else {
+						c_movi(C, R11, src.k);
+						c_store(C, dst.reg, dst.off, R11);
+					}
+					break;
+			}
+			break;
+		default:
+			T->failed = 1;
+	}
+}
+
+/* writes the value at p to its stack slot */
+static void
+t_spill(Tracer* T, int p) {
+	TraceValue* v = VALUE(T, p);
+	if (v->kind == TV_MEM) {
+		return;
+	}
+	t_move(T, (TraceLoc){TL_MEM, J_SP, 8 * p, 0}, t_loc(T, p));
+	if (v->kind == TV_GPR) {
+		T->gpr_used[v->reg] = 0;
+	} else if (v->kind == TV_XMM) {
+		T->xmm_used[v->reg] = 0;
+	}
+	v->kind = TV_MEM;
+}
+
+/* forgets the value at p (it was popped) */
+static void
+t_free(Tracer* T, int p) {
+	TraceValue* v = VALUE(T, p);
+	if (v->kind == TV_GPR) {
+		T->gpr_used[v->reg] = 0;
+	} else if (v->kind == TV_XMM) {
+		T->xmm_used[v->reg] = 0;
+	}
+	v->kind = TV_MEM;
+}
+
+/* a free temporary register, spills a value if there is none */
+static uint8_t
+t_alloc(Tracer* T, int xmm) {
+	int first = xmm ? (T->ncached >> 8) : (T->ncached & 0xFF);
+	int count = xmm ? TRACE_NXMMS : TRACE_NGPRS;
+	for (int i = first; i < count; i++) {
+		uint8_t reg = xmm ? 2 + i : trace_gprs[i];
+		uint8_t* used = xmm ? T->xmm_used : T->gpr_used;
+		if (!used[reg]) {
+			used[reg] = 1;
+			return reg;
+		}
+	}
+	for (int p = -TRACE_MAX_DEPTH + 1; p < TRACE_MAX_DEPTH; p++) {
+		TraceValue* v = VALUE(T, p);
+		if (v->kind == (xmm ? TV_XMM : TV_GPR)) {
+			uint8_t reg = v->reg;
+			t_spill(T, p);
+			(xmm ? T->xmm_used : T->gpr_used)[reg] = 1;
+			return reg;
+		}
+	}
+	T->failed = 1;
+	return xmm ? 2 : trace_gprs[TRACE_NGPRS - 1];
+}
+
+/* stores a copy of src at position p */
+static void
+t_put(Tracer* T, int p, TraceLoc src) {
+	TraceValue* v = VALUE(T, p);
+	t_check(T, p);
+	if (T->failed) {
+		return;
+	}
+	if (src.kind == TL_CONST) {
+		t_free(T, p);
+		v->kind = TV_CONST;
+		v->k = src.k;
+		return;
+	}
+	if (src.kind == TL_MEM && src.reg == J_BP) {
+		t_free(T, p);
+		v->kind = TV_SLOT;
+		v->off = src.off;
+		return;
+	}
+	int xmm = src.kind == TL_XMM;
+	if (v->kind != (xmm ? TV_XMM : TV_GPR)) {
+		t_free(T, p);
+		uint8_t reg = t_alloc(T, xmm);
+		v->kind = xmm ? TV_XMM : TV_GPR;
+		v->reg = reg;
+	}
+	t_move(T, xmm ? t_xmm(v->reg) : t_gpr(v->reg), src);
+}
+
+static void
+t_push(Tracer* T, TraceLoc src) {
+	t_put(T, T->depth + 1, src);
+	T->depth++;
+}
+
+/* pushes a copy of the local at off, without reading it yet */
+static void
+t_push_slot(Tracer* T, int32_t off) {
+	t_push(T, (TraceLoc){TL_MEM, J_BP, off, 0});
+}
+
+static void
+t_pop(Tracer* T, int n) {
+	while (n-- > 0) {
+		t_free(T, T->depth--);
+	}
+}
+
+/* moves sp, values that end up above sp are gone */
+static void
+t_adjust(Tracer* T, int32_t delta) {
+	int depth = T->depth + delta / 8;
+	if (delta % 8) {
+		T->failed = 1;
+	}
+	while (T->depth > depth) {
+		t_free(T, T->depth--);
+	}
+	T->depth = depth;
+	t_check(T, depth);
+}
+
+/* values above sp are dead when a new block (see regvm.c) starts */
+static void
+t_drop_above(Tracer* T) {
+	for (int p = T->depth + 1; p < TRACE_MAX_DEPTH; p++) {
+		t_free(T, p);
+	}
+}
+
+/* copies of locals in [lo, hi) have to be saved before the locals are
+ * written.  with lo > hi, every copy is saved */
+static void
+t_clobber(Tracer* T, int32_t lo, int32_t hi) {
+	for (int p = -TRACE_MAX_DEPTH + 1; p < TRACE_MAX_DEPTH; p++) {
+		TraceValue* v = VALUE(T, p);
+		if (v->kind != TV_SLOT) {
+			continue;
+		}
+		if (lo <= hi && (v->off >= hi || v->off + 8 <= lo)) {
+			continue;
+		}
+		t_spill(T, p);
+	}
+}
+
+static void
+t_write_slot(Tracer* T, int32_t off, TraceLoc src) {
+	t_move(T, t_slot_loc(T, off), src);
+}
+
+/* writes every local that is kept in a register back to the frame */
+static void
+t_writeback(Tracer* T) {
+	for (int i = 0; i < T->nslots; i++) {
+		if (T->slots[i].reg >= 0) {
+			t_move(T, (TraceLoc){TL_MEM, J_BP, T->slots[i].off, 0}, t_slot_loc(T, T->slots[i].off));
+		}
+	}
+}
+
+static void
+t_reload(Tracer* T) {
+	for (int i = 0; i < T->nslots; i++) {
+		if (T->slots[i].reg >= 0) {
+			t_move(T, t_slot_loc(T, T->slots[i].off), (TraceLoc){TL_MEM, J_BP, T->slots[i].off, 0});
+		}
+	}
+}
+
+/* writes the values up to position last to the stack */
+static void
+t_materialize(Tracer* T, int last) {
+	for (int p = -TRACE_MAX_DEPTH + 1; p <= last; p++) {
+		t_spill(T, p);
+	}
+}
+
+/* leaves the trace at ip with the current state, returns the label to
+ * jump to.  the exit itself is compiled after the loop */
+static uint32_t
+t_exit(Tracer* T, SpyOp* ip, uint8_t flags_op) {
+	if (T->nexits == T->exits_cap) {
+		T->exits_cap *= 2;
+		T->exits = realloc(T->exits, T->exits_cap * sizeof(TraceExit *));
+	}
+	TraceExit* e = malloc(sizeof(TraceExit));
+	e->label = t_label(T);
+	e->ip = ip;
+	e->depth = T->depth;
+	e->flags_op = flags_op;
+	memcpy(e->values, T->values, sizeof(T->values));
+	T->exits[T->nexits++] = e;
+	return e->label;
+}
+
+static void
+t_compile_exit(Tracer* T, TraceExit* e, uint32_t leave) {
+	Compiler* C = &T->C;
+	T->C.label[e->label] = C->len;
+	memcpy(T->values, e->values, sizeof(T->values));
+	T->depth = e->depth;
+	int32_t top = 8 * e->depth;
+	/* the stack, above sp too, the instruction that failed may need it */
+	t_materialize(T, TRACE_MAX_DEPTH - 1);
+	t_writeback(T);
+	if (e->flags_op) {
+		/* the operands of the compare are still in rax, rcx or xmm0, xmm1 */
+		int noperands = e->flags_op == 0x02 || e->flags_op == 0x48 ? 2 : 1;
+		if (e->flags_op == 0x02 || e->flags_op == 0x03) {
+			c_store(C, J_SP, top + 8, RAX);
+			c_store(C, J_SP, top + 16, RCX);
+		} else {
+			c_sse_mem(C, 0xF2, 0x11, 0, J_SP, top + 8);
+			c_sse_mem(C, 0xF2, 0x11, 1, J_SP, top + 16);
+		}
+		c_lea(C, RAX, J_SP, top + 8 * noperands);
+		c_store(C, J_SPY, offsetof(SpyState, sp), RAX);
+		c_mov(C, RDI, J_SPY);
+		c_movi(C, RSI, e->flags_op);
+		c_call(C, spy_exec_flags);
+	}
+	c_lea(C, RAX, J_SP, top);
+	c_store(C, J_SPY, offsetof(SpyState, sp), RAX);
+	c_store(C, J_SPY, offsetof(SpyState, bp), J_BP);
+	c_movi(C, RAX, (int64_t)(intptr_t)e->ip);
+	c_store(C, J_SPY, offsetof(SpyState, ip), RAX);
+	c_jump(C, CC_JMP, leave);
+}
+
+/* makes sure that positions up to maxpos are on the stack, the offset is
+ * patched when maxpos is known */
+static void
+t_stack_check(Tracer* T, SpyOp* ip) {
+	Compiler* C = &T->C;
+	c_lea(C, RAX, J_SP, 0);
+	T->checks[T->nchecks++] = C->len - 4;
+	c_lea(C, RDX, J_MEM, SIZE_CODE + SIZE_STACK - REG_STACK_RESERVE);
+	c_op_reg(C, 1, 0x39, RDX, RAX); /* cmp rax, rdx */
+	c_jump(C, CC_AE, t_exit(T, ip, 0));
+}
+
+static void
+t_jcc(Tracer* T, int cond, uint32_t label) {
+	Compiler* C = &T->C;
+	if (cond == CND_FE) {
+		uint32_t skip = c_skip(C, CC_P);
+		c_jump(C, CC_E, label);
+		c_land(C, skip);
+	} else if (cond == CND_FNE) {
+		c_jump(C, CC_P, label);
+		c_jump(C, CC_NE, label);
+	} else {
+		c_jump(C, cnd_cc[cond], label);
+	}
+}
+
+/* eax = cond */
+static void
+t_setcc(Tracer* T, int cond) {
+	Compiler* C = &T->C;
+	c_op2_reg(C, 0, cnd_cc[cond] + 0x10, 0, RAX);
+	if (cond == CND_FE || cond == CND_FNE) {
+		c_op2_reg(C, 0, (cond == CND_FE ? CC_NP : CC_P) + 0x10, 0, RDX);
+		c_op_reg(C, 0, cond == CND_FE ? 0x20 : 0x08, RDX, RAX); /* and/or al, dl */
+	}
+	c_op2_reg(C, 0, 0xB6, RAX, RAX);
+}
+
+/* the flags were just computed from cond, guard that the branch at op goes
+ * where it went while recording */
+static void
+t_guard(Tracer* T, int cond, SpyOp* op, SpyOp* target, SpyOp* next, uint8_t flags_op) {
+	if (target == op + 1) {
+		return;
+	}
+	if (next == target) {
+		t_jcc(T, cnd_invert[cond], t_exit(T, op + 1, flags_op));
+	} else {
+		t_jcc(T, cond, t_exit(T, target, flags_op));
+	}
+}
+
+/* emits the compare of the pending flags, returns the condition for the
+ * flag test idx (same order as JE ... JNS), or -1 if there's none */
+static int
+t_flags(Tracer* T, int idx) {
+	Compiler* C = &T->C;
+	switch (T->pending) {
+		case 0x02:
+			if (idx > 5) {
+				return -1;
+			}
+			c_op_reg(C, 1, 0x39, RCX, RAX);
+			return CND_E + idx;
+		case 0x48:
+			if (idx > 5) {
+				return -1;
+			}
+			c_sse_reg(C, 0x66, 0, 0x2E, 0, 1); /* ucomisd xmm0, xmm1 */
+			return CND_FE + idx;
+		case 0x03:
+			if (idx < 6) {
+				return -1;
+			}
+			c_op_reg(C, 1, 0x85, RAX, RAX);
+			return idx == 6 ? CND_E : idx == 7 ? CND_NE : idx == 8 ? CND_S : CND_NS;
+		case 0x49:
+			if (idx != 6 && idx != 7) {
+				return -1;
+			}
+			c_op2_reg(C, 0, 0x57, 1, 1); /* xorps xmm1, xmm1 */
+			c_sse_reg(C, 0x66, 0, 0x2E, 0, 1);
+			return idx == 6 ? CND_FE : CND_FNE;
+	}
+	/* flags from before the trace */
+	c_byte(C, 0x66);
+	c_rex(C, 0, 0, J_SPY);
+	c_byte(C, 0xF7);
+	c_mem(C, 0, J_SPY, offsetof(SpyState, flags));
+	c_byte(C, (uint8_t)flag_jumps[idx].mask);
+	c_byte(C, (uint8_t)(flag_jumps[idx].mask >> 8));
+	return flag_jumps[idx].set ? CND_NE : CND_E;
+}
+
+/* loads the operands of a compare (or test) into rax, rcx or xmm0, xmm1 */
+static void
+t_compare(Tracer* T, uint8_t opcode, TraceLoc a, TraceLoc b) {
+	int xmm = opcode == 0x48 || opcode == 0x49;
+	t_move(T, xmm ? t_xmm(0) : t_gpr(RAX), a);
+	if (opcode == 0x02 || opcode == 0x48) {
+		t_move(T, xmm ? t_xmm(1) : t_gpr(RCX), b);
+	}
+	T->pending = opcode;
+}
+
+static void
+t_bounds(Tracer* T, SpyOp* op) {
+	Compiler* C = &T->C;
+	uint32_t exit = t_exit(T, op, 0);
+	c_op_reg(C, 1, 0x85, RAX, RAX);
+	c_jump(C, CC_LE, exit);
+	c_alui(C, ALU_CMP, RAX, (int32_t)C->spy->memory_size - 7);
+	c_jump(C, CC_GE, exit);
+}
+
+/* rax = memory[rax], a pointer below the heap could point at a local that
+ * is kept in a register */
+static void
+t_deref(Tracer* T, int byte) {
+	Compiler* C = &T->C;
+	if (T->ncached) {
+		c_alui(C, ALU_CMP, RAX, START_MEMORY);
+		uint32_t heap = c_skip(C, CC_AE);
+		t_writeback(T);
+		c_land(C, heap);
+	}
+	c_op_reg(C, 1, 0x01, J_MEM, RAX);
+	if (byte) {
+		c_rex(C, 0, RAX, RAX);
+		c_byte(C, 0x0F);
+		c_byte(C, 0xB6);
+		c_mem(C, RAX, RAX, 0);
+	} else {
+		c_load(C, RAX, RAX, 0);
+	}
+}
+
+/* memory[rax] = rcx */
+static void
+t_save(Tracer* T, int byte) {
+	Compiler* C = &T->C;
+	uint32_t heap = 0;
+	uint32_t done = 0;
+	if (T->ncached) {
+		c_alui(C, ALU_CMP, RAX, START_MEMORY);
+		heap = c_skip(C, CC_AE);
+		t_writeback(T);
+		c_op_reg(C, 1, 0x01, J_MEM, RAX);
+		c_op_mem(C, !byte, byte ? 0x88 : 0x89, RCX, RAX, 0);
+		t_reload(T);
+		done = c_skip(C, CC_JMP);
+		c_land(C, heap);
+	}
+	c_op_reg(C, 1, 0x01, J_MEM, RAX);
+	c_op_mem(C, !byte, byte ? 0x88 : 0x89, RCX, RAX, 0);
+	if (T->ncached) {
+		c_land(C, done);
+	}
+}
+
+/* rax = a (op) b, op is an integer opcode of the stack vm */
+static void
+t_intop(Tracer* T, uint8_t opcode, TraceLoc a, TraceLoc b) {
+	Compiler* C = &T->C;
+	static const uint8_t alu[] = {0x01, 0x29, 0, 0, 0, 0, 0x21, 0x09, 0x31};
+	static const uint8_t ext[] = {0, 5, 0, 0, 0, 0, 4, 1, 6};
+	t_move(T, t_gpr(RAX), a);
+	switch (opcode) {
+		/* IADD, ISUB, AND, OR, XOR */
+		case 0x1A: case 0x1B: case 0x20: case 0x21: case 0x22:
+			if (b.kind == TL_CONST && t_fits32(b.k)) {
+				c_alui(C, ext[opcode - 0x1A], RAX, (int32_t)b.k);
+			} else if (b.kind == TL_GPR) {
+				c_op_reg(C, 1, alu[opcode - 0x1A], b.reg, RAX);
+			} else {
+				t_move(T, t_gpr(RCX), b);
+				c_op_reg(C, 1, alu[opcode - 0x1A], RCX, RAX);
+			}
+			break;
+		/* IMUL */
+		case 0x1C:
+			if (b.kind != TL_GPR) {
+				t_move(T, t_gpr(RCX), b);
+				b = t_gpr(RCX);
+			}
+			c_op2_reg(C, 1, 0xAF, RAX, b.reg);
+			break;
+		/* IDIV, MOD */
+		case 0x1D: case 0x5A:
+			t_move(T, t_gpr(RCX), b);
+			c_idiv(C);
+			if (opcode == 0x5A) {
+				c_mov(C, RAX, RDX);
+			}
+			break;
+		/* SHL, SHR */
+		case 0x1E: case 0x1F:
+			t_move(T, t_gpr(RCX), b);
+			c_shift(C, opcode == 0x1E ? 4 : 7);
+			break;
+	}
+}
+
+/* xmm0 = a (op) b, sse is addsd, subsd, mulsd or divsd */
+static void
+t_floatop(Tracer* T, uint8_t sse, TraceLoc a, TraceLoc b) {
+	Compiler* C = &T->C;
+	t_move(T, t_xmm(0), a);
+	if (b.kind == TL_XMM) {
+		c_sse_reg(C, 0xF2, 0, sse, 0, b.reg);
+	} else if (b.kind == TL_MEM) {
+		c_sse_mem(C, 0xF2, sse, 0, b.reg, b.off);
+	} else {
+		t_move(T, t_xmm(1), b);
+		c_sse_reg(C, 0xF2, 0, sse, 0, 1);
+	}
+}
+
+/* where operand n of a register instruction is */
+static TraceLoc
+t_rloc(Tracer* T, SpyOp* op, int n) {
+	switch (op->base[n]) {
+		case RB_BP:
+			return t_slot_loc(T, op->reg[n]);
+		case RB_K:
+			return (TraceLoc){TL_CONST, 0, 0, T->spy->rconst[op->reg[n] / 8]};
+		default:
+			return t_loc(T, t_position(T, op->reg[n]));
+	}
+}
+
+/* writes the result of a register instruction */
+static void
+t_rwrite(Tracer* T, SpyOp* op, TraceLoc src) {
+	switch (op->base[0]) {
+		case RB_BP:
+			t_clobber(T, op->reg[0], op->reg[0] + 8);
+			t_write_slot(T, op->reg[0], src);
+			break;
+		case RB_SP:
+			t_put(T, t_position(T, op->reg[0]), src);
+			break;
+		default:
+			T->failed = 1;
+	}
+}
+
+/* register opcode -> stack opcode of the same operation */
+static uint8_t
+t_stack_opcode(uint8_t opcode) {
+	static const uint8_t ops[] = {0x1A, 0x1B, 0x1C, 0x1D, 0x5A, 0x1E, 0x1F, 0x20, 0x21, 0x22};
+	return ops[opcode - R_IADD];
+}
+
+/* compiles one instruction of a trace, next is the instruction that was
+ * executed after it.  returns 0 if there is no template for it */
+static int
+t_instruction(Tracer* T, SpyOp* op, SpyOp* next) {
+
+	Compiler* C = &T->C;
+	int d = T->depth;
+	uint8_t pending = T->pending;
+
+	T->pending = 0;
+	if (pending && !((op->opcode >= 0x04 && op->opcode <= 0x0D) || (op->opcode >= 0x3D && op->opcode <= 0x46))) {
+		/* the flags are used later, or by the interpreter */
+		return 0;
+	}
+
+	switch (op->opcode) {
+		/* ICONST, FCONST */
+		case 0x01: case 0x47:
+			t_push(T, (TraceLoc){TL_CONST, 0, 0, op->a.i});
+			return 1;
+		/* ICMP, FCMP */
+		case 0x02: case 0x48:
+			t_compare(T, op->opcode, t_loc(T, d - 1), t_loc(T, d));
+			t_pop(T, 2);
+			return 1;
+		/* ITEST, FTEST */
+		case 0x03: case 0x49:
+			t_compare(T, op->opcode, t_loc(T, d), t_loc(T, d));
+			t_pop(T, 1);
+			return 1;
+		/* JE ... JNS */
+		case 0x04: case 0x05: case 0x06: case 0x07: case 0x08:
+		case 0x09: case 0x0A: case 0x0B: case 0x0C: case 0x0D: {
+			T->pending = pending;
+			int cond = t_flags(T, op->opcode - 0x04);
+			T->pending = 0;
+			if (cond < 0 || !op->a.op) {
+				return 0;
+			}
+			t_guard(T, cond, op, op->a.op, next, pending);
+			return 1;
+		}
+		/* JMP */
+		case 0x0E:
+			return op->a.op == next;
+		/* IADD ... XOR, MOD */
+		case 0x1A: case 0x1B: case 0x1C: case 0x1D: case 0x1E:
+		case 0x1F: case 0x20: case 0x21: case 0x22: case 0x5A:
+			t_intop(T, op->opcode, t_loc(T, d - 1), t_loc(T, d));
+			t_pop(T, 2);
+			t_push(T, t_gpr(RAX));
+			return 1;
+		/* CFCALL, CFCALL_IDX, MALLOC, FREE */
+		case 0x25: case 0x95: case 0x36: case 0x37:
+			if ((op->opcode == 0x25 || op->opcode == 0x95) && !op->a.cfunc) {
+				return 0;
+			}
+			t_materialize(T, d);
+			t_drop_above(T);
+			t_writeback(T);
+			c_lea(C, RAX, J_SP, 8 * d);
+			c_store(C, J_SPY, offsetof(SpyState, sp), RAX);
+			c_store(C, J_SPY, offsetof(SpyState, bp), J_BP);
+			c_mov(C, RDI, J_SPY);
+			if (op->opcode == 0x36 || op->opcode == 0x37) {
+				c_movi(C, RSI, op->opcode);
+				c_call(C, spy_exec_heap);
+			} else {
+				c_movi(C, RSI, (int64_t)(intptr_t)op);
+				c_call(C, jit_cfcall);
+			}
+			/* the c-function decides how many values it pushes, so
+			 * positions start over from the new sp */
+			c_load(C, J_SP, J_SPY, offsetof(SpyState, sp));
+			T->depth = 0;
+			t_reload(T);
+			c_rex(C, 0, 0, J_SPY);
+			c_byte(C, 0x83);
+			c_mem(C, 7, J_SPY, offsetof(SpyState, bail));
+			c_byte(C, 0);
+			c_jump(C, CC_NE, t_exit(T, op + 1, 0));
+			t_stack_check(T, op + 1);
+			return 1;
+		/* IDER, BDER, FDER */
+		case 0x28: case 0x29: case 0x54:
+			t_move(T, t_gpr(RAX), t_loc(T, d));
+			if (op->opcode != 0x54) {
+				t_bounds(T, op);
+			}
+			t_deref(T, op->opcode == 0x29);
+			t_pop(T, 1);
+			t_push(T, t_gpr(RAX));
+			return 1;
+		/* ISAVE, BSAVE, FSAVE */
+		case 0x2A: case 0x2B: case 0x59:
+			t_clobber(T, 1, 0);
+			t_move(T, t_gpr(RAX), t_loc(T, d - 1));
+			t_move(T, t_gpr(RCX), t_loc(T, d));
+			if (op->opcode != 0x59) {
+				t_bounds(T, op);
+			}
+			t_save(T, op->opcode == 0x2B);
+			t_pop(T, 2);
+			return 1;
+		/* RES */
+		case 0x2C:
+			if (op->a.i % 8 || op->a.i < 0 || op->a.i > 8 * 8) {
+				return 0;
+			}
+			for (int i = 0; i < op->a.i / 8; i++) {
+				t_push(T, (TraceLoc){TL_CONST, 0, 0, 0});
+			}
+			return 1;
+		/* IINC */
+		case 0x2D:
+			t_intop(T, 0x1A, t_loc(T, d), (TraceLoc){TL_CONST, 0, 0, op->a.i});
+			t_pop(T, 1);
+			t_push(T, t_gpr(RAX));
+			return 1;
+		/* POP */
+		case 0x2E:
+			t_pop(T, 1);
+			return 1;
+		/* IARG, FARG */
+		case 0x2F: case 0x55:
+			t_push_slot(T, -2*8 - op->a.i*8);
+			return 1;
+		/* ILOCALL, FLOCALL */
+		case 0x39: case 0x50:
+			t_push_slot(T, 8 + op->a.i);
+			return 1;
+		/* BARG, BLOCALL */
+		case 0x30: case 0x3A:
+			t_move(T, t_gpr(RAX), t_slot_loc(T, op->opcode == 0x30 ? -2*8 - op->a.i*8 : 8 + op->a.i));
+			c_op2_reg(C, 0, 0xB6, RAX, RAX);
+			t_push(T, t_gpr(RAX));
+			return 1;
+		/* LEA, LEADUP */
+		case 0x31: case 0x62:
+			c_lea(C, RAX, J_BP, 8 + op->a.i);
+			c_op_reg(C, 1, 0x29, J_MEM, RAX);
+			t_push(T, t_gpr(RAX));
+			if (op->opcode == 0x62) {
+				t_push(T, t_gpr(RAX));
+			}
+			return 1;
+		/* ILOCALS, FLOCALS */
+		case 0x3B: case 0x51:
+			t_clobber(T, 8 + op->a.i, 16 + op->a.i);
+			t_write_slot(T, 8 + op->a.i, t_loc(T, d));
+			t_pop(T, 1);
+			return 1;
+		/* BLOCALS */
+		case 0x3C:
+			t_clobber(T, 8 + op->a.i, 9 + op->a.i);
+			t_move(T, t_gpr(RAX), t_loc(T, d));
+			c_op_mem(C, 0, 0x88, RAX, J_BP, 8 + op->a.i);
+			t_pop(T, 1);
+			return 1;
+		/* PE ... PNS */
+		case 0x3D: case 0x3E: case 0x3F: case 0x40: case 0x41:
+		case 0x42: case 0x43: case 0x44: case 0x45: case 0x46: {
+			T->pending = pending;
+			int cond = t_flags(T, op->opcode - 0x3D);
+			T->pending = 0;
+			if (cond < 0) {
+				return 0;
+			}
+			t_setcc(T, cond);
+			t_push(T, t_gpr(RAX));
+			return 1;
+		}
+		/* FADD, FSUB, FMUL, FDIV */
+		case 0x4A: case 0x4B: case 0x4C: case 0x4D: {
+			static const uint8_t sse[4] = {0x58, 0x5C, 0x59, 0x5E};
+			t_floatop(T, sse[op->opcode - 0x4A], t_loc(T, d - 1), t_loc(T, d));
+			t_pop(T, 2);
+			t_push(T, t_xmm(0));
+			return 1;
+		}
+		/* FINC */
+		case 0x4E:
+			t_floatop(T, 0x58, t_loc(T, d), (TraceLoc){TL_CONST, 0, 0, op->a.i});
+			t_pop(T, 1);
+			t_push(T, t_xmm(0));
+			return 1;
+		/* ITOF */
+		case 0x56:
+			t_move(T, t_gpr(RAX), t_loc(T, d));
+			c_sse_reg(C, 0xF2, 1, 0x2A, 0, RAX);
+			t_pop(T, 1);
+			t_push(T, t_xmm(0));
+			return 1;
+		/* FTOI */
+		case 0x57:
+			t_move(T, t_xmm(0), t_loc(T, d));
+			c_sse_reg(C, 0xF2, 1, 0x2C, RAX, 0);
+			t_pop(T, 1);
+			t_push(T, t_gpr(RAX));
+			return 1;
+		/* DUP, DUP2 */
+		case 0x58: case 0x5F:
+			t_push(T, t_loc(T, op->opcode == 0x58 ? d : d - 1));
+			return 1;
+		/* NOT */
+		case 0x5C:
+			t_move(T, t_gpr(RAX), t_loc(T, d));
+			c_bool(C, RAX, CC_E);
+			t_pop(T, 1);
+			t_push(T, t_gpr(RAX));
+			return 1;
+		/* LAND, LOR */
+		case 0x5D: case 0x5E:
+			t_move(T, t_gpr(RAX), t_loc(T, d - 1));
+			t_move(T, t_gpr(RCX), t_loc(T, d));
+			c_bool(C, RAX, CC_NE);
+			c_bool(C, RCX, CC_NE);
+			c_op_reg(C, 1, op->opcode == 0x5D ? 0x21 : 0x09, RCX, RAX);
+			t_pop(T, 2);
+			t_push(T, t_gpr(RAX));
+			return 1;
+		/* IADDLL */
+		case 0x60:
+			t_intop(T, 0x1A, t_slot_loc(T, 8 + op->a.i), t_slot_loc(T, 8 + op->b.i));
+			t_push(T, t_gpr(RAX));
+			return 1;
+		/* IIDX */
+		case 0x61:
+			t_intop(T, 0x1C, t_loc(T, d), (TraceLoc){TL_CONST, 0, 0, op->a.i});
+			c_mov(C, RDX, RAX);
+			t_intop(T, 0x1A, t_loc(T, d - 1), t_gpr(RDX));
+			t_pop(T, 2);
+			t_push(T, t_gpr(RAX));
+			return 1;
+		/* ISAVEP, FSAVEP, BSAVEP, ISAVED, FSAVED, BSAVED */
+		case 0x63: case 0x64: case 0x65: case 0x66: case 0x67: case 0x68: {
+			int type = (op->opcode - 0x63) % 3;
+			t_clobber(T, 1, 0);
+			t_move(T, t_gpr(RAX), t_loc(T, d - 1));
+			t_move(T, t_gpr(RCX), t_loc(T, d));
+			t_move(T, t_gpr(RDX), t_loc(T, d - 2));
+			if (type != 1) {
+				t_bounds(T, op);
+			}
+			t_save(T, type == 2);
+			c_mov(C, RAX, RDX);
+			if (type != 1) {
+				t_bounds(T, op);
+			}
+			t_pop(T, 3);
+			if (op->opcode >= 0x66) {
+				t_deref(T, type == 2);
+				t_push(T, t_gpr(RAX));
+			}
+			return 1;
+		}
+		/* ICJE ... FCJLE */
+		case 0x69: case 0x6A: case 0x6B: case 0x6C: case 0x6D: case 0x6E:
+		case 0x6F: case 0x70: case 0x71: case 0x72: case 0x73: case 0x74: {
+			uint8_t cmp = op->opcode <= 0x6E ? 0x02 : 0x48;
+			t_compare(T, cmp, t_loc(T, d - 1), t_loc(T, d));
+			t_pop(T, 2);
+			int cond = t_flags(T, (op->opcode - 0x69) % 6);
+			T->pending = 0;
+			if (!op->a.op) {
+				return 0;
+			}
+			t_guard(T, cond, op, op->a.op, next, cmp);
+			return 1;
+		}
+		/* IJE ... FJLE, IPE ... FPLE (no flags are left behind) */
+		case 0x75: case 0x76: case 0x77: case 0x78: case 0x79: case 0x7A:
+		case 0x7B: case 0x7C: case 0x7D: case 0x7E: case 0x7F: case 0x80:
+		case 0x81: case 0x82: case 0x83: case 0x84: case 0x85: case 0x86:
+		case 0x87: case 0x88: case 0x89: case 0x8A: case 0x8B: case 0x8C: {
+			int is_float = (op->opcode - 0x75) % 12 >= 6;
+			if (op->opcode <= 0x80 && !op->a.op) {
+				return 0;
+			}
+			t_compare(T, is_float ? 0x48 : 0x02, t_loc(T, d - 1), t_loc(T, d));
+			t_pop(T, 2);
+			int cond = t_flags(T, (op->opcode - 0x75) % 6);
+			T->pending = 0;
+			if (op->opcode <= 0x80) {
+				t_guard(T, cond, op, op->a.op, next, 0);
+			} else {
+				t_setcc(T, cond);
+				t_push(T, t_gpr(RAX));
+			}
+			return 1;
+		}
+		/* IJZ, IJNZ */
+		case 0x8D: case 0x8E: {
+			if (!op->a.op) {
+				return 0;
+			}
+			t_compare(T, 0x03, t_loc(T, d), t_loc(T, d));
+			t_pop(T, 1);
+			int cond = t_flags(T, op->opcode == 0x8D ? 6 : 7);
+			T->pending = 0;
+			t_guard(T, cond, op, op->a.op, next, 0);
+			return 1;
+		}
+	}
+
+	/* register tier, see regvm.h */
+	switch (op->opcode) {
+		case R_MOV:
+			if (op->base[0] == RB_BP) {
+				t_clobber(T, op->reg[0], op->reg[0] + 8);
+				t_rwrite(T, op, t_rloc(T, op, 1));
+			} else if (op->base[1] == RB_BP) {
+				t_put(T, t_position(T, op->reg[0]), (TraceLoc){TL_MEM, J_BP, op->reg[1], 0});
+			} else {
+				t_rwrite(T, op, t_rloc(T, op, 1));
+			}
+			break;
+		case R_LEA:
+			c_lea(C, RAX, J_BP, (int32_t)op->a.i);
+			c_op_reg(C, 1, 0x29, J_MEM, RAX);
+			t_rwrite(T, op, t_gpr(RAX));
+			break;
+		case R_IADD: case R_ISUB: case R_IMUL: case R_IDIV: case R_MOD:
+		case R_SHL: case R_SHR: case R_AND: case R_OR: case R_XOR:
+			t_intop(T, t_stack_opcode(op->opcode), t_rloc(T, op, 1), t_rloc(T, op, 2));
+			t_rwrite(T, op, t_gpr(RAX));
+			break;
+		case R_FADD: case R_FSUB: case R_FMUL: case R_FDIV: {
+			static const uint8_t sse[4] = {0x58, 0x5C, 0x59, 0x5E};
+			t_floatop(T, sse[op->opcode - R_FADD], t_rloc(T, op, 1), t_rloc(T, op, 2));
+			t_rwrite(T, op, t_xmm(0));
+			break;
+		}
+		case R_ITOF:
+			t_move(T, t_gpr(RAX), t_rloc(T, op, 1));
+			c_sse_reg(C, 0xF2, 1, 0x2A, 0, RAX);
+			t_rwrite(T, op, t_xmm(0));
+			break;
+		case R_FTOI:
+			t_move(T, t_xmm(0), t_rloc(T, op, 1));
+			c_sse_reg(C, 0xF2, 1, 0x2C, RAX, 0);
+			t_rwrite(T, op, t_gpr(RAX));
+			break;
+		case R_IDER: case R_FDER: case R_BDER:
+			t_move(T, t_gpr(RAX), t_rloc(T, op, 1));
+			if (op->opcode != R_FDER) {
+				t_bounds(T, op);
+			}
+			t_deref(T, op->opcode == R_BDER);
+			t_rwrite(T, op, t_gpr(RAX));
+			break;
+		case R_BLOAD:
+			t_move(T, t_gpr(RAX), t_rloc(T, op, 1));
+			c_op2_reg(C, 0, 0xB6, RAX, RAX);
+			t_rwrite(T, op, t_gpr(RAX));
+			break;
+		case R_ISAVE: case R_FSAVE: case R_BSAVE:
+			t_clobber(T, 1, 0);
+			t_move(T, t_gpr(RAX), t_rloc(T, op, 0));
+			t_move(T, t_gpr(RCX), t_rloc(T, op, 1));
+			if (op->opcode != R_FSAVE) {
+				t_bounds(T, op);
+			}
+			t_save(T, op->opcode == R_BSAVE);
+			break;
+		case R_BSTORE:
+			if (op->base[0] != RB_BP) {
+				return 0;
+			}
+			t_move(T, t_gpr(RAX), t_rloc(T, op, 1));
+			t_clobber(T, op->reg[0], op->reg[0] + 1);
+			c_op_mem(C, 0, 0x88, RAX, J_BP, op->reg[0]);
+			break;
+		case R_SP:
+			break;
+		case R_IJE: case R_IJNE: case R_IJGT: case R_IJGE: case R_IJLT: case R_IJLE:
+		case R_FJE: case R_FJNE: case R_FJGT: case R_FJGE: case R_FJLT: case R_FJLE:
+		case R_IJZ: case R_IJNZ: {
+			int cond;
+			if (op->opcode >= R_FJE && op->opcode <= R_FJLE) {
+				t_move(T, t_xmm(0), t_rloc(T, op, 0));
+				t_move(T, t_xmm(1), t_rloc(T, op, 1));
+				c_sse_reg(C, 0x66, 0, 0x2E, 0, 1);
+				cond = CND_FE + op->opcode - R_FJE;
+			} else if (op->opcode >= R_IJZ) {
+				t_move(T, t_gpr(RAX), t_rloc(T, op, 0));
+				c_op_reg(C, 1, 0x85, RAX, RAX);
+				cond = op->opcode == R_IJZ ? CND_E : CND_NE;
+			} else {
+				t_move(T, t_gpr(RAX), t_rloc(T, op, 0));
+				t_move(T, t_gpr(RCX), t_rloc(T, op, 1));
+				c_op_reg(C, 1, 0x39, RCX, RAX);
+				cond = CND_E + op->opcode - R_IJE;
+			}
+			/* sp moves whether or not the branch is taken */
+			t_adjust(T, op->sp_delta);
+			t_guard(T, cond, op, op->b.op, next, 0);
+			return 1;
+		}
+		default:
+			return 0;
+	}
+	t_adjust(T, op->sp_delta);
+	return 1;
+
+}
+
+/* notes how a trace uses the local at off */
+static void
+t_use_slot(Tracer* T, int32_t off, enum TraceSlotClass cls) {
+	TraceSlot* s = t_find_slot(T, off);
+	if (!s) {
+		s = &T->slots[T->nslots++];
+		s->off = off;
+		s->cls = TS_ANY;
+		s->uses = 0;
+		s->reg = -1;
+	}
+	s->uses++;
+	if (cls != TS_ANY && s->cls != cls) {
+		s->cls = s->cls == TS_ANY ? cls : TS_NONE;
+	}
+}
+
+static enum TraceSlotClass
+t_operand_class(uint8_t opcode, int n) {
+	switch (opcode) {
+		case R_MOV:
+			return TS_ANY;
+		case R_FADD: case R_FSUB: case R_FMUL: case R_FDIV:
+		case R_FJE: case R_FJNE: case R_FJGT: case R_FJGE: case R_FJLT: case R_FJLE:
+			return TS_FLOAT;
+		case R_ITOF:
+			return n == 0 ? TS_FLOAT : TS_INT;
+		case R_FTOI:
+			return n == 0 ? TS_INT : TS_FLOAT;
+		case R_FDER:
+			return n == 0 ? TS_FLOAT : TS_INT;
+		case R_FSAVE:
+			return n == 0 ? TS_INT : TS_FLOAT;
+		case R_BSTORE:
+			return n == 0 ? TS_NONE : TS_INT;
+		default:
+			return TS_INT;
+	}
+}
+
+static int
+t_noperands(uint8_t opcode) {
+	if (opcode == R_SP) {
+		return 0;
+	}
+	if (opcode == R_LEA || opcode == R_IJZ || opcode == R_IJNZ) {
+		return 1;
+	}
+	if (opcode >= R_IADD && opcode <= R_FDIV) {
+		return 3;
+	}
+	return 2;
+}
+
+/* decides which locals are kept in registers */
+static void
+t_find_slots(Tracer* T, SpyOp** path, int n) {
+	T->slots = malloc((3 * n + 1) * sizeof(TraceSlot));
+	for (int i = 0; i < n; i++) {
+		SpyOp* op = path[i];
+		switch (op->opcode) {
+			case 0x2F: case 0x30:
+				t_use_slot(T, -2*8 - op->a.i*8, TS_INT);
+				break;
+			case 0x55:
+				t_use_slot(T, -2*8 - op->a.i*8, TS_FLOAT);
+				break;
+			case 0x39: case 0x3A: case 0x3B:
+				t_use_slot(T, 8 + op->a.i, TS_INT);
+				break;
+			case 0x50: case 0x51:
+				t_use_slot(T, 8 + op->a.i, TS_FLOAT);
+				break;
+			case 0x3C:
+				t_use_slot(T, 8 + op->a.i, TS_NONE);
+				break;
+			case 0x60:
+				t_use_slot(T, 8 + op->a.i, TS_INT);
+				t_use_slot(T, 8 + op->b.i, TS_INT);
+				break;
+			default:
+				if (op->opcode < R_MOV || op->opcode > R_IJNZ) {
+					break;
+				}
+				for (int j = 0; j < t_noperands(op->opcode); j++) {
+					if (op->base[j] == RB_BP) {
+						t_use_slot(T, op->reg[j], t_operand_class(op->opcode, j));
+					}
+				}
+		}
+	}
+
+	/* locals that overlap have to stay in memory */
+	for (int i = 0; i < T->nslots; i++) {
+		for (int j = 0; j < T->nslots; j++) {
+			int32_t diff = T->slots[i].off - T->slots[j].off;
+			if (i != j && diff > -8 && diff < 8) {
+				T->slots[i].cls = TS_NONE;
+			}
+		}
+	}
+
+	/* the most used ones get registers */
+	int ngprs = 0;
+	int nxmms = 0;
+	for (;;) {
+		TraceSlot* best = NULL;
+		for (int i = 0; i < T->nslots; i++) {
+			TraceSlot* s = &T->slots[i];
+			if (s->reg >= 0 || s->cls == TS_NONE) {
+				continue;
+			}
+			if (s->cls == TS_FLOAT ? nxmms == TRACE_XMM_LOCALS : ngprs == TRACE_GPR_LOCALS) {
+				continue;
+			}
+			if (!best || s->uses > best->uses) {
+				best = s;
+			}
+		}
+		if (!best) {
+			break;
+		}
+		if (best->cls == TS_FLOAT) {
+			best->reg = 2 + nxmms++;
+		} else {
+			best->cls = TS_INT;
+			best->reg = trace_gprs[ngprs++];
+		}
+	}
+	T->ncached = ngprs | (nxmms << 8);
+}
+
+static void
+t_epilogue(Compiler* C) {
+	c_alui(C, ALU_ADD, RSP, 8);
+	c_pop_reg(C, R15);
+	c_pop_reg(C, R14);
+	c_pop_reg(C, R13);
+	c_pop_reg(C, R12);
+	c_pop_reg(C, RBX);
+	c_pop_reg(C, RBP);
+	c_byte(C, 0xC3);
+}
+
+/* compiles the loop path[0] ... path[n - 1], returns NULL if it can't */
+SpyTraceFn
+spy_jit_trace(SpyState* spy, SpyOp** path, int n) {
+
+	Tracer T;
+	Compiler* C = &T.C;
+	SpyTraceFn native = NULL;
+
+	memset(&T, 0, sizeof(Tracer));
+	T.spy = spy;
+	T.exits_cap = 16;
+	T.exits = malloc(T.exits_cap * sizeof(TraceExit *));
+	T.checks = malloc((n + 1) * sizeof(uint32_t));
+	T.labels_cap = 16;
+	C->spy = spy;
+	C->cap = 4096;
+	C->buf = malloc(C->cap);
+	C->label = malloc(T.labels_cap * sizeof(uint32_t));
+	C->patches_cap = 64;
+	C->patches = malloc(C->patches_cap * sizeof(Patch));
+	uint32_t head = t_label(&T);
+	uint32_t leave = t_label(&T);
+
+	t_find_slots(&T, path, n);
+
+	c_push_reg(C, RBP);
+	c_push_reg(C, RBX);
+	c_push_reg(C, R12);
+	c_push_reg(C, R13);
+	c_push_reg(C, R14);
+	c_push_reg(C, R15);
+	c_alui(C, ALU_SUB, RSP, 8); /* keep rsp 16 byte aligned for calls */
+	c_mov(C, J_SPY, RDI);
+	c_reload(C);
+	c_load(C, J_MEM, J_SPY, offsetof(SpyState, memory));
+	t_reload(&T);
+
+	C->label[head] = C->len;
+	t_stack_check(&T, path[0]);
+	for (int i = 0; i < n && !T.failed; i++) {
+		SpyOp* op = path[i];
+		if (spy->op_map[op->addr] == op) {
+			t_drop_above(&T);
+		}
+		if (!t_instruction(&T, op, i + 1 < n ? path[i + 1] : path[0])) {
+			T.failed = 1;
+		}
+	}
+	if (T.pending) {
+		T.failed = 1;
+	}
+	if (T.failed) {
+		goto done;
+	}
+
+	/* back to the header, which starts a new block */
+	t_drop_above(&T);
+	t_materialize(&T, T.depth);
+	if (T.depth) {
+		c_lea(C, J_SP, J_SP, 8 * T.depth);
+	}
+	c_jump(C, CC_JMP, head);
+
+	for (int i = 0; i < T.nexits; i++) {
+		t_compile_exit(&T, T.exits[i], leave);
+	}
+	C->label[leave] = C->len;
+	t_epilogue(C);
+
+	for (uint32_t i = 0; i < C->npatches; i++) {
+		int32_t rel = (int32_t)(C->label[C->patches[i].target] - (C->patches[i].at + 4));
+		memcpy(&C->buf[C->patches[i].at], &rel, 4);
+	}
+	for (int i = 0; i < T.nchecks; i++) {
+		int32_t top = 8 * T.maxpos;
+		memcpy(&C->buf[T.checks[i]], &top, 4);
+	}
+	native = (SpyTraceFn)jit_install(C->buf, C->len);
+
+done:
+	for (int i = 0; i < T.nexits; i++) {
+		free(T.exits[i]);
+	}
+	free(T.exits);
+	free(T.checks);
+	free(T.slots);
+	free(C->buf);
+	free(C->label);
+	free(C->patches);
+	return native;
+
+}
+
+#else
+
+SpyJit*
+spy_jit_new(SpyState* spy) {
+	return NULL;
+}
+
+void
+spy_jit_free(SpyState* spy, SpyJit* jit) {
+}
+
+void
+spy_jit_release(void* native) {
+}
+
+SpyOp*
+spy_jit_sentinel(SpyJit* jit) {
+	return NULL;
+}
+
+int
+spy_jit_enter(SpyState* spy, SpyOp* target) {
+	return 0;
+}
+
+SpyTraceFn
+spy_jit_trace(SpyState* spy, SpyOp** path, int n) {
+	return NULL;
+}
+
+#endif
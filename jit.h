@@ -0,0 +1,22 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "vm.h"
+
+/* number of calls before a function is compiled */
+#define JIT_THRESHOLD 1
+
+/* internal opcode: return from a nested interpreter to the native code
+ * that called it.  used as the saved ip of frames created by native code */
+#define J_RETURN 0xD0
+
+typedef void (*SpyTraceFn)(SpyState*);
+
+SpyJit* spy_jit_new(SpyState*);
+void spy_jit_free(SpyState*, SpyJit*);
+void spy_jit_release(void*); /* compiled code, also used by trace.c */
+int spy_jit_enter(SpyState*, SpyOp*);
+SpyOp* spy_jit_sentinel(SpyJit*);
+SpyTraceFn spy_jit_trace(SpyState*, SpyOp**, int); /* see trace.c */
+
+#endif
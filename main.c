@@ -3,10 +3,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include "vm.h"
-#include "lex.h"
-#include "parse.h"
-#include "assemble.h"
 #include "generate.h"
+#include "assemble.h"
+#include "batch.h"
+#include "snapshot.h"
+#include "capi_load.h"
 
 int main(int argc, char** argv) {
 	
@@ -15,36 +16,97 @@ int main(int argc, char** argv) {
 		return 1;
 	}
 
+	if (!strcmp(argv[1], "--jobs")) {
+		if (argc != 4 || atoi(argv[2]) <= 0) {
+			printf("expected --jobs <threads> <job list>\n");
+			return 1;
+		}
+		return spy_batch(argv[3], atoi(argv[2]));
+	}
+
+	if (!strcmp(argv[1], "--resume")) {
+		if (argc != 3) {
+			printf("expected --resume <snapshot>\n");
+			return 1;
+		}
+		SpyState* spy = spy_new(NULL);
+		int status = spy_resume(spy, argv[2]);
+		if (!status) {
+			status = spy_run(spy);
+		}
+		spy_free(spy);
+		return status;
+	}
+
 	char* fname = argv[1];
-	char* fasm;
-	char* fbin;
-	char* fspy;
-	size_t slen = strlen(fname);
-	
-	fasm = malloc(slen + 6);
-	strcpy(fasm, fname);
-	strcat(fasm, ".spys");
+	SpyConfig config;
+	config.register_tier = 1;
+	config.jit = 0;
+	config.trace = 0;
+	config.heap_size = 0;
+	config.workers = 0;
+	config.out = NULL;
+	config.in = NULL;
+	const char* snapshot_at = NULL;
 
-	fspy = malloc(slen + 5);
-	strcpy(fspy, fname);
-	strcat(fspy, ".spy");
+	for (int i = 2; i < argc; i++) {
+		if (!strcmp(argv[i], "--stack-vm")) {
+			config.register_tier = 0; /* don't translate to register code */
+		} else if (!strcmp(argv[i], "--jit")) {
+			config.jit = 1; /* compile functions to machine code */
+		} else if (!strcmp(argv[i], "--trace")) {
+			config.trace = 1; /* compile hot loops to machine code */
+		} else if (!strcmp(argv[i], "--heap") && i + 1 < argc) {
+			config.heap_size = strtoll(argv[++i], NULL, 0); /* bytes of heap */
+			if (config.heap_size <= 0 || config.heap_size > MAX_HEAP) {
+				printf("invalid heap size '%s'\n", argv[i]);
+				return 1;
+			}
+		} else if (!strcmp(argv[i], "--workers") && i + 1 < argc) {
+			config.workers = atoi(argv[++i]); /* threads that run spawned tasks */
+			if (config.workers <= 0) {
+				printf("invalid number of workers '%s'\n", argv[i]);
+				return 1;
+			}
+		} else if (!strcmp(argv[i], "--load-ext") && i + 1 < argc) {
+			if (spy_load_ext(argv[++i])) { /* c-functions from a shared object */
+				return 1;
+			}
+		} else if (!strcmp(argv[i], "--snapshot-at") && i + 1 < argc) {
+			snapshot_at = argv[++i]; /* write an image when this label is reached */
+		} else {
+			printf("unknown option '%s'\n", argv[i]);
+			return 1;
+		}
+	}
 
-	fbin = malloc(slen + 6);
-	strcpy(fbin, fname);
-	strcat(fbin, ".spyb");
+	char* fbin = generate_program(fname);
+	SpyState* spy = spy_new(&config);
+	int status = spy_load_file(spy, fbin);
+	if (!status && snapshot_at) {
+		size_t slen = strlen(fname);
+		char* fasm = malloc(slen + 6);
+		char* fimg = malloc(slen + 8);
+		sprintf(fasm, "%s.spys", fname);
+		sprintf(fimg, "%s.spyimg", fname);
+		int64_t addr = label_address(fasm, snapshot_at);
+		if (addr < 0) {
+			printf("unknown label '%s'\n", snapshot_at);
+			status = 1;
+		} else {
+			status = spy_snapshot_at(spy, addr, fimg);
+		}
+		free(fasm);
+		free(fimg);
+	}
+	if (!status) {
+		status = spy_run(spy);
+	}
+	spy_free(spy);
 
-    free(fasm);
-    free(fspy);
-    free(fbin);
-	
-	TokenList* tokens = generate_tokens_from_source(fspy);
-	ParseState* state = generate_syntax_tree(tokens);
-	generate_instructions(state, fasm);
-	generate_bytecode(fasm, fbin);
-	spy_init();
-	spy_execute(fbin);
+	free(fbin);
 
 
-	return 0;
+	return status;
 
 }	
@@ -38,6 +38,12 @@ static void parse_break(ParseState*);
 static void parse_continue(ParseState*);
 static void parse_return(ParseState*);
 static void parse_do_until(ParseState*);
+static void parse_spawn(ParseState*);
+static void parse_sync(ParseState*);
+static void parse_parallel(ParseState*, TreeFor*);
+static void parse_reductions(ParseState*, TreeParallel*);
+static TreeNode* enclosing_parallel(ParseState*, int);
+static void check_parallel_write(ParseState*, const ExpNode*);
 static VarDeclaration* parse_declaration(ParseState*);
 static ExpNode* parse_expression(ParseState*);
 static FunctionDescriptor* parse_function_descriptor(ParseState*);
@@ -49,6 +55,7 @@ static int matches_declaration(ParseState*);
 static int matches_datatype(ParseState*);
 static int matches_array(ParseState*);
 static int matches_pointer(ParseState*);
+static int matches_spawn(ParseState*);
 
 /* exp stack functions */
 static void expstack_push(ExpStack**, ExpNode*);
@@ -151,7 +158,7 @@ is_keyword(const char* word) {
 	static const char* keywords[] = {
 		"if", "while", "for", "do", "struct",
 		"return", "continue", "break", "const",
-		"static", "foreign", NULL
+		"static", "foreign", "spawn", "sync", "parallel", NULL
 	};
 	for (const char** i = keywords; *i; i++) {
 		if (!strcmp(*i, word)) {
@@ -164,7 +171,7 @@ is_keyword(const char* word) {
 static int
 is_typename(const char* word) {
 	static const char* types[] = { 
-		"int", "byte", "float", "file", NULL
+		"int", "byte", "float", "file", "int4", "float4", "float8", NULL
 	};
 	for (const char** i = types; *i; i++) {
 		if (!strcmp(*i, word)) {
@@ -208,6 +215,11 @@ actual_data_size(Datatype* d) {
 			return 8;
 		case DATA_BYTE:
 			return 1;
+		case DATA_INT4:
+		case DATA_FLOAT4:
+			return 32;
+		case DATA_FLOAT8:
+			return 64;
 		case DATA_STRUCT:
 			return d->sdesc->desc->size;		
 	}
@@ -347,7 +359,7 @@ append_node(ParseState* P, TreeNode* node) {
 				break;
 			case NODE_FUNC_IMPL:
 				/* found function? reset offset */
-				P->current_offset = target->funcval->desc->fdesc->arg_space;
+				P->current_offset = 0;
 				P->current_function = target;
 				target->funcval->child = node;
 				break;
@@ -481,7 +493,7 @@ print_tree(TreeNode* tree, int indent) {
 			printf("]\n");
 			break;
 		case NODE_FOR:
-			printf("FOR: [\n");
+			printf(tree->forval->parallel ? "PARALLEL FOR: [\n" : "FOR: [\n");
 			INDENT(indent + 1);
 			printf("INITIALIZER: [\n");
 			print_expression(tree->forval->init, indent + 2);
@@ -553,6 +565,15 @@ print_tree(TreeNode* tree, int indent) {
 			INDENT(indent);
 			printf("]\n");
 			break;
+		case NODE_SPAWN:
+			printf("SPAWN (dest = %s): [\n", tree->spawnval->dest ? tree->spawnval->dest->name : "none");
+			print_expression(tree->spawnval->call, indent + 1);
+			INDENT(indent);
+			printf("]\n");
+			break;
+		case NODE_SYNC:
+			printf("SYNC\n");
+			break;
 	}
 }
 
@@ -633,6 +654,15 @@ print_datatype(Datatype* data, int indent) {
 		case DATA_VOID:
 			printf("void\n");
 			break;
+		case DATA_INT4:
+			printf("int4\n");
+			break;
+		case DATA_FLOAT4:
+			printf("float4\n");
+			break;
+		case DATA_FLOAT8:
+			printf("float8\n");
+			break;
 		case DATA_FPTR:
 			printf("(function pointer)\n");
 			/* print arguments */
@@ -708,6 +738,15 @@ tostring_datatype(const Datatype* data) {
 		case DATA_VOID:
 			strcat(buf, "void");
 			break;
+		case DATA_INT4:
+			strcat(buf, "int4");
+			break;
+		case DATA_FLOAT4:
+			strcat(buf, "float4");
+			break;
+		case DATA_FLOAT8:
+			strcat(buf, "float8");
+			break;
 		case DATA_STRUCT: 
 			strcat(buf, data->sdesc->name);
 			break;
@@ -808,6 +847,9 @@ matches_datatype(ParseState* P) {
 		|| on_ident(P, "float") 
 		|| on_ident(P, "byte") 
 		|| on_ident(P, "file")
+		|| on_ident(P, "int4")
+		|| on_ident(P, "float4")
+		|| on_ident(P, "float8")
 		|| on_ident(P, "struct")
 		|| on_ident(P, "const")
 		|| on_ident(P, "static")
@@ -828,6 +870,27 @@ matches_array(ParseState* P) {
 	return 0;
 }
 
+/* spawn f(...); or x = spawn f(...); */
+static int
+matches_spawn(ParseState* P) {
+	TokenList* start = P->tokens;
+	if (on_ident(P, "spawn")) {
+		MATCH_TRUE();
+	}
+	if (!is_ident(P)) {
+		MATCH_FALSE();
+	}
+	safe_eat(P);
+	if (!on_op(P, '=')) {
+		MATCH_FALSE();
+	}
+	safe_eat(P);
+	if (!on_ident(P, "spawn")) {
+		MATCH_FALSE();
+	}
+	MATCH_TRUE();
+}
+
 static TreeStruct*
 find_struct(ParseState* P, const char* name) {
 	for (TreeStructList* i = P->defined_structs; i; i = i->next) {
@@ -979,6 +1042,19 @@ check_function_arg(ParseState* P, Datatype* expected, const Datatype* check, int
 	}
 }
 
+/* helper function for typecheck_expression, args is the (typechecked)
+ * comma tree of a call */
+static int
+has_vector_argument(const ExpNode* args) {
+	if (!args) {
+		return 0;
+	}
+	if (IS_BIN_OP(args, ',')) {
+		return has_vector_argument(args->bval->left) || has_vector_argument(args->bval->right);
+	}
+	return args->eval && IS_VECTOR(args->eval);
+}
+
 static const Datatype*
 typecheck_expression(ParseState* P, ExpNode* exp) {
 	if (!exp) return NULL;
@@ -1020,9 +1096,13 @@ typecheck_expression(ParseState* P, ExpNode* exp) {
 					d->ptr_dim--;
 					return exp->eval = d;
 				}
-				case '!':
-					typecheck_expression(P, exp->uval->operand);
+				case '!': {
+					const Datatype* operand = typecheck_expression(P, exp->uval->operand);
+					if (IS_VECTOR(operand)) {
+						parse_die(P, "operator (!) can't be used on a vector");
+					}
 					return exp->eval = P->type_int;
+				}
 				default:
 					return exp->eval = typecheck_expression(P, exp->uval->operand);
 			}
@@ -1041,6 +1121,14 @@ typecheck_expression(ParseState* P, ExpNode* exp) {
 			if (!IS_INT(index)) {
 				parse_die(P, "an array index must evaluate to an integer");
 			}
+			if (IS_VECTOR(array)) {
+				/* a lane */
+				Datatype* ret = malloc(sizeof(Datatype));
+				memcpy(ret, array, sizeof(Datatype));
+				ret->type = VECTOR_FLOAT(array) ? DATA_FLOAT : DATA_INT;
+				ret->size = 8;
+				return exp->eval = ret;
+			}
 			if (!IS_ARRAY(array) && !IS_PTR(array)) {
 				parse_die(P, "attempt to index a non-pointer/array");
 			}
@@ -1060,12 +1148,76 @@ typecheck_expression(ParseState* P, ExpNode* exp) {
 		case EXP_CAST: {
 			const Datatype* from = typecheck_expression(P, exp->cxval->operand);
 			const Datatype* to = exp->cxval->d;
+			if (IS_VECTOR(from) && !types_match_strict(from, to)) {
+				parse_die(P, "a vector can't be cast to (%s)", tostring_datatype(to));
+			}
+			/* an int or a float is broadcast to every lane */
+			if (IS_VECTOR(to) && !IS_VECTOR(from) && !IS_INT(from) && !IS_FLOAT(from) && !IS_BYTE(from)) {
+				parse_die(P, "(%s) can't be cast to a vector", tostring_datatype(from));
+			}
 			
 			return exp->eval = to;
 		}
 		case EXP_CALL: {
 			FunctionDescriptor* desc = NULL;
 			const char* func_id = NULL;
+
+			/* hsum(v), hmin(v) and hmax(v) fold the lanes of a vector, unless
+			 * there is a function or a variable with that name */
+			ExpNode* fptr = exp->cval->fptr;
+			if (fptr->type == EXP_IDENTIFIER && !find_function(P, fptr->sval) && !find_local(P, fptr->sval)) {
+				char reduce = (
+					!strcmp(fptr->sval, "hsum") ? '+' :
+					!strcmp(fptr->sval, "hmin") ? '<' :
+					!strcmp(fptr->sval, "hmax") ? '>' : 0
+				);
+				if (reduce) {
+					ExpNode* arg = exp->cval->arguments;
+					if (!arg || IS_BIN_OP(arg, ',') || !IS_VECTOR(typecheck_expression(P, arg))) {
+						parse_die(P, "'%s' takes one vector", fptr->sval);
+					}
+					exp->cval->reduce = reduce;
+					exp->cval->nargs = 1;
+					return exp->eval = VECTOR_FLOAT(arg->eval) ? P->type_float : P->type_int;
+				}
+			}
+
+			/* memcpy(dest, src, n), memmove(dest, src, n), memset(dest, value, n)
+			 * and memcmp(a, b, n) are single instructions, the same way */
+			if (fptr->type == EXP_IDENTIFIER && !find_function(P, fptr->sval) && !find_local(P, fptr->sval)) {
+				static const char* blocks[] = {"memcpy", "memmove", "memset", "memcmp"};
+				for (int i = 0; i < 4; i++) {
+					if (strcmp(fptr->sval, blocks[i])) {
+						continue;
+					}
+					ExpNode* args = exp->cval->arguments;
+					typecheck_expression(P, args);
+					if (!args || !IS_BIN_OP(args, ',') || !IS_BIN_OP(args->bval->left, ',')
+						|| IS_BIN_OP(args->bval->left->bval->left, ',')) {
+						parse_die(P, "'%s' takes three arguments", blocks[i]);
+					}
+					const Datatype* a = args->bval->left->bval->left->eval;
+					const Datatype* b = args->bval->left->bval->right->eval;
+					const Datatype* n = args->bval->right->eval;
+					int is_set = !strcmp(blocks[i], "memset");
+					if (!IS_PTR(a) || (is_set ? !IS_INT(b) && !IS_BYTE(b) : !IS_PTR(b))) {
+						parse_die(P,
+							"'%s' expected (%s, int), got (%s, %s, %s)",
+							blocks[i],
+							is_set ? "pointer, int" : "pointer, pointer",
+							tostring_datatype(a),
+							tostring_datatype(b),
+							tostring_datatype(n)
+						);
+					}
+					if (!IS_INT(n) && !IS_BYTE(n)) {
+						parse_die(P, "the size passed to '%s' must be an int, got (%s)", blocks[i], tostring_datatype(n));
+					}
+					exp->cval->block = blocks[i];
+					exp->cval->nargs = 3;
+					return exp->eval = is_set || strcmp(blocks[i], "memcmp") ? P->type_void : P->type_int;
+				}
+			}
 					
 			/* we need to find the proper function descriptor and assign it
 			 * to desc... we can use the computed flag to determine if the
@@ -1096,6 +1248,9 @@ typecheck_expression(ParseState* P, ExpNode* exp) {
 			FuncCall* call = exp->cval;
 			ExpNode* arg = call->arguments;
 			typecheck_expression(P, arg);
+			if (has_vector_argument(arg)) {
+				parse_die(P, "a vector can't be passed to a function, pass a pointer to it");
+			}
 			if (arg) call->nargs++;
 			while (arg && arg->type == EXP_BINARY && arg->bval->optype == ',') {
 				call->nargs++;
@@ -1232,6 +1387,23 @@ typecheck_expression(ParseState* P, ExpNode* exp) {
 					if (IS_BIN_OP(exp, ',')) {
 						return exp->eval = NULL;
 					}
+					if (IS_VECTOR(left) || IS_VECTOR(right)) {
+						/* element-wise, on two vectors of the same type (a scalar is
+						 * broadcast with a cast, e.g. #float4 x) */
+						char op = exp->bval->optype;
+						if (op != '+' && op != '-' && op != '*' && op != '/' && op != '='
+							&& op != SPEC_INC_BY && op != SPEC_DEC_BY && op != SPEC_MUL_BY && op != SPEC_DIV_BY) {
+							parse_die(P, "operator (%s) can't be used on vectors", tokcode_tostring(op));
+						}
+						if (!types_match_strict(left, right)) {
+							parse_die(P, 
+								"attempt to use operator (%s) on mismatched types '%s' and '%s'", 
+								tokcode_tostring(op),
+								tostring_datatype(left),
+								tostring_datatype(right)
+							);
+						}
+					}
 					if (IS_BIN_OP(exp, SPEC_LOG_AND) || IS_BIN_OP(exp, SPEC_LOG_OR)) {
 						return exp->eval = P->type_int;
 					}
@@ -1257,6 +1429,7 @@ typecheck_expression(ParseState* P, ExpNode* exp) {
 						if (IS_LITERAL(lhs)) {
 							parse_die(P, "the left side of an assignment operator must not be a literal");
 						}
+						check_parallel_write(P, lhs);
 					}
 					if ((lf && ri) || (rf && li)) {
 						/* if one is a float and one is an int, an implicit cast will be done
@@ -1378,6 +1551,8 @@ parse_expression(ParseState* P) {
 			push->cval->fptr = NULL;
 			push->cval->arguments = parse_expression(P);
 			push->cval->nargs = 0;
+			push->cval->reduce = 0;
+			push->cval->block = NULL;
 			if (push->cval->arguments) {
 				push->cval->arguments->parent = push;
 			}
@@ -1520,6 +1695,10 @@ parse_expression(ParseState* P) {
 			expstack_push(&tree, at);
 		} else if (at->type == EXP_INDEX) {
 			at->aval->array = expstack_pop(&tree);
+			if (!at->aval->array) {
+				parse_die(P, malformed);
+			}
+			at->aval->array->parent = at;
 			expstack_push(&tree, at);
 		} else if (at->type == EXP_UNARY) {
 			ExpNode* operand = expstack_pop(&tree);
@@ -1668,11 +1847,30 @@ jump_out(ParseState* P) {
 	} while (P->current_block->type != NODE_BLOCK);
 }
 
+/* the parallel for that the next statement is in, NULL if there is none.
+ * if loop, only the innermost loop counts */
+static TreeNode*
+enclosing_parallel(ParseState* P, int loop) {
+	for (TreeNode* i = P->append_target ? P->append_target : P->current_block; i; i = i->parent) {
+		if (i->type == NODE_FOR && i->forval->parallel) {
+			return i;
+		}
+		if (i->type == NODE_FUNC_IMPL || (loop && (i->type == NODE_WHILE || i->type == NODE_DO || i->type == NODE_FOR))) {
+			return NULL;
+		}
+	}
+	return NULL;
+}
+
 static void
 parse_break(ParseState* P) {
 	TreeNode* node = empty_node(P);
 	node->type = NODE_BREAK;
 
+	if (enclosing_parallel(P, 1)) {
+		parse_die(P, "can't break out of a parallel for");
+	}
+
 	safe_eat(P);
 	eat_op(P, ';');
 
@@ -1698,6 +1896,10 @@ parse_return(ParseState* P) {
 
 	TreeFunction* func = P->current_function->funcval;
 	Datatype* expected_type = func->desc->fdesc->return_type;
+
+	if (enclosing_parallel(P, 0)) {
+		parse_die(P, "can't return from a parallel for");
+	}
 	
 	safe_eat(P);
 	mark_operator(P, SPEC_NULL, ';');
@@ -1718,6 +1920,93 @@ parse_return(ParseState* P) {
 	
 }
 
+/* the local that the spawns of the current function are counted in, it's
+ * reserved by the first spawn or sync (RES zeroes it) */
+static int
+sync_offset(ParseState* P) {
+	if (!P->current_function || P->current_block == P->root_node) {
+		parse_die(P, "'spawn' and 'sync' can only be used in a function");
+	}
+	if (enclosing_parallel(P, 0)) {
+		/* a chunk's frame is gone once its iterations are done */
+		parse_die(P, "'spawn' and 'sync' can't be used in a parallel for");
+	}
+	FunctionDescriptor* fdesc = P->current_function->funcval->desc->fdesc;
+	if (fdesc->sync_offset < 0) {
+		/* other threads count it down, keep it aligned in the frame */
+		unsigned int pad = (8 - P->current_offset % 8) % 8;
+		fdesc->sync_offset = P->current_offset + pad;
+		P->current_offset += pad + 8;
+		fdesc->stack_space += pad + 8;
+	}
+	return fdesc->sync_offset;
+}
+
+/* starts on SPAWN, or on the variable that gets the result */
+static void
+parse_spawn(ParseState* P) {
+	TreeNode* node = empty_node(P);
+	node->type = NODE_SPAWN;
+	node->spawnval = malloc(sizeof(TreeSpawn));
+	node->spawnval->dest = NULL;
+
+	sync_offset(P);
+	if (!on_ident(P, "spawn")) {
+		const char* name = P->tokens->token->sval;
+		VarDeclaration* dest = find_local(P, name);
+		if (!dest) {
+			parse_die(P, "undeclared identifier '%s'", name);
+		}
+		for (VarDeclarationList* i = P->root_node->blockval->locals; i; i = i->next) {
+			if (i->decl == dest) {
+				parse_die(P, "the result of 'spawn' can't be assigned to the global '%s'", name);
+			}
+		}
+		/* the task writes 8 bytes */
+		const Datatype* d = dest->datatype;
+		if (IS_ARRAY(d) || (!IS_PTR(d) && d->type != DATA_INT && d->type != DATA_FLOAT && d->type != DATA_FILE)) {
+			parse_die(P, "the result of 'spawn' can't be assigned to '%s' (%s)", name, tostring_datatype(d));
+		}
+		node->spawnval->dest = dest;
+		safe_eat(P); /* skip identifier */
+		safe_eat(P); /* skip = */
+	}
+	safe_eat(P); /* skip SPAWN */
+
+	mark_operator(P, SPEC_NULL, ';');
+	ExpNode* call = parse_expression(P);
+	if (!call || call->type != EXP_CALL || call->cval->computed || is_foreign(P, call->cval->fptr->sval)) {
+		parse_die(P, "'spawn' must be followed by a call to a function");
+	}
+	typecheck_expression(P, call);
+	fold_expression(P, call);
+	VarDeclaration* dest = node->spawnval->dest;
+	if (dest && (IS_VOID(call->eval) || !types_match(dest->datatype, call->eval))) {
+		parse_die(P,
+			"can't assign (%s) to '%s' of type (%s)",
+			tostring_datatype(call->eval),
+			dest->name,
+			tostring_datatype(dest->datatype)
+		);
+	}
+	node->spawnval->call = call;
+	safe_eat(P); /* skip ; */
+
+	append_node(P, node);
+}
+
+static void
+parse_sync(ParseState* P) {
+	TreeNode* node = empty_node(P);
+	node->type = NODE_SYNC;
+
+	sync_offset(P);
+	safe_eat(P); /* skip SYNC */
+	eat_op(P, ';');
+
+	append_node(P, node);
+}
+
 static void
 parse_block(ParseState* P) {
 	TreeNode* node = empty_node(P);
@@ -1745,6 +2034,7 @@ parse_function_descriptor(ParseState* P) {
 	fdesc->arg_space = 0;
 	fdesc->is_global = 0;
 	fdesc->vararg = 0;
+	fdesc->sync_offset = -1;
 
 	safe_eat(P); /* skip ( */
 
@@ -1758,9 +2048,13 @@ parse_function_descriptor(ParseState* P) {
 			break;
 		}
 		VarDeclaration* arg = parse_declaration(P);
-		arg->offset = fdesc->arg_space;
+		if (IS_VECTOR(arg->datatype)) {
+			/* a vector is more than one value, pass a pointer to it */
+			parse_die(P, "argument '%s' can't be a vector (%s)", arg->name, tostring_datatype(arg->datatype));
+		}
 		fdesc->nargs++;
-		fdesc->arg_space += arg->datatype->size;
+		/* every argument is pushed as one value */
+		fdesc->arg_space += 8;
 		if (IS_STRUCT(arg->datatype) && !IS_PTR(arg->datatype)) {
 			/* if a struct is an argument it is implicitly a pointer */
 			arg->datatype->size = 8;
@@ -1787,9 +2081,20 @@ parse_function_descriptor(ParseState* P) {
 		}
 	}
 
+	/* the arguments are read where the caller pushed them, the last one
+	 * is right below the saved ip and bp (see CALL) */
+	int offset = -16 - (int)fdesc->arg_space;
+	for (VarDeclarationList* i = fdesc->arguments; i; i = i->next) {
+		i->decl->offset = offset;
+		offset += 8;
+	}
+
 	eat_op(P, ')');
 	eat_op(P, SPEC_ARROW);
 	fdesc->return_type = parse_datatype(P);
+	if (IS_VECTOR(fdesc->return_type)) {
+		parse_die(P, "a function can't return a vector (%s)", tostring_datatype(fdesc->return_type));
+	}
 
 	return fdesc;
 	
@@ -1888,6 +2193,15 @@ parse_datatype(ParseState* P) {
 		} else if (on_ident(P, "file")) {
 			data->type = DATA_FILE;
 			data->size = 8;
+		} else if (on_ident(P, "int4")) {
+			data->type = DATA_INT4;
+			data->size = 32;
+		} else if (on_ident(P, "float4")) {
+			data->type = DATA_FLOAT4;
+			data->size = 32;
+		} else if (on_ident(P, "float8")) {
+			data->type = DATA_FLOAT8;
+			data->size = 64;
 		} else {
 			if (!is_ident(P)) {
 				parse_die(P, "expected typename");
@@ -2103,8 +2417,16 @@ parse_for(ParseState* P) {
 	node->type = NODE_FOR;
 	node->forval = malloc(sizeof(TreeFor));
 	node->forval->child = NULL;
-	
-	/* starts on token FOR */
+	node->forval->parallel = NULL;
+
+	/* starts on token FOR, or PARALLEL */
+	int parallel = on_ident(P, "parallel");
+	if (parallel) {
+		safe_eat(P); /* skip PARALLEL */
+		if (!on_ident(P, "for")) {
+			parse_die(P, "expected 'for' after 'parallel'");
+		}
+	}
 	safe_eat(P); /* skip FOR */
 	eat_op(P, '(');
 	mark_operator(P, SPEC_NULL, ';');
@@ -2122,10 +2444,182 @@ parse_for(ParseState* P) {
 	typecheck_expression(P, node->forval->statement);
 	fold_expression(P, node->forval->statement);
 	safe_eat(P); /* skip ) */
+	if (parallel) {
+		parse_parallel(P, node->forval);
+	}
 
 	append_node(P, node);
 }
 
+/* the loop variable of a parallel for, a local int */
+static VarDeclaration*
+parallel_variable(ParseState* P, const ExpNode* exp) {
+	if (!exp || exp->type != EXP_IDENTIFIER) {
+		return NULL;
+	}
+	VarDeclaration* var = find_local(P, exp->sval);
+	for (VarDeclarationList* i = P->root_node->blockval->locals; i; i = i->next) {
+		if (i->decl == var) {
+			return NULL;
+		}
+	}
+	return var && IS_INT(var->datatype) ? var : NULL;
+}
+
+/* every chunk of a parallel for has its own copy of the frame, so what the
+ * body writes to a local that's declared outside of it would be lost once
+ * the chunk is done.  only the loop variable and the reductions can be
+ * written (s.x, a[i] and v[i] write to the frame too if s, a and v are
+ * locals, writes through a pointer don't) */
+static void
+check_parallel_write(ParseState* P, const ExpNode* lhs) {
+	TreeNode* loop = enclosing_parallel(P, 0);
+	if (!loop) {
+		return;
+	}
+	for (;;) {
+		if (IS_BIN_OP(lhs, '.')) {
+			lhs = lhs->bval->left;
+		} else if (lhs->type == EXP_INDEX && lhs->aval->array->eval
+			&& (IS_ARRAY(lhs->aval->array->eval) || IS_VECTOR(lhs->aval->array->eval))) {
+			lhs = lhs->aval->array;
+		} else {
+			break;
+		}
+	}
+	if (lhs->type != EXP_IDENTIFIER) {
+		return;
+	}
+	VarDeclaration* var = find_local(P, lhs->sval);
+	TreeParallel* par = loop->forval->parallel;
+	if (!var || var == par->var) {
+		return;
+	}
+	for (TreeReduction* i = par->reductions; i; i = i->next) {
+		if (i->var == var) {
+			return;
+		}
+	}
+	/* globals aren't in the frame */
+	for (VarDeclarationList* i = P->root_node->blockval->locals; i; i = i->next) {
+		if (i->decl == var) {
+			return;
+		}
+	}
+	/* nor are the locals of the body */
+	for (TreeNode* i = P->current_block; i && i != loop; i = i->parent) {
+		if (i->type != NODE_BLOCK) {
+			continue;
+		}
+		for (VarDeclarationList* j = i->blockval->locals; j; j = j->next) {
+			if (j->decl == var) {
+				return;
+			}
+		}
+	}
+	parse_die(P, "'%s' can't be written in a parallel for, only the loop variable and reduce() variables can", var->name);
+}
+
+/* a parallel for only counts up by a constant, so that the vm can split
+ * its iterations into chunks before it runs any of them (see task.c):
+ *   parallel for (i = start; i < end; i += step) reduce(+: x, max: y)
+ * the body can't write to the other locals of the function (see
+ * check_parallel_write), and the loop variable has its final value after
+ * the loop */
+static void
+parse_parallel(ParseState* P, TreeFor* loop) {
+	if (!P->current_function || P->current_block == P->root_node) {
+		parse_die(P, "'parallel for' can only be used in a function");
+	}
+	if (enclosing_parallel(P, 0)) {
+		parse_die(P, "a parallel for can't be nested in another one");
+	}
+	TreeParallel* par = malloc(sizeof(TreeParallel));
+	par->reductions = NULL;
+
+	ExpNode* init = loop->init;
+	ExpNode* cond = loop->condition;
+	ExpNode* step = loop->statement;
+	if (!init || !IS_BIN_OP(init, '=') || !(par->var = parallel_variable(P, init->bval->left))) {
+		parse_die(P, "a parallel for has to start with 'var = start', var has to be a local int");
+	}
+	if (!cond || !(IS_BIN_OP(cond, '<') || IS_BIN_OP(cond, SPEC_LE))
+		|| parallel_variable(P, cond->bval->left) != par->var || !IS_INT(cond->bval->right->eval)) {
+		parse_die(P, "the condition of a parallel for has to be '%s < end' or '%s <= end'", par->var->name, par->var->name);
+	}
+	if (!step || !IS_BIN_OP(step, SPEC_INC_BY) || parallel_variable(P, step->bval->left) != par->var
+		|| step->bval->right->type != EXP_INTEGER || step->bval->right->ival <= 0) {
+		parse_die(P, "a parallel for has to count up with '%s += constant'", par->var->name);
+	}
+	par->start = init->bval->right;
+	par->end = cond->bval->right;
+	par->inclusive = IS_BIN_OP(cond, SPEC_LE);
+	par->step = step->bval->right->ival;
+
+	/* the vm's locals, aligned like the counter of sync_offset */
+	unsigned int pad = (8 - P->current_offset % 8) % 8;
+	FunctionDescriptor* fdesc = P->current_function->funcval->desc->fdesc;
+	par->offset = P->current_offset + pad;
+	P->current_offset += pad + 32;
+	fdesc->stack_space += pad + 32;
+
+	if (on_ident(P, "reduce")) {
+		parse_reductions(P, par);
+	}
+	loop->parallel = par;
+}
+
+/* starts on REDUCE, reduce(+: x, min: y, max: z) */
+static void
+parse_reductions(ParseState* P, TreeParallel* par) {
+	safe_eat(P); /* skip REDUCE */
+	eat_op(P, '(');
+	for (;;) {
+		TreeReduction* red = malloc(sizeof(TreeReduction));
+		if (on_op(P, '+')) {
+			red->optype = '+';
+		} else if (on_ident(P, "min")) {
+			red->optype = '<';
+		} else if (on_ident(P, "max")) {
+			red->optype = '>';
+		} else {
+			parse_die(P, "expected '+', 'min' or 'max' in reduce");
+		}
+		safe_eat(P);
+		eat_op(P, ':');
+		if (!is_ident(P)) {
+			parse_die(P, "expected a variable in reduce");
+		}
+		const char* name = P->tokens->token->sval;
+		VarDeclaration* var = find_local(P, name);
+		if (!var) {
+			parse_die(P, "undeclared identifier '%s'", name);
+		}
+		for (VarDeclarationList* i = P->root_node->blockval->locals; i; i = i->next) {
+			if (i->decl == var) {
+				parse_die(P, "the global '%s' can't be reduced", name);
+			}
+		}
+		if ((!IS_INT(var->datatype) && !IS_FLOAT(var->datatype)) || var == par->var) {
+			parse_die(P, "'%s' can't be reduced, only a local int or float can", name);
+		}
+		for (TreeReduction* i = par->reductions; i; i = i->next) {
+			if (i->var == var) {
+				parse_die(P, "'%s' is reduced twice", name);
+			}
+		}
+		red->var = var;
+		red->next = par->reductions;
+		par->reductions = red;
+		safe_eat(P); /* skip identifier */
+		if (!on_op(P, ',')) {
+			break;
+		}
+		safe_eat(P); /* skip , */
+	}
+	eat_op(P, ')');
+}
+
 ParseState*
 generate_syntax_tree(TokenList* tokens) {
 
@@ -2176,6 +2670,14 @@ generate_syntax_tree(TokenList* tokens) {
 	P->type_string->array_dim = 0;
 	P->type_string->size = 1;
 
+	P->type_void = malloc(sizeof(Datatype));
+	P->type_void->type = DATA_VOID;
+	P->type_void->ptr_dim = 0;
+	P->type_void->array_dim = 0;
+	P->type_void->sdesc = NULL;
+	P->type_void->mods = 0;
+	P->type_void->size = 0;
+
 	while (P->tokens && P->tokens->token) {
 		if (on_ident(P, "if")) {
 			parse_if(P);
@@ -2201,7 +2703,7 @@ generate_syntax_tree(TokenList* tokens) {
 			parse_else(P);
 		} else if (on_ident(P, "while")) {
 			parse_while(P);
-		} else if (on_ident(P, "for")) {
+		} else if (on_ident(P, "for") || on_ident(P, "parallel")) {
 			parse_for(P);
 		} else if (on_ident(P, "struct")) {
 			parse_struct(P);
@@ -2211,10 +2713,24 @@ generate_syntax_tree(TokenList* tokens) {
 			parse_continue(P);
 		} else if (on_ident(P, "return")) {
 			parse_return(P);
+		} else if (matches_spawn(P)) {
+			parse_spawn(P);
+		} else if (on_ident(P, "sync")) {
+			parse_sync(P);
 		} else if (matches_declaration(P)) {
 			VarDeclaration* var = parse_declaration(P);
 			var->offset = P->current_offset;
 			unsigned int inc = var->datatype->size;
+			if ((var->datatype->type == DATA_INT4 || var->datatype->type == DATA_FLOAT4
+				|| var->datatype->type == DATA_FLOAT8) && var->datatype->ptr_dim == 0) {
+				/* the lanes of a vector are aligned like stack slots */
+				unsigned int pad = (8 - P->current_offset % 8) % 8;
+				var->offset += pad;
+				P->current_offset += pad;
+				if (P->current_function) {
+					P->current_function->funcval->desc->fdesc->stack_space += pad;
+				}
+			}
 			if (var->datatype->type == DATA_STRUCT && var->datatype->ptr_dim == 0) {
 				/* an extra 8 bytes are needed for a struct because it is implemented
 				 * on the stack with a pointer */
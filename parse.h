@@ -18,6 +18,10 @@
 #define IS_STRING(d) (d->ptr_dim == 1 && d->array_dim == 0 && d->type == DATA_BYTE)
 #define IS_VOID(d) (d->ptr_dim == 0 && d->ptr_dim == 0 && d->type == DATA_VOID)
 #define IS_FUNC_PTR(d) (d->ptr_dim == 0 && d->array_dim == 0 && d->type == DATA_FPTR)
+#define IS_VECTOR(d) (d->ptr_dim == 0 && d->array_dim == 0 && \
+					  (d->type == DATA_INT4 || d->type == DATA_FLOAT4 || d->type == DATA_FLOAT8))
+#define VECTOR_LANES(d) ((d)->type == DATA_FLOAT8 ? 8 : 4)
+#define VECTOR_FLOAT(d) ((d)->type != DATA_INT4) /* lanes are floats, otherwise ints */
 #define IS_CT_CONSTANT(e) (e->type == EXP_INTEGER)
 #define IS_BIN_OP(e, op) ((e)->type == EXP_BINARY && (e)->bval->optype == (op))
 
@@ -55,9 +59,12 @@ typedef struct TreeNode TreeNode;
 typedef struct TreeIf TreeIf;
 typedef struct TreeWhile TreeWhile;
 typedef struct TreeFor TreeFor;
+typedef struct TreeParallel TreeParallel;
+typedef struct TreeReduction TreeReduction;
 typedef struct TreeBreak TreeBreak;
 typedef struct TreeContinue TreeContinue;
 typedef struct TreeReturn TreeReturn;
+typedef struct TreeSpawn TreeSpawn;
 typedef struct TreeBlock TreeBlock;
 typedef struct TreeStatement TreeStatement;
 typedef struct TreeWhile TreeWhile;
@@ -107,7 +114,9 @@ enum TreeNodeType {
 	NODE_RETURN = 8,
 	NODE_BLOCK = 9,
 	NODE_DO = 10,
-	NODE_UNTIL = 11
+	NODE_UNTIL = 11,
+	NODE_SPAWN = 12,
+	NODE_SYNC = 13
 };
 
 struct BinaryOp {
@@ -135,6 +144,8 @@ struct FuncCall {
 	ExpNode* arguments;
 	int nargs;
 	int computed; /* computed if fptr is not just an identifier */
+	char reduce; /* hsum ('+'), hmin ('<') or hmax ('>') of a vector, 0 if it's a real call */
+	const char* block; /* memcpy, memmove, memset or memcmp, NULL if it's a real call */
 	ExpNode* fptr; /* should evaluate to the address of a function */
 };
 
@@ -167,6 +178,7 @@ struct FunctionDescriptor {
 	int vararg;
 	VarDeclarationList* arguments;
 	Datatype* return_type;
+	int sync_offset; /* local that counts the unfinished spawns, -1 if the function doesn't spawn */
 };
 
 struct StructDescriptor {
@@ -183,7 +195,10 @@ struct Datatype {
 		DATA_FPTR = 4,
 		DATA_STRUCT = 5,
 		DATA_VOID = 6,
-		DATA_FILE = 7
+		DATA_FILE = 7,
+		DATA_INT4 = 8,
+		DATA_FLOAT4 = 9,
+		DATA_FLOAT8 = 10
 	} type;
 
 	/* 0 if not array */
@@ -204,6 +219,8 @@ struct Datatype {
 	 *   int:	size=8
 	 *   float: size=8
 	 *   byte:  size=1
+	 *   int4, float4: size=32
+	 *   float8: size=64
 	 *   ptr to any type: size=8
 	 *
 	 */ 
@@ -228,9 +245,10 @@ struct VarDeclaration {
 	Datatype* datatype;
 	
 	/* offset is a bit special... for function arguments and locals, it is the
-	 * offset from the base pointer.  for struct field, it is the offset from
+	 * offset from the base pointer (negative for arguments, they're below
+	 * the saved ip and bp).  for struct field, it is the offset from
 	 * the start structs */
-	unsigned int offset;
+	int offset;
 
 };
 
@@ -265,12 +283,37 @@ struct TreeFor {
 	ExpNode* condition;
 	ExpNode* statement;
 	TreeNode* child;
+	TreeParallel* parallel; /* NULL unless it's a parallel for */
+};
+
+/* parallel for (var = start; var < end; var += step) reduce(...) */
+struct TreeParallel {
+	VarDeclaration* var;
+	ExpNode* start;
+	ExpNode* end;
+	int inclusive; /* var <= end */
+	spy_int step;
+	int offset; /* 32 bytes of locals for the vm, see task.c */
+	TreeReduction* reductions;
+};
+
+/* reduce(+: x, min: y, max: z) */
+struct TreeReduction {
+	VarDeclaration* var;
+	char optype; /* '+', '<' (min) or '>' (max) */
+	TreeReduction* next;
 };
 
 struct TreeStatement {
 	ExpNode* exp;
 };
 
+/* spawn f(args); or x = spawn f(args); */
+struct TreeSpawn {
+	ExpNode* call;
+	VarDeclaration* dest; /* NULL if the result isn't used */
+};
+
 struct TreeFunction {
 	Datatype* desc;
 	char* name;
@@ -304,6 +347,7 @@ struct TreeNode {
 		TreeStatement* stateval;
 		TreeFunction* funcval;
 		TreeDoUntil* doval;
+		TreeSpawn* spawnval;
 	};
 };
 
@@ -320,6 +364,7 @@ struct ParseState {
 	Datatype* type_byte;
 	Datatype* type_string;
 	Datatype* type_file;
+	Datatype* type_void;
 	TreeStructList* defined_structs;
 	unsigned int current_offset;
 	int next_is_else;
@@ -0,0 +1,628 @@
+#include <stdlib.h>
+#include <string.h>
+#include "regvm.h"
+
+/*
+ * REGISTER TIER
+ *
+ * translates the decoded stack code into three-address register code
+ * when the program is loaded.  the "registers" are the slots that are
+ * already there: locals and arguments (relative to bp) and the operand
+ * stack (relative to sp).  every basic block is run symbolically, so a
+ * push of a local or a constant doesn't copy anything, the instruction
+ * that consumes the value reads it from wherever it already is, e.g.
+ *
+ *   leadup 96; flocall 96; flocall 96; fmul; flocall 80; fadd; fsavep
+ *
+ * becomes
+ *
+ *   R_FMUL [sp+8] = [bp+104], [bp+104]
+ *   R_FADD [bp+104] = [sp+8], [bp+88]
+ *
+ * at the end of every block, and before every instruction that isn't
+ * translated (calls, returns, ...), values that only exist symbolically
+ * are written to their stack slots and sp is moved to wherever the stack
+ * code would have left it.  so frames, the calling convention and the
+ * c-api see exactly the same stack as with the stack interpreter.
+ *
+ * assumptions:
+ *   - bp relative loads (ilocall, lea, ...) address locals and arguments,
+ *     never the part of the operand stack that is above sp
+ *   - compares only set flags for the branch right after them.  if the
+ *     program ever reads flags in a different block than the one that
+ *     set them, compares are left alone
+ */
+
+typedef struct RegOperand RegOperand;
+typedef struct RegValue RegValue;
+typedef struct Translator Translator;
+
+struct RegOperand {
+	uint8_t base;
+	int32_t off;
+};
+
+struct RegValue {
+	enum RegValueKind {
+		VAL_SLOT = 0, /* in its own stack slot */
+		VAL_REF, /* the 8 bytes at ref */
+		VAL_CONST, /* k */
+		VAL_ADDR /* address of bp + ref.off */
+	} kind;
+	RegOperand ref;
+	spy_int k;
+};
+
+struct Translator {
+	const SpyOp* old;
+	uint32_t nold;
+	uint8_t* leader; /* old instruction starts a basic block */
+	uint32_t* map; /* old index -> new index (leaders only) */
+	SpyOp* ops;
+	uint32_t nops;
+	uint32_t ops_cap;
+	uint32_t* fixups; /* new branches that still point at old instructions */
+	uint32_t nfixups;
+	uint32_t fixups_cap;
+	spy_int* consts;
+	uint32_t nconsts;
+	uint32_t consts_cap;
+	uint32_t addr; /* code offset of the instruction being translated */
+	uint32_t block_start; /* first new instruction since sp was synced */
+	int flags_local;
+	int top; /* position of the top of the stack, relative to sp */
+	RegValue values[2 * REG_MAX_TEMPS + 1];
+};
+
+/* value at stack position p, p = 0 is the top when sp was synced */
+#define VALUE(T, p) (&(T)->values[(p) + REG_MAX_TEMPS])
+
+static SpyOp*
+t_emit(Translator* T, uint8_t opcode) {
+	if (T->nops == T->ops_cap) {
+		T->ops_cap *= 2;
+		T->ops = realloc(T->ops, T->ops_cap * sizeof(SpyOp));
+	}
+	SpyOp* op = &T->ops[T->nops++];
+	memset(op, 0, sizeof(SpyOp));
+	op->addr = T->addr;
+	op->opcode = opcode;
+	return op;
+}
+
+static void
+t_fixup(Translator* T) {
+	if (T->nfixups == T->fixups_cap) {
+		T->fixups_cap *= 2;
+		T->fixups = realloc(T->fixups, T->fixups_cap * sizeof(uint32_t));
+	}
+	T->fixups[T->nfixups++] = T->nops - 1;
+}
+
+static void
+t_set(SpyOp* op, int n, RegOperand r) {
+	op->base[n] = r.base;
+	op->reg[n] = r.off;
+}
+
+static RegOperand
+t_slot(int p) {
+	return (RegOperand){RB_SP, 8 * p};
+}
+
+static RegOperand
+t_const(Translator* T, spy_int k) {
+	if (T->nconsts == T->consts_cap) {
+		T->consts_cap *= 2;
+		T->consts = realloc(T->consts, T->consts_cap * sizeof(spy_int));
+	}
+	T->consts[T->nconsts] = k;
+	return (RegOperand){RB_K, 8 * T->nconsts++};
+}
+
+/* frame offsets that are safe to use without a bounds check (the stack
+ * is at least SIZE_CODE away from both ends of memory) */
+static int
+t_frame_offset(spy_int off) {
+	return off > -SIZE_CODE && off < SIZE_CODE;
+}
+
+/* where the value at position p can be read from */
+static RegOperand
+t_operand(Translator* T, int p) {
+	RegValue* v = VALUE(T, p);
+	switch (v->kind) {
+		case VAL_SLOT:
+			break;
+		case VAL_REF:
+			return v->ref;
+		case VAL_CONST:
+			return t_const(T, v->k);
+		case VAL_ADDR: {
+			SpyOp* op = t_emit(T, R_LEA);
+			op->a.i = v->ref.off;
+			t_set(op, 0, t_slot(p));
+			v->kind = VAL_SLOT;
+			break;
+		}
+	}
+	return t_slot(p);
+}
+
+static RegOperand
+t_pop(Translator* T) {
+	RegOperand r = t_operand(T, T->top);
+	T->top--;
+	return r;
+}
+
+static void
+t_push(Translator* T, enum RegValueKind kind, RegOperand ref, spy_int k) {
+	RegValue* v = VALUE(T, ++T->top);
+	v->kind = kind;
+	v->ref = ref;
+	v->k = k;
+}
+
+/* pushes the result of a register instruction, returns the instruction */
+static SpyOp*
+t_push_result(Translator* T, uint8_t opcode) {
+	SpyOp* op = t_emit(T, opcode);
+	t_push(T, VAL_SLOT, t_slot(T->top + 1), 0);
+	t_set(op, 0, t_slot(T->top));
+	return op;
+}
+
+static void
+t_reset(Translator* T) {
+	T->top = 0;
+	T->block_start = T->nops;
+	for (int p = -REG_MAX_TEMPS; p <= REG_MAX_TEMPS; p++) {
+		VALUE(T, p)->kind = VAL_SLOT;
+	}
+}
+
+/* writes every value that isn't in its stack slot yet */
+static void
+t_materialize(Translator* T) {
+	for (int p = -REG_MAX_TEMPS; p <= T->top; p++) {
+		RegValue* v = VALUE(T, p);
+		if (v->kind == VAL_SLOT) {
+			continue;
+		}
+		RegOperand src = t_operand(T, p);
+		if (v->kind != VAL_SLOT) {
+			SpyOp* op = t_emit(T, R_MOV);
+			t_set(op, 0, t_slot(p));
+			t_set(op, 1, src);
+			v->kind = VAL_SLOT;
+		}
+	}
+}
+
+/* values that are copies of frame memory that is about to be written
+ * have to be saved first.  with lo > hi, every frame reference is saved */
+static void
+t_spill(Translator* T, int32_t lo, int32_t hi) {
+	for (int p = -REG_MAX_TEMPS; p <= T->top; p++) {
+		RegValue* v = VALUE(T, p);
+		if (v->kind != VAL_REF || v->ref.base != RB_BP) {
+			continue;
+		}
+		if (lo <= hi && (v->ref.off >= hi || v->ref.off + 8 <= lo)) {
+			continue;
+		}
+		SpyOp* op = t_emit(T, R_MOV);
+		t_set(op, 0, t_slot(p));
+		t_set(op, 1, v->ref);
+		v->kind = VAL_SLOT;
+	}
+}
+
+/* moves sp, if possible by letting the last instruction of the block do it */
+static void
+t_adjust(Translator* T, int32_t delta) {
+	if (delta == 0) {
+		return;
+	}
+	if (T->nops > T->block_start) {
+		SpyOp* last = &T->ops[T->nops - 1];
+		if (last->opcode >= R_MOV && last->opcode <= R_SP) {
+			last->sp_delta += delta;
+			return;
+		}
+	}
+	t_emit(T, R_SP)->sp_delta = delta;
+}
+
+/* brings the real stack up to date with the symbolic one */
+static void
+t_flush(Translator* T) {
+	t_materialize(T);
+	t_adjust(T, 8 * T->top);
+	t_reset(T);
+}
+
+static void
+t_binary(Translator* T, uint8_t opcode) {
+	RegOperand b = t_pop(T);
+	RegOperand a = t_pop(T);
+	SpyOp* op = t_push_result(T, opcode);
+	t_set(op, 1, a);
+	t_set(op, 2, b);
+}
+
+static void
+t_unary(Translator* T, uint8_t opcode) {
+	RegOperand a = t_pop(T);
+	SpyOp* op = t_push_result(T, opcode);
+	t_set(op, 1, a);
+}
+
+/* [addr] -> [value] */
+static void
+t_load(Translator* T, uint8_t opcode) {
+	RegValue* v = VALUE(T, T->top);
+	if (v->kind != VAL_ADDR) {
+		t_unary(T, opcode);
+	} else if (opcode == R_BDER) {
+		RegOperand src = v->ref;
+		T->top--;
+		t_set(t_push_result(T, R_BLOAD), 1, src);
+	} else {
+		v->kind = VAL_REF;
+	}
+}
+
+/* [(addr), value] -> [], stores the value to bp + off */
+static void
+t_store_frame(Translator* T, int32_t off, uint8_t opcode, int naddr) {
+	int p = T->top;
+	t_spill(T, off, off + (opcode == R_BSTORE ? 1 : 8));
+	if (opcode == R_MOV && VALUE(T, p)->kind == VAL_SLOT && T->nops > T->block_start) {
+		SpyOp* last = &T->ops[T->nops - 1];
+		if (last->opcode >= R_MOV && last->opcode <= R_BLOAD && last->sp_delta == 0
+			&& last->base[0] == RB_SP && last->reg[0] == 8 * p) {
+			/* the value was just computed, compute it into the local instead */
+			last->base[0] = RB_BP;
+			last->reg[0] = off;
+			T->top -= 1 + naddr;
+			return;
+		}
+	}
+	RegOperand value = t_pop(T);
+	T->top -= naddr;
+	SpyOp* op = t_emit(T, opcode);
+	t_set(op, 0, (RegOperand){RB_BP, off});
+	t_set(op, 1, value);
+}
+
+/* [addr, value] -> [] */
+static void
+t_store(Translator* T, uint8_t opcode) {
+	RegValue* addr = VALUE(T, T->top - 1);
+	if (addr->kind == VAL_ADDR) {
+		t_store_frame(T, addr->ref.off, opcode == R_BSAVE ? R_BSTORE : R_MOV, 1);
+		return;
+	}
+	RegOperand value = t_pop(T);
+	RegOperand at = t_pop(T);
+	/* could write anywhere, including locals */
+	t_spill(T, 1, 0);
+	SpyOp* op = t_emit(T, opcode);
+	t_set(op, 0, at);
+	t_set(op, 1, value);
+}
+
+/* compare (or test) and branch, ends the block */
+static void
+t_branch(Translator* T, uint8_t opcode, SpyOp* target, int noperands) {
+	RegOperand b = {0, 0};
+	if (noperands == 2) {
+		b = t_pop(T);
+	}
+	RegOperand a = t_pop(T);
+	t_materialize(T);
+	SpyOp* op = t_emit(T, opcode);
+	t_set(op, 0, a);
+	t_set(op, 1, b);
+	op->b.op = target;
+	op->sp_delta = 8 * T->top;
+	t_fixup(T);
+	t_reset(T);
+}
+
+static void
+t_copy(Translator* T, const SpyOp* old) {
+	SpyOp* op = t_emit(T, old->opcode);
+	op->a = old->a;
+	op->b = old->b;
+	if ((spy_is_branch(old->opcode) || old->opcode == 0x0E) && old->a.op) {
+		t_fixup(T);
+	}
+}
+
+/* translates the instruction(s) at old[i], returns how many instructions
+ * were translated (0 if it has to be executed by the stack interpreter) */
+static int
+t_translate(Translator* T, uint32_t i) {
+	const SpyOp* op = &T->old[i];
+	const SpyOp* next = (i + 1 < T->nold && !T->leader[i + 1]) ? &T->old[i + 1] : NULL;
+	switch (op->opcode) {
+		/* ICONST, FCONST */
+		case 0x01: case 0x47:
+			t_push(T, VAL_CONST, t_slot(0), op->a.i);
+			return 1;
+		/* ILOCALL, FLOCALL */
+		case 0x39: case 0x50:
+			if (!t_frame_offset(8 + op->a.i)) {
+				return 0;
+			}
+			t_push(T, VAL_REF, (RegOperand){RB_BP, 8 + op->a.i}, 0);
+			return 1;
+		/* BLOCALL */
+		case 0x3A:
+			if (!t_frame_offset(8 + op->a.i)) {
+				return 0;
+			}
+			t_set(t_push_result(T, R_BLOAD), 1, (RegOperand){RB_BP, 8 + op->a.i});
+			return 1;
+		/* LEA */
+		case 0x31:
+			if (!t_frame_offset(8 + op->a.i)) {
+				return 0;
+			}
+			t_push(T, VAL_ADDR, (RegOperand){RB_BP, 8 + op->a.i}, 0);
+			return 1;
+		/* DUP */
+		case 0x58: {
+			RegValue v = *VALUE(T, T->top);
+			if (v.kind == VAL_SLOT) {
+				v.kind = VAL_REF;
+				v.ref = t_slot(T->top);
+			}
+			t_push(T, v.kind, v.ref, v.k);
+			return 1;
+		}
+		/* POP */
+		case 0x2E:
+			T->top--;
+			return 1;
+		/* ILOCALS, FLOCALS, BLOCALS */
+		case 0x3B: case 0x51: case 0x3C:
+			if (!t_frame_offset(8 + op->a.i)) {
+				return 0;
+			}
+			t_store_frame(T, 8 + op->a.i, op->opcode == 0x3C ? R_BSTORE : R_MOV, 0);
+			return 1;
+		case 0x1A: t_binary(T, R_IADD); return 1;
+		case 0x1B: t_binary(T, R_ISUB); return 1;
+		case 0x1C: t_binary(T, R_IMUL); return 1;
+		case 0x1D: t_binary(T, R_IDIV); return 1;
+		case 0x1E: t_binary(T, R_SHL); return 1;
+		case 0x1F: t_binary(T, R_SHR); return 1;
+		case 0x20: t_binary(T, R_AND); return 1;
+		case 0x21: t_binary(T, R_OR); return 1;
+		case 0x22: t_binary(T, R_XOR); return 1;
+		case 0x5A: t_binary(T, R_MOD); return 1;
+		case 0x4A: t_binary(T, R_FADD); return 1;
+		case 0x4B: t_binary(T, R_FSUB); return 1;
+		case 0x4C: t_binary(T, R_FMUL); return 1;
+		case 0x4D: t_binary(T, R_FDIV); return 1;
+		case 0x56: t_unary(T, R_ITOF); return 1;
+		case 0x57: t_unary(T, R_FTOI); return 1;
+		/* IINC, FINC */
+		case 0x2D: case 0x4E:
+			t_push(T, VAL_CONST, t_slot(0), op->a.i);
+			t_binary(T, op->opcode == 0x2D ? R_IADD : R_FADD);
+			return 1;
+		case 0x28: t_load(T, R_IDER); return 1;
+		case 0x54: t_load(T, R_FDER); return 1;
+		case 0x29: t_load(T, R_BDER); return 1;
+		case 0x2A: t_store(T, R_ISAVE); return 1;
+		case 0x59: t_store(T, R_FSAVE); return 1;
+		case 0x2B: t_store(T, R_BSAVE); return 1;
+		/* IADDLL */
+		case 0x60:
+			if (!t_frame_offset(8 + op->a.i) || !t_frame_offset(8 + op->b.i)) {
+				return 0;
+			}
+			t_push(T, VAL_REF, (RegOperand){RB_BP, 8 + op->a.i}, 0);
+			t_push(T, VAL_REF, (RegOperand){RB_BP, 8 + op->b.i}, 0);
+			t_binary(T, R_IADD);
+			return 1;
+		/* IIDX */
+		case 0x61:
+			t_push(T, VAL_CONST, t_slot(0), op->a.i);
+			t_binary(T, R_IMUL);
+			t_binary(T, R_IADD);
+			return 1;
+		/* LEADUP */
+		case 0x62:
+			if (!t_frame_offset(8 + op->a.i)) {
+				return 0;
+			}
+			t_push(T, VAL_ADDR, (RegOperand){RB_BP, 8 + op->a.i}, 0);
+			t_push(T, VAL_ADDR, (RegOperand){RB_BP, 8 + op->a.i}, 0);
+			return 1;
+		/* ISAVEP, FSAVEP, BSAVEP, ISAVED, FSAVED, BSAVED */
+		case 0x63: case 0x64: case 0x65:
+		case 0x66: case 0x67: case 0x68: {
+			static const uint8_t save[3] = {R_ISAVE, R_FSAVE, R_BSAVE};
+			static const uint8_t der[3] = {R_IDER, R_FDER, R_BDER};
+			int type = (op->opcode - 0x63) % 3;
+			t_store(T, save[type]);
+			t_load(T, der[type]);
+			if (op->opcode <= 0x65) {
+				T->top--;
+			}
+			return 1;
+		}
+		/* ICMP, FCMP followed by JE ... JLE */
+		case 0x02: case 0x48:
+			if (!T->flags_local || !next || next->opcode < 0x04 || next->opcode > 0x09 || !next->a.op) {
+				return 0;
+			}
+			t_branch(T, (op->opcode == 0x02 ? R_IJE : R_FJE) + next->opcode - 0x04, next->a.op, 2);
+			return 2;
+		/* ITEST followed by JZ, JNZ */
+		case 0x03:
+			if (!T->flags_local || !next || (next->opcode != 0x0A && next->opcode != 0x0B) || !next->a.op) {
+				return 0;
+			}
+			t_branch(T, next->opcode == 0x0A ? R_IJZ : R_IJNZ, next->a.op, 1);
+			return 2;
+		/* ICJE ... FCJLE */
+		case 0x69: case 0x6A: case 0x6B: case 0x6C: case 0x6D: case 0x6E:
+		case 0x6F: case 0x70: case 0x71: case 0x72: case 0x73: case 0x74:
+			if (!T->flags_local || !op->a.op) {
+				return 0;
+			}
+			t_branch(T, R_IJE + op->opcode - 0x69, op->a.op, 2);
+			return 1;
+		/* IJE ... FJLE, these don't set the flags */
+		case 0x75: case 0x76: case 0x77: case 0x78: case 0x79: case 0x7A:
+		case 0x7B: case 0x7C: case 0x7D: case 0x7E: case 0x7F: case 0x80:
+			if (!op->a.op) {
+				return 0;
+			}
+			t_branch(T, R_IJE + op->opcode - 0x75, op->a.op, 2);
+			return 1;
+		/* IJZ, IJNZ */
+		case 0x8D: case 0x8E:
+			if (!op->a.op) {
+				return 0;
+			}
+			t_branch(T, op->opcode == 0x8D ? R_IJZ : R_IJNZ, op->a.op, 1);
+			return 1;
+	}
+	return 0;
+}
+
+/* instructions that end a basic block */
+static int
+t_ends_block(uint8_t opcode) {
+	if (spy_is_branch(opcode)) {
+		return 1;
+	}
+	switch (opcode) {
+		case 0x00: case 0x0E: case 0x0F: case 0x10: case 0x11: case 0x12:
+		case 0x13: case 0x14: case 0x15: case 0x16: case 0x17: case 0x18:
+		case 0x19: case 0x24: case 0x26: case 0x27: case 0x38: case 0x4F:
+		case 0x92:
+			return 1;
+	}
+	return 0;
+}
+
+/* a block starts at every possible jump target, return address, and
+ * after every instruction that ends a block */
+static void
+t_find_leaders(Translator* T, SpyState* spy) {
+	T->leader[spy->op_map[0] - T->old] = 1;
+	for (uint32_t i = 0; i < T->nold; i++) {
+		const SpyOp* op = &T->old[i];
+		if ((spy_is_branch(op->opcode) || op->opcode == 0x0E) && op->a.op) {
+			T->leader[op->a.op - T->old] = 1;
+		}
+		if (op->opcode == 0x01 && op->a.i >= 0 && op->a.i < spy->code_size && spy->op_map[op->a.i]) {
+			T->leader[spy->op_map[op->a.i] - T->old] = 1;
+		}
+		if (t_ends_block(op->opcode) && i + 1 < T->nold) {
+			T->leader[i + 1] = 1;
+		}
+	}
+}
+
+/* true if flags are never read in a different block than where they
+ * were set (i.e. compares can be merged with the branch after them) */
+static int
+t_flags_local(Translator* T) {
+	int set = 0;
+	for (uint32_t i = 0; i < T->nold; i++) {
+		if (T->leader[i]) {
+			set = 0;
+		}
+		uint8_t opcode = T->old[i].opcode;
+		if (opcode == 0x02 || opcode == 0x03 || opcode == 0x48 || opcode == 0x49
+			|| (opcode >= 0x69 && opcode <= 0x74)) {
+			set = 1;
+		} else if ((opcode >= 0x04 && opcode <= 0x0D) || (opcode >= 0x0F && opcode <= 0x18)
+			|| (opcode >= 0x3D && opcode <= 0x46)) {
+			if (!set) {
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+void
+spy_translate_registers(SpyState* spy) {
+
+	Translator T;
+	T.old = spy->ops;
+	T.nold = spy->nops;
+	T.leader = calloc(T.nold, sizeof(uint8_t));
+	T.map = calloc(T.nold, sizeof(uint32_t));
+	T.nops = 0;
+	T.ops_cap = T.nold + 16;
+	T.ops = malloc(T.ops_cap * sizeof(SpyOp));
+	T.nfixups = 0;
+	T.fixups_cap = 64;
+	T.fixups = malloc(T.fixups_cap * sizeof(uint32_t));
+	T.nconsts = 0;
+	T.consts_cap = 64;
+	T.consts = malloc(T.consts_cap * sizeof(spy_int));
+	T.addr = 0;
+
+	t_find_leaders(&T, spy);
+	T.flags_local = t_flags_local(&T);
+	t_reset(&T);
+
+	for (uint32_t i = 0; i < T.nold; i++) {
+		if (T.leader[i]) {
+			t_flush(&T);
+			T.map[i] = T.nops;
+		}
+		T.addr = T.old[i].addr;
+		/* make sure that the instruction has enough room to push and pop */
+		if (T.top > REG_MAX_TEMPS - 2 || T.top < 3 - REG_MAX_TEMPS) {
+			t_flush(&T);
+		}
+		int n = t_translate(&T, i);
+		if (n == 0) {
+			t_flush(&T);
+			t_copy(&T, &T.old[i]);
+			n = 1;
+		}
+		i += n - 1;
+	}
+	/* the decoder always ends code with an instruction that doesn't fall
+	 * through, so there is never anything left to flush here */
+
+	/* point branches at the translated blocks */
+	for (uint32_t i = 0; i < T.nfixups; i++) {
+		SpyOp* op = &T.ops[T.fixups[i]];
+		SpyOperand* target = op->opcode >= R_IJE && op->opcode <= R_IJNZ ? &op->b : &op->a;
+		target->op = &T.ops[T.map[target->op - T.old]];
+	}
+
+	/* computed jumps can only go to the start of a block */
+	for (spy_int i = 0; i < spy->code_size; i++) {
+		if (spy->op_map[i]) {
+			uint32_t index = spy->op_map[i] - T.old;
+			spy->op_map[i] = T.leader[index] ? &T.ops[T.map[index]] : NULL;
+		}
+	}
+
+	free(spy->ops);
+	spy->ops = T.ops;
+	spy->nops = T.nops;
+	spy->rconst = T.consts;
+
+	free(T.leader);
+	free(T.map);
+	free(T.fixups);
+
+}
@@ -0,0 +1,75 @@
+#ifndef REGVM_H
+#define REGVM_H
+
+#include "vm.h"
+
+/* register tier... see regvm.c
+ *
+ * register instructions have up to three operands (reg[0..2]).  every
+ * operand is a byte offset from one of these bases, so locals, arguments,
+ * stack temporaries and constants can all be used directly */
+#define RB_BP	0 /* frame (locals and arguments) */
+#define RB_SP	1 /* operand stack, relative to sp when the block was entered */
+#define RB_K	2 /* constant pool (spy->rconst) */
+
+/* maximum number of values a translated block keeps above sp */
+#define REG_MAX_TEMPS 16
+
+/* space that must be left above sp before any instruction, 16 bytes is
+ * the most that a stack instruction pushes */
+#define REG_STACK_RESERVE (16 + 8 * REG_MAX_TEMPS)
+
+/* internal opcodes, these can't be assembled.  every one of them adds
+ * sp_delta to sp after it is done with its operands */
+
+/* [reg0] = ... */
+#define R_MOV		0xA0	/* reg1 */
+#define R_LEA		0xA1	/* address of bp + a */
+#define R_IADD		0xA2	/* reg1 + reg2 */
+#define R_ISUB		0xA3
+#define R_IMUL		0xA4
+#define R_IDIV		0xA5
+#define R_MOD		0xA6
+#define R_SHL		0xA7
+#define R_SHR		0xA8
+#define R_AND		0xA9
+#define R_OR		0xAA
+#define R_XOR		0xAB
+#define R_FADD		0xAC
+#define R_FSUB		0xAD
+#define R_FMUL		0xAE
+#define R_FDIV		0xAF
+#define R_ITOF		0xB0	/* (float)reg1 */
+#define R_FTOI		0xB1	/* (int)reg1 */
+#define R_IDER		0xB2	/* int at memory[reg1] */
+#define R_FDER		0xB3	/* float at memory[reg1] */
+#define R_BDER		0xB4	/* byte at memory[reg1] */
+#define R_BLOAD		0xB5	/* byte at reg1 */
+
+/* stores */
+#define R_ISAVE		0xB6	/* memory[reg0] = reg1 (int) */
+#define R_FSAVE		0xB7	/* memory[reg0] = reg1 (float) */
+#define R_BSAVE		0xB8	/* memory[reg0] = reg1 (byte) */
+#define R_BSTORE	0xB9	/* byte at reg0 = reg1 */
+
+#define R_SP		0xBA	/* only adjusts sp */
+
+/* if (reg0 ? reg1) goto b */
+#define R_IJE		0xBB
+#define R_IJNE		0xBC
+#define R_IJGT		0xBD
+#define R_IJGE		0xBE
+#define R_IJLT		0xBF
+#define R_IJLE		0xC0
+#define R_FJE		0xC1
+#define R_FJNE		0xC2
+#define R_FJGT		0xC3
+#define R_FJGE		0xC4
+#define R_FJLT		0xC5
+#define R_FJLE		0xC6
+#define R_IJZ		0xC7	/* if (reg0 == 0) goto b */
+#define R_IJNZ		0xC8	/* if (reg0 != 0) goto b */
+
+void spy_translate_registers(SpyState*);
+
+#endif
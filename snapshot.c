@@ -0,0 +1,291 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "vm.h"
+#include "snapshot.h"
+
+/*
+ * SNAPSHOTS
+ *
+ * spy_snapshot_at arms an instruction (a code address that can be jumped
+ * to or called, e.g. the start of a function) before the program runs.
+ * the first time it's reached, the whole vm is written to an image:
+ *   header (SnapshotHeader)
+ *   heap memory map, nblocks * {addr, bytes}
+ *   the bytecode
+ *   memory up to the end of the heap (at a multiple of SNAPSHOT_ALIGN, the
+ *   guard after the stack is zeros)
+ * and the program keeps running.  spy_resume loads the bytecode from an
+ * image again, maps memory privately from the file (so only pages that
+ * are written to are copied) and leaves the registers where they were.
+ *
+ * decoding is deterministic, so ip is saved as an index into spy->ops.
+ * the only pointers in memory are the saved ip and bp of every frame (see
+ * CALL), the frames are walked and those are saved as an index and an
+ * offset.  anything that a c-function keeps outside of memory (FILE*s from
+ * fopen) isn't part of an image.  native code has frames of its own, so
+ * --jit and --trace can't be used with snapshots
+ */
+
+#define SNAPSHOT_MAGIC "SPYIMG3"
+
+typedef struct SnapshotHeader SnapshotHeader;
+typedef struct SnapshotBlock SnapshotBlock;
+
+struct SpySnapshot {
+	SpyOp* at; /* armed instruction, NULL once the image is written */
+	uint8_t opcode; /* its real opcode */
+	char* filename;
+};
+
+struct SnapshotHeader {
+	char magic[8];
+	int64_t register_tier;
+	int64_t heap_size;
+	int64_t code_size;
+	int64_t nblocks;
+	int64_t memory_at; /* file offset */
+	int64_t ip; /* index into spy->ops */
+	int64_t sp; /* offsets into memory */
+	int64_t bp;
+	int64_t flags;
+	int64_t instructions;
+};
+
+struct SnapshotBlock {
+	int64_t addr;
+	int64_t bytes;
+};
+
+/* the image is written to filename when addr is reached, returns 0 like
+ * spy_load */
+int
+spy_snapshot_at(SpyState* spy, spy_int addr, const char* filename) {
+	jmp_buf on_error;
+	spy->on_error = &on_error;
+	if (setjmp(on_error)) {
+		spy->on_error = NULL;
+		return 1;
+	}
+	if (spy->use_jit || spy->use_trace) {
+		spy_die(spy, "snapshots can't be taken with --jit or --trace");
+	}
+	if (!spy->ops || spy->snapshot || addr < 0 || addr >= spy->code_size || !spy->op_map[addr]) {
+		spy_die(spy, "can't take a snapshot at 0x%llX", addr);
+	}
+	/* the instruction is changed in place, so no other state can share
+	 * the program */
+	if (atomic_load(&spy->program->refs) != 1) {
+		spy_die(spy, "snapshots can't be taken of a shared program");
+	}
+	SpySnapshot* snapshot = malloc(sizeof(SpySnapshot));
+	snapshot->at = spy->op_map[addr];
+	snapshot->opcode = snapshot->at->opcode;
+	snapshot->filename = malloc(strlen(filename) + 1);
+	strcpy(snapshot->filename, filename);
+	snapshot->at->opcode = S_SNAPSHOT;
+	spy_interpret(spy, NULL);
+	spy->snapshot = snapshot;
+	spy->on_error = NULL;
+	return 0;
+}
+
+/* converts the saved ip and bp of every frame in memory, from pointers to
+ * index/offset if save, the other way around otherwise */
+static void
+snapshot_frames(SpyState* spy, spy_byte* memory, spy_int bp, int save) {
+	while (bp != SIZE_CODE) {
+		if (bp < SIZE_CODE + 16 || bp > SIZE_CODE + SIZE_STACK - 8) {
+			spy_die(spy, "invalid frame in snapshot (bp=0x%llX)", bp);
+		}
+		spy_int ip, saved_bp, next;
+		memcpy(&ip, &memory[bp - 8], 8);
+		memcpy(&saved_bp, &memory[bp], 8);
+		if (save) {
+			ip = (SpyOp *)(intptr_t)ip - spy->ops;
+			saved_bp = (spy_byte *)(intptr_t)saved_bp - spy->memory;
+			next = saved_bp;
+		} else {
+			if (ip < 0 || ip >= spy->nops) {
+				spy_die(spy, "invalid frame in snapshot (ip=%lld)", ip);
+			}
+			next = saved_bp;
+			ip = (intptr_t)&spy->ops[ip];
+			saved_bp = (intptr_t)&spy->memory[saved_bp];
+		}
+		memcpy(&memory[bp - 8], &ip, 8);
+		memcpy(&memory[bp], &saved_bp, 8);
+		/* callers are always further down the stack */
+		if (next >= bp) {
+			spy_die(spy, "invalid frame in snapshot (bp=0x%llX)", next);
+		}
+		bp = next;
+	}
+}
+
+/* called by the interpreter at the armed instruction (spy->ip) */
+void
+spy_snapshot_take(SpyState* spy) {
+
+	/* other threads could be running tasks in the same memory */
+	if (spy->worker || spy->owner != spy) {
+		spy_die(spy, "snapshots can't be taken once the program spawns");
+	}
+
+	SpySnapshot* snapshot = spy->snapshot;
+	snapshot->at->opcode = snapshot->opcode;
+	snapshot->at = NULL;
+
+	FILE* handle = fopen(snapshot->filename, "wb");
+	if (!handle) {
+		spy_die(spy, "couldn't write snapshot to '%s'", snapshot->filename);
+	}
+
+	SnapshotHeader header;
+	memset(&header, 0, sizeof(SnapshotHeader));
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.register_tier = spy->register_tier;
+	header.heap_size = spy->heap_size;
+	header.code_size = spy->code_size;
+	for (MemoryBlockList* i = spy->memory_map; i; i = i->next) {
+		header.nblocks++;
+	}
+	int64_t end = sizeof(SnapshotHeader) + header.nblocks * sizeof(SnapshotBlock) + header.code_size;
+	header.memory_at = (end + SNAPSHOT_ALIGN - 1) / SNAPSHOT_ALIGN * SNAPSHOT_ALIGN;
+	header.ip = spy->ip - spy->ops;
+	header.sp = spy->sp - spy->memory;
+	header.bp = spy->bp - spy->memory;
+	header.flags = spy->flags;
+	header.instructions = spy->instructions;
+	fwrite(&header, 1, sizeof(SnapshotHeader), handle);
+
+	for (MemoryBlockList* i = spy->memory_map; i; i = i->next) {
+		SnapshotBlock block = {i->block->addr, i->block->bytes};
+		fwrite(&block, 1, sizeof(SnapshotBlock), handle);
+	}
+	fwrite(spy->code, 1, spy->code_size, handle);
+	for (int64_t i = end; i < header.memory_at; i++) {
+		fputc(0, handle);
+	}
+
+	/* the frames are converted in a copy, the program keeps running.  the
+	 * guard can't be read, the heap is written straight from memory */
+	spy_int size = START_MEMORY + spy->heap_size;
+	spy_byte* memory = calloc(START_MEMORY, 1);
+	memcpy(memory, spy->memory, SIZE_CODE + SIZE_STACK);
+	snapshot_frames(spy, memory, header.bp, 1);
+	size_t written = fwrite(memory, 1, START_MEMORY, handle);
+	written += fwrite(&spy->memory[START_MEMORY], 1, spy->heap_size, handle);
+	free(memory);
+
+	if (fclose(handle) != 0 || written != (size_t)size) {
+		spy_die(spy, "couldn't write snapshot to '%s'", snapshot->filename);
+	}
+
+}
+
+void
+spy_snapshot_free(SpyState* spy) {
+	if (spy->snapshot) {
+		free(spy->snapshot->filename);
+		free(spy->snapshot);
+		spy->snapshot = NULL;
+	}
+}
+
+/* loads an image written by spy_snapshot_take, spy_run then continues
+ * where the snapshot was taken.  returns 0 like spy_load */
+int
+spy_resume(SpyState* spy, const char* filename) {
+
+	jmp_buf on_error;
+	FILE* volatile handle = NULL;
+	spy_byte* volatile code = NULL;
+	spy->on_error = &on_error;
+	if (setjmp(on_error)) {
+		spy->on_error = NULL;
+		if (handle) {
+			fclose(handle);
+		}
+		free(code);
+		return 1;
+	}
+
+	if (spy->program) {
+		spy_die(spy, "a program is already loaded");
+	}
+	handle = fopen(filename, "rb");
+	if (!handle) {
+		spy_die(spy, "couldn't read snapshot from '%s'", filename);
+	}
+
+	SnapshotHeader header;
+	if (fread(&header, 1, sizeof(SnapshotHeader), handle) != sizeof(SnapshotHeader)
+		|| memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic))
+		|| header.heap_size <= 0 || header.heap_size > MAX_HEAP || header.heap_size % SIZE_GUARD
+		|| header.code_size <= 0 || header.code_size > SIZE_CODE
+		|| header.nblocks < 1 || header.memory_at % SNAPSHOT_ALIGN
+		|| header.sp < SIZE_CODE || header.sp > SIZE_CODE + SIZE_STACK
+		|| header.bp < SIZE_CODE || header.bp > header.sp) {
+		spy_die(spy, "'%s' isn't a valid snapshot", filename);
+	}
+
+	/* heap memory map, the list from spy_new is replaced */
+	MemoryBlockList* prev = NULL;
+	for (int64_t i = 0; i < header.nblocks; i++) {
+		SnapshotBlock block;
+		if (fread(&block, 1, sizeof(SnapshotBlock), handle) != sizeof(SnapshotBlock)) {
+			spy_die(spy, "'%s' isn't a valid snapshot", filename);
+		}
+		MemoryBlockList* list = i == 0 ? spy->memory_map : malloc(sizeof(MemoryBlockList));
+		if (i > 0) {
+			list->block = malloc(sizeof(MemoryBlock));
+			list->next = NULL;
+			prev->next = list;
+		}
+		list->prev = prev;
+		list->block->addr = block.addr;
+		list->block->bytes = block.bytes;
+		prev = list;
+	}
+
+	code = malloc(header.code_size);
+	if (fread(code, 1, header.code_size, handle) != (size_t)header.code_size) {
+		spy_die(spy, "'%s' isn't a valid snapshot", filename);
+	}
+
+	if (header.heap_size != spy->heap_size) {
+		spy_map_memory(spy, header.heap_size);
+	}
+	spy->register_tier = header.register_tier;
+	spy->use_jit = 0;
+	spy->use_trace = 0;
+	spy_prepare(spy, code, header.code_size);
+	free(code);
+	code = NULL;
+
+	/* memory is mapped copy-on-write over what spy_prepare set up,
+	 * nothing is read until it's used */
+	if (mmap(spy->memory, START_MEMORY + spy->heap_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fileno(handle), header.memory_at) == MAP_FAILED
+		|| mprotect(&spy->memory[SIZE_CODE + SIZE_STACK], SIZE_GUARD, PROT_NONE) != 0) {
+		spy_die(spy, "couldn't map memory from '%s'", filename);
+	}
+	fclose(handle);
+	handle = NULL;
+
+	if (header.ip < 0 || header.ip >= spy->nops) {
+		spy_die(spy, "'%s' isn't a valid snapshot", filename);
+	}
+	snapshot_frames(spy, spy->memory, header.bp, 0);
+	spy->ip = &spy->ops[header.ip];
+	spy->sp = &spy->memory[header.sp];
+	spy->bp = &spy->memory[header.bp];
+	spy->flags = header.flags;
+	spy->instructions = header.instructions;
+
+	spy->on_error = NULL;
+	return 0;
+
+}
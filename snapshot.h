@@ -0,0 +1,18 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "vm.h"
+
+/* internal opcode: the instruction that a snapshot is taken at.  it's
+ * changed back to what it was once the snapshot is written */
+#define S_SNAPSHOT 0xD1
+
+/* memory is at a multiple of this in an image, so that it can be mapped */
+#define SNAPSHOT_ALIGN 0x10000
+
+int spy_snapshot_at(SpyState*, spy_int, const char*);
+void spy_snapshot_take(SpyState*);
+void spy_snapshot_free(SpyState*);
+int spy_resume(SpyState*, const char*);
+
+#endif
@@ -0,0 +1,601 @@
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "vm.h"
+#include "spylib.h"
+#include "regvm.h"
+#include "jit.h"
+#include "task.h"
+
+/*
+ * TASKS
+ *
+ * spawn f(x) (see parse.c) doesn't make the call, it pushes it as a task.
+ * every thread that runs the program is a worker with a deque of its own:
+ * it pushes and takes tasks at the bottom, and when it has nothing to do it
+ * steals from the top of another worker's deque (chase-lev.  the deques
+ * don't grow, a spawn makes the call right away when its deque is full).
+ * sync waits for the spawns of its frame by running tasks itself, its own
+ * first, until the counter in the frame is 0.  every function syncs before
+ * it returns, so the frame that a task writes its result to is still there.
+ *
+ * workers are SpyStates that share the memory, the program, and the heap
+ * (behind a mutex, see capi_std.c) of the state that runs the program.
+ * each one has a stack of its own after the heap (see MEMORY in vm.c), and
+ * only interprets: the jit and traces stay with the state that runs the
+ * program.  the threads are started by the first spawn and stopped by
+ * spy_run.  an error, quit() or exit in a task ends the whole program.
+ *
+ * a parallel for (see generate_parallel_for) is split into chunks that are
+ * tasks as well.  the frame of the loop is copied once, and every chunk
+ * runs the loop's code for its part of the range on a copy of that copy,
+ * on top of the stack of whichever worker runs it.  a chunk ends with
+ * pend, after ireduce/freduce have combined its reductions with the
+ * loop's frame.  the loop waits for its chunks like sync does
+ */
+
+typedef struct SpyTask SpyTask;
+typedef struct SpyTasks SpyTasks;
+typedef struct SpyFrame SpyFrame;
+
+/* values of SpyTasks.stop */
+enum {
+	TASK_RUNNING = 0,
+	TASK_QUIT,
+	TASK_FAILED
+};
+
+struct SpyTask {
+	SpyOp* entry;
+	spy_int dest; /* address of the result, 0 if it isn't kept */
+	spy_int counter; /* address of the spawning frame's counter */
+	SpyFrame* frame; /* NULL, or the loop's frame for a chunk */
+	spy_int nargs;
+	spy_int args[]; /* first to last, the order they're pushed in,
+	                 * start and end for a chunk */
+};
+
+/* copy of the frame of a parallel for, from its first argument to sp */
+struct SpyFrame {
+	atomic_int refs; /* the loop, and every chunk that isn't done */
+	spy_int bp; /* offsets into bytes */
+	spy_int sp;
+	spy_int size;
+	spy_int parent; /* address of the loop's bp */
+	spy_int offset; /* of the vm's locals, see generate_parallel_for */
+	spy_byte bytes[];
+};
+
+struct SpyWorker {
+	SpyTasks* pool;
+	SpyState* spy;
+	pthread_t thread;
+	int started; /* thread is running, workers[0] never has one */
+	unsigned int victim; /* next deque to steal from */
+	atomic_long top; /* thieves take from here */
+	atomic_long bottom; /* the worker pushes and takes here */
+	_Atomic(SpyTask*) deque[TASK_DEQUE_SIZE];
+};
+
+struct SpyTasks {
+	SpyWorker* workers; /* workers[0] is the state that runs the program */
+	int nworkers;
+	atomic_int stop;
+	atomic_int sleeping; /* workers waiting for wake */
+	SpyOp sentinel; /* saved ip of a task's frame (J_RETURN) */
+	pthread_mutex_t heap;
+	pthread_mutex_t reduce;
+	pthread_mutex_t idle;
+	pthread_cond_t wake;
+};
+
+/* number of workers for a config (0 for one per core) */
+int
+spy_task_workers(int workers) {
+	if (workers <= 0) {
+		workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (workers < 1) {
+		workers = 1;
+	}
+	return workers > TASK_MAX_WORKERS ? TASK_MAX_WORKERS : workers;
+}
+
+/* the counter is a local of the spawning frame, and workers count it down */
+static _Atomic spy_int*
+task_counter(SpyState* spy, spy_int addr) {
+	return (_Atomic spy_int *)&spy->memory[addr];
+}
+
+/* stack of worker i (from 1), see MEMORY in vm.c */
+static spy_byte*
+task_stack(SpyState* spy, int i) {
+	return &spy->memory[START_MEMORY + spy->heap_size + SIZE_GUARD + (i - 1) * (SIZE_STACK + SIZE_GUARD)];
+}
+
+static void
+task_frame_release(SpyFrame* frame) {
+	if (atomic_fetch_sub_explicit(&frame->refs, 1, memory_order_acq_rel) == 1) {
+		free(frame);
+	}
+}
+
+static void
+task_free(SpyTask* task) {
+	if (task->frame) {
+		task_frame_release(task->frame);
+	}
+	free(task);
+}
+
+/* DEQUES
+ *
+ * only the owner pushes and takes, so bottom is only written by the owner.
+ * a take and a steal can only want the same task when it's the last one,
+ * then they both try to move top past it */
+
+/* returns 0 if the deque is full */
+static int
+task_push(SpyWorker* worker, SpyTask* task) {
+	long b = atomic_load_explicit(&worker->bottom, memory_order_relaxed);
+	long t = atomic_load_explicit(&worker->top, memory_order_acquire);
+	if (b - t >= TASK_DEQUE_SIZE) {
+		return 0;
+	}
+	atomic_store_explicit(&worker->deque[b % TASK_DEQUE_SIZE], task, memory_order_relaxed);
+	atomic_store_explicit(&worker->bottom, b + 1, memory_order_release);
+	return 1;
+}
+
+/* the task that was pushed last, NULL if there is none */
+static SpyTask*
+task_take(SpyWorker* worker) {
+	long b = atomic_load_explicit(&worker->bottom, memory_order_relaxed) - 1;
+	atomic_store_explicit(&worker->bottom, b, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	long t = atomic_load_explicit(&worker->top, memory_order_relaxed);
+	SpyTask* task = NULL;
+	if (t <= b) {
+		task = atomic_load_explicit(&worker->deque[b % TASK_DEQUE_SIZE], memory_order_relaxed);
+		if (t == b) {
+			if (!atomic_compare_exchange_strong_explicit(&worker->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed)) {
+				task = NULL; /* stolen */
+			}
+			atomic_store_explicit(&worker->bottom, b + 1, memory_order_relaxed);
+		}
+	} else {
+		atomic_store_explicit(&worker->bottom, b + 1, memory_order_relaxed);
+	}
+	return task;
+}
+
+/* the oldest task of victim, NULL if there is none (or another thread was
+ * faster) */
+static SpyTask*
+task_steal_from(SpyWorker* victim) {
+	long t = atomic_load_explicit(&victim->top, memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	long b = atomic_load_explicit(&victim->bottom, memory_order_acquire);
+	if (t >= b) {
+		return NULL;
+	}
+	SpyTask* task = atomic_load_explicit(&victim->deque[t % TASK_DEQUE_SIZE], memory_order_relaxed);
+	if (!atomic_compare_exchange_strong_explicit(&victim->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed)) {
+		return NULL;
+	}
+	return task;
+}
+
+/* tries every other worker once */
+static SpyTask*
+task_steal(SpyWorker* worker) {
+	SpyTasks* pool = worker->pool;
+	for (int i = 0; i < pool->nworkers; i++) {
+		SpyWorker* victim = &pool->workers[worker->victim++ % pool->nworkers];
+		SpyTask* task = victim == worker ? NULL : task_steal_from(victim);
+		if (task) {
+			return task;
+		}
+	}
+	return NULL;
+}
+
+/* ends the program (the first reason sticks), every state stops at its
+ * next safepoint */
+static void
+task_stop(SpyTasks* pool, int why) {
+	int running = TASK_RUNNING;
+	atomic_compare_exchange_strong(&pool->stop, &running, why);
+	for (int i = 0; i < pool->nworkers; i++) {
+		pool->workers[i].spy->bail = 1;
+	}
+	pthread_mutex_lock(&pool->idle);
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->idle);
+}
+
+/* nothing to steal, yield for a while, then sleep until a spawn (or for a
+ * millisecond, a spawn can miss a worker that is just going to sleep) */
+static void
+task_idle(SpyTasks* pool, int* misses) {
+	if (++*misses < TASK_SPINS) {
+		sched_yield();
+		return;
+	}
+	*misses = 0;
+	struct timespec until;
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_nsec += 1000000;
+	if (until.tv_nsec >= 1000000000) {
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000;
+	}
+	pthread_mutex_lock(&pool->idle);
+	atomic_fetch_add(&pool->sleeping, 1);
+	if (atomic_load(&pool->stop) == TASK_RUNNING) {
+		pthread_cond_timedwait(&pool->wake, &pool->idle, &until);
+	}
+	atomic_fetch_sub(&pool->sleeping, 1);
+	pthread_mutex_unlock(&pool->idle);
+}
+
+/* runs task on top of spy's stack, the same as a CALL that returns to
+ * here (or a jump into the loop for a chunk).  returns 0 if the program
+ * has to stop */
+static int
+task_run(SpyState* spy, SpyTask* task) {
+
+	SpyOp* ip = spy->ip;
+	spy_byte* bp = spy->bp;
+	spy_byte* base = spy->sp;
+	uint16_t flags = spy->flags;
+	SpyFrame* frame = task->frame;
+
+	/* what CALL checks for, and the frame */
+	spy_int bytes = (frame ? frame->size : 8 * task->nargs + 16) + (spy->verified ? spy->frame_height : spy->stack_slack);
+	if (spy->stack_end - spy->sp <= REG_STACK_RESERVE + bytes) {
+		task_free(task);
+		spy_die(spy, "stack overflow");
+		return 0;
+	}
+
+	if (frame) {
+		spy_byte* start = spy->sp + 8;
+		memcpy(start, frame->bytes, frame->size);
+		spy->bp = start + frame->bp;
+		spy->sp = start + frame->sp;
+		spy_int chunk[3] = {task->args[0], task->args[1], frame->parent};
+		memcpy(&spy->bp[8 + frame->offset + 8], chunk, sizeof(chunk));
+	} else {
+		for (spy_int i = 0; i < task->nargs; i++) {
+			spy_push_int(spy, task->args[i]);
+		}
+		spy_push_int(spy, (intptr_t)&spy->worker->pool->sentinel);
+		spy_push_int(spy, (intptr_t)bp);
+		spy->bp = spy->sp;
+	}
+	spy_interpret(spy, task->entry);
+	if (spy->bail) {
+		task_free(task);
+		return 0;
+	}
+
+	/* IRET left the result on the stack, VRET didn't */
+	if (task->dest && spy->sp > base) {
+		memcpy(&spy->memory[task->dest], base + 8, 8);
+	}
+	spy->ip = ip;
+	spy->bp = bp;
+	spy->sp = base;
+	spy->flags = flags;
+	atomic_fetch_sub_explicit(task_counter(spy, task->counter), 1, memory_order_release);
+	task_free(task);
+	return 1;
+
+}
+
+static void*
+task_worker(void* arg) {
+	SpyWorker* worker = arg;
+	SpyState* spy = worker->spy;
+	SpyTasks* pool = worker->pool;
+	jmp_buf on_error;
+	spy_set_running(spy);
+	spy->on_error = &on_error;
+	if (setjmp(on_error)) {
+		task_stop(pool, TASK_FAILED);
+		return NULL;
+	}
+	int misses = 0;
+	while (atomic_load(&pool->stop) == TASK_RUNNING) {
+		SpyTask* task = task_take(worker);
+		if (!task) {
+			task = task_steal(worker);
+		}
+		if (!task) {
+			task_idle(pool, &misses);
+			continue;
+		}
+		misses = 0;
+		if (!task_run(spy, task)) {
+			/* quit() or exit, or the program is over */
+			task_stop(pool, TASK_QUIT);
+		}
+	}
+	return NULL;
+}
+
+/* a worker shares everything with spy except for its registers and its
+ * stack, and it doesn't compile anything */
+static SpyState*
+task_state(SpyState* spy, SpyWorker* worker, int i) {
+	SpyState* state = malloc(sizeof(SpyState));
+	memcpy(state, spy, sizeof(SpyState));
+	state->ip = NULL;
+	state->sp = task_stack(spy, i);
+	state->bp = state->sp;
+	state->stack_end = state->sp + SIZE_STACK;
+	state->use_jit = 0;
+	state->jit = NULL;
+	state->use_trace = 0;
+	state->trace = NULL;
+	state->quick = NULL;
+	state->recording = 0;
+	state->flags = 0;
+	atomic_init(&state->bail, 0);
+	state->instructions = 0;
+	state->snapshot = NULL;
+	state->on_error = NULL;
+	state->worker = worker;
+	state->owner = spy;
+	return state;
+}
+
+/* called by the first spawn, handler is the interpreter's for J_RETURN
+ * (NULL without computed goto) */
+static void
+task_start(SpyState* spy, const void* handler) {
+
+	SpyTasks* pool = malloc(sizeof(SpyTasks));
+	pool->nworkers = spy->workers;
+	pool->workers = calloc(pool->nworkers, sizeof(SpyWorker));
+	atomic_init(&pool->stop, TASK_RUNNING);
+	atomic_init(&pool->sleeping, 0);
+	memset(&pool->sentinel, 0, sizeof(SpyOp));
+	pool->sentinel.opcode = J_RETURN;
+	pool->sentinel.handler = handler;
+	pthread_mutex_init(&pool->heap, NULL);
+	pthread_mutex_init(&pool->reduce, NULL);
+	pthread_mutex_init(&pool->idle, NULL);
+	pthread_cond_init(&pool->wake, NULL);
+
+	for (int i = 0; i < pool->nworkers; i++) {
+		SpyWorker* worker = &pool->workers[i];
+		worker->pool = pool;
+		worker->victim = i + 1;
+		atomic_init(&worker->top, 0);
+		atomic_init(&worker->bottom, 0);
+		worker->spy = i == 0 ? spy : task_state(spy, worker, i);
+	}
+	spy->worker = &pool->workers[0];
+
+	/* without threads, spy runs every task itself when it syncs */
+	for (int i = 1; i < pool->nworkers; i++) {
+		SpyWorker* worker = &pool->workers[i];
+		worker->started = pthread_create(&worker->thread, NULL, task_worker, worker) == 0;
+	}
+
+}
+
+/* SPAWN, the function at entry is called with nargs arguments from the
+ * stack.  its result goes to dest, and the counter at counter is counted
+ * down when it's done.  returns 0 if the program has to stop */
+int
+spy_task_spawn(SpyState* spy, SpyOp* entry, spy_int dest, spy_int counter, spy_int nargs, const void* handler) {
+	if (nargs < 0 || nargs > (spy->sp - (spy->stack_end - SIZE_STACK)) / 8) {
+		spy_die(spy, "invalid spawn (%lld arguments)", nargs);
+	}
+	if (!spy->worker) {
+		task_start(spy, handler);
+	}
+	SpyWorker* worker = spy->worker;
+	SpyTasks* pool = worker->pool;
+	SpyTask* task = malloc(sizeof(SpyTask) + nargs * sizeof(spy_int));
+	task->entry = entry;
+	task->dest = dest;
+	task->counter = counter;
+	task->frame = NULL;
+	task->nargs = nargs;
+	for (spy_int i = nargs - 1; i >= 0; i--) {
+		task->args[i] = spy_pop_int(spy);
+	}
+	atomic_fetch_add_explicit(task_counter(spy, counter), 1, memory_order_relaxed);
+	if (pool->nworkers == 1 || !task_push(worker, task)) {
+		/* nobody would steal it, or there's no room */
+		return task_run(spy, task);
+	}
+	if (atomic_load(&pool->sleeping) > 0) {
+		pthread_mutex_lock(&pool->idle);
+		pthread_cond_signal(&pool->wake);
+		pthread_mutex_unlock(&pool->idle);
+	}
+	return 1;
+}
+
+/* SYNC, waits until every task that was spawned with the counter at
+ * counter is done.  returns 0 if the program has to stop */
+int
+spy_task_sync(SpyState* spy, spy_int counter) {
+	_Atomic spy_int* count = task_counter(spy, counter);
+	if (atomic_load_explicit(count, memory_order_acquire) <= 0) {
+		return 1;
+	}
+	if (!spy->worker) {
+		spy_die(spy, "invalid sync (nothing was spawned)");
+	}
+	SpyWorker* worker = spy->worker;
+	SpyTasks* pool = worker->pool;
+	while (atomic_load_explicit(count, memory_order_acquire) > 0) {
+		if (atomic_load(&pool->stop) != TASK_RUNNING) {
+			spy->bail = 1;
+			return 0;
+		}
+		SpyTask* task = task_take(worker);
+		if (!task) {
+			task = task_steal(worker);
+		}
+		if (task) {
+			if (!task_run(spy, task)) {
+				return 0;
+			}
+		} else {
+			/* what's left is running on other workers */
+			sched_yield();
+		}
+	}
+	return 1;
+}
+
+/* PFOR, runs the chunk code at entry for [start, end) in steps of step,
+ * offset is where the vm's locals are in the frame and nargs is how many
+ * arguments are below it.  returns 0 if the program has to stop */
+int
+spy_task_for(SpyState* spy, SpyOp* entry, spy_int start, spy_int end, spy_int step, spy_int offset, spy_int nargs, const void* handler) {
+	spy_byte* stack = spy->stack_end - SIZE_STACK;
+	spy_byte* first = spy->bp - 8 - 8 * nargs; /* first argument */
+	if (step <= 0 || nargs < 0 || first <= stack || &spy->bp[8 + offset + 32] > spy->sp + 8) {
+		spy_die(spy, "invalid parallel for");
+	}
+	if (end <= start) {
+		return 1;
+	}
+	if (!spy->worker) {
+		task_start(spy, handler);
+	}
+	SpyWorker* worker = spy->worker;
+	SpyTasks* pool = worker->pool;
+
+	/* one chunk without other workers, it's the same as the loop */
+	spy_int iterations = (end - start - 1) / step + 1;
+	spy_int chunks = pool->nworkers == 1 ? 1 : pool->nworkers * TASK_FOR_CHUNKS;
+	if (chunks > iterations) {
+		chunks = iterations;
+	}
+	spy_int per_chunk = (iterations + chunks - 1) / chunks;
+	chunks = (iterations + per_chunk - 1) / per_chunk;
+
+	spy_int size = spy->sp + 8 - first;
+	SpyFrame* frame = malloc(sizeof(SpyFrame) + size);
+	atomic_init(&frame->refs, (int)chunks + 1);
+	frame->bp = spy->bp - first;
+	frame->sp = spy->sp - first;
+	frame->size = size;
+	frame->parent = spy->bp - spy->memory;
+	frame->offset = offset;
+	memcpy(frame->bytes, first, size);
+
+	/* the first chunk is pushed last, it's taken first */
+	spy_int counter = &spy->bp[8 + offset] - spy->memory;
+	for (spy_int i = chunks - 1; i >= 0; i--) {
+		SpyTask* task = malloc(sizeof(SpyTask) + 2 * sizeof(spy_int));
+		task->entry = entry;
+		task->dest = 0;
+		task->counter = counter;
+		task->frame = frame;
+		task->nargs = 2;
+		task->args[0] = start + i * per_chunk * step;
+		task->args[1] = i == chunks - 1 ? end : task->args[0] + per_chunk * step;
+		atomic_fetch_add_explicit(task_counter(spy, counter), 1, memory_order_relaxed);
+		if ((pool->nworkers == 1 || !task_push(worker, task)) && !task_run(spy, task)) {
+			task_frame_release(frame);
+			return 0;
+		}
+	}
+	if (pool->nworkers > 1 && atomic_load(&pool->sleeping) > 0) {
+		pthread_mutex_lock(&pool->idle);
+		pthread_cond_broadcast(&pool->wake);
+		pthread_mutex_unlock(&pool->idle);
+	}
+	int ok = spy_task_sync(spy, counter);
+	task_frame_release(frame);
+	return ok;
+}
+
+/* IREDUCE, FREDUCE, combines the value of a chunk with the one at addr in
+ * the loop's frame */
+void
+spy_task_reduce(SpyState* spy, spy_int addr, spy_int value, int how, int is_float) {
+	SpyWorker* worker = spy->owner->worker;
+	if (!worker) {
+		spy_die(spy, "invalid reduction (not in a parallel for)");
+	}
+	pthread_mutex_lock(&worker->pool->reduce);
+	spy_int old;
+	memcpy(&old, &spy->memory[addr], 8);
+	if (is_float) {
+		spy_float a, b;
+		memcpy(&a, &old, 8);
+		memcpy(&b, &value, 8);
+		a = how == TASK_REDUCE_ADD ? a + b : how == TASK_REDUCE_MIN ? (b < a ? b : a) : (b > a ? b : a);
+		memcpy(&old, &a, 8);
+	} else {
+		old = how == TASK_REDUCE_ADD ? old + value : how == TASK_REDUCE_MIN ? (value < old ? value : old) : (value > old ? value : old);
+	}
+	memcpy(&spy->memory[addr], &old, 8);
+	pthread_mutex_unlock(&worker->pool->reduce);
+}
+
+/* stops the workers once the program is done (or died), returns 1 if a
+ * task failed */
+int
+spy_task_stop(SpyState* spy) {
+	if (!spy->worker) {
+		return 0;
+	}
+	SpyTasks* pool = spy->worker->pool;
+	task_stop(pool, TASK_QUIT);
+	for (int i = 0; i < pool->nworkers; i++) {
+		SpyWorker* worker = &pool->workers[i];
+		if (worker->started) {
+			pthread_join(worker->thread, NULL);
+		}
+		/* only an error leaves tasks behind */
+		long b = atomic_load(&worker->bottom);
+		for (long t = atomic_load(&worker->top); t < b; t++) {
+			task_free(atomic_load(&worker->deque[t % TASK_DEQUE_SIZE]));
+		}
+		if (i > 0) {
+			spy->instructions += worker->spy->instructions;
+			free(worker->spy);
+		}
+	}
+	int failed = atomic_load(&pool->stop) == TASK_FAILED;
+	pthread_mutex_destroy(&pool->heap);
+	pthread_mutex_destroy(&pool->reduce);
+	pthread_mutex_destroy(&pool->idle);
+	pthread_cond_destroy(&pool->wake);
+	free(pool->workers);
+	free(pool);
+	spy->worker = NULL;
+	return failed;
+}
+
+/* the heap is shared by every worker, see capi_std.c */
+void
+spy_task_lock(SpyState* spy) {
+	if (spy->owner->worker) {
+		pthread_mutex_lock(&spy->owner->worker->pool->heap);
+	}
+}
+
+void
+spy_task_unlock(SpyState* spy) {
+	if (spy->owner->worker) {
+		pthread_mutex_unlock(&spy->owner->worker->pool->heap);
+	}
+}
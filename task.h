@@ -0,0 +1,36 @@
+#ifndef TASK_H
+#define TASK_H
+
+#include "vm.h"
+
+/* most threads that run tasks */
+#define TASK_MAX_WORKERS 64
+
+/* tasks that a worker can have waiting, spawn makes the call right away
+ * when its deque is full */
+#define TASK_DEQUE_SIZE 1024
+
+/* times an idle worker yields before it sleeps */
+#define TASK_SPINS 64
+
+/* chunks of a parallel for for every worker, more than one so that the
+ * workers that get the quick ones can steal the rest */
+#define TASK_FOR_CHUNKS 4
+
+/* how ireduce and freduce combine a chunk's value with the loop's */
+enum {
+	TASK_REDUCE_ADD = 0,
+	TASK_REDUCE_MIN,
+	TASK_REDUCE_MAX
+};
+
+int spy_task_workers(int);
+int spy_task_spawn(SpyState*, SpyOp*, spy_int, spy_int, spy_int, const void*);
+int spy_task_sync(SpyState*, spy_int);
+int spy_task_for(SpyState*, SpyOp*, spy_int, spy_int, spy_int, spy_int, spy_int, const void*);
+void spy_task_reduce(SpyState*, spy_int, spy_int, int, int);
+int spy_task_stop(SpyState*);
+void spy_task_lock(SpyState*);
+void spy_task_unlock(SpyState*);
+
+#endif
@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vm.h"
+#include "jit.h"
+#include "trace.h"
+
+/*
+ * LOOP TRACES
+ *
+ * the interpreter counts the backward jumps to every loop header.  once a
+ * header is hot, the interpreter records every instruction that it runs
+ * until it's back at the header.  the recorded path is compiled by
+ * spy_jit_trace (jit.c), and the next backward jump to the header runs the
+ * compiled loop instead of interpreting it, until it takes a different path.
+ *
+ * a recording is thrown away if it leaves the function or reaches another
+ * loop first.  instructions are typed, so the only guards a trace needs are
+ * the ones for its branches.
+ */
+
+struct SpyTrace {
+	SpyTraceFn* native; /* decoded instruction -> compiled loop */
+	uint16_t* hits;
+	uint8_t* attempts;
+	SpyOp* header; /* loop that is being recorded */
+	SpyOp* path[TRACE_MAX_OPS];
+	int length;
+};
+
+SpyTrace*
+spy_trace_new(SpyState* spy) {
+	SpyTrace* trace = malloc(sizeof(SpyTrace));
+	trace->native = calloc(spy->nops, sizeof(SpyTraceFn));
+	trace->hits = calloc(spy->nops, sizeof(uint16_t));
+	trace->attempts = calloc(spy->nops, sizeof(uint8_t));
+	trace->header = NULL;
+	trace->length = 0;
+	return trace;
+}
+
+void
+spy_trace_free(SpyState* spy, SpyTrace* trace) {
+	for (spy_int i = 0; i < spy->nops; i++) {
+		spy_jit_release((void *)trace->native[i]);
+	}
+	free(trace->native);
+	free(trace->hits);
+	free(trace->attempts);
+	free(trace);
+}
+
+static void
+trace_stop(SpyState* spy, int failed) {
+	SpyTrace* trace = spy->trace;
+	size_t i = trace->header - spy->ops;
+	if (failed) {
+		trace->hits[i] = 0;
+		if (trace->attempts[i] < TRACE_MAX_ATTEMPTS) {
+			trace->attempts[i]++;
+		}
+	}
+	trace->header = NULL;
+	trace->length = 0;
+	spy->recording = 0;
+}
+
+/* instructions that leave the function (or are computed jumps) */
+static int
+trace_leaves(uint8_t opcode) {
+	switch (opcode) {
+		case 0x00: case 0x23: case 0x24: case 0x26: case 0x27:
+		case 0x38: case 0x4F: case 0x5B: case 0x8F: case 0x90: case 0x91:
+		case 0x92:
+			return 1;
+	}
+	return (opcode >= 0x0F && opcode <= 0x19) || opcode == J_RETURN;
+}
+
+/* called when the interpreter just jumped back to spy->ip */
+void
+spy_trace_loop(SpyState* spy) {
+	SpyTrace* trace = spy->trace;
+	SpyOp* header = spy->ip;
+	size_t i = header - spy->ops;
+	if (spy->recording) {
+		if (header != trace->header) {
+			/* inner loop, it has to get hot on its own */
+			trace_stop(spy, 1);
+		}
+		return;
+	}
+	if (trace->native[i]) {
+		/* sets ip, sp and bp to wherever the loop was left */
+		trace->native[i](spy);
+		return;
+	}
+	if (trace->attempts[i] == TRACE_MAX_ATTEMPTS || ++trace->hits[i] < TRACE_THRESHOLD) {
+		return;
+	}
+	trace->header = header;
+	trace->length = 0;
+	spy->recording = 1;
+}
+
+/* called for every instruction that runs while recording */
+void
+spy_trace_record(SpyState* spy, SpyOp* op) {
+	SpyTrace* trace = spy->trace;
+	if (op == trace->header && trace->length > 0) {
+		size_t i = trace->header - spy->ops;
+		trace->native[i] = spy_jit_trace(spy, trace->path, trace->length);
+		if (!trace->native[i]) {
+			trace->attempts[i] = TRACE_MAX_ATTEMPTS;
+		}
+		trace_stop(spy, 0);
+		return;
+	}
+	if (trace->length == TRACE_MAX_OPS || trace_leaves(op->opcode)) {
+		trace_stop(spy, 1);
+		return;
+	}
+	trace->path[trace->length++] = op;
+}
@@ -0,0 +1,20 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "vm.h"
+
+/* backward jumps to a loop header before the loop is recorded */
+#define TRACE_THRESHOLD 64
+
+/* longest path through a loop that is recorded */
+#define TRACE_MAX_OPS 256
+
+/* recordings of a loop that may fail before it is left to the interpreter */
+#define TRACE_MAX_ATTEMPTS 4
+
+SpyTrace* spy_trace_new(SpyState*);
+void spy_trace_free(SpyState*, SpyTrace*);
+void spy_trace_loop(SpyState*);
+void spy_trace_record(SpyState*, SpyOp*);
+
+#endif
@@ -0,0 +1,860 @@
+#include <stdlib.h>
+#include <string.h>
+#include "verify.h"
+#include "regvm.h"
+
+/*
+ * BYTECODE VERIFIER
+ *
+ * runs once when the code is loaded, before it is translated to register
+ * code.  every function that can be called from the entry point is run
+ * abstractly: the verifier only keeps track of how many values are on
+ * the stack, and for some of them where they come from.  the code is
+ * verified if
+ *
+ *   - instructions don't overlap, and every jump goes to an instruction
+ *   - the stack has the same depth on every path to an instruction, and
+ *     never goes below the frame
+ *   - arguments (iarg, or locals at negative offsets) are ones that every
+ *     caller passes, returns pop as many as that, and locals (ilocall, ...)
+ *     are below the top of the stack
+ *   - absolute addresses (aider, ...) are inside memory
+ *   - every call goes to a known function (ccall only calls constant
+ *     addresses, ccfcall isn't used) with the same number of arguments
+ *
+ * the result is the height of the largest frame.  the verified
+ * interpreter (see interpret.h) checks for that much stack when it calls
+ * a function, and leaves out the stack checks at the other safepoints,
+ * at RES and the checks of addresses that are known to be in the frame.
+ *
+ * c-functions are assumed to pop their arguments and leave cfunc->results
+ * values behind, the verified interpreter makes sure of that after the
+ * call
+ */
+
+/* largest stack that a frame can ever have */
+#define VERIFY_MAX_SLOTS ((SIZE_STACK - REG_STACK_RESERVE) / 8)
+
+typedef struct Verifier Verifier;
+typedef struct VerifySlot VerifySlot;
+
+/* what is known about a value on the stack */
+struct VerifySlot {
+	enum VerifySlotKind {
+		SLOT_ANY = 0,
+		SLOT_FRAME, /* the address of bp[8 + value] (lea) */
+		SLOT_CONST /* value (iconst) */
+	} kind;
+	spy_int value;
+	int32_t size; /* bytes, 8 except for the locals of RES */
+};
+
+struct Verifier {
+	SpyState* spy;
+	SpyOp* ops;
+	uint32_t nops;
+	uint32_t main; /* the entry point, it has no caller to return to */
+	int32_t* depth; /* op index -> values on the stack before it, -1 if not reached */
+	VerifySlot** before; /* op index -> the stack before it */
+	int32_t* function; /* op index -> entry of the function it belongs to, -1 if none */
+	int32_t* nargs; /* entry index -> number of arguments, -1 if not a function */
+	int32_t* height; /* entry index -> most bytes that the function has on the stack */
+	int8_t* results; /* entry index -> values it returns, -2 if not known yet */
+	uint8_t* queued;
+	uint32_t* pending; /* instructions that have to be (re)visited */
+	uint32_t npending;
+	uint32_t* entries; /* functions to verify */
+	uint32_t nentries;
+	VerifySlot* stack; /* the stack while an instruction is visited */
+	int32_t top;
+	int32_t bytes; /* size of the values on the stack */
+	int operands[256]; /* number of operands of each opcode, -1 if it doesn't exist */
+};
+
+/* instructions that never continue with the next one */
+static int
+v_ends(uint8_t opcode) {
+	switch (opcode) {
+		case 0x00: case 0x0E: case 0x19: case 0x26: case 0x27: case 0x38: case 0x4F: case 0x92:
+			return 1;
+	}
+	return 0;
+}
+
+/* bytes of code that an instruction was decoded from.  the decoder adds
+ * a JMP where a run reaches code that is already decoded and a NOP where
+ * it runs off the end of the code, those don't have any */
+static spy_int
+v_size(const Verifier* V, const SpyOp* op) {
+	if (op->opcode == 0x0E && op->a.op && op->a.op->addr == op->addr) {
+		return 0;
+	}
+	if (op->addr >= V->spy->code_size || V->spy->code[op->addr] != op->opcode) {
+		return 0;
+	}
+	return 1 + 8 * V->operands[op->opcode];
+}
+
+/* values that the function at entry returns: 1 if it returns with IRET or
+ * FRET, 0 with VRET (or if it never returns), -1 if it does both */
+static int
+v_results(Verifier* V, uint32_t entry) {
+	if (V->results[entry] != -2) {
+		return V->results[entry];
+	}
+	uint8_t* seen = calloc(V->nops, sizeof(uint8_t));
+	uint32_t* todo = malloc(V->nops * sizeof(uint32_t));
+	uint32_t ntodo = 0;
+	int results = -2;
+	todo[ntodo++] = entry;
+	seen[entry] = 1;
+	while (ntodo > 0 && results != -1) {
+		uint32_t i = todo[--ntodo];
+		const SpyOp* op = &V->ops[i];
+		int r = op->opcode == 0x38 ? 0 : (op->opcode == 0x26 || op->opcode == 0x4F) ? 1 : -2;
+		if (r != -2) {
+			results = (results == -2 || results == r) ? r : -1;
+		}
+		if ((spy_is_branch(op->opcode) || op->opcode == 0x0E) && op->opcode != 0x23 && op->a.op) {
+			uint32_t t = op->a.op - V->ops;
+			if (!seen[t]) {
+				seen[t] = 1;
+				todo[ntodo++] = t;
+			}
+		}
+		if (!v_ends(op->opcode) && i + 1 < V->nops && !seen[i + 1]) {
+			seen[i + 1] = 1;
+			todo[ntodo++] = i + 1;
+		}
+	}
+	free(seen);
+	free(todo);
+	V->results[entry] = results == -2 ? 0 : results;
+	return V->results[entry];
+}
+
+/* adds the current stack to the ones that reach ops[i] */
+static int
+v_merge(Verifier* V, uint32_t entry, uint32_t i) {
+	if (V->function[i] != -1 && V->function[i] != (int32_t)entry) {
+		/* shared by two functions */
+		return 0;
+	}
+	if (V->depth[i] < 0) {
+		V->function[i] = entry;
+		V->depth[i] = V->top;
+		V->before[i] = malloc((V->top + 1) * sizeof(VerifySlot));
+		memcpy(V->before[i], V->stack, V->top * sizeof(VerifySlot));
+	} else if (V->depth[i] != V->top) {
+		return 0;
+	} else {
+		int changed = 0;
+		for (int32_t k = 0; k < V->top; k++) {
+			VerifySlot* s = &V->before[i][k];
+			if (s->size != V->stack[k].size) {
+				return 0;
+			}
+			if (s->kind != SLOT_ANY && (s->kind != V->stack[k].kind || s->value != V->stack[k].value)) {
+				s->kind = SLOT_ANY;
+				changed = 1;
+			}
+		}
+		if (!changed) {
+			return 1;
+		}
+	}
+	if (!V->queued[i]) {
+		V->queued[i] = 1;
+		V->pending[V->npending++] = i;
+	}
+	return 1;
+}
+
+/* pops n values, the locals of RES can't be popped */
+static int
+v_pop(Verifier* V, spy_int n) {
+	if (n < 0 || n > V->top) {
+		return 0;
+	}
+	for (spy_int k = 0; k < n; k++) {
+		V->top--;
+		if (V->stack[V->top].size != 8) {
+			return 0;
+		}
+		V->bytes -= 8;
+	}
+	return 1;
+}
+
+static int
+v_push_bytes(Verifier* V, uint32_t entry, enum VerifySlotKind kind, spy_int value, spy_int size) {
+	if (V->top >= VERIFY_MAX_SLOTS || size > VERIFY_MAX_SLOTS * 8 - V->bytes) {
+		return 0;
+	}
+	V->stack[V->top].kind = kind;
+	V->stack[V->top].value = value;
+	V->stack[V->top].size = (int32_t)size;
+	V->top++;
+	V->bytes += (int32_t)size;
+	if (V->bytes > V->height[entry]) {
+		V->height[entry] = V->bytes;
+	}
+	return 1;
+}
+
+static int
+v_push(Verifier* V, uint32_t entry, enum VerifySlotKind kind, spy_int value) {
+	return v_push_bytes(V, entry, kind, value, 8);
+}
+
+/* a local of size bytes at bp[8 + off] is below the top of the stack,
+ * or it's one of the arguments (below the saved ip and bp, see CALL) */
+static int
+v_local(const Verifier* V, uint32_t entry, spy_int off, spy_int size) {
+	if (off < 0) {
+		return off >= -16 - 8 * (spy_int)V->nargs[entry] && off + size <= -16;
+	}
+	return off + size <= V->bytes;
+}
+
+/* an absolute address that the interpreter won't check, it's mapped
+ * whatever the size of the heap is (see MEMORY in vm.c) */
+static int
+v_absolute(spy_int addr) {
+	return addr > 0 && addr + 8 <= START_MEMORY;
+}
+
+static int
+v_call(Verifier* V, uint32_t entry, uint32_t callee, spy_int nargs) {
+	if (callee == V->main || nargs < 0 || nargs > VERIFY_MAX_SLOTS) {
+		return 0;
+	}
+	if (V->nargs[callee] < 0) {
+		V->nargs[callee] = nargs;
+		V->entries[V->nentries++] = callee;
+	} else if (V->nargs[callee] != nargs) {
+		return 0;
+	}
+	int results = v_results(V, callee);
+	if (results < 0 || !v_pop(V, nargs)) {
+		return 0;
+	}
+	for (int r = 0; r < results; r++) {
+		if (!v_push(V, entry, SLOT_ANY, 0)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* a vector instruction of n lanes that pops and pushes that many values
+ * (every lane is a value of its own) */
+static int
+v_vector(Verifier* V, uint32_t entry, spy_int n, spy_int pop, spy_int push) {
+	if (n < 1 || n > VECTOR_MAX_LANES || !v_pop(V, pop)) {
+		return 0;
+	}
+	for (spy_int i = 0; i < push; i++) {
+		if (!v_push(V, entry, SLOT_ANY, 0)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* runs ops[i] with the stack that reaches it */
+static int
+v_instruction(Verifier* V, uint32_t entry, uint32_t i) {
+
+	#define POP(n) if (!v_pop(V, (n))) return 0
+	#define PUSH(kind, value) if (!v_push(V, entry, (kind), (value))) return 0
+	#define TOP(n) (V->stack[V->top - 1 - (n)]) /* only after a check for the depth */
+
+	SpyOp* op = &V->ops[i];
+	SpyOp* target = NULL;
+
+	switch (op->opcode) {
+		/* NOP, EXIT */
+		case 0x00: case 0x27:
+			break;
+
+		/* ICONST */
+		case 0x01:
+			PUSH(SLOT_CONST, op->a.i);
+			break;
+
+		/* ICMP, FCMP */
+		case 0x02: case 0x48:
+			POP(2);
+			break;
+
+		/* ITEST, FTEST, POP, ILOG, BLOG, FLOG */
+		case 0x03: case 0x49: case 0x2E: case 0xFD: case 0xFE: case 0xFF:
+			POP(1);
+			break;
+
+		/* JE ... JNS, JMP */
+		case 0x04: case 0x05: case 0x06: case 0x07: case 0x08: case 0x09:
+		case 0x0A: case 0x0B: case 0x0C: case 0x0D: case 0x0E:
+			target = op->a.op;
+			if (!target) {
+				return 0;
+			}
+			break;
+
+		/* CJEQ ... CJMP, the address has to be a constant */
+		case 0x0F: case 0x10: case 0x11: case 0x12: case 0x13: case 0x14:
+		case 0x15: case 0x16: case 0x17: case 0x18: case 0x19: {
+			POP(1);
+			VerifySlot addr = V->stack[V->top];
+			if (addr.kind != SLOT_CONST || addr.value < 0 || addr.value >= V->spy->code_size) {
+				return 0;
+			}
+			target = V->spy->op_map[addr.value];
+			if (!target) {
+				return 0;
+			}
+			break;
+		}
+
+		/* IADD (constant offsets from a frame address stay in the frame) */
+		case 0x1A: {
+			POP(2);
+			VerifySlot a = V->stack[V->top];
+			VerifySlot b = V->stack[V->top + 1];
+			if (a.kind == SLOT_FRAME && b.kind == SLOT_CONST) {
+				PUSH(SLOT_FRAME, a.value + b.value);
+			} else if (a.kind == SLOT_CONST && b.kind == SLOT_FRAME) {
+				PUSH(SLOT_FRAME, a.value + b.value);
+			} else {
+				PUSH(SLOT_ANY, 0);
+			}
+			break;
+		}
+
+		/* ISUB ... XOR, MOD, LAND, LOR, IIDX, FADD ... FDIV, IPE ... FPLE */
+		case 0x1B: case 0x1C: case 0x1D: case 0x1E: case 0x1F: case 0x20:
+		case 0x21: case 0x22: case 0x5A: case 0x5D: case 0x5E: case 0x61:
+		case 0x4A: case 0x4B: case 0x4C: case 0x4D:
+		case 0x81: case 0x82: case 0x83: case 0x84: case 0x85: case 0x86:
+		case 0x87: case 0x88: case 0x89: case 0x8A: case 0x8B: case 0x8C:
+			POP(2);
+			PUSH(SLOT_ANY, 0);
+			break;
+
+		/* CALL */
+		case 0x23:
+			if (!op->a.op || !v_call(V, entry, op->a.op - V->ops, op->b.i)) {
+				return 0;
+			}
+			break;
+
+		/* CCALL, the address has to be a constant */
+		case 0x24: {
+			POP(1);
+			VerifySlot addr = V->stack[V->top];
+			if (addr.kind != SLOT_CONST || addr.value < 0 || addr.value >= V->spy->code_size) {
+				return 0;
+			}
+			SpyOp* callee = V->spy->op_map[addr.value];
+			if (!callee || !v_call(V, entry, callee - V->ops, op->a.i)) {
+				return 0;
+			}
+			break;
+		}
+
+		/* CFCALL, CFCALL_IDX */
+		case 0x25: case 0x95:
+			if (!op->a.cfunc) {
+				return 0;
+			}
+			POP(op->b.i);
+			for (int r = 0; r < op->a.cfunc->results; r++) {
+				PUSH(SLOT_ANY, 0);
+			}
+			break;
+
+		/* IRET, FRET, with the callers' number of arguments */
+		case 0x26: case 0x4F:
+			if (entry == V->main || V->results[entry] != 1 || op->a.i != V->nargs[entry]) {
+				return 0;
+			}
+			POP(1);
+			break;
+
+		/* VRET */
+		case 0x38:
+			if (entry == V->main || V->results[entry] != 0 || op->a.i != V->nargs[entry]) {
+				return 0;
+			}
+			break;
+
+		/* IDER, BDER, FDER */
+		case 0x28: case 0x29: case 0x54:
+			POP(1);
+			PUSH(SLOT_ANY, 0);
+			break;
+
+		/* ISAVE, BSAVE, FSAVE */
+		case 0x2A: case 0x2B: case 0x59:
+			POP(2);
+			break;
+
+		/* RES, the locals are one value that can't be popped */
+		case 0x2C:
+			if (op->a.i < 0 || (op->a.i > 0 && !v_push_bytes(V, entry, SLOT_ANY, 0, op->a.i))) {
+				return 0;
+			}
+			break;
+
+		/* IINC */
+		case 0x2D:
+			POP(1);
+			if (V->stack[V->top].kind == SLOT_FRAME) {
+				PUSH(SLOT_FRAME, V->stack[V->top].value + op->a.i);
+			} else {
+				PUSH(SLOT_ANY, 0);
+			}
+			break;
+
+		/* FINC, ITOF, FTOI, NOT */
+		case 0x4E: case 0x56: case 0x57: case 0x5C:
+			POP(1);
+			PUSH(SLOT_ANY, 0);
+			break;
+
+		/* IARG, BARG, FARG */
+		case 0x2F: case 0x30: case 0x55:
+			if (op->a.i < 0 || op->a.i >= V->nargs[entry]) {
+				return 0;
+			}
+			PUSH(SLOT_ANY, 0);
+			break;
+
+		/* LEA */
+		case 0x31:
+			PUSH(SLOT_FRAME, op->a.i);
+			break;
+
+		/* LEADUP */
+		case 0x62:
+			PUSH(SLOT_FRAME, op->a.i);
+			PUSH(SLOT_FRAME, op->a.i);
+			break;
+
+		/* AISAVE, ABSAVE, AFSAVE */
+		case 0x32: case 0x33: case 0x52:
+			if (!v_absolute(op->a.i)) {
+				return 0;
+			}
+			POP(1);
+			break;
+
+		/* AIDER, ABDER, AFDER */
+		case 0x34: case 0x35: case 0x53:
+			if (!v_absolute(op->a.i)) {
+				return 0;
+			}
+			PUSH(SLOT_ANY, 0);
+			break;
+
+		/* ILOCALL, FLOCALL */
+		case 0x39: case 0x50:
+			if (!v_local(V, entry, op->a.i, 8)) {
+				return 0;
+			}
+			PUSH(SLOT_ANY, 0);
+			break;
+
+		/* BLOCALL */
+		case 0x3A:
+			if (!v_local(V, entry, op->a.i, 1)) {
+				return 0;
+			}
+			PUSH(SLOT_ANY, 0);
+			break;
+
+		/* ILOCALS, FLOCALS */
+		case 0x3B: case 0x51:
+			POP(1);
+			if (!v_local(V, entry, op->a.i, 8)) {
+				return 0;
+			}
+			break;
+
+		/* BLOCALS */
+		case 0x3C:
+			POP(1);
+			if (!v_local(V, entry, op->a.i, 1)) {
+				return 0;
+			}
+			break;
+
+		/* PE ... PNS, FCONST */
+		case 0x3D: case 0x3E: case 0x3F: case 0x40: case 0x41: case 0x42:
+		case 0x43: case 0x44: case 0x45: case 0x46: case 0x47:
+			PUSH(SLOT_ANY, 0);
+			break;
+
+		/* DUP */
+		case 0x58:
+			if (V->top < 1) {
+				return 0;
+			}
+			PUSH(TOP(0).kind, TOP(0).value);
+			break;
+
+		/* DUP2 (copies the value below the top) */
+		case 0x5F:
+			if (V->top < 2) {
+				return 0;
+			}
+			PUSH(TOP(1).kind, TOP(1).value);
+			break;
+
+		/* IADDLL */
+		case 0x60:
+			if (!v_local(V, entry, op->a.i, 8) || !v_local(V, entry, op->b.i, 8)) {
+				return 0;
+			}
+			PUSH(SLOT_ANY, 0);
+			break;
+
+		/* ISAVEP, FSAVEP, BSAVEP */
+		case 0x63: case 0x64: case 0x65:
+			POP(3);
+			break;
+
+		/* ISAVED, FSAVED, BSAVED */
+		case 0x66: case 0x67: case 0x68:
+			POP(3);
+			PUSH(SLOT_ANY, 0);
+			break;
+
+		/* ICJE ... FCJLE, IJE ... FJLE */
+		case 0x69: case 0x6A: case 0x6B: case 0x6C: case 0x6D: case 0x6E:
+		case 0x6F: case 0x70: case 0x71: case 0x72: case 0x73: case 0x74:
+		case 0x75: case 0x76: case 0x77: case 0x78: case 0x79: case 0x7A:
+		case 0x7B: case 0x7C: case 0x7D: case 0x7E: case 0x7F: case 0x80:
+			POP(2);
+			target = op->a.op;
+			if (!target) {
+				return 0;
+			}
+			break;
+
+		/* IJZ, IJNZ */
+		case 0x8D: case 0x8E:
+			POP(1);
+			target = op->a.op;
+			if (!target) {
+				return 0;
+			}
+			break;
+
+		/* SPAWN, the address has to be a constant.  the result goes to dest
+		 * (which the interpreter checks) once the task is done, the
+		 * counter is a local */
+		case 0x8F: {
+			POP(1);
+			VerifySlot addr = V->stack[V->top];
+			if (addr.kind != SLOT_CONST || addr.value < 0 || addr.value >= V->spy->code_size) {
+				return 0;
+			}
+			SpyOp* callee = V->spy->op_map[addr.value];
+			POP(1);
+			if (!callee || !v_local(V, entry, op->b.i, 8) || !v_call(V, entry, callee - V->ops, op->a.i)) {
+				return 0;
+			}
+			POP(v_results(V, callee - V->ops));
+			break;
+		}
+
+		/* SYNC */
+		case 0x90:
+			if (!v_local(V, entry, op->a.i, 8)) {
+				return 0;
+			}
+			break;
+
+		/* PFOR, the chunk code starts with the same stack as the code after
+		 * it, in a copy of the frame (from the first argument) */
+		case 0x91: {
+			POP(4);
+			VerifySlot addr = V->stack[V->top + 3];
+			if (addr.kind != SLOT_CONST || addr.value < 0 || addr.value >= V->spy->code_size
+				|| !v_local(V, entry, op->a.i, 32) || op->b.i != V->nargs[entry]) {
+				return 0;
+			}
+			target = V->spy->op_map[addr.value];
+			if (!target) {
+				return 0;
+			}
+			break;
+		}
+
+		/* PEND */
+		case 0x92:
+			break;
+
+		/* IREDUCE, FREDUCE */
+		case 0x93: case 0x94:
+			POP(2);
+			break;
+
+		/* VLOAD, VSPLAT */
+		case 0xD4: case 0xD6:
+			if (!v_vector(V, entry, op->a.i, 1, op->a.i)) {
+				return 0;
+			}
+			break;
+
+		/* VSAVE */
+		case 0xD5:
+			if (!v_vector(V, entry, op->a.i, op->a.i + 1, 0)) {
+				return 0;
+			}
+			break;
+
+		/* VLANE */
+		case 0xD7:
+			if (!v_vector(V, entry, op->a.i, op->a.i + 1, 1)) {
+				return 0;
+			}
+			break;
+
+		/* VIADD ... VFDIV */
+		case 0xD8: case 0xD9: case 0xDA: case 0xDB:
+		case 0xDC: case 0xDD: case 0xDE: case 0xDF:
+			if (!v_vector(V, entry, op->a.i, 2 * op->a.i, op->a.i)) {
+				return 0;
+			}
+			break;
+
+		/* VISUM ... VFMAX */
+		case 0xE0: case 0xE1: case 0xE2: case 0xE3: case 0xE4: case 0xE5:
+			if (!v_vector(V, entry, op->a.i, op->a.i, 1)) {
+				return 0;
+			}
+			break;
+
+		/* MEMCPY, MEMMOVE, MEMSET */
+		case 0x96: case 0x97: case 0x98:
+			POP(3);
+			break;
+
+		/* MEMCMP */
+		case 0x99:
+			POP(3);
+			PUSH(SLOT_ANY, 0);
+			break;
+
+		/* MALLOC */
+		case 0x36:
+			POP(1);
+			PUSH(SLOT_ANY, 0);
+			break;
+
+		/* FREE */
+		case 0x37:
+			POP(1);
+			break;
+
+		/* CCFCALL could call anything, everything else isn't an
+		 * instruction */
+		default:
+			return 0;
+	}
+
+	#undef POP
+	#undef PUSH
+	#undef TOP
+
+	if (target && !v_merge(V, entry, target - V->ops)) {
+		return 0;
+	}
+	if (!v_ends(op->opcode) && (i + 1 >= V->nops || !v_merge(V, entry, i + 1))) {
+		return 0;
+	}
+	return 1;
+
+}
+
+static int
+v_function(Verifier* V, uint32_t entry) {
+	V->top = 0;
+	V->bytes = 0;
+	if (!v_merge(V, entry, entry)) {
+		return 0;
+	}
+	while (V->npending > 0) {
+		uint32_t i = V->pending[--V->npending];
+		V->queued[i] = 0;
+		V->top = V->depth[i];
+		V->bytes = 0;
+		for (int32_t k = 0; k < V->top; k++) {
+			V->stack[k] = V->before[i][k];
+			V->bytes += V->stack[k].size;
+		}
+		if (!v_instruction(V, entry, i)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* the instructions that were reached don't overlap */
+static int
+v_boundaries(Verifier* V) {
+	uint8_t* used = calloc(V->spy->code_size + 1, sizeof(uint8_t));
+	int ok = 1;
+	for (uint32_t i = 0; i < V->nops && ok; i++) {
+		if (V->depth[i] < 0) {
+			continue;
+		}
+		const SpyOp* op = &V->ops[i];
+		spy_int size = v_size(V, op);
+		if (op->addr + size > V->spy->code_size) {
+			ok = 0;
+			break;
+		}
+		for (spy_int b = op->addr; b < op->addr + size; b++) {
+			if (used[b]) {
+				ok = 0;
+				break;
+			}
+			used[b] = 1;
+		}
+	}
+	free(used);
+	return ok;
+}
+
+/* frame addresses that memory instructions can use unchecked */
+static void
+v_mark(Verifier* V) {
+	for (uint32_t i = 0; i < V->nops; i++) {
+		if (V->depth[i] < 0) {
+			continue;
+		}
+		SpyOp* op = &V->ops[i];
+		const VerifySlot* s = V->before[i];
+		int32_t d = V->depth[i];
+		int32_t first, second = -1;
+		switch (op->opcode) {
+			/* IDER, BDER */
+			case 0x28: case 0x29:
+				first = d - 1;
+				break;
+			/* ISAVE, BSAVE */
+			case 0x2A: case 0x2B:
+				first = d - 2;
+				break;
+			/* ISAVEP, BSAVEP, ISAVED, BSAVED */
+			case 0x63: case 0x65: case 0x66: case 0x68:
+				first = d - 2;
+				second = d - 3;
+				break;
+			default:
+				continue;
+		}
+		spy_int frame = V->height[V->function[i]];
+		#define IN_FRAME(k) (s[k].kind == SLOT_FRAME && s[k].value >= 0 && s[k].value + 8 <= frame)
+		op->b.i = 0;
+		if (IN_FRAME(first)) {
+			op->b.i |= VERIFY_ADDR;
+		}
+		if (second >= 0 && IN_FRAME(second)) {
+			op->b.i |= VERIFY_ADDR2;
+		}
+		#undef IN_FRAME
+	}
+}
+
+/* returns 1 if the decoded code can be run by the verified interpreter,
+ * and sets spy->frame_height */
+int
+spy_verify(SpyState* spy) {
+
+	Verifier V;
+	V.spy = spy;
+	V.ops = spy->ops;
+	V.nops = spy->nops;
+	if (V.nops == 0 || !spy->op_map || !spy->op_map[0]) {
+		return 0;
+	}
+	V.main = spy->op_map[0] - spy->ops;
+	V.depth = malloc(V.nops * sizeof(int32_t));
+	V.before = calloc(V.nops, sizeof(VerifySlot *));
+	V.function = malloc(V.nops * sizeof(int32_t));
+	V.nargs = malloc(V.nops * sizeof(int32_t));
+	V.height = calloc(V.nops, sizeof(int32_t));
+	V.results = malloc(V.nops * sizeof(int8_t));
+	V.queued = calloc(V.nops, sizeof(uint8_t));
+	V.pending = malloc(V.nops * sizeof(uint32_t));
+	V.npending = 0;
+	V.entries = malloc(V.nops * sizeof(uint32_t));
+	V.nentries = 0;
+	V.stack = malloc(VERIFY_MAX_SLOTS * sizeof(VerifySlot));
+	V.top = 0;
+	for (uint32_t i = 0; i < V.nops; i++) {
+		V.depth[i] = -1;
+		V.function[i] = -1;
+		V.nargs[i] = -1;
+		V.results[i] = -2;
+	}
+	for (int i = 0; i < 256; i++) {
+		V.operands[i] = -1;
+	}
+	for (const SpyInstruction* i = spy_instructions; i->name; i++) {
+		int n = 0;
+		while (n < 4 && i->operands[n] != OP_NONE) {
+			n++;
+		}
+		V.operands[i->opcode] = n;
+	}
+
+	/* the entry point runs without arguments or anywhere to return to */
+	V.nargs[V.main] = 0;
+	V.results[V.main] = 0;
+	V.entries[V.nentries++] = V.main;
+
+	int ok = 1;
+	for (uint32_t k = 0; k < V.nentries && ok; k++) {
+		ok = v_function(&V, V.entries[k]);
+	}
+	if (ok) {
+		ok = v_boundaries(&V);
+	}
+	if (ok) {
+		spy_int height = 0;
+		for (uint32_t k = 0; k < V.nentries; k++) {
+			if (V.height[V.entries[k]] > height) {
+				height = V.height[V.entries[k]];
+			}
+		}
+		/* the entry point isn't called, its frame has to fit right away */
+		ok = height + REG_STACK_RESERVE < SIZE_STACK;
+		if (ok) {
+			spy->frame_height = height;
+			v_mark(&V);
+		}
+	}
+
+	for (uint32_t i = 0; i < V.nops; i++) {
+		free(V.before[i]);
+	}
+	free(V.depth);
+	free(V.before);
+	free(V.function);
+	free(V.nargs);
+	free(V.height);
+	free(V.results);
+	free(V.queued);
+	free(V.pending);
+	free(V.entries);
+	free(V.stack);
+
+	return ok;
+
+}
@@ -0,0 +1,14 @@
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include "vm.h"
+
+/* bits that the verifier sets in the b operand of IDER, ISAVE, ISAVEP,
+ * ISAVED (and the byte versions) when an address is known to be in the
+ * frame, the verified interpreter doesn't check those (see verify.c) */
+#define VERIFY_ADDR		(0x1 << 0) /* the address that is used first */
+#define VERIFY_ADDR2	(0x1 << 1) /* the second address of SAVEP and SAVED */
+
+int spy_verify(SpyState*);
+
+#endif
@@ -1,12 +1,23 @@
+#define _DEFAULT_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "vm.h"
 #include "spylib.h"
 #include "capi_load.h"
-
-static SpyState* spy = NULL;
+#include "regvm.h"
+#include "jit.h"
+#include "trace.h"
+#include "verify.h"
+#include "snapshot.h"
+#include "task.h"
 
 const SpyInstruction spy_instructions[255] = {
 	{"NOP", 0x00, {OP_NONE}},				/* [] -> [] */
@@ -44,10 +55,10 @@ const SpyInstruction spy_instructions[255] = {
 	{"and", 0x20, {OP_NONE}},				/* [int a, int b] -> [int result] */
 	{"or", 0x21, {OP_NONE}},				/* [int a, int b] -> [int result] */
 	{"xor", 0x22, {OP_NONE}},				/* [int a, int b] -> [int result] */
-	{"call", 0x23, {OP_INT64, OP_INT64}},	/* [] -> [int ip_save, int bp_save, int nargs */
-	{"ccall", 0x24, {OP_INT64}},			/* [int addr] -> [int ip_save, int bp_save, int nargs */
-	{"cfcall", 0x25, {OP_INT64, OP_INT64}},	/* [] -> [int ip_save, int bp_save, int nargs] */
-	{"iret", 0x26, {OP_NONE}},				/* [int ip_save, int bp_save, int nargs, int ret_val] -> [int ret_val] */
+	{"call", 0x23, {OP_INT64, OP_INT64}},	/* [args...] -> [args..., int ip_save, int bp_save] */
+	{"ccall", 0x24, {OP_INT64}},			/* [args..., int addr] -> [args..., int ip_save, int bp_save] */
+	{"cfcall", 0x25, {OP_INT64, OP_INT64}},	/* [args...] -> [results...] */
+	{"iret", 0x26, {OP_INT64}},				/* [args..., int ip_save, int bp_save, ..., int ret_val] -> [int ret_val] */
 	{"exit", 0x27, {OP_NONE}},				/* [] -> [] */
 	{"ider", 0x28, {OP_NONE}},				/* [int addr] -> [int value] */
 	{"bder", 0x29, {OP_NONE}},				/* [int addr] -> [int value (casted uint8_t)] */
@@ -56,8 +67,8 @@ const SpyInstruction spy_instructions[255] = {
 	{"res", 0x2C, {OP_INT64}},				/* [] -> [int[bytes]] */
 	{"iinc", 0x2D, {OP_INT64}},				/* [int val = x] -> [int val = x + amount] */
 	{"pop", 0x2E, {OP_NONE}},				/* [64bit thing] -> [] */
-	{"iarg", 0x2F, {OP_INT64}},				/* [] -> [int value] */
-	{"barg", 0x30, {OP_INT64}},				/* [] -> [int value (casted uint8_t)] */
+	{"iarg", 0x2F, {OP_INT64}},				/* [] -> [int value (nth argument from the last)] */
+	{"barg", 0x30, {OP_INT64}},				/* [] -> [int value (casted uint8_t, nth argument from the last)] */
 	{"lea", 0x31, {OP_INT64}},				/* [] -> [int addr] */
 	{"aisave", 0x32, {OP_INT64}},			/* [int value] -> [] */
 	{"absave", 0x33, {OP_INT64}},			/* [int value (casted uint8_t)] -> [] */
@@ -65,7 +76,7 @@ const SpyInstruction spy_instructions[255] = {
 	{"abder", 0x35, {OP_INT64}},			/* [] -> [int value (casted uint8_t)] */
 	{"malloc", 0x36, {OP_NONE}},			/* [int num_bytes] -> [int ptr] */
 	{"free", 0x37, {OP_NONE}},				/* [int ptr] -> [] */
-	{"vret", 0x38, {OP_NONE}},				/* [int ip_save, int bp_save, int nargs] -> [int ret_val] */
+	{"vret", 0x38, {OP_INT64}},				/* [args..., int ip_save, int bp_save, ...] -> [] */
 	{"ilocall", 0x39, {OP_INT64}},			/* [] -> [int value] */
 	{"blocall", 0x3A, {OP_INT64}},			/* [] -> [int value (casted uint8_t)] */
 	{"ilocals", 0x3B, {OP_INT64}},			/* [int value] -> [] */
@@ -88,24 +99,114 @@ const SpyInstruction spy_instructions[255] = {
 	{"fmul", 0x4C, {OP_NONE}},				/* [float a, float b] -> [float resu;t] */
 	{"fdiv", 0x4D, {OP_NONE}},				/* [float a, float b] -> [float resu;t] */
 	{"finc", 0x4E, {OP_FLOAT64}},			/* [float value] -> [float value] */
-	{"fret", 0x4F, {OP_NONE}},				/* [float value] -> [float value] */	
+	{"fret", 0x4F, {OP_INT64}},				/* [args..., int ip_save, int bp_save, ..., float value] -> [float value] */
 	{"flocall", 0x50, {OP_INT64}},			/* [] -> [float value] */	
 	{"flocals", 0x51, {OP_INT64}},			/* [float value] -> [] */
 	{"afsave", 0x52, {OP_INT64}},			/* [float value] -> [] */
 	{"afder", 0x53, {OP_INT64}},			/* [] -> [float value] */
 	{"fder", 0x54, {OP_NONE}},				/* [int addr] -> [float value] */
-	{"farg", 0x55, {OP_INT64}},				/* [] -> [float value] */
+	{"farg", 0x55, {OP_INT64}},				/* [] -> [float value (nth argument from the last)] */
 	{"itof", 0x56, {OP_NONE}},				/* [int value] -> [float value] */
 	{"ftoi", 0x57, {OP_NONE}},				/* [float value] -> [int value] */
 	{"dup", 0x58, {OP_NONE}},				/* [int value] -> [int value, int value] */
 	{"fsave", 0x59, {OP_NONE}},				/* [int addr, float value] -> [] */
 	{"mod", 0x5A, {OP_NONE}},				/* [int a, int b] -> [int result] */
-	{"ccfcall", 0x5B, {OP_INT64}},			/* [char* name] -> [int ip_save, int bp_save, int nargs] */
+	{"ccfcall", 0x5B, {OP_INT64}},			/* [args..., char* name] -> [results...] */
 	{"not", 0x5C, {OP_NONE}},				/* [int value] -> [int !value] */
 	{"land", 0x5D, {OP_NONE}},				/* [int a, int b] -> [int a && b] */
 	{"lor", 0x5E, {OP_NONE}},				/* [int a, int b] -> [int a || b] */
 	{"dup2", 0x5F, {OP_NONE}},				
 
+	/* superinstructions, fused by the assembler (see assemble.c) */
+	{"iaddll", 0x60, {OP_INT64, OP_INT64}},	/* ilocall a, ilocall b, iadd */
+	{"iidx", 0x61, {OP_INT64}},				/* iconst size, imul, iadd */
+	{"leadup", 0x62, {OP_INT64}},			/* lea offset, dup */
+	{"isavep", 0x63, {OP_NONE}},			/* isave, ider, pop */
+	{"fsavep", 0x64, {OP_NONE}},			/* fsave, fder, pop */
+	{"bsavep", 0x65, {OP_NONE}},			/* bsave, bder, pop */
+	{"isaved", 0x66, {OP_NONE}},			/* isave, ider */
+	{"fsaved", 0x67, {OP_NONE}},			/* fsave, fder */
+	{"bsaved", 0x68, {OP_NONE}},			/* bsave, bder */
+	{"icje", 0x69, {OP_INT64}},				/* icmp, je addr */
+	{"icjne", 0x6A, {OP_INT64}},			/* icmp, jne addr */
+	{"icjgt", 0x6B, {OP_INT64}},			/* icmp, jgt addr */
+	{"icjge", 0x6C, {OP_INT64}},			/* icmp, jge addr */
+	{"icjlt", 0x6D, {OP_INT64}},			/* icmp, jlt addr */
+	{"icjle", 0x6E, {OP_INT64}},			/* icmp, jle addr */
+	{"fcje", 0x6F, {OP_INT64}},				/* fcmp, je addr */
+	{"fcjne", 0x70, {OP_INT64}},			/* fcmp, jne addr */
+	{"fcjgt", 0x71, {OP_INT64}},			/* fcmp, jgt addr */
+	{"fcjge", 0x72, {OP_INT64}},			/* fcmp, jge addr */
+	{"fcjlt", 0x73, {OP_INT64}},			/* fcmp, jlt addr */
+	{"fcjle", 0x74, {OP_INT64}},			/* fcmp, jle addr */
+
+	/* compares that branch or push their result without touching the
+	 * flags (float compares are false for NaN, except ne, lt and le,
+	 * the same as fcmp followed by a flag jump) */
+	{"ije", 0x75, {OP_INT64}},				/* [int a, int b] -> [] */
+	{"ijne", 0x76, {OP_INT64}},				/* [int a, int b] -> [] */
+	{"ijgt", 0x77, {OP_INT64}},				/* [int a, int b] -> [] */
+	{"ijge", 0x78, {OP_INT64}},				/* [int a, int b] -> [] */
+	{"ijlt", 0x79, {OP_INT64}},				/* [int a, int b] -> [] */
+	{"ijle", 0x7A, {OP_INT64}},				/* [int a, int b] -> [] */
+	{"fje", 0x7B, {OP_INT64}},				/* [float a, float b] -> [] */
+	{"fjne", 0x7C, {OP_INT64}},				/* [float a, float b] -> [] */
+	{"fjgt", 0x7D, {OP_INT64}},				/* [float a, float b] -> [] */
+	{"fjge", 0x7E, {OP_INT64}},				/* [float a, float b] -> [] */
+	{"fjlt", 0x7F, {OP_INT64}},				/* [float a, float b] -> [] */
+	{"fjle", 0x80, {OP_INT64}},				/* [float a, float b] -> [] */
+	{"ipe", 0x81, {OP_NONE}},				/* [int a, int b] -> [int flag] */
+	{"ipne", 0x82, {OP_NONE}},				/* [int a, int b] -> [int flag] */
+	{"ipgt", 0x83, {OP_NONE}},				/* [int a, int b] -> [int flag] */
+	{"ipge", 0x84, {OP_NONE}},				/* [int a, int b] -> [int flag] */
+	{"iplt", 0x85, {OP_NONE}},				/* [int a, int b] -> [int flag] */
+	{"iple", 0x86, {OP_NONE}},				/* [int a, int b] -> [int flag] */
+	{"fpe", 0x87, {OP_NONE}},				/* [float a, float b] -> [int flag] */
+	{"fpne", 0x88, {OP_NONE}},				/* [float a, float b] -> [int flag] */
+	{"fpgt", 0x89, {OP_NONE}},				/* [float a, float b] -> [int flag] */
+	{"fpge", 0x8A, {OP_NONE}},				/* [float a, float b] -> [int flag] */
+	{"fplt", 0x8B, {OP_NONE}},				/* [float a, float b] -> [int flag] */
+	{"fple", 0x8C, {OP_NONE}},				/* [float a, float b] -> [int flag] */
+	{"ijz", 0x8D, {OP_INT64}},				/* [int value] -> [] */
+	{"ijnz", 0x8E, {OP_INT64}},				/* [int value] -> [] */
+
+	/* c-function from the import table (see spy_imports) */
+	{"cfcall_idx", 0x95, {OP_INT64, OP_INT64}},	/* [args...] -> [results...] */
+
+	/* tasks (see task.c) */
+	{"spawn", 0x8F, {OP_INT64, OP_INT64}},	/* [args..., int dest, int addr] -> [] */
+	{"sync", 0x90, {OP_INT64}},				/* [] -> [] */
+	{"pfor", 0x91, {OP_INT64, OP_INT64}},	/* [int start, int end, int step, int addr] -> [] */
+	{"pend", 0x92, {OP_NONE}},				/* [] -> [] */
+	{"ireduce", 0x93, {OP_INT64}},			/* [int addr, int value] -> [] */
+	{"freduce", 0x94, {OP_INT64}},			/* [int addr, float value] -> [] */
+
+	/* blocks of n bytes, see BLOCKS */
+	{"memcpy", 0x96, {OP_NONE}},			/* [int dest, int src, int n] -> [] */
+	{"memmove", 0x97, {OP_NONE}},			/* [int dest, int src, int n] -> [] */
+	{"memset", 0x98, {OP_NONE}},			/* [int dest, int value (casted uint8_t), int n] -> [] */
+	{"memcmp", 0x99, {OP_NONE}},			/* [int a, int b, int n] -> [int -1, 0 or 1] */
+
+	/* vectors of n lanes (the operand), see VECTORS */
+	{"vload", 0xD4, {OP_INT64}},			/* [int addr] -> [n values] */
+	{"vsave", 0xD5, {OP_INT64}},			/* [int addr, n values] -> [] */
+	{"vsplat", 0xD6, {OP_INT64}},			/* [value] -> [n values] */
+	{"vlane", 0xD7, {OP_INT64}},			/* [n values, int lane] -> [value] */
+	{"viadd", 0xD8, {OP_INT64}},			/* [n ints a, n ints b] -> [n ints result] */
+	{"visub", 0xD9, {OP_INT64}},			/* [n ints a, n ints b] -> [n ints result] */
+	{"vimul", 0xDA, {OP_INT64}},			/* [n ints a, n ints b] -> [n ints result] */
+	{"vidiv", 0xDB, {OP_INT64}},			/* [n ints a, n ints b] -> [n ints result] */
+	{"vfadd", 0xDC, {OP_INT64}},			/* [n floats a, n floats b] -> [n floats result] */
+	{"vfsub", 0xDD, {OP_INT64}},			/* [n floats a, n floats b] -> [n floats result] */
+	{"vfmul", 0xDE, {OP_INT64}},			/* [n floats a, n floats b] -> [n floats result] */
+	{"vfdiv", 0xDF, {OP_INT64}},			/* [n floats a, n floats b] -> [n floats result] */
+	{"visum", 0xE0, {OP_INT64}},			/* [n ints] -> [int sum] */
+	{"vimin", 0xE1, {OP_INT64}},			/* [n ints] -> [int min] */
+	{"vimax", 0xE2, {OP_INT64}},			/* [n ints] -> [int max] */
+	{"vfsum", 0xE3, {OP_INT64}},			/* [n floats] -> [float sum] */
+	{"vfmin", 0xE4, {OP_INT64}},			/* [n floats] -> [float min] */
+	{"vfmax", 0xE5, {OP_INT64}},			/* [n floats] -> [float max] */
+
 	/* debuggers */
 	{"ilog", 0xFD, {OP_NONE}},				
 	{"blog", 0xFE, {OP_NONE}},
@@ -116,26 +217,150 @@ const SpyInstruction spy_instructions[255] = {
 
 };
 
+/* MEMORY
+ *
+ * a state's memory is one mapping, reserved when the state is made.  pages
+ * are only backed once a program touches them, so a big heap costs nothing
+ * until it's used:
+ *   code   [0, SIZE_CODE)
+ *   stack  [SIZE_CODE, SIZE_CODE + SIZE_STACK)
+ *   guard  SIZE_GUARD bytes
+ *   heap   [START_MEMORY, START_MEMORY + heap_size)
+ *   guard  SIZE_GUARD bytes
+ *   then a stack and a guard for every other task worker (see task.c)
+ * the guards can't be read or written.  the interpreter only checks that
+ * an address is somewhere in the mapping (see BOUNDS_CHECK), and only
+ * checks for stack overflow where the code can push past the guard at
+ * once (see STACK_CHECK).  the mmu catches the rest, and spy_fault turns
+ * it into an error of the state that was running
+ */
+
+static _Thread_local SpyState* spy_running; /* for spy_fault */
+static pthread_once_t spy_fault_once = PTHREAD_ONCE_INIT;
+static struct sigaction spy_fault_old; /* what handled SIGSEGV before */
+
+/* reserves memory for a heap of heap_size bytes (rounded up to a multiple
+ * of SIZE_GUARD), anything that was mapped before is gone */
 void
-spy_init() {
+spy_map_memory(SpyState* spy, spy_int heap_size) {
+	if (spy->memory) {
+		munmap(spy->memory, spy->memory_size);
+		spy->memory = NULL;
+	}
+	if (heap_size <= 0 || heap_size > MAX_HEAP) {
+		spy_die(spy, "invalid heap size (%lld bytes)", heap_size);
+	}
+	spy->heap_size = (heap_size + SIZE_GUARD - 1) / SIZE_GUARD * SIZE_GUARD;
+	spy->memory_size = START_MEMORY + spy->heap_size + SIZE_GUARD + (spy->workers - 1) * (SIZE_STACK + SIZE_GUARD);
+	spy_byte* memory = mmap(NULL, spy->memory_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (memory == MAP_FAILED) {
+		spy_die(spy, "couldn't reserve memory (%lld bytes)", spy->memory_size);
+	}
+	if (mprotect(memory, SIZE_CODE + SIZE_STACK, PROT_READ | PROT_WRITE) != 0
+		|| mprotect(&memory[START_MEMORY], spy->heap_size, PROT_READ | PROT_WRITE) != 0) {
+		munmap(memory, spy->memory_size);
+		spy_die(spy, "couldn't reserve memory (%lld bytes)", spy->memory_size);
+	}
+	for (int i = 1; i < spy->workers; i++) {
+		spy_byte* stack = &memory[START_MEMORY + spy->heap_size + SIZE_GUARD + (i - 1) * (SIZE_STACK + SIZE_GUARD)];
+		if (mprotect(stack, SIZE_STACK, PROT_READ | PROT_WRITE) != 0) {
+			munmap(memory, spy->memory_size);
+			spy_die(spy, "couldn't reserve memory (%lld bytes)", spy->memory_size);
+		}
+	}
+	spy->memory = memory;
+	spy->stack_end = &memory[SIZE_CODE + SIZE_STACK];
+}
+
+/* SIGSEGV handler.  a fault in the memory of the state that this thread
+ * is running is an error of that state, anything else goes to the handler
+ * that was there before.  if that was the default, it's put back and the
+ * faulting instruction runs again and crashes as usual */
+static void
+spy_fault(int sig, siginfo_t* info, void* context) {
+	SpyState* spy = spy_running;
+	spy_byte* addr = info->si_addr;
+	if (!spy || addr < spy->memory || addr >= spy->memory + spy->memory_size) {
+		if (spy_fault_old.sa_flags & SA_SIGINFO) {
+			spy_fault_old.sa_sigaction(sig, info, context);
+		} else if (spy_fault_old.sa_handler == SIG_DFL || spy_fault_old.sa_handler == SIG_IGN) {
+			sigaction(sig, &spy_fault_old, NULL);
+		} else {
+			spy_fault_old.sa_handler(sig);
+		}
+		return;
+	}
+	spy_int at = addr - spy->memory;
+	spy_byte* end = spy->stack_end; /* a task worker's stack is elsewhere */
+	if (addr >= end && addr < end + SIZE_GUARD && spy->sp >= end - REG_STACK_RESERVE) {
+		spy_die(spy, "stack overflow");
+	}
+	spy_die(spy, "segmentation fault (addr=0x%llX)", at);
+}
+
+/* for the threads of task.c, returns the state that was running */
+SpyState*
+spy_set_running(SpyState* spy) {
+	SpyState* running = spy_running;
+	spy_running = spy;
+	return running;
+}
+
+/* SA_NODEFER because spy_die longjmps out of the handler */
+static void
+spy_install_fault(void) {
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_sigaction = spy_fault;
+	action.sa_flags = SA_SIGINFO | SA_NODEFER;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGSEGV, &action, &spy_fault_old);
+}
+
+/* a new state with nothing loaded, see spy_load */
+SpyState*
+spy_new(const SpyConfig* config) {
 	
-	spy = malloc(sizeof(SpyState));
-	spy->memory = malloc(SIZE_MEMORY);	
+	SpyState* spy = malloc(sizeof(SpyState));
 
-	/* zero registers for now, initialized in spy_execute */
+	/* zero registers for now, initialized in spy_run */
 	spy->ip = NULL;
 	spy->sp = NULL;
 	spy->bp = NULL;
+	spy->program = NULL;
 	spy->code = NULL;
+	spy->code_size = 0;
+	spy->ops = NULL;
+	spy->nops = 0;
+	spy->op_map = NULL;
+	spy->rconst = NULL;
+	spy->register_tier = config ? config->register_tier : 1;
+	spy->use_jit = config ? config->jit && SPY_JIT : 0; /* ignored without SPY_JIT */
+	spy->jit = NULL;
+	spy->use_trace = config ? config->trace && SPY_JIT : 0;
+	spy->trace = NULL;
+	spy->quick = NULL;
+	spy->recording = 0;
+	spy->stack_slack = 0;
+	spy->verified = 0;
+	spy->frame_height = 0;
 	spy->bail = 0;
+	spy->instructions = 0;
+	spy->snapshot = NULL;
+	spy->workers = spy_task_workers(config ? config->workers : 0);
+	spy->worker = NULL;
+	spy->owner = spy;
+	spy->out = config && config->out ? config->out : stdout;
+	spy->in = config && config->in ? config->in : stdin;
+	spy->on_error = NULL;
+
+	spy->memory = NULL;
+	spy_map_memory(spy, config && config->heap_size ? config->heap_size : SIZE_HEAP);
 
 	/* zero flags */
 	spy->flags = 0;
 
-	/* initialize c-api */
-	spy->cfuncs = malloc(sizeof(SpyCFuncList));
-	spy->cfuncs->cfunc = NULL;
-	spy->cfuncs->next = NULL;
+	/* initialize c-api, the registry is shared (see capi_load.c) */
 	spy_init_capi(spy);
 
 	/* initialize memory map */
@@ -143,46 +368,157 @@ spy_init() {
 	/* first block marks the start of the heap */
 	spy->memory_map->block = malloc(sizeof(MemoryBlock));;
 	spy->memory_map->block->bytes = 0;
-	spy->memory_map->block->addr = SIZE_CODE + SIZE_STACK;
+	spy->memory_map->block->addr = START_MEMORY;
 	spy->memory_map->next = NULL;
 	spy->memory_map->prev = NULL;
 
-}
+	return spy;
 
-static uint8_t
-spy_code_int8() {
-	return *spy->ip++;
 }
 
-static uint32_t
-spy_code_uint32() {
-	int32_t ret = *(int32_t *)spy->ip;
-	spy->ip += 4;
-	return ret;
+/* HEAP
+ *
+ * memory_map is the list of blocks that are allocated in the heap, in
+ * order of their addresses.  the first block has no bytes, it marks the
+ * start of the heap.  a new block goes in the first gap that's big
+ * enough, or after the last one.  task workers use the heap of their
+ * owner, under spy_task_lock.  MALLOC and FREE (and alloc and delete of
+ * capi_std) are the only ways in */
+
+/* address of a new block of bytes, 0 if it doesn't fit */
+spy_int
+spy_heap_alloc(SpyState* spy, spy_int requested_bytes) {
+	if (requested_bytes < 0) {
+		return 0;
+	}
+	requested_bytes += MALLOC_CHUNK; /* for case when requested_bytes == 0 */
+	SpyState* owner = spy->owner; /* task workers share its heap */
+	spy_task_lock(spy);
+	MemoryBlockList* new_list = malloc(sizeof(MemoryBlockList));
+	new_list->next = NULL;
+	new_list->prev = NULL;
+	new_list->block = malloc(sizeof(MemoryBlock));
+	new_list->block->bytes = requested_bytes + (MALLOC_CHUNK % requested_bytes);
+	MemoryBlockList* head = owner->memory_map;
+	MemoryBlockList* tail = NULL;
+	int found_slot = 0;
+	for (MemoryBlockList* i = owner->memory_map; i->next; i = i->next) {
+		spy_int pending_addr = i->block->addr + i->block->bytes;
+		spy_int delta = i->next->block->addr - pending_addr;
+		/* is there enough space to fit the block? */
+		if (new_list->block->bytes <= delta) {
+			/* found enough space: */
+			new_list->next = i->next;
+			new_list->prev = i;
+			i->next->prev = new_list;
+			i->next = new_list;
+			new_list->block->addr = pending_addr;
+			found_slot = 1;
+			break;
+		}
+		if (!i->next->next) {
+			tail = i->next;
+		}
+	}
+	/* space wasn't found... append to tail block */
+	if (!found_slot) {
+		if (tail) {
+			tail->next = new_list;
+			new_list->prev = tail;
+			new_list->block->addr = tail->block->addr + tail->block->bytes;
+		} else {
+			new_list->block->addr = head->block->addr;
+			new_list->prev = head;
+			head->next = new_list;
+		}
+	}
+	/* !!!! out of memory !!!! */
+	/* TODO defragment when OOM and retry */
+	spy_int addr = new_list->block->addr;
+	if (addr + new_list->block->bytes > START_MEMORY + owner->heap_size) {
+		new_list->prev->next = NULL;
+		free(new_list->block);
+		free(new_list);
+		addr = 0;
+	}
+	spy_task_unlock(spy);
+	return addr;
 }
 
-static spy_int
-spy_code_int64() {
-	spy_int ret = *(spy_int *)spy->ip;
-	spy->ip += 8;
-	return ret;
+/* frees the block at addr, which has to be one that spy_heap_alloc
+ * returned */
+void
+spy_heap_free(SpyState* spy, spy_int addr) {
+	SpyState* owner = spy->owner;
+	spy_task_lock(spy);
+	/* the first block only marks the start of the heap, the first one
+	 * that's allocated has the same address */
+	for (MemoryBlockList* i = owner->memory_map->next; i; i = i->next) {
+		if (i->block->addr == addr) {
+			i->prev->next = i->next;
+			if (i->next) {
+				i->next->prev = i->prev;
+			}
+			free(i->block);
+			free(i);
+			spy_task_unlock(spy);
+			return;
+		}
+	}
+	spy_task_unlock(spy);
+	spy_die(spy, "attempt to free an invalid pointer (addr=0x%llX)", addr);
 }
 
-static spy_float
-spy_code_float() {
-	spy_float ret = *(spy_float *)spy->ip;
-	spy->ip += 8;
-	return ret;
+void
+spy_free(SpyState* spy) {
+
+	if (spy->jit) {
+		spy_jit_free(spy, spy->jit);
+	}
+	if (spy->trace) {
+		spy_trace_free(spy, spy->trace);
+	}
+	spy_snapshot_free(spy);
+	free(spy->quick);
+
+	MemoryBlockList* blocks = spy->memory_map;
+	while (blocks) {
+		MemoryBlockList* next = blocks->next;
+		free(blocks->block);
+		free(blocks);
+		blocks = next;
+	}
+
+	/* the ops are only the state's own if decoding failed */
+	if (!spy->program || spy->ops != spy->program->ops) {
+		free(spy->ops);
+		free(spy->op_map);
+		free(spy->rconst);
+	}
+	if (spy->program) {
+		spy_program_free(spy->program);
+	}
+	if (spy->memory) {
+		munmap(spy->memory, spy->memory_size);
+	}
+	free(spy);
+
 }
 
+/* while a state is loading or running, errors only end that state (the
+ * call to spy_load or spy_run returns 1), otherwise they exit */
 void
-spy_die(const char* msg, ...) {
+spy_die(SpyState* spy, const char* msg, ...) {
 	va_list args;
+	FILE* out = spy ? spy->out : stdout;
 	va_start(args, msg);
-	printf("\n\n*** SPYRE RUNTIME ERROR ***\n\tmessage: ");
-	vprintf(msg, args);
-	printf("\n\n\n");
+	fprintf(out, "\n\n*** SPYRE RUNTIME ERROR ***\n\tmessage: ");
+	vfprintf(out, msg, args);
+	fprintf(out, "\n\n\n");
 	va_end(args); /* is this really necessary? */
+	if (spy && spy->on_error) {
+		longjmp(*spy->on_error, 1);
+	}
 	exit(1);
 }
 
@@ -197,18 +533,8 @@ spy_get_instruction(const char* name) {
 	return NULL;
 }
 
-static const SpyInstruction*
-spy_get_instruction_op(uint8_t opcode) {
-	for (const SpyInstruction* i = spy_instructions; i->name; i++) {
-		if (i->opcode == opcode) {
-			return i;
-		}	
-	}
-	return NULL;
-}
-
 void
-spy_dump() {
+spy_dump(SpyState* spy) {
 	printf("STACK: \n");
 	for (uint8_t* i = spy->sp; i >= &spy->memory[SIZE_CODE] + 8; i -= 8) {
 		printf("\t[SP + 0x%04lx]: %lld\n", i - &spy->memory[SIZE_CODE], *(spy_int *)i);
@@ -226,793 +552,972 @@ spy_dump() {
 	printf("\tNS:   %d\n", !(spy->flags & FLAG_S));
 }
 
-/*
+static spy_int
+spy_read_int64(const spy_byte* at) {
+	spy_int ret;
+	memcpy(&ret, at, sizeof(spy_int));
+	return ret;
+}
+
+SpyCFunc*
+spy_find_cfunc(SpyState* spy, const char* name) {
+	return spy_capi_find(name);
+}
+
+/* PRE-DECODING
  *
- * note: there is no differentiation between code and data... the
- * first instructions that is executed is whatever is at code[0]...
- * therefore, the first instruction should (almost) always be
- * some sort of jump instruction to an entry point
+ * before anything is executed, the bytecode is translated into an array
+ * of fixed-width SpyOps (see vm.h).  code and data are mixed together in
+ * the bytecode, so it can't just be swept from start to finish... instead
+ * the decoder follows control flow from every address that could possibly
+ * be executed: the entry point, every jump/call target, and every iconst
+ * operand that lands inside of the code (computed addresses for ccall,
+ * cjmp, etc. can only come from there).  if some data is decoded by
+ * accident, that's fine, it will just never be executed.
+ *
+ * instructions are decoded in runs... a run continues until it hits an
+ * instruction that never falls through, or until it reaches an address
+ * that has already been decoded (then a jmp to that instruction is added)
  */
-void
-spy_execute(const char* filename) {
-	
-	/* read file contents into code */
-	uint8_t* code;
-	FILE* handle;
-	spy_int flen;
 
-	handle = fopen(filename, "rb");
-	if (!handle) {
-		spy_die("couldn't read bytecode from '%s'", filename);
+typedef struct Decoder Decoder;
+
+/* instructions that continue with the next instruction, but could also
+ * go to the code address in their first operand */
+int
+spy_is_branch(uint8_t opcode) {
+	switch (opcode) {
+		case 0x04: case 0x05: case 0x06: case 0x07: case 0x08:
+		case 0x09: case 0x0A: case 0x0B: case 0x0C: case 0x0D:
+		case 0x23:
+		case 0x69: case 0x6A: case 0x6B: case 0x6C: case 0x6D: case 0x6E:
+		case 0x6F: case 0x70: case 0x71: case 0x72: case 0x73: case 0x74:
+		case 0x75: case 0x76: case 0x77: case 0x78: case 0x79: case 0x7A:
+		case 0x7B: case 0x7C: case 0x7D: case 0x7E: case 0x7F: case 0x80:
+		case 0x8D: case 0x8E:
+			return 1;
 	}
-	fseek(handle, 0, SEEK_END);
-	flen = ftell(handle);
-	rewind(handle);
-	code = malloc(flen);
-	fread(code, 1, flen, handle);
-	fclose(handle);
+	return 0;
+}
 
-	/* copy code into memory */
-	memcpy(&spy->memory[0], code, flen);
+struct Decoder {
+	const spy_byte* code;
+	spy_int size;
+	uint32_t* index; /* code offset -> index into ops + 1, 0 if not decoded */
+	SpyOp* ops;
+	uint32_t nops;
+	uint32_t ops_cap;
+	uint32_t* pending; /* offsets that still need to be decoded */
+	uint32_t npending;
+	uint32_t pending_cap;
+	uint32_t* guesses; /* iconst operands that might be code */
+	uint32_t nguesses;
+	uint32_t guesses_cap;
+	const SpyInstruction* instructions[256];
+};
 
-	/* initialize registers */
-	spy->code = code;
-	spy->ip = &spy->memory[0];
-	spy->sp = &spy->memory[SIZE_CODE]; /* stack grows up */
-	spy->bp = &spy->memory[SIZE_CODE];
-	
-	/* other stuff */
-	uint8_t opcode;
-
-	/* NOTES
-	 *
-	 * 1. for now, jump instructions are relative to the
-	 * start of the code section (INCLUDING the data section)
-	 * e.g. ip becomes &code[addr];
-	 * 
-	 *
-	 */
-
-	/* some useful macros for instructions */
-
-	#define JMPCOND(cond) \
-		{ \
-			spy_int addr = spy_code_int64(); \
-			if ((cond)) { \
-				spy->ip = &code[addr]; \
-			} \
-		}
+static void
+decoder_queue(Decoder* D, spy_int addr) {
+	if (addr < 0 || addr >= D->size || D->index[addr]) {
+		return;
+	}
+	if (D->npending == D->pending_cap) {
+		D->pending_cap *= 2;
+		D->pending = realloc(D->pending, D->pending_cap * sizeof(uint32_t));
+	}
+	D->pending[D->npending++] = (uint32_t)addr;
+}
 
-	#define CJMPCOND(cond) \
-		{ \
-			spy_int addr = spy_pop_int(spy); \
-			if ((cond)) { \
-				spy->ip = &code[addr]; \
-			} \
-		}
+static void
+decoder_guess(Decoder* D, spy_int addr) {
+	if (addr < 0 || addr >= D->size || D->index[addr]) {
+		return;
+	}
+	if (D->nguesses == D->guesses_cap) {
+		D->guesses_cap *= 2;
+		D->guesses = realloc(D->guesses, D->guesses_cap * sizeof(uint32_t));
+	}
+	D->guesses[D->nguesses++] = (uint32_t)addr;
+}
 
-	#define INTARITH(op) \
-		{ \
-			spy_int b = spy_pop_int(spy); \
-			spy_int a = spy_pop_int(spy); \
-			spy_push_int(spy, a op b); \
+static SpyOp*
+decoder_emit(Decoder* D, uint8_t opcode, uint32_t addr) {
+	if (D->nops == D->ops_cap) {
+		D->ops_cap *= 2;
+		D->ops = realloc(D->ops, D->ops_cap * sizeof(SpyOp));
+	}
+	SpyOp* op = &D->ops[D->nops++];
+	op->handler = NULL;
+	op->a.i = 0;
+	op->b.i = 0;
+	op->addr = addr;
+	op->opcode = opcode;
+	memset(op->base, 0, sizeof(op->base));
+	memset(op->reg, 0, sizeof(op->reg));
+	op->sp_delta = 0;
+	return op;
+}
+
+static void
+decoder_run(Decoder* D, uint32_t at) {
+	for (;;) {
+		if (at >= D->size) {
+			/* ran off the end of the code, behave like the trailing NOP */
+			decoder_emit(D, 0x00, at);
+			return;
 		}
-	
-	#define FLOATARITH(op) \
-		{ \
-			spy_float b = spy_pop_float(spy); \
-			spy_float a = spy_pop_float(spy); \
-			spy_push_float(spy, a op b); \
+		if (D->index[at]) {
+			/* reached code that was already decoded, jump to it */
+			SpyOp* op = decoder_emit(D, 0x0E, at);
+			op->a.i = at;
+			return;
 		}
-
-	#define CMPTYPE(type) \
-		{ \
-			spy_ ## type b = spy_pop_ ## type(spy); \
-			spy_ ## type a = spy_pop_ ## type(spy); \
-			if (a == b) { \
-				spy->flags |= FLAG_EQ; \
-				spy->flags &= ~(FLAG_LT | FLAG_GT); \
-			} else if (a > b) { \
-				spy->flags |= FLAG_GT; \
-				spy->flags &= ~(FLAG_LT | FLAG_EQ); \
-			} else { \
-				spy->flags |= FLAG_LT; \
-				spy->flags &= ~(FLAG_GT | FLAG_EQ); \
-			} \
-			if (a - b > 0) { \
-				spy->flags &= ~FLAG_S; \
-			} else { \
-				spy->flags |= FLAG_S; \
-			} \
-		} 
-
-	#define TESTTYPE(type) \
-		{ \
-			spy_ ## type a = spy_pop_ ## type(spy); \
-			if (a == 0) { \
-				spy->flags |= FLAG_Z; \
-			} else { \
-				spy->flags &= ~FLAG_Z; \
-			} \
-			if (a < 0) { \
-				spy->flags |= FLAG_S; \
-			} else { \
-				spy->flags &= ~FLAG_S; \
-			} \
+		uint8_t opcode = D->code[at];
+		const SpyInstruction* ins = D->instructions[opcode];
+		uint32_t size = 1;
+		int noperands = 0;
+		if (ins) {
+			for (; noperands < 4 && ins->operands[noperands] != OP_NONE; noperands++) {
+				size += 8;
+			}
 		}
-
-	#define PUSHFLAG(flag) spy_push_int(spy, (spy->flags & (flag)) != 0)
-	
-	#define PUSHNOTFLAG(flag) spy_push_int(spy, !(spy->flags & (flag)))
-
-	#define BOUNDS_CHECK(addr) if (addr <= 0 || addr >= START_MEMORY + SIZE_MEMORY) spy_die("segmentation fault (addr=0x%X)", addr)
-	
-	uint64_t instructions = 0;			
-
-	/* go */
-	do {
-		/* check for stack overflow before executing the next instruction...
-		 * note: 24 is the maximum stack space that an instruction requires */
-		if (&spy->memory[SIZE_STACK + SIZE_CODE] - spy->sp <= 24) {
-			spy_die("stack overflow");
+		if (at + size > D->size) {
+			decoder_emit(D, 0x00, at);
+			return;
 		}
-
-		if (spy->bail) {
-			break;
+		SpyOp* op = decoder_emit(D, opcode, at);
+		D->index[at] = D->nops;
+		if (noperands > 0) {
+			op->a.i = spy_read_int64(&D->code[at + 1]);
+		}
+		if (noperands > 1) {
+			op->b.i = spy_read_int64(&D->code[at + 9]);
+		}
+		if (spy_is_branch(opcode)) {
+			decoder_queue(D, op->a.i);
 		}
-
-		opcode = spy_code_int8();
-		
-		/*		
-		const SpyInstruction* ins = spy_get_instruction_op(opcode);
-		printf("EXECUTED (%s)\n", ins->name);
-		*/
-
-		instructions++;
-
 		switch (opcode) {
-			/* NOP */
-			case 0x00: 
-				break;
-
-			/* ICONST */
-			case 0x01: 
-				spy_push_int(spy, spy_code_int64());
-				break;
-
-			/* ICMP */
-			case 0x02: 
-				CMPTYPE(int);
-				break;
-			
-
-			/* ITEST */
-			case 0x03: 
-				TESTTYPE(int);
-				break;
-			
-			/* JE */	
-			case 0x04: 
-				JMPCOND(spy->flags & FLAG_EQ);
-				break;
-			
-			/* JNE */
-			case 0x05:
-				JMPCOND(!(spy->flags & FLAG_EQ));
-				break;
-
-			/* JGT */
-			case 0x06:
-				JMPCOND(spy->flags & FLAG_GT);
-				break;
-	
-			/* JGE */
-			case 0x07:
-				JMPCOND(!(spy->flags & FLAG_LT));
-				break;
-
-			/* JLT */
-			case 0x08:
-				JMPCOND(spy->flags & FLAG_LT);
-				break;
-			
-			/* JLE */
-			case 0x09:
-				JMPCOND(!(spy->flags & FLAG_GT));
-				break;
-
-			/* JZ */
-			case 0x0A:
-				JMPCOND(spy->flags & FLAG_Z);
-				break;
-			
-			/* JNZ */
-			case 0x0B:
-				JMPCOND(!(spy->flags & FLAG_Z));
-				break;
-
-			/* JS */
-			case 0x0C:
-				JMPCOND(spy->flags & FLAG_S);
+			/* iconst could be the address of a function */
+			case 0x01:
+				decoder_guess(D, op->a.i);
 				break;
-
-			/* JNS */
-			case 0x0D:
-				JMPCOND(!(spy->flags & FLAG_S));
-				break;
-	
 			/* JMP */
 			case 0x0E:
-				JMPCOND(1); /* will be optimized */
-				break;
-
-			/* CJEQ */	
-			case 0x0F: 
-				CJMPCOND(spy->flags & FLAG_EQ);
-				break;
-			
-			/* CJNEQ */
-			case 0x10:
-				CJMPCOND(!(spy->flags & FLAG_EQ));
-				break;
+				decoder_queue(D, op->a.i);
+				return;
+			/* never fall through: NOP, CJMP, IRET, EXIT, VRET, FRET, PEND */
+			case 0x00: case 0x19: case 0x26: case 0x27: case 0x38: case 0x4F: case 0x92:
+				return;
+		}
+		at += size;
+	}
+}
 
-			/* CJGT */
-			case 0x11:
-				CJMPCOND(spy->flags & FLAG_GT);
-				break;
-	
-			/* CJGE */
-			case 0x12:
-				CJMPCOND(!(spy->flags & FLAG_GT));
-				break;
+static void
+decoder_drain(Decoder* D) {
+	while (D->npending > 0) {
+		uint32_t at = D->pending[--D->npending];
+		if (!D->index[at]) {
+			decoder_run(D, at);
+		}
+	}
+}
 
-			/* CJLT */
-			case 0x13:
-				CJMPCOND(spy->flags & FLAG_LT);
-				break;
-			
-			/* CJLE */
-			case 0x14:
-				CJMPCOND(!(spy->flags & FLAG_GT));
-				break;
+/* IMPORTS
+ *
+ * the assembler turns cfcall name, n into cfcall_idx index, n and ends the
+ * bytecode with the names that are called that way:
+ *   addr[nimports]  where each name is in the code
+ *   nimports
+ *   IMPORT_MAGIC
+ * every name is looked up once, when the program is made, and a program
+ * that calls a c-function that doesn't exist isn't loaded.  the decoder
+ * gives every cfcall_idx its SpyCFunc from the table.  bytecode without
+ * a table (hand-written, or from an older assembler) has no imports */
+static void
+spy_imports(SpyState* spy, const spy_byte* code, spy_int size) {
+	SpyProgram* program = spy->program;
+	if (size < 16 || memcmp(&code[size - 8], IMPORT_MAGIC, 8)) {
+		return;
+	}
+	spy_int n = spy_read_int64(&code[size - 16]);
+	if (n < 0 || n > (size - 16) / 8) {
+		spy_die(spy, "invalid import table");
+	}
+	const spy_byte* table = &code[size - 16 - 8 * n];
+	program->imports = malloc((n > 0 ? n : 1) * sizeof(SpyCFunc *));
+	program->nimports = n;
+	for (spy_int i = 0; i < n; i++) {
+		spy_int addr = spy_read_int64(&table[8 * i]);
+		if (addr < 0 || addr >= size || !memchr(&code[addr], 0, size - addr)) {
+			spy_die(spy, "invalid import table");
+		}
+		program->imports[i] = spy_find_cfunc(spy, (const char *)&code[addr]);
+		if (!program->imports[i]) {
+			spy_die(spy, "unknown c-function '%s'", &code[addr]);
+		}
+	}
+}
 
-			/* CJZ */
-			case 0x15:
-				CJMPCOND(spy->flags & FLAG_Z);
-				break;
-			
-			/* CJNZ */
-			case 0x16:
-				CJMPCOND(!(spy->flags & FLAG_Z));
-				break;
+static void
+spy_decode(SpyState* spy, const spy_byte* code, spy_int size) {
+	
+	Decoder D;
+	D.code = code;
+	D.size = size;
+	D.index = calloc(size + 1, sizeof(uint32_t));
+	D.nops = 0;
+	D.ops_cap = size / 4 + 16;
+	D.ops = malloc(D.ops_cap * sizeof(SpyOp));
+	D.npending = 0;
+	D.pending_cap = 64;
+	D.pending = malloc(D.pending_cap * sizeof(uint32_t));
+	D.nguesses = 0;
+	D.guesses_cap = 64;
+	D.guesses = malloc(D.guesses_cap * sizeof(uint32_t));
+	memset(D.instructions, 0, sizeof(D.instructions));
+	for (const SpyInstruction* i = spy_instructions; i->name; i++) {
+		D.instructions[i->opcode] = i;
+	}
 
-			/* CJS */
-			case 0x17:
-				CJMPCOND(spy->flags & FLAG_S);
-				break;
+	/* entry point is code[0] */
+	decoder_queue(&D, 0);
+	decoder_drain(&D);
+
+	/* an iconst operand is often a string or a number, not a function.
+	 * what it points at is decoded only if every branch in it goes
+	 * somewhere in the code, otherwise it's thrown away again and a
+	 * computed jump there dies in spy_op_at */
+	while (D.nguesses > 0) {
+		uint32_t at = D.guesses[--D.nguesses];
+		if (D.index[at]) {
+			continue;
+		}
+		uint32_t first = D.nops;
+		decoder_run(&D, at);
+		decoder_drain(&D);
+		int valid = 1;
+		for (uint32_t i = first; i < D.nops && valid; i++) {
+			const SpyOp* op = &D.ops[i];
+			if ((spy_is_branch(op->opcode) || op->opcode == 0x0E) && (op->a.i < 0 || op->a.i >= size)) {
+				valid = 0;
+			}
+		}
+		if (!valid) {
+			for (uint32_t i = first; i < D.nops; i++) {
+				uint32_t addr = D.ops[i].addr;
+				if (addr < size && D.index[addr] > first) {
+					D.index[addr] = 0;
+				}
+			}
+			D.nops = first;
+		}
+	}
 
-			/* CJNS */
-			case 0x18:
-				CJMPCOND(!(spy->flags & FLAG_S));
+	/* everything is decoded, now resolve addresses and names */
+	for (SpyOp* op = D.ops; op < D.ops + D.nops; op++) {
+		if (spy_is_branch(op->opcode) || op->opcode == 0x0E) {
+			/* only code that the program really reaches is left, so this
+			 * is a corrupt program.  never hand the interpreter a branch
+			 * without a target */
+			spy_int addr = op->a.i;
+			if (addr < 0 || addr >= size || !D.index[addr]) {
+				free(D.index);
+				free(D.pending);
+				free(D.guesses);
+				free(D.ops);
+				spy_die(spy, "invalid jump target (addr=0x%llX)", addr);
+			}
+			op->a.op = &D.ops[D.index[addr] - 1];
+			continue;
+		}
+		switch (op->opcode) {
+			case 0x25: {
+				spy_int addr = op->a.i;
+				op->a.cfunc = NULL;
+				if (addr >= 0 && addr < size && memchr(&code[addr], 0, size - addr)) {
+					op->a.cfunc = spy_find_cfunc(spy, (const char *)&code[addr]);
+				}
 				break;
-
-			/* CJMP */
-			case 0x19:
-				CJMPCOND(1); /* will be optimized */
+			}
+			case 0x95: {
+				spy_int index = op->a.i;
+				SpyProgram* program = spy->program;
+				op->a.cfunc = (index >= 0 && index < program->nimports) ? program->imports[index] : NULL;
 				break;
+			}
+		}
+	}
 
-			/* IADD */
-			case 0x1A:
-				INTARITH(+);
-				break;
+	spy->ops = D.ops;
+	spy->nops = D.nops;
+	spy->op_map = calloc(size, sizeof(SpyOp *));
+	for (spy_int i = 0; i < size; i++) {
+		if (D.index[i]) {
+			spy->op_map[i] = &D.ops[D.index[i] - 1];
+		}
+	}
+	spy->code_size = size;
 
-			/* ISUB */
-			case 0x1B:
-				INTARITH(-);
-				break;
+	free(D.index);
+	free(D.pending);
+	free(D.guesses);
 
-			/* IMUL */
-			case 0x1C:
-				INTARITH(*);
-				break;
+}
 
-			/* IDIV */
-			case 0x1D:
-				INTARITH(/);
-				break;
+/* STACK BOUNDS
+ *
+ * the interpreter doesn't check for stack overflow before every
+ * instruction.  it checks only at safepoints: res (the start of every
+ * frame), calls, computed jumps and backward jumps.  between two
+ * safepoints ip only moves forward, so every instruction runs at most
+ * once, and the stack can grow at most by the sum of what they push.
+ * res checks for its locals plus the longest such run after it, the
+ * other safepoints check for the longest run that starts at any place
+ * they can go to (spy->stack_slack) */
+
+/* most bytes that an instruction leaves on the stack */
+static spy_int
+stack_growth(const SpyOp* op) {
+	switch (op->opcode) {
+		/* ICONST, FCONST, IARG, BARG, FARG, LEA, AIDER, ABDER, AFDER */
+		case 0x01: case 0x47: case 0x2F: case 0x30: case 0x55: case 0x31:
+		case 0x34: case 0x35: case 0x53:
+		/* ILOCALL, BLOCALL, FLOCALL, PE ... PNS, DUP, IADDLL */
+		case 0x39: case 0x3A: case 0x50: case 0x3D: case 0x3E: case 0x3F:
+		case 0x40: case 0x41: case 0x42: case 0x43: case 0x44: case 0x45:
+		case 0x46: case 0x58: case 0x60:
+		/* CFCALL, CCFCALL, CFCALL_IDX (return value) */
+		case 0x25: case 0x5B: case 0x95:
+			return 8;
+		/* DUP2, LEADUP */
+		case 0x5F: case 0x62:
+			return 16;
+		/* CALL, CCALL (saved ip and bp) */
+		case 0x23: case 0x24:
+			return 16;
+		/* VLOAD, VSPLAT (n lanes for one value) */
+		case 0xD4: case 0xD6:
+			return op->a.i > 1 && op->a.i <= VECTOR_MAX_LANES ? 8 * (op->a.i - 1) : 0;
+	}
+	return 0;
+}
 
-			/* SHL */
-			case 0x1E:
-				INTARITH(<<);
-				break;
+/* instructions that never continue with the next one */
+static int
+stack_ends_run(uint8_t opcode) {
+	switch (opcode) {
+		case 0x00: case 0x0E: case 0x19: case 0x26: case 0x27: case 0x38: case 0x4F: case 0x92:
+			return 1;
+	}
+	return 0;
+}
 
-			/* SHR */
-			case 0x1F:
-				INTARITH(>>);
-				break;
+static void
+spy_stack_bounds(SpyState* spy) {
+	spy_int* bound = calloc(spy->nops + 1, sizeof(spy_int));
+	spy_int slack = 0;
+
+	/* runs only go forward, so the ops can be done back to front */
+	for (spy_int i = spy->nops - 1; i >= 0; i--) {
+		SpyOp* op = &spy->ops[i];
+		spy_int next = stack_ends_run(op->opcode) ? 0 : bound[i + 1];
+		if (op->opcode != 0x23 && (spy_is_branch(op->opcode) || op->opcode == 0x0E) && op->a.op > op) {
+			spy_int jump = bound[op->a.op - spy->ops];
+			if (jump > next) {
+				next = jump;
+			}
+		}
+		if (op->opcode == 0x2C) {
+			/* RES is a safepoint itself */
+			op->b.i = op->a.i + next;
+			bound[i] = 0;
+		} else {
+			bound[i] = stack_growth(op) + next;
+		}
+	}
 
-			/* AND */
-			case 0x20:
-				INTARITH(&);
-				break;
+	/* where the other safepoints can go: the entry point, backward jump
+	 * targets, call targets and every computed address */
+	slack = bound[spy->op_map[0] - spy->ops];
+	for (spy_int i = 0; i < spy->nops; i++) {
+		SpyOp* op = &spy->ops[i];
+		SpyOp* target = NULL;
+		if ((spy_is_branch(op->opcode) || op->opcode == 0x0E) && op->a.op && (op->opcode == 0x23 || op->a.op <= op)) {
+			target = op->a.op;
+		} else if (op->opcode == 0x01 && op->a.i >= 0 && op->a.i < spy->code_size) {
+			target = spy->op_map[op->a.i];
+		}
+		if (target && bound[target - spy->ops] > slack) {
+			slack = bound[target - spy->ops];
+		}
+	}
+	spy->stack_slack = slack;
 
-			/* OR */
-			case 0x21:
-				INTARITH(|);
-				break;
+	free(bound);
+}
 
-			/* XOR */
-			case 0x22:
-				INTARITH(^);
-				break;
+/* decoded instruction at a computed code address */
+SpyOp*
+spy_op_at(SpyState* spy, spy_int addr) {
+	if (addr < 0 || addr >= spy->code_size || !spy->op_map[addr]) {
+		spy_die(spy, "invalid jump target (addr=0x%llX)", addr);
+	}
+	return spy->op_map[addr];
+}
 
-			/* CALL */
-			case 0x23: {
-				spy_int addr = spy_code_int64();
-				spy_int nargs = spy_code_int64();
-				if (nargs > 1) {
-					uint64_t* args = malloc(nargs * sizeof(uint64_t));
-					for (int i = 0; i < nargs; i++) {
-						args[i] = spy_pop_int(spy);
-					}
-					for (int i = 0; i < nargs; i++) {
-						spy_push_int(spy, args[i]);
-					}
-					free(args);
-				}
-				/* save things on stack */
-				spy_push_int(spy, (intptr_t)spy->ip);	/* save ip */
-				spy_push_int(spy, (intptr_t)spy->bp);	/* save bp */
-				spy_push_int(spy, (spy_int)nargs);  /* save nargs */
-				spy->bp = spy->sp;
-				spy->ip = &code[addr];
-				break;
-			}
-			
-			/* CCALL (computed call, NOT C-func call) */
-			case 0x24: {
-				spy_int addr = spy_pop_int(spy);
-				spy_int nargs = spy_code_int64();
-				if (nargs > 1) {
-					uint64_t* args = malloc(nargs * sizeof(uint64_t));
-					for (int i = 0; i < nargs; i++) {
-						args[i] = spy_pop_int(spy);
-					}
-					for (int i = 0; i < nargs; i++) {
-						spy_push_int(spy, args[i]);
-					}
-					free(args);
-				}
-				/* save things on stack */
-				spy_push_int(spy, (intptr_t)spy->ip);	/* save ip */
-				spy_push_int(spy, (intptr_t)spy->bp);	/* save bp */
-				spy_push_int(spy, (spy_int)nargs);  /* save nargs */
-				spy->bp = spy->sp;
-				spy->ip = &code[addr];
-				break;	
-			}
+/* QUICKENING
+ *
+ * ccall and ccfcall work out their target every time they run, but most
+ * of them always get the same one.  a state keeps the last target of
+ * each of them (spy->quick, by op) and only looks it up again when it's
+ * given another address.  the ops themselves are never written, they're
+ * shared by every state that runs the program (and by its task workers,
+ * which don't keep targets) */
+
+/* target of the CCALL op, given addr */
+SpyOp*
+spy_quick_op(SpyState* spy, const SpyOp* op, spy_int addr) {
+	SpyQuick* quick = spy->quick ? &spy->quick[op - spy->ops] : NULL;
+	if (quick && quick->target && quick->key == addr) {
+		return quick->target;
+	}
+	SpyOp* target = spy_op_at(spy, addr);
+	if (quick) {
+		quick->key = addr;
+		quick->target = target;
+	}
+	return target;
+}
 
-			/* CFCALL (c-func call) */
-			case 0x25: {
-				char* cf_name = (char *)&code[spy_code_int64()];
-				spy_int nargs = spy_code_int64();
-				if (nargs > 1) {
-					uint64_t* args = malloc(nargs * sizeof(uint64_t));
-					for (int i = 0; i < nargs; i++) {
-						args[i] = spy_pop_int(spy);
-					}
-					for (int i = 0; i < nargs; i++) {
-						spy_push_int(spy, args[i]);
-					}
-					free(args);
-				}
-				SpyCFunc* cfunc = NULL;
-				for (SpyCFuncList* i = spy->cfuncs; i; i = i->next) {
-					if (!i->cfunc) {
-						break;
-					}
-					if (!strcmp(i->cfunc->name, cf_name)) {
-						cfunc = i->cfunc;
-						break;
-					}	
-				}
-				if (!cfunc) {
-					spy_die("unknown c-function '%s'", cf_name);
-				}
-				cfunc->f(spy);
-				break;
-			}
+/* c-function of the CCFCALL op, given the address of its name.  only
+ * names in the code are kept, anything else can change */
+SpyCFunc*
+spy_quick_cfunc(SpyState* spy, const SpyOp* op, spy_int name) {
+	SpyQuick* quick = spy->quick ? &spy->quick[op - spy->ops] : NULL;
+	if (quick && quick->target && quick->key == name) {
+		return quick->target;
+	}
+	SpyCFunc* cfunc = spy_find_cfunc(spy, (char *)&spy->code[name]);
+	if (!cfunc) {
+		spy_die(spy, "unknown c-function '%s'", &spy->code[name]);
+	}
+	if (quick && name >= 0 && name < spy->code_size) {
+		quick->key = name;
+		quick->target = cfunc;
+	}
+	return cfunc;
+}
 
-			/* IRET */
-			case 0x26: {
-				spy_int retval, nargs;
-				retval = spy_pop_int(spy);
-				spy->sp = spy->bp;
-				nargs = spy_pop_int(spy);
-				spy->bp = (uint8_t *)spy_pop_int(spy);
-				spy->ip = (uint8_t *)spy_pop_int(spy);
-				spy->sp -= nargs * 8;
-				spy_push_int(spy, retval);
-				break;
-			}
+/* arguments are pushed first to last, but c-functions pop the first one
+ * first.  CFCALL and CCFCALL turn them around where they are */
+void
+spy_cfunc_args(SpyState* spy, spy_int nargs) {
+	if (nargs < 0 || nargs > (spy->sp - (spy->stack_end - SIZE_STACK)) / 8) {
+		spy_die(spy, "invalid c-function call (%lld arguments)", nargs);
+	}
+	spy_byte* lo = spy->sp - (nargs - 1) * 8;
+	spy_byte* hi = spy->sp;
+	while (lo < hi) {
+		spy_int tmp;
+		memcpy(&tmp, lo, 8);
+		memcpy(lo, hi, 8);
+		memcpy(hi, &tmp, 8);
+		lo += 8;
+		hi -= 8;
+	}
+}
 
-			/* EXIT */
-			case 0x27:
-				//printf("INSTRUCTIONS EXECUTED: %llu\n", instructions);
-				return;
+/* the code in a temporary file, so that every state can map it over the
+ * start of its memory.  the pages are shared until a state writes to
+ * them.  -1 if there is nowhere to put the file */
+static int
+spy_code_image(const spy_byte* code, spy_int size) {
+	FILE* handle = tmpfile();
+	int image = -1;
+	if (!handle) {
+		return -1;
+	}
+	if (fwrite(code, 1, size, handle) == (size_t)size && fflush(handle) == 0) {
+		image = dup(fileno(handle));
+	}
+	fclose(handle);
+	return image;
+}
 
-			/* IDER */
-			case 0x28: {
-				spy_int addr = spy_pop_int(spy);
-				BOUNDS_CHECK(addr);
-				spy_push_int(spy, *(spy_int *)&spy->memory[addr]);
-				break;
-			}
+/* a program for size bytes of code that isn't decoded yet, it's given to
+ * spy, see spy_make_program */
+static void
+spy_program_alloc(SpyState* spy, spy_byte* code, spy_int size, int image, int mapped) {
+	SpyProgram* program = malloc(sizeof(SpyProgram));
+	memset(program, 0, sizeof(SpyProgram));
+	program->code = code;
+	program->code_size = size;
+	program->image = image;
+	program->mapped = mapped;
+	atomic_init(&program->refs, 1);
+	spy->program = program;
+}
 
-			/* BDER */
-			case 0x29: {
-				spy_int addr = spy_pop_int(spy);
-				BOUNDS_CHECK(addr);
-				spy_push_byte(spy, spy->memory[addr]);
-				break;
-			}
+/* the program spy runs is in memory, set up its own tiers and registers */
+static void
+spy_start(SpyState* spy) {
+
+	SpyProgram* program = spy->program;
+	spy->code = program->code;
+	spy->code_size = program->code_size;
+	spy->ops = program->ops;
+	spy->nops = program->nops;
+	spy->op_map = program->op_map;
+	spy->rconst = program->rconst;
+	spy->stack_slack = program->stack_slack;
+	spy->verified = program->verified;
+	spy->frame_height = program->frame_height;
+	spy->register_tier = program->register_tier;
+	spy->use_jit = program->jit;
+	spy->use_trace = program->trace;
+
+	/* map the code over the start of memory (the rest of the last page
+	 * reads as zeros), without an image it's copied */
+	spy_int page = sysconf(_SC_PAGESIZE);
+	spy_int bytes = (program->code_size + page - 1) / page * page;
+	if (program->image < 0) {
+		memcpy(&spy->memory[0], program->code, program->code_size);
+	} else if (mmap(spy->memory, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, program->image, 0) == MAP_FAILED) {
+		spy_die(spy, "couldn't map code into memory");
+	}
 
-			/* ISAVE */
-			case 0x2A: {
-				spy_int value = spy_pop_int(spy);
-				spy_int addr = spy_pop_int(spy);
-				BOUNDS_CHECK(addr);
-				spy_save_int(spy, addr, value);	
-				break;
-			}
-				
-			/* BSAVE */
-			case 0x2B: {
-				spy_byte value = spy_pop_byte(spy);
-				spy_int addr = spy_pop_int(spy);
-				BOUNDS_CHECK(addr);
-				spy_save_byte(spy, addr, value);
-				break;
-			}
+	if (spy->use_jit) {
+		spy->jit = spy_jit_new(spy);
+	}
+	if (spy->use_trace) {
+		spy->trace = spy_trace_new(spy);
+	}
+	spy->quick = calloc(spy->nops, sizeof(SpyQuick));
 
-			/* RES */
-			case 0x2C: {
-				spy_int inc = spy_code_int64();
-				memset(spy->sp + 8, 0, inc);
-				spy->sp += inc;
-				break;
-			}
+	/* initialize registers */
+	spy->ip = spy->op_map[0];
+	spy->sp = &spy->memory[SIZE_CODE]; /* stack grows up */
+	spy->bp = &spy->memory[SIZE_CODE];
 
-			/* IINC */
-			case 0x2D:
-				spy_push_int(spy, spy_pop_int(spy) + spy_code_int64());
-				break;
+}
 
-			/* POP */
-			case 0x2E:
-				spy_pop_int(spy); /* type of pop is irrelevant */
-				break;
+/* decodes the code of spy->program with the tiers of spy, spy holds the
+ * first reference to it */
+static void
+spy_make_program(SpyState* spy) {
 
-			/* IARG */
-			case 0x2F: 
-				spy_push_int(spy, *(spy_int *)&spy->bp[-3*8 - spy_code_int64()*8]);
-				break;
-			
-			/* BARG */
-			case 0x30:
-				spy_push_byte(spy, spy->bp[-3*8 - spy_code_int64()*8]);
-				break;
+	SpyProgram* program = spy->program;
+	spy->code = program->code;
 
-			/* LEA */
-			case 0x31:
-				spy_push_int(spy, (spy_int)(&spy->bp[8 + spy_code_int64()] - spy->memory));
-				break;
+	/* translate code into SpyOps */
+	spy_imports(spy, spy->code, program->code_size);
+	spy_decode(spy, spy->code, program->code_size);
+	spy_stack_bounds(spy);
 
-			/* AISAVE (absolute integer save) */
-			case 0x32: {
-				spy_int value = spy_pop_int(spy);
-				spy_int addr = spy_code_int64();
-				BOUNDS_CHECK(addr);
-				spy_save_int(spy, addr, value);	
-				break;
-			}
-				
-			/* ABSAVE */
-			case 0x33: {	
-				spy_byte value = spy_pop_byte(spy);
-				spy_int addr = spy_code_int64();
-				BOUNDS_CHECK(addr);
-				spy_save_byte(spy, addr, value);
-				break;
-			}
+	/* native code doesn't keep to the frames that the verifier works out
+	 * (and has its own checks), so only the interpreter can rely on them */
+	if (!spy->use_jit && !spy->use_trace) {
+		spy->verified = spy_verify(spy);
+	}
 
-			/* AIDER */
-			case 0x34:  {
-				spy_int addr = spy_code_int64();
-				BOUNDS_CHECK(addr);
-				spy_push_int(spy, spy_mem_int(spy, addr));
-				break;
-			}
+	if (spy->register_tier) {
+		spy_translate_registers(spy);
+	}
 
-			/* ABDER */
-			case 0x35: {
-				spy_int addr = spy_code_int64();
-				BOUNDS_CHECK(addr);
-				spy_push_byte(spy, spy_mem_int(spy, addr));
-				break;
-			}
-			
-			/* MALLOC */
-			case 0x36: 
-				break;
+	/* point every instruction at its handler, nothing writes to the ops
+	 * after this */
+	spy_interpret(spy, NULL);
+
+	program->ops = spy->ops;
+	program->nops = spy->nops;
+	program->op_map = spy->op_map;
+	program->rconst = spy->rconst;
+	program->stack_slack = spy->stack_slack;
+	program->verified = spy->verified;
+	program->frame_height = spy->frame_height;
+	program->register_tier = spy->register_tier;
+	program->jit = spy->use_jit;
+	program->trace = spy->use_trace;
 
-			/* FREE */
-			case 0x37:
-				break;
+}
 
-			/* VRET */
-			case 0x38: {
-				spy_int nargs;
-				spy->sp = spy->bp;
-				nargs = spy_pop_int(spy);
-				spy->bp = (uint8_t *)spy_pop_int(spy);
-				spy->ip = (uint8_t *)spy_pop_int(spy);
-				spy->sp -= nargs * 8;
-				break;
-			}
+static void
+spy_check_size(SpyState* spy, spy_int size) {
+	if (spy->program) {
+		spy_die(spy, "a program is already loaded");
+	}
+	if (size <= 0 || size > SIZE_CODE) {
+		spy_die(spy, "invalid bytecode size (%lld bytes)", size);
+	}
+}
 
-			/* ILOCALL */
-			case 0x39:
-				spy_push_int(spy, *(spy_int *)&spy->bp[8 + spy_code_int64()]);
-				break;
-			
-			/* BLOCALL */
-			case 0x3A: 
-				spy_push_byte(spy, spy->bp[8 + spy_code_int64()]);
-				break;
-			
-			/* ILOCALS */
-			case 0x3B:
-				*(spy_int *)&spy->bp[8 + spy_code_int64()] = spy_pop_int(spy);
-				break;
+/* makes a program from size bytes of bytecode (they are copied) */
+static void
+spy_prepare_code(SpyState* spy, const spy_byte* code, spy_int size) {
+	spy_check_size(spy, size);
+	spy_byte* copy = malloc(size);
+	memcpy(copy, code, size);
+	spy_program_alloc(spy, copy, size, spy_code_image(code, size), 0);
+	spy_make_program(spy);
+}
 
-			/* BLOCALS */
-			case 0x3C:
-				spy->bp[8 + spy_code_int64()] = spy_pop_byte(spy);
-				break;
+/* makes a program from a .spyb file.  nothing is read or copied, the file
+ * is mapped for the decoder and then into the memory of every state that
+ * runs the program */
+static void
+spy_prepare_file(SpyState* spy, const char* filename) {
+	struct stat info;
+	int image = open(filename, O_RDONLY);
+	if (image < 0 || fstat(image, &info) != 0) {
+		if (image >= 0) {
+			close(image);
+		}
+		spy_die(spy, "couldn't read bytecode from '%s'", filename);
+	}
+	/* spy_check_size dies, the file is closed first */
+	if (spy->program || info.st_size <= 0 || info.st_size > SIZE_CODE) {
+		close(image);
+		spy_check_size(spy, info.st_size);
+	}
+	spy_byte* code = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, image, 0);
+	if (code == MAP_FAILED) {
+		close(image);
+		spy_die(spy, "couldn't read bytecode from '%s'", filename);
+	}
+	spy_program_alloc(spy, code, info.st_size, image, 1);
+	spy_make_program(spy);
+}
 
-			/* PE */
-			case 0x3D:
-				PUSHFLAG(FLAG_EQ);
-				break;
-				
-			/* PNE */
-			case 0x3E:	
-				PUSHNOTFLAG(FLAG_EQ);
-				break;
+/* makes a program from bytecode and starts it, see spy_load */
+void
+spy_prepare(SpyState* spy, const spy_byte* code, spy_int size) {
+	spy_prepare_code(spy, code, size);
+	spy_start(spy);
+}
 
-			/* PGT */
-			case 0x3F:
-				PUSHFLAG(FLAG_GT);
-				break;
-				
-			/* PGE */
-			case 0x40:	
-				PUSHNOTFLAG(FLAG_LT);
-				break;
+/* loads size bytes of bytecode (they are copied), returns 0 if the program
+ * can be run with spy_run.  a state loads only one program
+ *
+ * note: there is no differentiation between code and data... the
+ * first instructions that is executed is whatever is at code[0]...
+ * therefore, the first instruction should (almost) always be
+ * some sort of jump instruction to an entry point
+ */
+int
+spy_load(SpyState* spy, const spy_byte* code, spy_int size) {
+
+	jmp_buf on_error;
+	spy->on_error = &on_error;
+	if (setjmp(on_error)) {
+		spy->on_error = NULL;
+		return 1;
+	}
 
-			/* PLT */
-			case 0x41:
-				PUSHFLAG(FLAG_LT);
-				break;
-				
-			/* PLE */
-			case 0x42:	
-				PUSHNOTFLAG(FLAG_GT);
-				break;
+	spy_prepare(spy, code, size);
 
-			/* PZ */
-			case 0x43:
-				PUSHFLAG(FLAG_Z);
-				break;
-				
-			/* PNZ */
-			case 0x44:	
-				PUSHNOTFLAG(FLAG_Z);
-				break;
+	spy->on_error = NULL;
+	return 0;
 
-			/* PS */
-			case 0x45:
-				PUSHFLAG(FLAG_S);
-				break;
+}
 
-			/* PNS */
-			case 0x46:
-				PUSHNOTFLAG(FLAG_S);
-				break;
+/* loads a .spyb file, see spy_load */
+int
+spy_load_file(SpyState* spy, const char* filename) {
 
-			/* FCONST */
-			case 0x47:
-				spy_push_float(spy, spy_code_float());
-				break;
-			
-			/* FCMP */
-			case 0x48:
-				CMPTYPE(float);
-				break;
+	jmp_buf on_error;
+	spy->on_error = &on_error;
+	if (setjmp(on_error)) {
+		spy->on_error = NULL;
+		return 1;
+	}
 
-			/* FTEST */
-			case 0x49:
-				TESTTYPE(float);
-				break;
+	spy_prepare_file(spy, filename);
+	spy_start(spy);
 
-			/* FADD */
-			case 0x4A:
-				FLOATARITH(+);
-				break;
+	spy->on_error = NULL;
+	return 0;
 
-			/* FSUB */
-			case 0x4B:
-				FLOATARITH(-);
-				break;
-			
-			/* FMUL */
-			case 0x4C:
-				FLOATARITH(*);
-				break;
+}
 
-			/* FDIV */
-			case 0x4D:
-				FLOATARITH(/);
-				break;
+/* makes a program in a state of its own, from code or from filename */
+static SpyProgram*
+spy_program_from(const SpyConfig* config, const spy_byte* code, spy_int size, const char* filename) {
+	SpyState* spy = spy_new(config);
+	SpyProgram* volatile program = NULL;
+	jmp_buf on_error;
+	spy->on_error = &on_error;
+	if (!setjmp(on_error)) {
+		if (filename) {
+			spy_prepare_file(spy, filename);
+		} else {
+			spy_prepare_code(spy, code, size);
+		}
+		program = spy->program;
+		atomic_fetch_add(&program->refs, 1);
+	}
+	spy_free(spy);
+	return program;
+}
 
-			/* FINC */
-			case 0x4E:
-				spy_push_float(spy, spy_pop_float(spy) + spy_code_float());
-				break;
+/* makes a program that any number of states can load with spy_load_program
+ * (config is the same as for spy_new, only its tiers are used).  returns
+ * NULL if the bytecode can't be loaded, after printing why */
+SpyProgram*
+spy_program_new(const SpyConfig* config, const spy_byte* code, spy_int size) {
+	return spy_program_from(config, code, size, NULL);
+}
 
-			/* FRET */
-			case 0x4F: {
-				spy_int nargs;
-				spy_float retval;
-				retval = spy_pop_float(spy);
-				spy->sp = spy->bp;
-				nargs = spy_pop_int(spy);
-				spy->bp = (uint8_t *)spy_pop_int(spy);
-				spy->ip = (uint8_t *)spy_pop_int(spy);
-				spy->sp -= nargs * 8;
-				spy_push_float(spy, retval);
-				break;
-			}
+/* the same for a .spyb file, see spy_prepare_file */
+SpyProgram*
+spy_program_new_file(const SpyConfig* config, const char* filename) {
+	return spy_program_from(config, NULL, 0, filename);
+}
 
-			/* FLOCALL */
-			case 0x50:
-				spy_push_float(spy, *(spy_float *)&spy->bp[8 + spy_code_int64()]);
-				break;
+/* drops a reference to program, it's freed once no state uses it */
+void
+spy_program_free(SpyProgram* program) {
+	if (atomic_fetch_sub(&program->refs, 1) != 1) {
+		return;
+	}
+	if (program->mapped) {
+		munmap(program->code, program->code_size);
+	} else {
+		free(program->code);
+	}
+	if (program->image >= 0) {
+		close(program->image);
+	}
+	free(program->ops);
+	free(program->op_map);
+	free(program->rconst);
+	free(program->imports);
+	free(program);
+}
 
-			/* FLOCALS */
-			case 0x51:
-				*(spy_float *)&spy->bp[8 + spy_code_int64()] = spy_pop_float(spy);
-				break;
+/* loads a program made by spy_program_new, like spy_load.  the state runs
+ * it with the tiers it was made for, whatever its own config says */
+int
+spy_load_program(SpyState* spy, SpyProgram* program) {
 
-			/* AFSAVE */
-			case 0x52: {
-				spy_float value = spy_pop_int(spy);
-				spy_int addr = spy_code_int64();
-				spy_save_float(spy, addr, value);	
-				break;
-			}
+	jmp_buf on_error;
+	spy->on_error = &on_error;
+	if (setjmp(on_error)) {
+		spy->on_error = NULL;
+		return 1;
+	}
 
-			/* AFDER */
-			case 0x53: 
-				spy_push_float(spy, spy_mem_float(spy, spy_code_int64()));
-				break;
+	if (spy->program) {
+		spy_die(spy, "a program is already loaded");
+	}
 
-			/* FDER */
-			case 0x54:
-				spy_push_float(spy, *(spy_float *)&spy->memory[spy_pop_int(spy)]);
-				break;
+	atomic_fetch_add(&program->refs, 1);
+	spy->program = program;
+	spy_start(spy);
 
-			/* FARG */
-			case 0x55:
-				spy_push_float(spy, *(spy_float *)&spy->bp[-3*8 - spy_code_int64()*8]);
-				break;
+	spy->on_error = NULL;
+	return 0;
 
-			/* ITOF */
-			case 0x56:
-				spy_push_float(spy, (spy_float)spy_pop_int(spy));
-				break;
+}
 
-			/* FTOI */
-			case 0x57:
-				spy_push_int(spy, (spy_int)spy_pop_float(spy));
-				break;
-			
-			/* DUP */
-			case 0x58:
-				spy_push_int(spy, spy_top_int(spy));
-				break;
+/* runs the loaded program (from the start, or from where a snapshot was
+ * taken), returns 1 if it died with an error.  a program is only run once.
+ * the first run in the process installs a SIGSEGV handler (spy_fault),
+ * faults outside the memory of a state go on to the handler that was
+ * installed before it */
+int
+spy_run(SpyState* spy) {
+
+	jmp_buf on_error;
+	SpyState* volatile running = spy_running;
+	pthread_once(&spy_fault_once, spy_install_fault);
+	spy_running = spy;
+	spy->on_error = &on_error;
+	if (setjmp(on_error)) {
+		spy->on_error = NULL;
+		spy_task_stop(spy);
+		spy_running = running;
+		return 1;
+	}
 
-			/* FSAVE */
-			case 0x59: {
-				spy_float value = spy_pop_float(spy);
-				spy_int addr = spy_pop_int(spy);
-				spy_save_float(spy, addr, value);	
-				break;
-			}
+	if (!spy->ip) {
+		spy_die(spy, "no program is loaded");
+	}
 
-			/* MOD */
-			case 0x5A:
-				INTARITH(%);
-				break;
-			
-			/* CCFCALL */
-			case 0x5B: {
-				char* cf_name = (char *)&code[spy_pop_int(spy)];
-				spy_int nargs = spy_code_int64();
-				if (nargs > 1) {
-					uint64_t* args = malloc(nargs * sizeof(uint64_t));
-					for (int i = 0; i < nargs; i++) {
-						args[i] = spy_pop_int(spy);
-					}
-					for (int i = 0; i < nargs; i++) {
-						spy_push_int(spy, args[i]);
-					}
-					free(args);
-				}
-				SpyCFunc* cfunc = NULL;
-				for (SpyCFuncList* i = spy->cfuncs; i; i = i->next) {
-					if (!i->cfunc) {
-						break;
-					}
-					if (!strcmp(i->cfunc->name, cf_name)) {
-						cfunc = i->cfunc;
-						break;
-					}	
-				}
-				if (!cfunc) {
-					spy_die("unknown c-function '%s'", cf_name);
-				}
-				cfunc->f(spy);
-				break;
-			}
+	spy_interpret(spy, spy->ip);
 
-			/* NOT */
-			case 0x5C:
-				spy_push_int(spy, !spy_pop_int(spy));
-				break;
-			
-			/* LAND */
-			case 0x5D:
-				INTARITH(&&);
-				break;
+	spy->on_error = NULL;
+	int failed = spy_task_stop(spy);
+	spy_running = running;
+	return failed;
 
-			/* LOR */
-			case 0x5E:
-				INTARITH(||);
-				break;
+}
 
-			/* DUP2*/
-			case 0x5F:
-				spy_push_int(spy, *(spy_int *)&spy->sp[-8]);
-				break;
+/* the interpreter, once with every check and once for verified code */
+#define SPY_INTERPRET spy_interpret_checked
+#define SPY_VERIFIED 0
+#include "interpret.h"
+#undef SPY_INTERPRET
+#undef SPY_VERIFIED
+
+#define SPY_INTERPRET spy_interpret_verified
+#define SPY_VERIFIED 1
+#include "interpret.h"
+#undef SPY_INTERPRET
+#undef SPY_VERIFIED
+
+/* runs decoded instructions starting at entry until NOP or EXIT, or until
+ * a return pops the J_RETURN sentinel (native code runs functions that
+ * aren't compiled this way, see jit.c).  without an entry, it only points
+ * the instructions at their handlers */
+void
+spy_interpret(SpyState* spy, SpyOp* entry) {
+	if (spy->verified) {
+		spy_interpret_verified(spy, entry);
+	} else {
+		spy_interpret_checked(spy, entry);
+	}
+}
 
-			/* ILOG */
-			case 0xFD:
-				printf("%lld\n", spy_pop_int(spy));
-				break;
+/* runs a compare or test instruction for native code, see jit.c */
+void
+spy_exec_flags(SpyState* spy, uint8_t opcode) {
+	switch (opcode) {
+		/* ICMP */
+		case 0x02:
+			CMPTYPE(int);
+			break;
+		/* ITEST */
+		case 0x03:
+			TESTTYPE(int);
+			break;
+		/* FCMP */
+		case 0x48:
+			CMPTYPE(float);
+			break;
+		/* FTEST */
+		case 0x49:
+			TESTTYPE(float);
+			break;
+	}
+}
 
-			/* BLOG */
-			case 0xFE:
-				printf("%d\n", spy_pop_byte(spy));
-				break;
+/* runs MALLOC or FREE for native code, see jit.c */
+void
+spy_exec_heap(SpyState* spy, uint8_t opcode) {
+	if (opcode == 0x36) {
+		spy_push_int(spy, spy_heap_alloc(spy, spy_pop_int(spy)));
+	} else {
+		spy_heap_free(spy, spy_pop_int(spy));
+	}
+}
 
-			/* FLOG */
-			case 0xFF:
-				printf("%f\n", spy_pop_float(spy));
-				break;
-		}
+/* VECTORS
+ *
+ * a vector of n lanes (n is the operand of every vector instruction, 1
+ * to VECTOR_MAX_LANES) is n values on the stack, lane 0 the deepest.
+ * every lane is an 8 byte slot, an int or a float, so vectors load from
+ * and save to memory in the same layout as an array of them.  the
+ * instructions work on all of their lanes at once (see VARITH in
+ * interpret.h) instead of one dispatch per value */
+
+/* runs a vector instruction for native code, op has a valid number of
+ * lanes (see jit.c) */
+void
+spy_exec_vector(SpyState* spy, const SpyOp* op) {
+	switch (op->opcode) {
+		/* VLOAD */
+		case 0xD4:
+			VLOAD();
+			break;
+		/* VSAVE */
+		case 0xD5:
+			VSAVE();
+			break;
+		/* VSPLAT */
+		case 0xD6:
+			VSPLAT();
+			break;
+		/* VLANE */
+		case 0xD7:
+			VLANE();
+			break;
+		/* VIADD ... VIDIV */
+		case 0xD8:
+			VARITH(int, +);
+			break;
+		case 0xD9:
+			VARITH(int, -);
+			break;
+		case 0xDA:
+			VARITH(int, *);
+			break;
+		case 0xDB:
+			VARITH(int, /);
+			break;
+		/* VFADD ... VFDIV */
+		case 0xDC:
+			VARITH(float, +);
+			break;
+		case 0xDD:
+			VARITH(float, -);
+			break;
+		case 0xDE:
+			VARITH(float, *);
+			break;
+		case 0xDF:
+			VARITH(float, /);
+			break;
+		/* VISUM, VIMIN, VIMAX */
+		case 0xE0:
+			VREDUCE(int, r += v[l]);
+			break;
+		case 0xE1:
+			VREDUCE(int, r = v[l] < r ? v[l] : r);
+			break;
+		case 0xE2:
+			VREDUCE(int, r = v[l] > r ? v[l] : r);
+			break;
+		/* VFSUM, VFMIN, VFMAX */
+		case 0xE3:
+			VREDUCE(float, r += v[l]);
+			break;
+		case 0xE4:
+			VREDUCE(float, r = v[l] < r ? v[l] : r);
+			break;
+		case 0xE5:
+			VREDUCE(float, r = v[l] > r ? v[l] : r);
+			break;
+	}
+}
 
-	} while (opcode != 0x00);
+/* BLOCKS
+ *
+ * memcpy, memmove, memset and memcmp work on n bytes at once with the
+ * functions of libc, instead of a loop of bder and bsave.  both ends of
+ * every block are checked (see BLOCK_BOUNDS_CHECK in interpret.h), a
+ * block that crosses a guard faults like any other access.  an empty
+ * block isn't checked at all */
 
+/* runs a block instruction for native code, see jit.c */
+void
+spy_exec_memory(SpyState* spy, uint8_t opcode) {
+	switch (opcode) {
+		/* MEMCPY */
+		case 0x96:
+			MEMCOPY(memcpy);
+			break;
+		/* MEMMOVE */
+		case 0x97:
+			MEMCOPY(memmove);
+			break;
+		/* MEMSET */
+		case 0x98:
+			MEMSET();
+			break;
+		/* MEMCMP */
+		case 0x99:
+			MEMCMP();
+			break;
+	}
 }
@@ -1,15 +1,20 @@
 #ifndef SPY_H
 #define SPY_H
 
+#include <stdio.h>
 #include <stdint.h>
+#include <setjmp.h>
+#include <stdatomic.h>
 #include "spy_types.h"
 
-#define SIZE_MEMORY 0x100000
+#define SIZE_HEAP   0x100000 /* default, see SpyConfig */
 #define SIZE_STACK  0x010000
 #define SIZE_CODE	0x010000
+#define SIZE_GUARD  0x010000 /* can't be touched, after the stack and the heap */
+#define MAX_HEAP    0x40000000
 
 #define START_STACK  SIZE_CODE
-#define START_MEMORY (SIZE_STACK + SIZE_CODE)
+#define START_MEMORY (SIZE_CODE + SIZE_STACK + SIZE_GUARD)
 
 #define FLAG_EQ		(0x1 << 0) /* NEQ = !EQ */
 #define FLAG_GT		(0x1 << 1) /* GE = !LT */
@@ -19,43 +24,154 @@
 
 #define DO_OPTIMIZE 1
 
+/* threaded dispatch (GCC labels-as-values) in spy_interpret... compile
+ * with -DSPY_NO_COMPUTED_GOTO to force the portable switch dispatch */
+#if defined(__GNUC__) && !defined(SPY_NO_COMPUTED_GOTO)
+#define SPY_COMPUTED_GOTO 1
+#else
+#define SPY_COMPUTED_GOTO 0
+#endif
+
+/* native code generation (jit.c) needs x86-64 and mmap... compile with
+ * -DSPY_NO_JIT to leave it out, --jit is then ignored */
+#if defined(__x86_64__) && defined(__unix__) && !defined(SPY_NO_JIT)
+#define SPY_JIT 1
+#else
+#define SPY_JIT 0
+#endif
+
 #define MALLOC_CHUNK 8 /* must be multiple of 8 */
 
+/* most lanes of a vector (vload ... vfmax), every lane is one 8 byte
+ * stack slot */
+#define VECTOR_MAX_LANES 8
+
+/* ends bytecode that has an import table, see spy_imports */
+#define IMPORT_MAGIC "SPYIMP1"
+
 /* NOTES
  * 
  * CODE LAYOUT:
  *   32BIT INT DATA_SIZE
  *   ... CODE ...
+ *   [IMPORT TABLE] (see spy_imports)
  */
 
 typedef struct SpyState SpyState;
+typedef struct SpyProgram SpyProgram;
+typedef struct SpyConfig SpyConfig;
 typedef struct SpyCFunc SpyCFunc;
-typedef struct SpyCFuncList SpyCFuncList;
 typedef struct SpyInstruction SpyInstruction;
 typedef struct MemoryBlock MemoryBlock;
 typedef struct MemoryBlockList MemoryBlockList;
+typedef struct SpyOp SpyOp;
+typedef struct SpyQuick SpyQuick;
+typedef union SpyOperand SpyOperand;
+typedef struct SpyJit SpyJit;
+typedef struct SpyTrace SpyTrace;
+typedef struct SpySnapshot SpySnapshot;
+typedef struct SpyWorker SpyWorker;
+
+/* a loaded program.  it doesn't change once it's made, so any number of
+ * states can run it at once (see spy_load_program), each of them only has
+ * a stack and a heap of its own */
+struct SpyProgram {
+	spy_byte* code;
+	spy_int code_size;
+	SpyOp* ops; /* pre-decoded code, see spy_decode */
+	spy_int nops;
+	SpyOp** op_map; /* code offset -> decoded instruction (NULL if none) */
+	spy_int* rconst; /* constant pool of the register tier */
+	SpyCFunc** imports; /* import table, resolved when the program is made */
+	spy_int nimports;
+	spy_int stack_slack; /* stack checked for at safepoints, see spy_stack_bounds */
+	int verified; /* the code passed spy_verify, see verify.c */
+	spy_int frame_height; /* largest frame of verified code */
+	int register_tier; /* the ops are made for these tiers, see SpyConfig */
+	int jit;
+	int trace;
+	int image; /* file with the code, mapped into every state's memory (-1 if none) */
+	int mapped; /* code is mapped from image, not malloc'd */
+	atomic_int refs;
+};
 
+/* everything a program uses lives in its SpyState, so any number of them
+ * can be loaded and run at once (one thread per state) */
 struct SpyState {
 	spy_byte* memory;	
-	spy_byte* ip;
+	spy_int heap_size;
+	spy_int memory_size; /* bytes mapped at memory, see MEMORY in vm.c */
+	SpyOp* ip;
 	spy_byte* sp;
 	spy_byte* bp;
+	spy_byte* stack_end; /* followed by a guard */
+	SpyProgram* program; /* code ... rconst and stack_slack ... frame_height are copied from it */
 	spy_byte* code;
-	SpyCFuncList* cfuncs;
+	spy_int code_size;
+	SpyOp* ops;
+	spy_int nops;
+	SpyOp** op_map;
+	spy_int* rconst;
+	int register_tier; /* translate to register code before running */
+	int use_jit; /* compile functions to machine code, see jit.c */
+	SpyJit* jit; /* NULL unless use_jit */
+	int use_trace; /* compile hot loops, see trace.c */
+	SpyTrace* trace; /* NULL unless use_trace */
+	SpyQuick* quick; /* one for every op, see QUICKENING (NULL in task workers) */
+	int recording; /* a loop is being recorded */
+	spy_int stack_slack;
+	int verified;
+	spy_int frame_height;
 	MemoryBlockList* memory_map;
 	uint16_t flags;
-	int bail;
+	atomic_int bail; /* set by another thread to stop a task worker */
+	spy_int instructions; /* instructions run by the interpreter */
+	SpySnapshot* snapshot; /* NULL unless one is to be taken, see snapshot.c */
+	int workers; /* threads that run spawned tasks, this one included */
+	SpyWorker* worker; /* NULL until the program spawns, see task.c */
+	SpyState* owner; /* the state whose heap this one uses (itself, except in task workers) */
+	FILE* out; /* the program's stdout and stdin (see capi_io.c) */
+	FILE* in;
+	jmp_buf* on_error; /* where spy_die goes, NULL exits (see spy_run) */
+};
+
+/* options for spy_new */
+struct SpyConfig {
+	int register_tier; /* translate to register code before running, see regvm.c */
+	int jit; /* compile functions to machine code, see jit.c */
+	int trace; /* compile hot loops, see trace.c */
+	spy_int heap_size; /* 0 for SIZE_HEAP, at most MAX_HEAP */
+	int workers; /* threads for spawn, 0 for one per core (see task.c) */
+	FILE* out; /* NULL for stdout */
+	FILE* in; /* NULL for stdin */
 };
 
+/* most arguments of a typed c-function, see capi_load.c */
+#define NATIVE_MAX_ARGS 3
+
 struct SpyCFunc {
 	char* name;
-	spy_int (*f)(SpyState*);
+	spy_int (*f)(SpyState*); /* can be NULL for a typed c-function */
+	int results; /* values that a call leaves for the program */
+	/* a typed c-function is a plain c function, signature is like
+	 * "(ptr, int) -> float", the rest is filled in when it's registered.
+	 * if the signature can't be used, f is called instead.  a ptr argument
+	 * is only checked where it starts, the function has to bound its own
+	 * accesses from it */
+	const char* signature;
+	void (*native)(void);
+	int nargs;
+	char ret; /* 'i', 'f' or 'v' */
+	char args[NATIVE_MAX_ARGS]; /* 'i', 'f' or 'p' */
 };
 
-struct SpyCFuncList {
-	SpyCFunc* cfunc;
-	SpyCFuncList* next;
-};	
+
+/* the last target of a CCALL or CCFCALL, key is the address it was
+ * given (of the function, or of the c-function's name) */
+struct SpyQuick {
+	spy_int key;
+	void* target; /* SpyOp* or SpyCFunc*, NULL until it ran */
+};
 
 struct MemoryBlock {
 	spy_int addr; /* index into spy->memory */
@@ -80,12 +196,57 @@ struct SpyInstruction {
 	} operands[4];
 };
 
+union SpyOperand {
+	spy_int i;
+	spy_float f;
+	SpyOp* op; /* jump/call target */
+	SpyCFunc* cfunc; /* NULL if the name couldn't be resolved */
+};
+
+/* fixed-width instruction, decoded once when the bytecode is loaded.
+ * operands are in the same order as the bytecode's operands, except
+ * that code addresses are resolved to the decoded instruction and
+ * c-function names are resolved to their SpyCFunc */
+struct SpyOp {
+	const void* handler; /* only used with SPY_COMPUTED_GOTO */
+	SpyOperand a;
+	SpyOperand b;
+	uint32_t addr; /* offset of the original instruction */
+	uint8_t opcode;
+	uint8_t base[3]; /* register instructions only, see regvm.h */
+	int32_t reg[3];
+	int32_t sp_delta;
+};
+
 extern const SpyInstruction spy_instructions[255]; 
 
-void spy_init();
-void spy_execute(const char*);
-void spy_dump();
-void spy_die(const char*, ...);
+SpyState* spy_new(const SpyConfig*); /* NULL for the default config */
+int spy_load(SpyState*, const spy_byte*, spy_int);
+int spy_load_file(SpyState*, const char*);
+SpyProgram* spy_program_new(const SpyConfig*, const spy_byte*, spy_int);
+SpyProgram* spy_program_new_file(const SpyConfig*, const char*);
+void spy_program_free(SpyProgram*);
+int spy_load_program(SpyState*, SpyProgram*);
+int spy_run(SpyState*); /* the first run installs a SIGSEGV handler, see vm.c */
+void spy_free(SpyState*);
+void spy_prepare(SpyState*, const spy_byte*, spy_int); /* for snapshot.c... */
+void spy_map_memory(SpyState*, spy_int); /* for snapshot.c... */
+SpyState* spy_set_running(SpyState*); /* for task.c... */
+void spy_interpret(SpyState*, SpyOp*);
+void spy_exec_flags(SpyState*, uint8_t);
+void spy_exec_vector(SpyState*, const SpyOp*);
+void spy_exec_memory(SpyState*, uint8_t);
+void spy_exec_heap(SpyState*, uint8_t);
+spy_int spy_heap_alloc(SpyState*, spy_int);
+void spy_heap_free(SpyState*, spy_int);
+SpyOp* spy_op_at(SpyState*, spy_int);
+void spy_cfunc_args(SpyState*, spy_int);
+SpyOp* spy_quick_op(SpyState*, const SpyOp*, spy_int);
+SpyCFunc* spy_quick_cfunc(SpyState*, const SpyOp*, spy_int);
+SpyCFunc* spy_find_cfunc(SpyState*, const char*);
+void spy_dump(SpyState*);
+void spy_die(SpyState*, const char*, ...);
 const SpyInstruction* spy_get_instruction(const char*); /* for the assembler... */
+int spy_is_branch(uint8_t); /* for the register tier... */
 
 #endif